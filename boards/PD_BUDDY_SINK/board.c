@@ -218,6 +218,11 @@ void __early_init(void) {
     asm("cpsie i");
     void (*bootloader)(void) = (void (*)(void)) (*((uint32_t *) SYSMEM_RESET_VECTOR));
     dfu_reset_to_bootloader_magic = 0;
+    /* The boot selector mapped RAM at address 0, but the bootloader expects
+     * the system memory there. */
+    RCC->APB2ENR |= RCC_APB2ENR_SYSCFGCOMPEN;
+    SYSCFG->CFGR1 = (SYSCFG->CFGR1 & ~SYSCFG_CFGR1_MEM_MODE)
+        | SYSCFG_CFGR1_MEM_MODE_0;
     __set_MSP(BOOTLOADER_STACK_POINTER);
     bootloader();
     while (42);
@@ -0,0 +1,182 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Boot selector
+ *
+ * Runs from reset, before either firmware slot, and starts the slot the boot
+ * state says to.  A new image is checked against its CRC and started once.
+ * If it hasn't confirmed itself by the next reset, or if it's corrupt, its
+ * record is discarded and the image that was running before is started
+ * instead from then on.  If neither slot holds firmware, the DfuSe bootloader
+ * is started so some can be flashed.
+ *
+ * This runs with the reset clock configuration and no RAM initialization, so
+ * it must not use any static variables.
+ */
+
+#include <stdint.h>
+
+#include <stm32f0xx.h>
+
+#include "boot_select.h"
+
+
+/* The vector table of the STM32F072's system memory, for the DfuSe
+ * bootloader */
+#define BOOT_SYSMEM_VECTORS 0x1FFFC800
+
+/* Top of the boot selector's stack, the end of RAM */
+extern uint32_t __boot_stack_end__;
+
+typedef void (*boot_vector_t)(void);
+
+void boot_reset(void) __attribute__((noreturn));
+static void boot_fault(void);
+
+/* Only reset and the faults are needed, since interrupts stay disabled */
+__attribute__((section(".vectors"), used))
+static const boot_vector_t boot_vectors[4] = {
+    (boot_vector_t) &__boot_stack_end__,
+    boot_reset,
+    boot_fault,
+    boot_fault
+};
+
+
+static void boot_fault(void)
+{
+    NVIC_SystemReset();
+}
+
+/*
+ * Wait for a flash operation to finish, and clear its flags
+ */
+static void boot_flash_wait(void)
+{
+    while ((FLASH->SR & FLASH_SR_BSY) != 0) {
+    }
+    FLASH->SR = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPRTERR;
+}
+
+static void boot_flash_write(const uint16_t *addr, uint16_t data)
+{
+    FLASH->CR |= FLASH_CR_PG;
+    *(volatile uint16_t *) addr = data;
+    boot_flash_wait();
+    FLASH->CR &= ~FLASH_CR_PG;
+}
+
+static void boot_flash_unlock(void)
+{
+    if ((FLASH->CR & FLASH_CR_LOCK) != 0) {
+        FLASH->KEYR = FLASH_KEY1;
+        FLASH->KEYR = FLASH_KEY2;
+    }
+}
+
+static void boot_flash_lock(void)
+{
+    FLASH->CR |= FLASH_CR_LOCK;
+}
+
+/*
+ * Note that the given record's image has been started
+ */
+static void boot_mark_tried(const struct pdbs_boot_record *rec)
+{
+    boot_flash_unlock();
+    boot_flash_write(&rec->tried, 0);
+    boot_flash_lock();
+}
+
+/*
+ * Clear the given record's magic number, so the record before it counts
+ * instead
+ */
+static void boot_discard(const struct pdbs_boot_record *rec)
+{
+    boot_flash_unlock();
+    boot_flash_write(&rec->magic, 0);
+    boot_flash_lock();
+}
+
+/*
+ * Start the firmware with the given vector table.  If it's not in the system
+ * memory, the vector table is copied to RAM and RAM is mapped at address 0.
+ */
+static void boot_jump(const uint32_t *vectors) __attribute__((noreturn));
+static void boot_jump(const uint32_t *vectors)
+{
+    RCC->APB2ENR |= RCC_APB2ENR_SYSCFGCOMPEN;
+    if ((uint32_t) vectors == BOOT_SYSMEM_VECTORS) {
+        SYSCFG->CFGR1 = (SYSCFG->CFGR1 & ~SYSCFG_CFGR1_MEM_MODE)
+            | SYSCFG_CFGR1_MEM_MODE_0;
+    } else {
+        volatile uint32_t *ram = (volatile uint32_t *) SRAM_BASE;
+        for (int i = 0; i < PDBS_BOOT_VECTORS; i++) {
+            ram[i] = vectors[i];
+        }
+        SYSCFG->CFGR1 |= SYSCFG_CFGR1_MEM_MODE;
+    }
+
+    __set_MSP(vectors[0]);
+    ((void (*)(void)) vectors[1])();
+    while (1) {
+    }
+}
+
+/*
+ * Start the given slot if it holds firmware for it
+ */
+static void boot_slot(uint8_t slot)
+{
+    const uint32_t *vectors = (const uint32_t *) pdbs_slot_base(slot);
+
+    if (pdbs_slot_vectors_valid(vectors, slot)) {
+        boot_jump(vectors);
+    }
+}
+
+void boot_reset(void)
+{
+    const struct pdbs_boot_record *rec = pdbs_boot_record_latest();
+
+    /* A new image gets one try, if it's intact.  If it isn't, or if it's had
+     * its try and hasn't confirmed itself, go back to the image that was
+     * running before. */
+    while (rec != NULL && rec->confirmed != 0) {
+        if (rec->tried != 0 && rec->length <= PDBS_SLOT_SIZE
+                && pdbs_boot_crc32((const uint8_t *) pdbs_slot_base(rec->slot),
+                    rec->length) == rec->crc) {
+            boot_mark_tried(rec);
+            break;
+        }
+        boot_discard(rec);
+        rec = pdbs_boot_record_latest();
+    }
+    uint8_t slot = (rec != NULL && rec->slot == PDBS_SLOT_B)
+        ? PDBS_SLOT_B : PDBS_SLOT_A;
+
+    /* Start the chosen slot, or the other one if it's empty */
+    boot_slot(slot);
+    boot_slot(!slot);
+
+    /* With no firmware at all, all we can do is wait for some */
+    boot_jump((const uint32_t *) BOOT_SYSMEM_VECTORS);
+}
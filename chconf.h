@@ -464,7 +464,7 @@
  * @note    The default failure mode is to halt the system with the global
  *          @p panic_msg variable set to @p NULL.
  */
-#define CH_DBG_ENABLE_STACK_CHECK           FALSE
+#define CH_DBG_ENABLE_STACK_CHECK           TRUE
 
 /**
  * @brief   Debug option, stacks initialization.
@@ -603,7 +603,9 @@
  *          the system is halted.
  */
 #define CH_CFG_SYSTEM_HALT_HOOK(reason) {                                   \
-  /* System halt code here.*/                                               \
+  /* Log the crash and reset instead of halting.*/                          \
+  extern void pdbs_crash_halt(const char *r);                               \
+  pdbs_crash_halt(reason);                                                  \
 }
 
 /**
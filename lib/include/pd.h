@@ -27,7 +27,8 @@
  * Macros for working with USB Power Delivery messages.
  *
  * This file is mostly written from the PD Rev. 2.0 spec, but the header is
- * written from the Rev. 3.0 spec.
+ * written from the Rev. 3.0 spec.  Extended Power Range definitions are from
+ * the Rev. 3.1 spec, and SPR AVS definitions are from the Rev. 3.2 spec.
  */
 
 /*
@@ -69,6 +70,7 @@
 #define PD_MSGTYPE_FR_SWAP 0x13
 #define PD_MSGTYPE_GET_PPS_STATUS 0x14
 #define PD_MSGTYPE_GET_COUNTRY_CODES 0x15
+#define PD_MSGTYPE_GET_SINK_CAP_EXTENDED 0x16
 /* Data Message */
 #define PD_MSGTYPE_SOURCE_CAPABILITIES 0x01
 #define PD_MSGTYPE_REQUEST 0x02
@@ -77,6 +79,9 @@
 #define PD_MSGTYPE_BATTERY_STATUS 0x05
 #define PD_MSGTYPE_ALERT 0x06
 #define PD_MSGTYPE_GET_COUNTRY_INFO 0x07
+#define PD_MSGTYPE_ENTER_USB 0x08
+#define PD_MSGTYPE_EPR_REQUEST 0x09
+#define PD_MSGTYPE_EPR_MODE 0x0A
 #define PD_MSGTYPE_VENDOR_DEFINED 0x0F
 /* Extended Message */
 #define PD_MSGTYPE_SOURCE_CAPABILITIES_EXTENDED 0x01
@@ -93,6 +98,10 @@
 #define PD_MSGTYPE_PPS_STATUS 0x0C
 #define PD_MSGTYPE_COUNTRY_INFO 0x0D
 #define PD_MSGTYPE_COUNTRY_CODES 0x0E
+#define PD_MSGTYPE_SINK_CAPABILITIES_EXTENDED 0x0F
+#define PD_MSGTYPE_EXTENDED_CONTROL 0x10
+#define PD_MSGTYPE_EPR_SOURCE_CAPABILITIES 0x11
+#define PD_MSGTYPE_EPR_SINK_CAPABILITIES 0x12
 
 /* Data roles */
 #define PD_DATAROLE_UFP (0x0 << PD_HDR_DATAROLE_SHIFT)
@@ -136,6 +145,134 @@
 #define PD_CHUNK_NUMBER_GET(msg) (((msg)->exthdr & PD_EXTHDR_CHUNK_NUMBER) >> PD_EXTHDR_CHUNK_NUMBER_SHIFT)
 
 
+/*
+ * PD Extended Control Message
+ *
+ * The first data byte holds the type, the second holds the data.
+ */
+#define PD_EXTCTRL_TYPE_EPR_GET_SOURCE_CAP 0x01
+#define PD_EXTCTRL_TYPE_EPR_GET_SINK_CAP 0x02
+#define PD_EXTCTRL_TYPE_EPR_KEEPALIVE 0x03
+#define PD_EXTCTRL_TYPE_EPR_KEEPALIVE_ACK 0x04
+
+/* Length of the Extended Control Message data block, in bytes */
+#define PD_EXTCTRL_DATA_SIZE 2
+
+
+/*
+ * PD EPR Mode Data Object
+ */
+#define PD_EPRMDO_ACTION_SHIFT 24
+#define PD_EPRMDO_ACTION (0xFF << PD_EPRMDO_ACTION_SHIFT)
+#define PD_EPRMDO_DATA_SHIFT 16
+#define PD_EPRMDO_DATA (0xFF << PD_EPRMDO_DATA_SHIFT)
+
+#define PD_EPRMDO_ACTION_SET(a) (((a) << PD_EPRMDO_ACTION_SHIFT) & PD_EPRMDO_ACTION)
+#define PD_EPRMDO_ACTION_GET(msg) (((msg)->obj[0] & PD_EPRMDO_ACTION) >> PD_EPRMDO_ACTION_SHIFT)
+#define PD_EPRMDO_DATA_SET(d) (((d) << PD_EPRMDO_DATA_SHIFT) & PD_EPRMDO_DATA)
+#define PD_EPRMDO_DATA_GET(msg) (((msg)->obj[0] & PD_EPRMDO_DATA) >> PD_EPRMDO_DATA_SHIFT)
+
+/* EPR Mode actions */
+#define PD_EPRMDO_ACTION_ENTER 0x01
+#define PD_EPRMDO_ACTION_ENTER_ACK 0x02
+#define PD_EPRMDO_ACTION_ENTER_SUCCEEDED 0x03
+#define PD_EPRMDO_ACTION_ENTER_FAILED 0x04
+#define PD_EPRMDO_ACTION_EXIT 0x05
+
+
+/*
+ * PD Source Capabilities Extended Data Block
+ *
+ * Byte offsets of the fields in the data block.  Multi-byte fields are little
+ * endian.
+ */
+#define PD_SCEDB_VID 0
+#define PD_SCEDB_PID 2
+#define PD_SCEDB_XID 4
+#define PD_SCEDB_FW_VERSION 8
+#define PD_SCEDB_HW_VERSION 9
+#define PD_SCEDB_VOLTAGE_REGULATION 10
+#define PD_SCEDB_HOLDUP_TIME 11
+#define PD_SCEDB_COMPLIANCE 12
+#define PD_SCEDB_TOUCH_CURRENT 13
+#define PD_SCEDB_PEAK_CURRENT1 14
+#define PD_SCEDB_PEAK_CURRENT2 16
+#define PD_SCEDB_PEAK_CURRENT3 18
+#define PD_SCEDB_TOUCH_TEMP 20
+#define PD_SCEDB_SOURCE_INPUTS 21
+#define PD_SCEDB_BATTERIES 22
+#define PD_SCEDB_SPR_PDP 23
+#define PD_SCEDB_EPR_PDP 24
+
+/* Length of the data block, in bytes.  Revision 3.0 sources don't send the
+ * EPR Source PDP Rating. */
+#define PD_SCEDB_SIZE 25
+#define PD_SCEDB_SIZE_REV30 24
+
+/* Peak Current fields */
+#define PD_SCEDB_PEAK_OVERLOAD_SHIFT 0
+#define PD_SCEDB_PEAK_OVERLOAD (0x1F << PD_SCEDB_PEAK_OVERLOAD_SHIFT)
+#define PD_SCEDB_PEAK_PERIOD_SHIFT 5
+#define PD_SCEDB_PEAK_PERIOD (0x3F << PD_SCEDB_PEAK_PERIOD_SHIFT)
+#define PD_SCEDB_PEAK_DUTY_CYCLE_SHIFT 11
+#define PD_SCEDB_PEAK_DUTY_CYCLE (0xF << PD_SCEDB_PEAK_DUTY_CYCLE_SHIFT)
+#define PD_SCEDB_PEAK_VBUS_DROOP_SHIFT 15
+#define PD_SCEDB_PEAK_VBUS_DROOP (1 << PD_SCEDB_PEAK_VBUS_DROOP_SHIFT)
+
+/* Peak current, as a percentage of the operating current, in 10% units.
+ * Values over 25 are treated as 25. */
+#define PD_SCEDB_PEAK_OVERLOAD_GET(pc) (((pc) & PD_SCEDB_PEAK_OVERLOAD) >> PD_SCEDB_PEAK_OVERLOAD_SHIFT)
+#define PD_SCEDB_PEAK_OVERLOAD_MAX 25
+/* Overload period, in 20 ms units */
+#define PD_SCEDB_PEAK_PERIOD_GET(pc) (((pc) & PD_SCEDB_PEAK_PERIOD) >> PD_SCEDB_PEAK_PERIOD_SHIFT)
+/* Duty cycle, in 5% units */
+#define PD_SCEDB_PEAK_DUTY_CYCLE_GET(pc) (((pc) & PD_SCEDB_PEAK_DUTY_CYCLE) >> PD_SCEDB_PEAK_DUTY_CYCLE_SHIFT)
+
+/* Source Inputs field */
+#define PD_SCEDB_SOURCE_INPUTS_EXTERNAL (1 << 0)
+#define PD_SCEDB_SOURCE_INPUTS_EXTERNAL_UNCONSTRAINED (1 << 1)
+#define PD_SCEDB_SOURCE_INPUTS_INTERNAL_BATTERY (1 << 2)
+
+/* Number of Batteries/Battery Slots field */
+#define PD_SCEDB_BATTERIES_FIXED_SHIFT 0
+#define PD_SCEDB_BATTERIES_FIXED (0xF << PD_SCEDB_BATTERIES_FIXED_SHIFT)
+#define PD_SCEDB_BATTERIES_HOT_SWAPPABLE_SHIFT 4
+#define PD_SCEDB_BATTERIES_HOT_SWAPPABLE (0xF << PD_SCEDB_BATTERIES_HOT_SWAPPABLE_SHIFT)
+
+
+/*
+ * PD PPS Status Data Block
+ *
+ * Byte offsets of the fields in the data block.  Multi-byte fields are little
+ * endian.
+ */
+#define PD_PPSSDB_OUTPUT_VOLTAGE 0
+#define PD_PPSSDB_OUTPUT_CURRENT 2
+#define PD_PPSSDB_REAL_TIME_FLAGS 3
+
+/* Length of the data block, in bytes */
+#define PD_PPSSDB_SIZE 4
+
+/* Output Voltage (in PRV) and Output Current (in PAI) values the source uses
+ * if it doesn't support measuring them */
+#define PD_PPSSDB_OUTPUT_VOLTAGE_UNSUPPORTED 0xFFFF
+#define PD_PPSSDB_OUTPUT_CURRENT_UNSUPPORTED 0xFF
+
+/* Real Time Flags field */
+#define PD_PPSSDB_PTF_SHIFT 1
+#define PD_PPSSDB_PTF (0x3 << PD_PPSSDB_PTF_SHIFT)
+#define PD_PPSSDB_OMF_SHIFT 3
+#define PD_PPSSDB_OMF (1 << PD_PPSSDB_OMF_SHIFT)
+
+#define PD_PPSSDB_PTF_GET(flags) (((flags) & PD_PPSSDB_PTF) >> PD_PPSSDB_PTF_SHIFT)
+
+/* Present Temperature Flag values */
+#define PD_PPSSDB_PTF_NOT_SUPPORTED 0x0
+#define PD_PPSSDB_PTF_NORMAL 0x1
+#define PD_PPSSDB_PTF_WARNING 0x2
+#define PD_PPSSDB_PTF_OVER_TEMPERATURE 0x3
+
+
 /*
  * PD Power Data Object
  */
@@ -153,6 +290,8 @@
 
 /* APDO types */
 #define PD_APDO_TYPE_PPS (0x0 << PD_APDO_TYPE_SHIFT)
+#define PD_APDO_TYPE_EPR_AVS (0x1 << PD_APDO_TYPE_SHIFT)
+#define PD_APDO_TYPE_SPR_AVS (0x2 << PD_APDO_TYPE_SHIFT)
 
 /* PD Source Fixed PDO */
 #define PD_PDO_SRC_FIXED_DUAL_ROLE_PWR_SHIFT 29
@@ -167,6 +306,8 @@
 #define PD_PDO_SRC_FIXED_DUAL_ROLE_DATA (1 << PD_PDO_SRC_FIXED_DUAL_ROLE_DATA_SHIFT)
 #define PD_PDO_SRC_FIXED_UNCHUNKED_EXT_MSG_SHIFT 24
 #define PD_PDO_SRC_FIXED_UNCHUNKED_EXT_MSG (1 << PD_PDO_SRC_FIXED_UNCHUNKED_EXT_MSG_SHIFT)
+#define PD_PDO_SRC_FIXED_EPR_CAPABLE_SHIFT 23
+#define PD_PDO_SRC_FIXED_EPR_CAPABLE (1 << PD_PDO_SRC_FIXED_EPR_CAPABLE_SHIFT)
 #define PD_PDO_SRC_FIXED_PEAK_CURRENT_SHIFT 20
 #define PD_PDO_SRC_FIXED_PEAK_CURRENT (0x3 << PD_PDO_SRC_FIXED_PEAK_CURRENT_SHIFT)
 #define PD_PDO_SRC_FIXED_VOLTAGE_SHIFT 10
@@ -180,6 +321,35 @@
 /* PD Source Fixed PDO voltage */
 #define PD_PDO_SRC_FIXED_VOLTAGE_GET(pdo) (((pdo) & PD_PDO_SRC_FIXED_VOLTAGE) >> PD_PDO_SRC_FIXED_VOLTAGE_SHIFT)
 
+/* PD Source Variable and Battery PDOs */
+#define PD_PDO_SRC_VARIABLE_MAX_VOLTAGE_SHIFT 20
+#define PD_PDO_SRC_VARIABLE_MAX_VOLTAGE (0x3FF << PD_PDO_SRC_VARIABLE_MAX_VOLTAGE_SHIFT)
+#define PD_PDO_SRC_VARIABLE_MIN_VOLTAGE_SHIFT 10
+#define PD_PDO_SRC_VARIABLE_MIN_VOLTAGE (0x3FF << PD_PDO_SRC_VARIABLE_MIN_VOLTAGE_SHIFT)
+#define PD_PDO_SRC_VARIABLE_CURRENT_SHIFT 0
+#define PD_PDO_SRC_VARIABLE_CURRENT (0x3FF << PD_PDO_SRC_VARIABLE_CURRENT_SHIFT)
+
+#define PD_PDO_SRC_BATTERY_MAX_VOLTAGE_SHIFT 20
+#define PD_PDO_SRC_BATTERY_MAX_VOLTAGE (0x3FF << PD_PDO_SRC_BATTERY_MAX_VOLTAGE_SHIFT)
+#define PD_PDO_SRC_BATTERY_MIN_VOLTAGE_SHIFT 10
+#define PD_PDO_SRC_BATTERY_MIN_VOLTAGE (0x3FF << PD_PDO_SRC_BATTERY_MIN_VOLTAGE_SHIFT)
+#define PD_PDO_SRC_BATTERY_POWER_SHIFT 0
+#define PD_PDO_SRC_BATTERY_POWER (0x3FF << PD_PDO_SRC_BATTERY_POWER_SHIFT)
+
+/* PD Source Variable PDO voltages */
+#define PD_PDO_SRC_VARIABLE_MAX_VOLTAGE_GET(pdo) (((pdo) & PD_PDO_SRC_VARIABLE_MAX_VOLTAGE) >> PD_PDO_SRC_VARIABLE_MAX_VOLTAGE_SHIFT)
+#define PD_PDO_SRC_VARIABLE_MIN_VOLTAGE_GET(pdo) (((pdo) & PD_PDO_SRC_VARIABLE_MIN_VOLTAGE) >> PD_PDO_SRC_VARIABLE_MIN_VOLTAGE_SHIFT)
+
+/* PD Source Variable PDO current */
+#define PD_PDO_SRC_VARIABLE_CURRENT_GET(pdo) (((pdo) & PD_PDO_SRC_VARIABLE_CURRENT) >> PD_PDO_SRC_VARIABLE_CURRENT_SHIFT)
+
+/* PD Source Battery PDO voltages */
+#define PD_PDO_SRC_BATTERY_MAX_VOLTAGE_GET(pdo) (((pdo) & PD_PDO_SRC_BATTERY_MAX_VOLTAGE) >> PD_PDO_SRC_BATTERY_MAX_VOLTAGE_SHIFT)
+#define PD_PDO_SRC_BATTERY_MIN_VOLTAGE_GET(pdo) (((pdo) & PD_PDO_SRC_BATTERY_MIN_VOLTAGE) >> PD_PDO_SRC_BATTERY_MIN_VOLTAGE_SHIFT)
+
+/* PD Source Battery PDO power */
+#define PD_PDO_SRC_BATTERY_POWER_GET(pdo) (((pdo) & PD_PDO_SRC_BATTERY_POWER) >> PD_PDO_SRC_BATTERY_POWER_SHIFT)
+
 /* PD Programmable Power Supply APDO */
 #define PD_APDO_PPS_MAX_VOLTAGE_SHIFT 17
 #define PD_APDO_PPS_MAX_VOLTAGE (0xFF << PD_APDO_PPS_MAX_VOLTAGE_SHIFT)
@@ -200,6 +370,41 @@
 
 #define PD_APDO_PPS_CURRENT_SET(i) (((i) << PD_APDO_PPS_CURRENT_SHIFT) & PD_APDO_PPS_CURRENT)
 
+/* PD SPR Adjustable Voltage Supply APDO */
+#define PD_APDO_SPR_AVS_PEAK_CURRENT_SHIFT 26
+#define PD_APDO_SPR_AVS_PEAK_CURRENT (0x3 << PD_APDO_SPR_AVS_PEAK_CURRENT_SHIFT)
+#define PD_APDO_SPR_AVS_CURRENT_15V_SHIFT 10
+#define PD_APDO_SPR_AVS_CURRENT_15V (0x3FF << PD_APDO_SPR_AVS_CURRENT_15V_SHIFT)
+#define PD_APDO_SPR_AVS_CURRENT_20V_SHIFT 0
+#define PD_APDO_SPR_AVS_CURRENT_20V (0x3FF << PD_APDO_SPR_AVS_CURRENT_20V_SHIFT)
+
+/* PD SPR Adjustable Voltage Supply APDO currents, for 9-15 V and 15-20 V */
+#define PD_APDO_SPR_AVS_CURRENT_15V_GET(pdo) (((pdo) & PD_APDO_SPR_AVS_CURRENT_15V) >> PD_APDO_SPR_AVS_CURRENT_15V_SHIFT)
+#define PD_APDO_SPR_AVS_CURRENT_20V_GET(pdo) (((pdo) & PD_APDO_SPR_AVS_CURRENT_20V) >> PD_APDO_SPR_AVS_CURRENT_20V_SHIFT)
+
+/* PD SPR Adjustable Voltage Supply voltage range, in millivolts.  The range
+ * only extends past 15 V if the 15-20 V current is non-zero. */
+#define PD_SPR_AVS_MIN_MV 9000
+#define PD_SPR_AVS_15V_MAX_MV 15000
+#define PD_SPR_AVS_20V_MAX_MV 20000
+
+/* PD EPR Adjustable Voltage Supply APDO */
+#define PD_APDO_EPR_AVS_PEAK_CURRENT_SHIFT 26
+#define PD_APDO_EPR_AVS_PEAK_CURRENT (0x3 << PD_APDO_EPR_AVS_PEAK_CURRENT_SHIFT)
+#define PD_APDO_EPR_AVS_MAX_VOLTAGE_SHIFT 17
+#define PD_APDO_EPR_AVS_MAX_VOLTAGE (0x1FF << PD_APDO_EPR_AVS_MAX_VOLTAGE_SHIFT)
+#define PD_APDO_EPR_AVS_MIN_VOLTAGE_SHIFT 8
+#define PD_APDO_EPR_AVS_MIN_VOLTAGE (0xFF << PD_APDO_EPR_AVS_MIN_VOLTAGE_SHIFT)
+#define PD_APDO_EPR_AVS_PDP_SHIFT 0
+#define PD_APDO_EPR_AVS_PDP (0xFF << PD_APDO_EPR_AVS_PDP_SHIFT)
+
+/* PD EPR Adjustable Voltage Supply APDO voltages */
+#define PD_APDO_EPR_AVS_MAX_VOLTAGE_GET(pdo) (((pdo) & PD_APDO_EPR_AVS_MAX_VOLTAGE) >> PD_APDO_EPR_AVS_MAX_VOLTAGE_SHIFT)
+#define PD_APDO_EPR_AVS_MIN_VOLTAGE_GET(pdo) (((pdo) & PD_APDO_EPR_AVS_MIN_VOLTAGE) >> PD_APDO_EPR_AVS_MIN_VOLTAGE_SHIFT)
+
+/* PD EPR Adjustable Voltage Supply APDO power, in watts */
+#define PD_APDO_EPR_AVS_PDP_GET(pdo) (((pdo) & PD_APDO_EPR_AVS_PDP) >> PD_APDO_EPR_AVS_PDP_SHIFT)
+
 /* TODO: other types of source PDO */
 
 /* PD Sink Fixed PDO */
@@ -231,7 +436,7 @@
  * PD Request Data Object
  */
 #define PD_RDO_OBJPOS_SHIFT 28
-#define PD_RDO_OBJPOS (0x7 << PD_RDO_OBJPOS_SHIFT)
+#define PD_RDO_OBJPOS (0xF << PD_RDO_OBJPOS_SHIFT)
 #define PD_RDO_GIVEBACK_SHIFT 27
 #define PD_RDO_GIVEBACK (1 << PD_RDO_GIVEBACK_SHIFT)
 #define PD_RDO_CAP_MISMATCH_SHIFT 26
@@ -242,6 +447,8 @@
 #define PD_RDO_NO_USB_SUSPEND (1 << PD_RDO_NO_USB_SUSPEND_SHIFT)
 #define PD_RDO_UNCHUNKED_EXT_MSG_SHIFT 23
 #define PD_RDO_UNCHUNKED_EXT_MSG (1 << PD_RDO_UNCHUNKED_EXT_MSG_SHIFT)
+#define PD_RDO_EPR_CAPABLE_SHIFT 22
+#define PD_RDO_EPR_CAPABLE (1 << PD_RDO_EPR_CAPABLE_SHIFT)
 
 #define PD_RDO_OBJPOS_SET(i) (((i) << PD_RDO_OBJPOS_SHIFT) & PD_RDO_OBJPOS)
 #define PD_RDO_OBJPOS_GET(msg) (((msg)->obj[0] & PD_RDO_OBJPOS) >> PD_RDO_OBJPOS_SHIFT)
@@ -261,7 +468,20 @@
 
 #define PD_RDO_FV_MIN_CURRENT_SET(i) (((i) << PD_RDO_FV_MIN_CURRENT_SHIFT) & PD_RDO_FV_MIN_CURRENT)
 
-/* TODO: Battery RDOs */
+/* Battery RDO, no GiveBack support */
+#define PD_RDO_BATT_POWER_SHIFT 10
+#define PD_RDO_BATT_POWER (0x3FF << PD_RDO_BATT_POWER_SHIFT)
+#define PD_RDO_BATT_MAX_POWER_SHIFT 0
+#define PD_RDO_BATT_MAX_POWER (0x3FF << PD_RDO_BATT_MAX_POWER_SHIFT)
+
+#define PD_RDO_BATT_POWER_SET(p) (((p) << PD_RDO_BATT_POWER_SHIFT) & PD_RDO_BATT_POWER)
+#define PD_RDO_BATT_MAX_POWER_SET(p) (((p) << PD_RDO_BATT_MAX_POWER_SHIFT) & PD_RDO_BATT_MAX_POWER)
+
+/* Battery RDO with GiveBack support */
+#define PD_RDO_BATT_MIN_POWER_SHIFT 0
+#define PD_RDO_BATT_MIN_POWER (0x3FF << PD_RDO_BATT_MIN_POWER_SHIFT)
+
+#define PD_RDO_BATT_MIN_POWER_SET(p) (((p) << PD_RDO_BATT_MIN_POWER_SHIFT) & PD_RDO_BATT_MIN_POWER)
 
 /* Programmable RDO */
 #define PD_RDO_PROG_VOLTAGE_SHIFT 9
@@ -272,6 +492,95 @@
 #define PD_RDO_PROG_VOLTAGE_SET(i) (((i) << PD_RDO_PROG_VOLTAGE_SHIFT) & PD_RDO_PROG_VOLTAGE)
 #define PD_RDO_PROG_CURRENT_SET(i) (((i) << PD_RDO_PROG_CURRENT_SHIFT) & PD_RDO_PROG_CURRENT)
 
+/* AVS RDO */
+#define PD_RDO_AVS_VOLTAGE_SHIFT 9
+#define PD_RDO_AVS_VOLTAGE (0xFFF << PD_RDO_AVS_VOLTAGE_SHIFT)
+#define PD_RDO_AVS_CURRENT_SHIFT 0
+#define PD_RDO_AVS_CURRENT (0x7F << PD_RDO_AVS_CURRENT_SHIFT)
+
+#define PD_RDO_AVS_VOLTAGE_SET(i) (((i) << PD_RDO_AVS_VOLTAGE_SHIFT) & PD_RDO_AVS_VOLTAGE)
+#define PD_RDO_AVS_CURRENT_SET(i) (((i) << PD_RDO_AVS_CURRENT_SHIFT) & PD_RDO_AVS_CURRENT)
+
+
+/*
+ * PD Vendor Defined Message Header
+ */
+#define PD_VDM_SVID_SHIFT 16
+#define PD_VDM_SVID (0xFFFF << PD_VDM_SVID_SHIFT)
+#define PD_VDM_STRUCTURED_SHIFT 15
+#define PD_VDM_STRUCTURED (1 << PD_VDM_STRUCTURED_SHIFT)
+#define PD_VDM_VERSION_SHIFT 13
+#define PD_VDM_VERSION (0x3 << PD_VDM_VERSION_SHIFT)
+#define PD_VDM_OBJPOS_SHIFT 8
+#define PD_VDM_OBJPOS (0x7 << PD_VDM_OBJPOS_SHIFT)
+#define PD_VDM_CMDTYPE_SHIFT 6
+#define PD_VDM_CMDTYPE (0x3 << PD_VDM_CMDTYPE_SHIFT)
+#define PD_VDM_CMD_SHIFT 0
+#define PD_VDM_CMD (0x1F << PD_VDM_CMD_SHIFT)
+
+#define PD_VDM_SVID_SET(s) (((uint32_t) (s) << PD_VDM_SVID_SHIFT) & PD_VDM_SVID)
+#define PD_VDM_SVID_GET(vdmh) (((vdmh) & PD_VDM_SVID) >> PD_VDM_SVID_SHIFT)
+#define PD_VDM_VERSION_SET(v) (((v) << PD_VDM_VERSION_SHIFT) & PD_VDM_VERSION)
+#define PD_VDM_VERSION_GET(vdmh) (((vdmh) & PD_VDM_VERSION) >> PD_VDM_VERSION_SHIFT)
+#define PD_VDM_CMDTYPE_SET(t) (((t) << PD_VDM_CMDTYPE_SHIFT) & PD_VDM_CMDTYPE)
+#define PD_VDM_CMDTYPE_GET(vdmh) (((vdmh) & PD_VDM_CMDTYPE) >> PD_VDM_CMDTYPE_SHIFT)
+#define PD_VDM_CMD_GET(vdmh) (((vdmh) & PD_VDM_CMD) >> PD_VDM_CMD_SHIFT)
+
+/* Structured VDM versions */
+#define PD_VDM_VERSION_1_0 0x0
+#define PD_VDM_VERSION_2_0 0x1
+
+/* Structured VDM command types */
+#define PD_VDM_CMDTYPE_REQ 0x0
+#define PD_VDM_CMDTYPE_ACK 0x1
+#define PD_VDM_CMDTYPE_NAK 0x2
+#define PD_VDM_CMDTYPE_BUSY 0x3
+
+/* Structured VDM commands */
+#define PD_VDM_CMD_DISCOVER_IDENTITY 0x01
+#define PD_VDM_CMD_DISCOVER_SVIDS 0x02
+#define PD_VDM_CMD_DISCOVER_MODES 0x03
+#define PD_VDM_CMD_ENTER_MODE 0x04
+#define PD_VDM_CMD_EXIT_MODE 0x05
+#define PD_VDM_CMD_ATTENTION 0x06
+
+/* Standard ID for USB Power Delivery */
+#define PD_SVID_PD_SID 0xFF00
+
+/* ID Header VDO */
+#define PD_VDO_IDH_USB_HOST (1 << 31)
+#define PD_VDO_IDH_USB_DEVICE (1 << 30)
+#define PD_VDO_IDH_UFP_TYPE_SHIFT 27
+#define PD_VDO_IDH_UFP_TYPE (0x7 << PD_VDO_IDH_UFP_TYPE_SHIFT)
+#define PD_VDO_IDH_MODAL (1 << 26)
+#define PD_VDO_IDH_DFP_TYPE_SHIFT 23
+#define PD_VDO_IDH_DFP_TYPE (0x7 << PD_VDO_IDH_DFP_TYPE_SHIFT)
+#define PD_VDO_IDH_CONNECTOR_SHIFT 21
+#define PD_VDO_IDH_CONNECTOR (0x3 << PD_VDO_IDH_CONNECTOR_SHIFT)
+#define PD_VDO_IDH_VID_SHIFT 0
+#define PD_VDO_IDH_VID (0xFFFF << PD_VDO_IDH_VID_SHIFT)
+
+#define PD_VDO_IDH_VID_SET(v) (((v) << PD_VDO_IDH_VID_SHIFT) & PD_VDO_IDH_VID)
+
+/* UFP product types */
+#define PD_VDO_IDH_UFP_TYPE_UNDEFINED (0x0 << PD_VDO_IDH_UFP_TYPE_SHIFT)
+#define PD_VDO_IDH_UFP_TYPE_HUB (0x1 << PD_VDO_IDH_UFP_TYPE_SHIFT)
+#define PD_VDO_IDH_UFP_TYPE_PERIPHERAL (0x2 << PD_VDO_IDH_UFP_TYPE_SHIFT)
+#define PD_VDO_IDH_UFP_TYPE_PSD (0x3 << PD_VDO_IDH_UFP_TYPE_SHIFT)
+
+/* Connector types */
+#define PD_VDO_IDH_CONNECTOR_RECEPTACLE (0x2 << PD_VDO_IDH_CONNECTOR_SHIFT)
+#define PD_VDO_IDH_CONNECTOR_PLUG (0x3 << PD_VDO_IDH_CONNECTOR_SHIFT)
+
+/* Product VDO */
+#define PD_VDO_PRODUCT_PID_SHIFT 16
+#define PD_VDO_PRODUCT_PID (0xFFFF << PD_VDO_PRODUCT_PID_SHIFT)
+#define PD_VDO_PRODUCT_BCDDEVICE_SHIFT 0
+#define PD_VDO_PRODUCT_BCDDEVICE (0xFFFF << PD_VDO_PRODUCT_BCDDEVICE_SHIFT)
+
+#define PD_VDO_PRODUCT_PID_SET(p) (((uint32_t) (p) << PD_VDO_PRODUCT_PID_SHIFT) & PD_VDO_PRODUCT_PID)
+#define PD_VDO_PRODUCT_BCDDEVICE_SET(b) (((b) << PD_VDO_PRODUCT_BCDDEVICE_SHIFT) & PD_VDO_PRODUCT_BCDDEVICE)
+
 
 /*
  * Time values
@@ -286,6 +595,11 @@
 #define PD_T_SINK_REQUEST TIME_MS2I(100)
 #define PD_T_TYPEC_SINK_WAIT_CAP TIME_MS2I(465)
 #define PD_T_PPS_REQUEST TIME_S2I(10)
+#define PD_T_CHUNK_SENDER_RESPONSE TIME_MS2I(27)
+#define PD_T_ENTER_EPR TIME_MS2I(500)
+#define PD_T_SINK_EPR_KEEP_ALIVE TIME_MS2I(375)
+#define PD_T_VDM_RECEIVER_RESPONSE TIME_MS2I(15)
+#define PD_T_VDM_SENDER_RESPONSE TIME_MS2I(27)
 /* This is actually from Type-C, not Power Delivery, but who cares? */
 #define PD_T_PD_DEBOUNCE TIME_MS2I(15)
 
@@ -302,6 +616,12 @@
 #define PD_MAX_EXT_MSG_LEN 260
 #define PD_MAX_EXT_MSG_CHUNK_LEN 26
 #define PD_MAX_EXT_MSG_LEGACY_LEN 26
+/* Maximum number of PDOs in a Source_Capabilities message */
+#define PD_MAX_SPR_PDOS 7
+/* Maximum number of PDOs in an EPR_Source_Capabilities message */
+#define PD_MAX_EPR_PDOS 11
+/* Object position of the first EPR PDO */
+#define PD_EPR_PDO_FIRST_OBJPOS 8
 
 
 /*
@@ -313,6 +633,7 @@
  * PRV: Programmable RDO voltage unit (20 mV)
  * PDV: Power Delivery voltage unit (50 mV)
  * PAV: PPS APDO voltage unit (100 mV)
+ * ASV: AVS RDO voltage unit (25 mV)
  *
  * A: ampere
  * CA: centiampere
@@ -323,6 +644,7 @@
  * W: watt
  * CW: centiwatt
  * MW: milliwatt
+ * PDW: PD power unit (250 mW)
  *
  * O: ohm
  * CO: centiohm
@@ -334,6 +656,8 @@
 #define PD_PRV2MV(prv) ((prv) * 20)
 #define PD_PDV2MV(pdv) ((pdv) * 50)
 #define PD_PAV2MV(pav) ((pav) * 100)
+#define PD_MV2ASV(mv) ((mv) / 25)
+#define PD_ASV2MV(asv) ((asv) * 25)
 
 #define PD_MA2CA(ma) (((ma) + 10 - 1) / 10)
 #define PD_MA2PDI(ma) (((ma) + 10 - 1) / 10)
@@ -344,6 +668,8 @@
 #define PD_PAI2CA(pai) ((pai) * 5)
 
 #define PD_MW2CW(mw) ((mw) / 10)
+#define PD_CW2PDW(cw) (((cw) + 25 - 1) / 25)
+#define PD_PDW2CW(pdw) ((pdw) * 25)
 
 #define PD_MO2CO(mo) ((mo) / 10)
 
@@ -368,6 +694,9 @@
 #define PD_CW_W(cw) ((cw) / 100)
 #define PD_CW_CW(cw) ((cw) % 100)
 
+#define PD_PDW_W(pdw) ((pdw) / 4)
+#define PD_PDW_CW(pdw) (25 * ((pdw) % 4))
+
 /* Get portions of a resistance in more normal units */
 #define PD_CO_O(co) ((co) / 100)
 #define PD_CO_CO(co) ((co) % 100)
@@ -376,7 +705,8 @@
  * Unit constants
  */
 #define PD_MV_MIN 0
-#define PD_MV_MAX 21000
+#define PD_MV_MAX 48000
+#define PD_MV_SPR_MAX 21000
 #define PD_PDV_MIN PD_MV2PDV(PD_MV_MIN)
 #define PD_PDV_MAX PD_MV2PDV(PD_MV_MAX)
 
@@ -388,7 +718,10 @@
 #define PD_PDI_MAX PD_MA2PDI(PD_MA_MAX)
 
 #define PD_MW_MIN 0
-#define PD_MW_MAX 100000
+#define PD_MW_MAX 240000
+
+/* The largest Operational PDP a sink can request in EPR Mode, in watts */
+#define PD_EPR_PDP_MAX 240
 
 #define PD_MO_MIN 500
 #define PD_MO_MAX 655350
@@ -56,6 +56,7 @@ struct pdb_config {
     /* INT_N pin thread and related variables */
     struct pdb_int_n int_n;
 
+    /* Application-defined state, e.g. the selected profile */
     uint8_t state;
 };
 
@@ -19,6 +19,7 @@
 #define PDB_DPM_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include <pdb_fusb.h>
 #include <pdb_msg.h>
@@ -27,6 +28,23 @@
 /* Forward declaration of struct pdb_config */
 struct pdb_config;
 
+/*
+ * Identity to report in response to a Discover Identity Structured VDM
+ */
+struct pdb_dpm_identity {
+    /* ID Header VDO.  Modal Operation must not be set, since we don't support
+     * any modes. */
+    uint32_t id_header;
+    /* Cert Stat VDO */
+    uint32_t cert_stat;
+    /* Product VDO */
+    uint32_t product;
+    /* Product Type VDOs, if the ID Header's product type calls for any */
+    uint32_t product_type[3];
+    /* The number of Product Type VDOs */
+    uint8_t product_type_numobj;
+};
+
 /* DPM callback typedefs */
 typedef void (*pdb_dpm_func)(struct pdb_config *);
 typedef bool (*pdb_dpm_eval_cap_func)(struct pdb_config *,
@@ -34,6 +52,15 @@ typedef bool (*pdb_dpm_eval_cap_func)(struct pdb_config *,
 typedef void (*pdb_dpm_get_sink_cap_func)(struct pdb_config *, union pd_msg *);
 typedef bool (*pdb_dpm_giveback_func)(struct pdb_config *);
 typedef bool (*pdb_dpm_tcc_func)(struct pdb_config *, enum fusb_typec_current);
+typedef uint8_t (*pdb_dpm_epr_pdp_func)(struct pdb_config *);
+typedef bool (*pdb_dpm_epr_eval_cap_func)(struct pdb_config *,
+        const uint32_t *, uint8_t, union pd_msg *);
+typedef void (*pdb_dpm_src_cap_ext_func)(struct pdb_config *,
+        const union pd_msg *);
+typedef void (*pdb_dpm_pps_status_func)(struct pdb_config *,
+        const union pd_msg *);
+typedef const struct pdb_dpm_identity *(*pdb_dpm_identity_func)(struct pdb_config *);
+typedef bool (*pdb_dpm_overtemp_func)(struct pdb_config *);
 
 /*
  * PD Buddy firmware library Device Policy Manager callbacks
@@ -140,6 +167,92 @@ struct pdb_dpm_callbacks {
      * Optional.  If no special handling is needed, this may be omitted.
      */
     pdb_dpm_func not_supported_received;
+
+    /*
+     * Return our Operational PDP in watts if we want to enter EPR Mode, or 0
+     * if Standard Power Range power is enough.
+     *
+     * Optional.  If the implementation never needs more than 20 V, this may
+     * be omitted, and we will never enter EPR Mode.
+     */
+    pdb_dpm_epr_pdp_func epr_mode_pdp;
+
+    /*
+     * Evaluate the EPR_Source_Capabilities, creating an EPR_Request in
+     * response.
+     *
+     * The second parameter points to the PDOs from the EPR_Source_Capabilities
+     * message, and the third parameter is the number of PDOs.  Object
+     * positions 1 to 7 hold the SPR PDOs, and EPR PDOs start at object
+     * position 8.  The PDOs remain valid until the Policy Engine leaves EPR
+     * Mode or receives new EPR_Source_Capabilities.
+     *
+     * The fourth parameter is a union pd_msg * into which the EPR_Request must
+     * be written.
+     *
+     * Returns true if sufficient power is available, false otherwise.
+     *
+     * Optional.  If and only if epr_mode_pdp is NULL, this may be omitted.
+     */
+    pdb_dpm_epr_eval_cap_func evaluate_epr_capability;
+
+    /*
+     * Handle a received Source_Capabilities_Extended message.
+     *
+     * The second parameter is the Source_Capabilities_Extended message.  It
+     * is only valid for the duration of the call.  The Policy Engine asks for
+     * it once per session, after the first explicit contract.
+     *
+     * Optional.  If NULL, the Policy Engine never asks for
+     * Source_Capabilities_Extended.
+     */
+    pdb_dpm_src_cap_ext_func source_capabilities_extended;
+
+    /*
+     * Handle a received PPS_Status message.
+     *
+     * The second parameter is the PPS_Status message.  It is only valid for
+     * the duration of the call.  The Policy Engine asks for it every
+     * pps_status_interval during a PPS contract.
+     *
+     * Optional.  If NULL, the Policy Engine never asks for PPS_Status.
+     */
+    pdb_dpm_pps_status_func pps_status;
+
+    /*
+     * Return the identity to report in response to Discover Identity.
+     *
+     * Optional.  If NULL, Structured VDMs are answered with Not_Supported
+     * (PD 3.0) or ignored (PD 2.0), as if we didn't support them.
+     */
+    pdb_dpm_identity_func get_identity;
+
+    /*
+     * Handle the PHY reporting that it has overheated.
+     *
+     * Returns true if the DPM will request less power, in which case the
+     * Policy Engine asks it for new power, or false to have the Policy Engine
+     * send a Hard Reset.
+     *
+     * Optional.  If NULL, the Policy Engine always sends a Hard Reset.
+     */
+    pdb_dpm_overtemp_func overtemp;
+
+    /*
+     * Called when a Soft Reset is sent or received.
+     *
+     * Optional.  If nothing special needs to happen on a Soft Reset, this may
+     * be omitted.
+     */
+    pdb_dpm_func soft_reset;
+
+    /*
+     * Handle the source answering a Request with Reject or Wait, leaving the
+     * old contract (if any) in place.
+     *
+     * Optional.  If no special handling is needed, this may be omitted.
+     */
+    pdb_dpm_func request_rejected;
 };
 
 
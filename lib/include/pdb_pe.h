@@ -24,6 +24,10 @@
 #include <ch.h>
 
 #include "pdb_conf.h"
+#include "pd.h"
+
+
+struct pdb_config;
 
 /*
  * Events for the Policy Engine thread, sent by user code
@@ -33,6 +37,21 @@
 /* Tell the PE that new power is required */
 #define PDB_EVT_PE_NEW_POWER EVENT_MASK(8)
 
+/* The number of Policy Engine state changes remembered for crash reports */
+#define PDB_PE_TRACE_LEN 8
+
+
+/*
+ * A Policy Engine state change
+ */
+struct pdb_pe_trace {
+    /* When the state was entered, in milliseconds, wrapping around */
+    uint16_t time;
+    /* The state entered, numbered as in enum policy_engine_state, or
+     * UINT8_MAX if there's no change here yet */
+    uint8_t state;
+};
+
 
 /*
  * Structure for Policy Engine thread and variables
@@ -46,6 +65,9 @@ struct pdb_pe {
     mailbox_t mailbox;
     /* PD message header template */
     uint16_t hdr_template;
+    /* How often to send Get_PPS_Status during a PPS contract, or 0 to never
+     * send it.  Takes effect at the next Request. */
+    sysinterval_t pps_status_interval;
 
     /* The received message we're currently working with */
     union pd_msg *_message;
@@ -57,17 +79,55 @@ struct pdb_pe {
     bool _min_power;
     /* The number of hard resets we've sent */
     int8_t _hard_reset_counter;
+    /* Whether VBUS went away while the source was unresponsive */
+    bool _source_detached;
+    /* When we entered PESinkSourceUnresponsive */
+    systime_t _unresponsive_start;
+    /* How long to stay in PESinkSourceUnresponsive before trying again */
+    sysinterval_t _unresponsive_backoff;
     /* The result of the last Type-C Current match comparison */
     int8_t _old_tcc_match;
-    /* The index of the first PPS APDO */
-    uint8_t _pps_index;
-    /* The index of the just-requested PPS APDO */
+    /* Bit n is set if the PDO at object position n is a PPS APDO */
+    uint16_t _pps_mask;
+    /* The index of the just-requested PPS APDO, or 0 if there isn't one */
     uint8_t _last_pps;
     /* Virtual timer for SinkPPSPeriodicTimer */
     virtual_timer_t _sink_pps_periodic_timer;
+    /* Virtual timer for polling PPS_Status */
+    virtual_timer_t _pps_status_timer;
+    /* Whether or not the source advertised EPR Mode support */
+    bool _epr_src_capable;
+    /* Whether or not we've tried to enter EPR Mode with this source */
+    bool _epr_attempted;
+    /* Whether or not we're in EPR Mode */
+    bool _epr_mode;
+    /* The most recent EPR_Source_Capabilities PDOs */
+    uint32_t _epr_caps[PD_MAX_EPR_PDOS];
+    /* The number of PDOs in _epr_caps */
+    uint8_t _epr_caps_numobj;
+    /* Virtual timer for SinkEPRKeepAliveTimer */
+    virtual_timer_t _sink_epr_keepalive_timer;
+    /* Whether or not we've asked this source for its extended capabilities */
+    bool _src_cap_ext_requested;
+    /* Whether we're waiting with nothing to do, and since when */
+    bool _idle;
+    systime_t _idle_since;
+    /* The state the PE is in */
+    uint8_t _state;
+    /* The last PDB_PE_TRACE_LEN state changes, oldest at _trace_next */
+    struct pdb_pe_trace _trace[PDB_PE_TRACE_LEN];
+    uint8_t _trace_next;
     /* Queue for the PE mailbox */
     msg_t _mailbox_queue[PDB_MSG_POOL_SIZE];
 };
 
 
+/*
+ * Return whether the Policy Engine has had nothing to do for at least the
+ * given interval.  Operations that stall the CPU for a long time, like flash
+ * page erasures, are least likely to make it miss a deadline then.
+ */
+bool pdb_pe_idle(struct pdb_config *cfg, sysinterval_t quiet);
+
+
 #endif /* PDB_PE_H */
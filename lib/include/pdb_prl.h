@@ -53,6 +53,12 @@ struct pdb_prl {
     union pd_msg *_tx_message;
     /* Queue for the TX mailbox */
     msg_t _tx_mailbox_queue[PDB_MSG_POOL_SIZE];
+
+    /* The states the RX, TX, and hard reset threads are in, for crash
+     * reports */
+    uint8_t _rx_state;
+    uint8_t _tx_state;
+    uint8_t _hardrst_state;
 };
 
 
@@ -132,7 +132,13 @@ uint8_t fusb_read_message(struct pdb_fusb_config *cfg, union pd_msg *msg)
 
     /* If this isn't an SOP message, return error.
      * Because of our configuration, we should be able to assume this means the
-     * buffer is empty, and not try to read past a non-SOP message. */
+     * buffer is empty, and not try to read past a non-SOP message.
+     *
+     * SOP' and SOP'' reception stay disabled on purpose.  Only the VCONN
+     * Source may talk to a cable plug, and we never are, so we couldn't ask
+     * the cable for its identity anyway.  Just listening in wouldn't work
+     * either: with AUTO_CRC enabled, the PHY would send GoodCRC for messages
+     * meant for the source or the cable. */
     if ((fusb_read_byte(cfg, FUSB_FIFOS) & FUSB_FIFO_RX_TOKEN_BITS)
             != FUSB_FIFO_RX_SOP) {
         i2cReleaseBus(cfg->i2cp);
@@ -233,6 +239,18 @@ enum fusb_typec_current fusb_get_typec_current(struct pdb_fusb_config *cfg)
     return bc_lvl;
 }
 
+bool fusb_get_vbusok(struct pdb_fusb_config *cfg)
+{
+    i2cAcquireBus(cfg->i2cp);
+
+    /* Read the VBUSOK flag */
+    bool vbusok = fusb_read_byte(cfg, FUSB_STATUS0) & FUSB_STATUS0_VBUSOK;
+
+    i2cReleaseBus(cfg->i2cp);
+
+    return vbusok;
+}
+
 void fusb_reset(struct pdb_fusb_config *cfg)
 {
     i2cAcquireBus(cfg->i2cp);
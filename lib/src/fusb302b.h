@@ -19,6 +19,7 @@
 #define PDB_FUSB302B_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #include <pdb_fusb.h>
 
@@ -288,6 +289,11 @@ void fusb_get_status(struct pdb_fusb_config *cfg, union fusb_status *status);
  */
 enum fusb_typec_current fusb_get_typec_current(struct pdb_fusb_config *cfg);
 
+/*
+ * Read whether the FUSB302B sees VBUS above its VBUSOK threshold
+ */
+bool fusb_get_vbusok(struct pdb_fusb_config *cfg);
+
 /*
  * Initialization routine for the FUSB302B
  */
@@ -124,10 +124,14 @@ static enum hardrst_state hardrst_complete(struct pdb_config *cfg)
 /*
  * Hard Reset state machine thread
  */
-static THD_FUNCTION(HardReset, cfg) {
+static THD_FUNCTION(HardReset, vcfg) {
+    struct pdb_config *cfg = vcfg;
     enum hardrst_state state = PRLHRResetLayer;
 
+    chRegSetThreadName("Hard reset");
+
     while (true) {
+        cfg->prl._hardrst_state = state;
         switch (state) {
             case PRLHRResetLayer:
                 state = hardrst_reset_layer(cfg);
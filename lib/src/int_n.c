@@ -38,6 +38,8 @@ static THD_FUNCTION(IntNPoll, vcfg) {
     union fusb_status status;
     eventmask_t events;
 
+    chRegSetThreadName("INT_N");
+
     while (true) {
         /* If the INT_N line is low */
         if (palReadLine(cfg->fusb.int_n) == PAL_LOW) {
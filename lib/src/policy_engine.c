@@ -21,6 +21,7 @@
 
 #include <pd.h>
 #include "priorities.h"
+#include "protocol_rx.h"
 #include "protocol_tx.h"
 #include "hard_reset.h"
 #include "fusb302b.h"
@@ -34,6 +35,29 @@ static void pe_sink_pps_periodic_timer_cb(void *cfg)
     chSysUnlockFromISR();
 }
 
+static void pe_sink_pps_status_timer_cb(void *vcfg)
+{
+    struct pdb_config *cfg = vcfg;
+
+    /* Signal the PE thread to send a Get_PPS_Status message, and do it again
+     * after another interval */
+    chSysLockFromISR();
+    chEvtSignalI(cfg->pe.thread, PDB_EVT_PE_PPS_STATUS);
+    if (cfg->pe.pps_status_interval > 0) {
+        chVTSetI(&cfg->pe._pps_status_timer, cfg->pe.pps_status_interval,
+                pe_sink_pps_status_timer_cb, cfg);
+    }
+    chSysUnlockFromISR();
+}
+
+static void pe_sink_epr_keepalive_timer_cb(void *cfg)
+{
+    /* Signal the PE thread to send an EPR_KeepAlive message */
+    chSysLockFromISR();
+    chEvtSignalI(((struct pdb_config *) cfg)->pe.thread, PDB_EVT_PE_EPR_KEEPALIVE);
+    chSysUnlockFromISR();
+}
+
 
 enum policy_engine_state {
     PESinkStartup,
@@ -52,13 +76,105 @@ enum policy_engine_state {
     PESinkSendNotSupported,
     PESinkChunkReceived,
     PESinkNotSupportedReceived,
-    PESinkSourceUnresponsive
+    PESinkSourceUnresponsive,
+    PESinkEPRModeEntry,
+    PESinkEPRModeExit,
+    PESinkEPREvalCap,
+    PESinkEPRKeepAlive,
+    PESinkGetSourceCapExt,
+    PESinkGetPPSStatus,
+    PESinkRespondVDM
 };
 
+/*
+ * Return whether or not the last request was for a PPS APDO
+ */
+static bool pe_sink_request_is_pps(struct pdb_config *cfg)
+{
+    return (cfg->pe._pps_mask
+            & (1 << PD_RDO_OBJPOS_GET(cfg->pe._last_dpm_request))) != 0;
+}
+
+/*
+ * Remember which of the given PDOs are PPS APDOs so we can check if a request
+ * is for a PPS APDO in PE_SNK_Select_Cap.  Other APDOs, like AVS, don't need
+ * periodic requests.
+ */
+static void pe_sink_find_pps(struct pdb_config *cfg, uint32_t pdo, uint8_t objpos)
+{
+    if ((pdo & PD_PDO_TYPE) == PD_PDO_TYPE_AUGMENTED
+            && (pdo & PD_APDO_TYPE) == PD_APDO_TYPE_PPS) {
+        cfg->pe._pps_mask |= 1 << objpos;
+    }
+}
+
+/*
+ * Get a message object for a new request from the DPM, remembering what the
+ * old request was for
+ */
+static void pe_sink_prepare_request(struct pdb_config *cfg)
+{
+    /* Get a message object for the request if we don't have one already */
+    if (cfg->pe._last_dpm_request == NULL) {
+        cfg->pe._last_dpm_request = chPoolAlloc(&pdb_msg_pool);
+    } else {
+        /* Remember the last PDO we requested if it was a PPS APDO */
+        if (pe_sink_request_is_pps(cfg)) {
+            cfg->pe._last_pps = PD_RDO_OBJPOS_GET(cfg->pe._last_dpm_request);
+        /* Otherwise, forget any PPS APDO we had requested */
+        } else {
+            cfg->pe._last_pps = 0;
+        }
+    }
+}
+
+/*
+ * Return whether or not we should be in EPR Mode
+ */
+static bool pe_sink_epr_wanted(struct pdb_config *cfg)
+{
+    /* EPR Mode needs PD 3.0 signaling, a source that supports it, and a DPM
+     * that asks for it */
+    return (cfg->pe.hdr_template & PD_HDR_SPECREV) == PD_SPECREV_3_0
+        && cfg->pe._epr_src_capable
+        && cfg->dpm.epr_mode_pdp != NULL
+        && cfg->dpm.epr_mode_pdp(cfg) > 0;
+}
+
+/*
+ * Leave EPR Mode
+ */
+static void pe_sink_epr_exit(struct pdb_config *cfg)
+{
+    cfg->pe._epr_mode = false;
+    /* Stop SinkEPRKeepAliveTimer */
+    chVTReset(&cfg->pe._sink_epr_keepalive_timer);
+}
+
+/*
+ * Note whether we're waiting with nothing to do
+ */
+static void pe_idle_set(struct pdb_config *cfg, bool idle)
+{
+    if (idle && !cfg->pe._idle) {
+        cfg->pe._idle_since = chVTGetSystemTime();
+    }
+    cfg->pe._idle = idle;
+}
+
 static enum policy_engine_state pe_sink_startup(struct pdb_config *cfg)
 {
     /* We don't have an explicit contract currently */
     cfg->pe._explicit_contract = false;
+    /* A hard reset or a new attach leaves EPR Mode, and we don't know yet
+     * whether the source supports it */
+    pe_sink_epr_exit(cfg);
+    cfg->pe._epr_src_capable = false;
+    cfg->pe._epr_attempted = false;
+    /* We haven't asked this source for its extended capabilities yet */
+    cfg->pe._src_cap_ext_requested = false;
+    /* Stop polling PPS_Status until we have a new PPS contract */
+    chVTReset(&cfg->pe._pps_status_timer);
     /* Tell the DPM that we've started negotiations, if it cares */
     if (cfg->dpm.pd_start != NULL) {
         cfg->dpm.pd_start(cfg);
@@ -106,7 +222,8 @@ static enum policy_engine_state pe_sink_wait_cap(struct pdb_config *cfg)
         if (chMBFetchTimeout(&cfg->pe.mailbox, (msg_t *) &cfg->pe._message, TIME_IMMEDIATE) == MSG_OK) {
             /* If we got a Source_Capabilities message, read it. */
             if (PD_MSGTYPE_GET(cfg->pe._message) == PD_MSGTYPE_SOURCE_CAPABILITIES
-                    && PD_NUMOBJ_GET(cfg->pe._message) > 0) {
+                    && PD_NUMOBJ_GET(cfg->pe._message) > 0
+                    && !(cfg->pe._message->hdr & PD_HDR_EXT)) {
                 /* First, determine what PD revision we're using */
                 if ((cfg->pe.hdr_template & PD_HDR_SPECREV) == PD_SPECREV_1_0) {
                     /* If the other end is using at least version 3.0, we'll
@@ -120,6 +237,11 @@ static enum policy_engine_state pe_sink_wait_cap(struct pdb_config *cfg)
                     }
                 }
                 return PESinkEvalCap;
+            /* In EPR Mode, we get EPR_Source_Capabilities instead */
+            } else if (cfg->pe._epr_mode
+                    && PD_MSGTYPE_GET(cfg->pe._message) == PD_MSGTYPE_EPR_SOURCE_CAPABILITIES
+                    && (cfg->pe._message->hdr & PD_HDR_EXT)) {
+                return PESinkEPREvalCap;
             /* If the message was a Soft_Reset, do the soft reset procedure */
             } else if (PD_MSGTYPE_GET(cfg->pe._message) == PD_MSGTYPE_SOFT_RESET
                     && PD_NUMOBJ_GET(cfg->pe._message) == 0) {
@@ -141,40 +263,34 @@ static enum policy_engine_state pe_sink_wait_cap(struct pdb_config *cfg)
 
 static enum policy_engine_state pe_sink_eval_cap(struct pdb_config *cfg)
 {
-    /* If we have a Source_Capabilities message, remember the index of the
-     * first PPS APDO so we can check if the request is for a PPS APDO in
+    /* If we have a Source_Capabilities message, remember which PDOs are PPS
+     * APDOs so we can check if the request is for a PPS APDO in
      * PE_SNK_Select_Cap. */
     if (cfg->pe._message != NULL) {
-        /* Start by assuming we won't find a PPS APDO (set the index greater
-         * than the maximum possible) */
-        cfg->pe._pps_index = 8;
-        /* Search for the first PPS APDO */
+        /* Start by assuming we won't find a PPS APDO */
+        cfg->pe._pps_mask = 0;
+        /* Search for PPS APDOs */
         for (int8_t i = 0; i < PD_NUMOBJ_GET(cfg->pe._message); i++) {
-            if ((cfg->pe._message->obj[i] & PD_PDO_TYPE) == PD_PDO_TYPE_AUGMENTED
-                    && (cfg->pe._message->obj[i] & PD_APDO_TYPE) == PD_APDO_TYPE_PPS) {
-                cfg->pe._pps_index = i + 1;
-                break;
-            }
+            pe_sink_find_pps(cfg, cfg->pe._message->obj[i], i + 1);
         }
         /* New capabilities also means we can't be making a request from the
          * same PPS APDO */
-        cfg->pe._last_pps = 8;
-    }
-    /* Get a message object for the request if we don't have one already */
-    if (cfg->pe._last_dpm_request == NULL) {
-        cfg->pe._last_dpm_request = chPoolAlloc(&pdb_msg_pool);
-    } else {
-        /* Remember the last PDO we requested if it was a PPS APDO */
-        if (PD_RDO_OBJPOS_GET(cfg->pe._last_dpm_request) >= cfg->pe._pps_index) {
-            cfg->pe._last_pps = PD_RDO_OBJPOS_GET(cfg->pe._last_dpm_request);
-        /* Otherwise, forget any PPS APDO we had requested */
-        } else {
-            cfg->pe._last_pps = 8;
-        }
+        cfg->pe._last_pps = 0;
+
+        /* Remember whether or not the source supports EPR Mode */
+        cfg->pe._epr_src_capable = (cfg->pe._message->obj[0]
+                & PD_PDO_SRC_FIXED_EPR_CAPABLE) != 0;
     }
+    /* Get a message object for the request */
+    pe_sink_prepare_request(cfg);
     /* Ask the DPM what to request */
     cfg->dpm.evaluate_capability(cfg, cfg->pe._message,
             cfg->pe._last_dpm_request);
+    /* Tell the source if we support EPR Mode */
+    if ((cfg->pe.hdr_template & PD_HDR_SPECREV) == PD_SPECREV_3_0
+            && cfg->dpm.epr_mode_pdp != NULL) {
+        cfg->pe._last_dpm_request->obj[0] |= PD_RDO_EPR_CAPABLE;
+    }
     /* It's up to the DPM to free the Source_Capabilities message, which it can
      * do whenever it sees fit.  Just remove our reference to it since we won't
      * know when it's no longer valid. */
@@ -203,12 +319,21 @@ static enum policy_engine_state pe_sink_select_cap(struct pdb_config *cfg)
     /* If we're using PD 3.0 */
     if ((cfg->pe.hdr_template & PD_HDR_SPECREV) == PD_SPECREV_3_0) {
         /* If the request was for a PPS APDO, start SinkPPSPeriodicTimer */
-        if (PD_RDO_OBJPOS_GET(cfg->pe._last_dpm_request) >= cfg->pe._pps_index) {
+        if (pe_sink_request_is_pps(cfg)) {
             chVTSet(&cfg->pe._sink_pps_periodic_timer, PD_T_PPS_REQUEST,
                     pe_sink_pps_periodic_timer_cb, cfg);
-        /* Otherwise, stop SinkPPSPeriodicTimer */
+            /* Start polling PPS_Status too, if the DPM wants it and we
+             * aren't already */
+            if (cfg->dpm.pps_status != NULL && cfg->pe.pps_status_interval > 0
+                    && !chVTIsArmed(&cfg->pe._pps_status_timer)) {
+                chVTSet(&cfg->pe._pps_status_timer,
+                        cfg->pe.pps_status_interval,
+                        pe_sink_pps_status_timer_cb, cfg);
+            }
+        /* Otherwise, stop SinkPPSPeriodicTimer and PPS_Status polling */
         } else {
             chVTReset(&cfg->pe._sink_pps_periodic_timer);
+            chVTReset(&cfg->pe._pps_status_timer);
         }
     }
     /* This will use a virtual timer to send an event flag to this thread after
@@ -251,6 +376,10 @@ static enum policy_engine_state pe_sink_select_cap(struct pdb_config *cfg)
         } else if ((PD_MSGTYPE_GET(cfg->pe._message) == PD_MSGTYPE_REJECT
                     || PD_MSGTYPE_GET(cfg->pe._message) == PD_MSGTYPE_WAIT)
                 && PD_NUMOBJ_GET(cfg->pe._message) == 0) {
+            /* Tell the DPM it didn't get what it asked for, if it cares */
+            if (cfg->dpm.request_rejected != NULL) {
+                cfg->dpm.request_rejected(cfg);
+            }
             /* If we don't have an explicit contract, wait for capabilities */
             if (!cfg->pe._explicit_contract) {
                 chPoolFree(&pdb_msg_pool, cfg->pe._message);
@@ -297,6 +426,11 @@ static enum policy_engine_state pe_sink_transition_sink(struct pdb_config *cfg)
             /* We just finished negotiating an explicit contract */
             cfg->pe._explicit_contract = true;
 
+            /* The source is evidently responsive, so forget about any hard
+             * resets that led up to this contract. */
+            cfg->pe._hard_reset_counter = 0;
+            cfg->pe._unresponsive_backoff = TIME_MS2I(PDB_SRC_UNRESPONSIVE_BACKOFF_MIN);
+
             /* Set the output appropriately */
             if (!cfg->pe._min_power) {
                 cfg->dpm.transition_requested(cfg);
@@ -304,6 +438,29 @@ static enum policy_engine_state pe_sink_transition_sink(struct pdb_config *cfg)
 
             chPoolFree(&pdb_msg_pool, cfg->pe._message);
             cfg->pe._message = NULL;
+
+            /* If we're in EPR Mode, start SinkEPRKeepAliveTimer */
+            if (cfg->pe._epr_mode) {
+                chVTSet(&cfg->pe._sink_epr_keepalive_timer,
+                        PD_T_SINK_EPR_KEEP_ALIVE,
+                        pe_sink_epr_keepalive_timer_cb, cfg);
+            /* Otherwise, enter EPR Mode if the DPM wants more power than SPR
+             * can give it.  Only try once per source, since the cable might
+             * not be up to it. */
+            } else if (!cfg->pe._epr_attempted && pe_sink_epr_wanted(cfg)) {
+                /* Tell the protocol layer we're starting an AMS */
+                chEvtSignal(cfg->prl.tx_thread, PDB_EVT_PRLTX_START_AMS);
+                return PESinkEPRModeEntry;
+            }
+            /* After the first explicit contract, ask the source for its
+             * extended capabilities if the DPM wants them */
+            if (!cfg->pe._src_cap_ext_requested
+                    && (cfg->pe.hdr_template & PD_HDR_SPECREV) == PD_SPECREV_3_0
+                    && cfg->dpm.source_capabilities_extended != NULL) {
+                /* Tell the protocol layer we're starting an AMS */
+                chEvtSignal(cfg->prl.tx_thread, PDB_EVT_PRLTX_START_AMS);
+                return PESinkGetSourceCapExt;
+            }
             return PESinkReady;
         /* If there was a protocol error, send a hard reset */
         } else {
@@ -326,25 +483,33 @@ static enum policy_engine_state pe_sink_ready(struct pdb_config *cfg)
     eventmask_t evt;
 
     /* Wait for an event */
+    pe_idle_set(cfg, true);
     if (cfg->pe._min_power) {
         evt = chEvtWaitAnyTimeout(PDB_EVT_PE_MSG_RX | PDB_EVT_PE_RESET
                 | PDB_EVT_PE_I_OVRTEMP | PDB_EVT_PE_GET_SOURCE_CAP
-                | PDB_EVT_PE_NEW_POWER | PDB_EVT_PE_PPS_REQUEST,
+                | PDB_EVT_PE_NEW_POWER | PDB_EVT_PE_PPS_REQUEST
+                | PDB_EVT_PE_EPR_KEEPALIVE | PDB_EVT_PE_PPS_STATUS,
                 PD_T_SINK_REQUEST);
     } else {
         evt = chEvtWaitAny(PDB_EVT_PE_MSG_RX | PDB_EVT_PE_RESET
                 | PDB_EVT_PE_I_OVRTEMP | PDB_EVT_PE_GET_SOURCE_CAP
-                | PDB_EVT_PE_NEW_POWER | PDB_EVT_PE_PPS_REQUEST);
+                | PDB_EVT_PE_NEW_POWER | PDB_EVT_PE_PPS_REQUEST
+                | PDB_EVT_PE_EPR_KEEPALIVE | PDB_EVT_PE_PPS_STATUS);
     }
+    pe_idle_set(cfg, false);
 
     /* If we got reset signaling, transition to default */
     if (evt & PDB_EVT_PE_RESET) {
         return PESinkTransitionDefault;
     }
 
-    /* If we overheated, send a hard reset */
+    /* If we overheated, let the DPM ask for less power, or send a hard reset
+     * if it can't */
     if (evt & PDB_EVT_PE_I_OVRTEMP) {
-        return PESinkHardReset;
+        if (cfg->dpm.overtemp == NULL || !cfg->dpm.overtemp(cfg)) {
+            return PESinkHardReset;
+        }
+        evt |= PDB_EVT_PE_NEW_POWER;
     }
 
     /* If the DPM wants us to, send a Get_Source_Cap message */
@@ -366,9 +531,28 @@ static enum policy_engine_state pe_sink_ready(struct pdb_config *cfg)
         }
         /* Tell the protocol layer we're starting an AMS */
         chEvtSignal(cfg->prl.tx_thread, PDB_EVT_PRLTX_START_AMS);
+        /* In EPR Mode, evaluate the old EPR_Source_Capabilities, or leave EPR
+         * Mode if the DPM doesn't need it anymore */
+        if (cfg->pe._epr_mode) {
+            if (!pe_sink_epr_wanted(cfg)) {
+                return PESinkEPRModeExit;
+            }
+            return PESinkEPREvalCap;
+        }
+        /* If the DPM needs EPR Mode now, try entering it */
+        if (cfg->pe._explicit_contract && pe_sink_epr_wanted(cfg)) {
+            return PESinkEPRModeEntry;
+        }
         return PESinkEvalCap;
     }
 
+    /* If SinkEPRKeepAliveTimer ran out, keep EPR Mode alive */
+    if ((evt & PDB_EVT_PE_EPR_KEEPALIVE) && cfg->pe._epr_mode) {
+        /* Tell the protocol layer we're starting an AMS */
+        chEvtSignal(cfg->prl.tx_thread, PDB_EVT_PRLTX_START_AMS);
+        return PESinkEPRKeepAlive;
+    }
+
     /* If SinkPPSPeriodicTimer ran out, send a new request */
     if (evt & PDB_EVT_PE_PPS_REQUEST) {
         /* Tell the protocol layer we're starting an AMS */
@@ -376,6 +560,15 @@ static enum policy_engine_state pe_sink_ready(struct pdb_config *cfg)
         return PESinkSelectCap;
     }
 
+    /* If it's time to poll PPS_Status and we still have a PPS contract, send
+     * a Get_PPS_Status message */
+    if ((evt & PDB_EVT_PE_PPS_STATUS) && cfg->pe._explicit_contract
+            && pe_sink_request_is_pps(cfg)) {
+        /* Tell the protocol layer we're starting an AMS */
+        chEvtSignal(cfg->prl.tx_thread, PDB_EVT_PRLTX_START_AMS);
+        return PESinkGetPPSStatus;
+    }
+
     /* If no event was received, the timer ran out. */
     if (evt == 0) {
         /* Repeat our Request message */
@@ -385,12 +578,11 @@ static enum policy_engine_state pe_sink_ready(struct pdb_config *cfg)
     /* If we received a message */
     if (evt & PDB_EVT_PE_MSG_RX) {
         if (chMBFetchTimeout(&cfg->pe.mailbox, (msg_t *) &cfg->pe._message, TIME_IMMEDIATE) == MSG_OK) {
-            /* Ignore vendor-defined messages */
+            /* Respond to vendor-defined messages */
             if (PD_MSGTYPE_GET(cfg->pe._message) == PD_MSGTYPE_VENDOR_DEFINED
                     && PD_NUMOBJ_GET(cfg->pe._message) > 0) {
-                chPoolFree(&pdb_msg_pool, cfg->pe._message);
-                cfg->pe._message = NULL;
-                return PESinkReady;
+                /* Don't free the message: we need it to make the response */
+                return PESinkRespondVDM;
             /* Ignore Ping messages */
             } else if (PD_MSGTYPE_GET(cfg->pe._message) == PD_MSGTYPE_PING
                     && PD_NUMOBJ_GET(cfg->pe._message) == 0) {
@@ -453,7 +645,8 @@ static enum policy_engine_state pe_sink_ready(struct pdb_config *cfg)
                 }
             /* Evaluate new Source_Capabilities */
             } else if (PD_MSGTYPE_GET(cfg->pe._message) == PD_MSGTYPE_SOURCE_CAPABILITIES
-                    && PD_NUMOBJ_GET(cfg->pe._message) > 0) {
+                    && PD_NUMOBJ_GET(cfg->pe._message) > 0
+                    && !(cfg->pe._message->hdr & PD_HDR_EXT)) {
                 /* Don't free the message: we need to keep the
                  * Source_Capabilities message so we can evaluate it. */
                 return PESinkEvalCap;
@@ -471,9 +664,27 @@ static enum policy_engine_state pe_sink_ready(struct pdb_config *cfg)
                 return PESinkSoftReset;
             /* PD 3.0 messges */
             } else if ((cfg->pe.hdr_template & PD_HDR_SPECREV) == PD_SPECREV_3_0) {
+                /* Evaluate new EPR_Source_Capabilities */
+                if (cfg->pe._epr_mode
+                        && PD_MSGTYPE_GET(cfg->pe._message) == PD_MSGTYPE_EPR_SOURCE_CAPABILITIES
+                        && (cfg->pe._message->hdr & PD_HDR_EXT)) {
+                    /* Don't free the message: we need the first chunk to get
+                     * the rest of the EPR_Source_Capabilities. */
+                    return PESinkEPREvalCap;
+                /* If the source leaves EPR Mode, it sends new SPR
+                 * Source_Capabilities */
+                } else if (cfg->pe._epr_mode
+                        && PD_MSGTYPE_GET(cfg->pe._message) == PD_MSGTYPE_EPR_MODE
+                        && PD_NUMOBJ_GET(cfg->pe._message) == 1
+                        && !(cfg->pe._message->hdr & PD_HDR_EXT)
+                        && PD_EPRMDO_ACTION_GET(cfg->pe._message) == PD_EPRMDO_ACTION_EXIT) {
+                    pe_sink_epr_exit(cfg);
+                    chPoolFree(&pdb_msg_pool, cfg->pe._message);
+                    cfg->pe._message = NULL;
+                    return PESinkWaitCap;
                 /* If the message is a multi-chunk extended message, let it
                  * time out. */
-                if ((cfg->pe._message->hdr & PD_HDR_EXT)
+                } else if ((cfg->pe._message->hdr & PD_HDR_EXT)
                         && (PD_DATA_SIZE_GET(cfg->pe._message) > PD_MAX_EXT_MSG_LEGACY_LEN)) {
                     chPoolFree(&pdb_msg_pool, cfg->pe._message);
                     cfg->pe._message = NULL;
@@ -566,6 +777,7 @@ static enum policy_engine_state pe_sink_hard_reset(struct pdb_config *cfg)
     /* If we've already sent the maximum number of hard resets, assume the
      * source is unresponsive. */
     if (cfg->pe._hard_reset_counter > PD_N_HARD_RESET_COUNT) {
+        cfg->pe._unresponsive_start = chVTGetSystemTime();
         return PESinkSourceUnresponsive;
     }
 
@@ -601,6 +813,11 @@ static enum policy_engine_state pe_sink_soft_reset(struct pdb_config *cfg)
     /* No need to explicitly reset the protocol layer here.  It resets itself
      * when a Soft_Reset message is received. */
 
+    /* Tell the DPM about the reset */
+    if (cfg->dpm.soft_reset != NULL) {
+        cfg->dpm.soft_reset(cfg);
+    }
+
     /* Get a message object */
     union pd_msg *accept = chPoolAlloc(&pdb_msg_pool);
     /* Make an Accept message */
@@ -630,6 +847,11 @@ static enum policy_engine_state pe_sink_send_soft_reset(struct pdb_config *cfg)
     /* No need to explicitly reset the protocol layer here.  It resets itself
      * just before a Soft_Reset message is transmitted. */
 
+    /* Tell the DPM about the reset */
+    if (cfg->dpm.soft_reset != NULL) {
+        cfg->dpm.soft_reset(cfg);
+    }
+
     /* Get a message object */
     union pd_msg *softrst = chPoolAlloc(&pdb_msg_pool);
     /* Make a Soft_Reset message */
@@ -748,11 +970,630 @@ static enum policy_engine_state pe_sink_not_supported_received(struct pdb_config
     return PESinkReady;
 }
 
+static enum policy_engine_state pe_sink_epr_mode_entry(struct pdb_config *cfg)
+{
+    /* Don't try again with this source unless the DPM asks for new power */
+    cfg->pe._epr_attempted = true;
+
+    /* Get a message object */
+    union pd_msg *epr_mode = chPoolAlloc(&pdb_msg_pool);
+    /* Make an EPR_Mode (Enter) message with our Operational PDP */
+    epr_mode->hdr = cfg->pe.hdr_template | PD_MSGTYPE_EPR_MODE | PD_NUMOBJ(1);
+    epr_mode->obj[0] = PD_EPRMDO_ACTION_SET(PD_EPRMDO_ACTION_ENTER)
+        | PD_EPRMDO_DATA_SET(cfg->dpm.epr_mode_pdp(cfg));
+    /* Transmit the EPR_Mode */
+    chMBPostTimeout(&cfg->prl.tx_mailbox, (msg_t) epr_mode, TIME_IMMEDIATE);
+    chEvtSignal(cfg->prl.tx_thread, PDB_EVT_PRLTX_MSG_TX);
+    eventmask_t evt = chEvtWaitAny(PDB_EVT_PE_TX_DONE | PDB_EVT_PE_TX_ERR
+            | PDB_EVT_PE_RESET);
+    /* Free the sent message */
+    chPoolFree(&pdb_msg_pool, epr_mode);
+    epr_mode = NULL;
+    /* If we got reset signaling, transition to default */
+    if (evt & PDB_EVT_PE_RESET) {
+        return PESinkTransitionDefault;
+    }
+    /* If the message transmission failed, send a hard reset */
+    if ((evt & PDB_EVT_PE_TX_DONE) == 0) {
+        return PESinkHardReset;
+    }
+
+    /* Wait for the source to acknowledge the request */
+    evt = chEvtWaitAnyTimeout(PDB_EVT_PE_MSG_RX | PDB_EVT_PE_RESET,
+            PD_T_SENDER_RESPONSE);
+    /* If we got reset signaling, transition to default */
+    if (evt & PDB_EVT_PE_RESET) {
+        return PESinkTransitionDefault;
+    }
+    /* If we didn't get a response before the timeout, send a soft reset */
+    if (evt == 0) {
+        return PESinkSendSoftReset;
+    }
+
+    /* Get the response message */
+    if (chMBFetchTimeout(&cfg->pe.mailbox, (msg_t *) &cfg->pe._message, TIME_IMMEDIATE) != MSG_OK) {
+        return PESinkSendSoftReset;
+    }
+    /* If the source doesn't support EPR Mode after all, stay in SPR Mode */
+    if (PD_MSGTYPE_GET(cfg->pe._message) == PD_MSGTYPE_NOT_SUPPORTED
+            && PD_NUMOBJ_GET(cfg->pe._message) == 0) {
+        chPoolFree(&pdb_msg_pool, cfg->pe._message);
+        cfg->pe._message = NULL;
+        return PESinkNotSupportedReceived;
+    }
+    /* Anything but an acknowledgement means we failed to enter EPR Mode */
+    if (PD_MSGTYPE_GET(cfg->pe._message) != PD_MSGTYPE_EPR_MODE
+            || PD_NUMOBJ_GET(cfg->pe._message) != 1
+            || (cfg->pe._message->hdr & PD_HDR_EXT)
+            || PD_EPRMDO_ACTION_GET(cfg->pe._message) != PD_EPRMDO_ACTION_ENTER_ACK) {
+        chPoolFree(&pdb_msg_pool, cfg->pe._message);
+        cfg->pe._message = NULL;
+        return PESinkSendSoftReset;
+    }
+    chPoolFree(&pdb_msg_pool, cfg->pe._message);
+    cfg->pe._message = NULL;
+
+    /* Wait for the source to check the cable and tell us how it went */
+    evt = chEvtWaitAnyTimeout(PDB_EVT_PE_MSG_RX | PDB_EVT_PE_RESET,
+            PD_T_ENTER_EPR);
+    /* If we got reset signaling, transition to default */
+    if (evt & PDB_EVT_PE_RESET) {
+        return PESinkTransitionDefault;
+    }
+    /* If we didn't get a response before the timeout, send a soft reset */
+    if (evt == 0) {
+        return PESinkSendSoftReset;
+    }
+
+    /* Get the response message */
+    if (chMBFetchTimeout(&cfg->pe.mailbox, (msg_t *) &cfg->pe._message, TIME_IMMEDIATE) != MSG_OK) {
+        return PESinkSendSoftReset;
+    }
+    /* If we didn't succeed, send a soft reset to get back to a known SPR
+     * contract */
+    if (PD_MSGTYPE_GET(cfg->pe._message) != PD_MSGTYPE_EPR_MODE
+            || PD_NUMOBJ_GET(cfg->pe._message) != 1
+            || (cfg->pe._message->hdr & PD_HDR_EXT)
+            || PD_EPRMDO_ACTION_GET(cfg->pe._message) != PD_EPRMDO_ACTION_ENTER_SUCCEEDED) {
+        chPoolFree(&pdb_msg_pool, cfg->pe._message);
+        cfg->pe._message = NULL;
+        return PESinkSendSoftReset;
+    }
+    chPoolFree(&pdb_msg_pool, cfg->pe._message);
+    cfg->pe._message = NULL;
+
+    /* We're in EPR Mode now, so start SinkEPRKeepAliveTimer */
+    cfg->pe._epr_mode = true;
+    chVTSet(&cfg->pe._sink_epr_keepalive_timer, PD_T_SINK_EPR_KEEP_ALIVE,
+            pe_sink_epr_keepalive_timer_cb, cfg);
+
+    /* The source will send us EPR_Source_Capabilities next */
+    return PESinkWaitCap;
+}
+
+static enum policy_engine_state pe_sink_epr_mode_exit(struct pdb_config *cfg)
+{
+    /* Get a message object */
+    union pd_msg *epr_mode = chPoolAlloc(&pdb_msg_pool);
+    /* Make an EPR_Mode (Exit) message */
+    epr_mode->hdr = cfg->pe.hdr_template | PD_MSGTYPE_EPR_MODE | PD_NUMOBJ(1);
+    epr_mode->obj[0] = PD_EPRMDO_ACTION_SET(PD_EPRMDO_ACTION_EXIT);
+    /* Transmit the EPR_Mode */
+    chMBPostTimeout(&cfg->prl.tx_mailbox, (msg_t) epr_mode, TIME_IMMEDIATE);
+    chEvtSignal(cfg->prl.tx_thread, PDB_EVT_PRLTX_MSG_TX);
+    eventmask_t evt = chEvtWaitAny(PDB_EVT_PE_TX_DONE | PDB_EVT_PE_TX_ERR
+            | PDB_EVT_PE_RESET);
+    /* Free the sent message */
+    chPoolFree(&pdb_msg_pool, epr_mode);
+    epr_mode = NULL;
+    /* If we got reset signaling, transition to default */
+    if (evt & PDB_EVT_PE_RESET) {
+        return PESinkTransitionDefault;
+    }
+    /* If the message transmission failed, send a hard reset */
+    if ((evt & PDB_EVT_PE_TX_DONE) == 0) {
+        return PESinkHardReset;
+    }
+
+    pe_sink_epr_exit(cfg);
+
+    /* The source will send us SPR Source_Capabilities next */
+    return PESinkWaitCap;
+}
+
+static enum policy_engine_state pe_sink_epr_eval_cap(struct pdb_config *cfg)
+{
+    /* If we have the first chunk of an EPR_Source_Capabilities message, put
+     * the whole message together, requesting the other chunks one at a time.
+     */
+    if (cfg->pe._message != NULL) {
+        uint8_t *caps = (uint8_t *) cfg->pe._epr_caps;
+        int data_size = PD_DATA_SIZE_GET(cfg->pe._message);
+
+        /* Make sure the message is chunked and will fit */
+        if (!(cfg->pe._message->exthdr & PD_EXTHDR_CHUNKED)
+                || PD_CHUNK_NUMBER_GET(cfg->pe._message) != 0
+                || data_size > (int) sizeof(cfg->pe._epr_caps)) {
+            chPoolFree(&pdb_msg_pool, cfg->pe._message);
+            cfg->pe._message = NULL;
+            return PESinkSendSoftReset;
+        }
+
+        for (int chunk = 0; ; chunk++) {
+            /* Copy the data from this chunk */
+            int offset = chunk * PD_MAX_EXT_MSG_CHUNK_LEN;
+            for (int i = 0; i < PD_MAX_EXT_MSG_CHUNK_LEN && offset + i < data_size; i++) {
+                caps[offset + i] = cfg->pe._message->data[i];
+            }
+            chPoolFree(&pdb_msg_pool, cfg->pe._message);
+            cfg->pe._message = NULL;
+
+            /* If that was the last chunk, we're done */
+            if (offset + PD_MAX_EXT_MSG_CHUNK_LEN >= data_size) {
+                break;
+            }
+
+            /* Get a message object */
+            union pd_msg *chunk_req = chPoolAlloc(&pdb_msg_pool);
+            /* Make a request for the next chunk */
+            chunk_req->hdr = cfg->pe.hdr_template | PD_HDR_EXT
+                | PD_MSGTYPE_EPR_SOURCE_CAPABILITIES | PD_NUMOBJ(1);
+            chunk_req->exthdr = PD_EXTHDR_CHUNKED | PD_EXTHDR_REQUEST_CHUNK
+                | PD_CHUNK_NUMBER(chunk + 1) | PD_DATA_SIZE(0);
+            chunk_req->data[0] = 0;
+            chunk_req->data[1] = 0;
+            /* Transmit the chunk request */
+            chMBPostTimeout(&cfg->prl.tx_mailbox, (msg_t) chunk_req, TIME_IMMEDIATE);
+            chEvtSignal(cfg->prl.tx_thread, PDB_EVT_PRLTX_MSG_TX);
+            eventmask_t evt = chEvtWaitAny(PDB_EVT_PE_TX_DONE
+                    | PDB_EVT_PE_TX_ERR | PDB_EVT_PE_RESET);
+            /* Free the sent message */
+            chPoolFree(&pdb_msg_pool, chunk_req);
+            chunk_req = NULL;
+            /* If we got reset signaling, transition to default */
+            if (evt & PDB_EVT_PE_RESET) {
+                return PESinkTransitionDefault;
+            }
+            /* If the message transmission failed, send a hard reset */
+            if ((evt & PDB_EVT_PE_TX_DONE) == 0) {
+                return PESinkHardReset;
+            }
+
+            /* Wait for the next chunk */
+            evt = chEvtWaitAnyTimeout(PDB_EVT_PE_MSG_RX | PDB_EVT_PE_RESET,
+                    PD_T_CHUNK_SENDER_RESPONSE);
+            /* If we got reset signaling, transition to default */
+            if (evt & PDB_EVT_PE_RESET) {
+                return PESinkTransitionDefault;
+            }
+            /* If we didn't get the chunk in time, send a soft reset */
+            if (evt == 0) {
+                return PESinkSendSoftReset;
+            }
+            if (chMBFetchTimeout(&cfg->pe.mailbox, (msg_t *) &cfg->pe._message, TIME_IMMEDIATE) != MSG_OK) {
+                return PESinkSendSoftReset;
+            }
+            /* If we got something other than the chunk we asked for, send a
+             * soft reset */
+            if (!(cfg->pe._message->hdr & PD_HDR_EXT)
+                    || PD_MSGTYPE_GET(cfg->pe._message) != PD_MSGTYPE_EPR_SOURCE_CAPABILITIES
+                    || PD_CHUNK_NUMBER_GET(cfg->pe._message) != chunk + 1) {
+                chPoolFree(&pdb_msg_pool, cfg->pe._message);
+                cfg->pe._message = NULL;
+                return PESinkSendSoftReset;
+            }
+        }
+
+        cfg->pe._epr_caps_numobj = data_size / 4;
+
+        /* Remember which PDOs are PPS APDOs */
+        cfg->pe._pps_mask = 0;
+        for (int8_t i = 0; i < cfg->pe._epr_caps_numobj; i++) {
+            pe_sink_find_pps(cfg, cfg->pe._epr_caps[i], i + 1);
+        }
+        /* New capabilities also means we can't be making a request from the
+         * same PPS APDO */
+        cfg->pe._last_pps = 0;
+    }
+
+    /* Get a message object for the request */
+    pe_sink_prepare_request(cfg);
+    /* Ask the DPM what to request */
+    cfg->dpm.evaluate_epr_capability(cfg, cfg->pe._epr_caps,
+            cfg->pe._epr_caps_numobj, cfg->pe._last_dpm_request);
+    /* We still support EPR Mode */
+    cfg->pe._last_dpm_request->obj[0] |= PD_RDO_EPR_CAPABLE;
+
+    return PESinkSelectCap;
+}
+
+static enum policy_engine_state pe_sink_epr_keep_alive(struct pdb_config *cfg)
+{
+    /* Get a message object */
+    union pd_msg *keepalive = chPoolAlloc(&pdb_msg_pool);
+    /* Make an Extended_Control (EPR_KeepAlive) message */
+    keepalive->hdr = cfg->pe.hdr_template | PD_HDR_EXT
+        | PD_MSGTYPE_EXTENDED_CONTROL | PD_NUMOBJ(1);
+    keepalive->exthdr = PD_EXTHDR_CHUNKED | PD_DATA_SIZE(PD_EXTCTRL_DATA_SIZE);
+    keepalive->data[0] = PD_EXTCTRL_TYPE_EPR_KEEPALIVE;
+    keepalive->data[1] = 0;
+    /* Transmit the EPR_KeepAlive */
+    chMBPostTimeout(&cfg->prl.tx_mailbox, (msg_t) keepalive, TIME_IMMEDIATE);
+    chEvtSignal(cfg->prl.tx_thread, PDB_EVT_PRLTX_MSG_TX);
+    eventmask_t evt = chEvtWaitAny(PDB_EVT_PE_TX_DONE | PDB_EVT_PE_TX_ERR
+            | PDB_EVT_PE_RESET);
+    /* Free the sent message */
+    chPoolFree(&pdb_msg_pool, keepalive);
+    keepalive = NULL;
+    /* If we got reset signaling, transition to default */
+    if (evt & PDB_EVT_PE_RESET) {
+        return PESinkTransitionDefault;
+    }
+    /* If the message transmission failed, send a hard reset */
+    if ((evt & PDB_EVT_PE_TX_DONE) == 0) {
+        return PESinkHardReset;
+    }
+
+    /* Wait for a response */
+    evt = chEvtWaitAnyTimeout(PDB_EVT_PE_MSG_RX | PDB_EVT_PE_RESET,
+            PD_T_SENDER_RESPONSE);
+    /* If we got reset signaling, transition to default */
+    if (evt & PDB_EVT_PE_RESET) {
+        return PESinkTransitionDefault;
+    }
+    /* If we didn't get a response before the timeout, send a hard reset */
+    if (evt == 0) {
+        return PESinkHardReset;
+    }
+
+    /* Get the response message */
+    if (chMBFetchTimeout(&cfg->pe.mailbox, (msg_t *) &cfg->pe._message, TIME_IMMEDIATE) == MSG_OK) {
+        /* If the source acknowledged, keep going */
+        if ((cfg->pe._message->hdr & PD_HDR_EXT)
+                && PD_MSGTYPE_GET(cfg->pe._message) == PD_MSGTYPE_EXTENDED_CONTROL
+                && cfg->pe._message->data[0] == PD_EXTCTRL_TYPE_EPR_KEEPALIVE_ACK) {
+            chPoolFree(&pdb_msg_pool, cfg->pe._message);
+            cfg->pe._message = NULL;
+
+            /* Restart SinkEPRKeepAliveTimer */
+            chVTSet(&cfg->pe._sink_epr_keepalive_timer,
+                    PD_T_SINK_EPR_KEEP_ALIVE,
+                    pe_sink_epr_keepalive_timer_cb, cfg);
+            return PESinkReady;
+        /* If the message was a Soft_Reset, do the soft reset procedure */
+        } else if (PD_MSGTYPE_GET(cfg->pe._message) == PD_MSGTYPE_SOFT_RESET
+                && PD_NUMOBJ_GET(cfg->pe._message) == 0) {
+            chPoolFree(&pdb_msg_pool, cfg->pe._message);
+            cfg->pe._message = NULL;
+            return PESinkSoftReset;
+        /* Otherwise, send a soft reset */
+        } else {
+            chPoolFree(&pdb_msg_pool, cfg->pe._message);
+            cfg->pe._message = NULL;
+            return PESinkSendSoftReset;
+        }
+    }
+    return PESinkHardReset;
+}
+
+static enum policy_engine_state pe_sink_get_source_cap_ext(struct pdb_config *cfg)
+{
+    /* Only ask once per session, whatever the outcome */
+    cfg->pe._src_cap_ext_requested = true;
+
+    /* Get a message object */
+    union pd_msg *get_source_cap_ext = chPoolAlloc(&pdb_msg_pool);
+    /* Make a Get_Source_Cap_Extended message */
+    get_source_cap_ext->hdr = cfg->pe.hdr_template
+        | PD_MSGTYPE_GET_SOURCE_CAP_EXTENDED | PD_NUMOBJ(0);
+    /* Transmit the Get_Source_Cap_Extended */
+    chMBPostTimeout(&cfg->prl.tx_mailbox, (msg_t) get_source_cap_ext, TIME_IMMEDIATE);
+    chEvtSignal(cfg->prl.tx_thread, PDB_EVT_PRLTX_MSG_TX);
+    eventmask_t evt = chEvtWaitAny(PDB_EVT_PE_TX_DONE | PDB_EVT_PE_TX_ERR
+            | PDB_EVT_PE_RESET);
+    /* Free the sent message */
+    chPoolFree(&pdb_msg_pool, get_source_cap_ext);
+    get_source_cap_ext = NULL;
+    /* If we got reset signaling, transition to default */
+    if (evt & PDB_EVT_PE_RESET) {
+        return PESinkTransitionDefault;
+    }
+    /* If the message transmission failed, send a hard reset */
+    if ((evt & PDB_EVT_PE_TX_DONE) == 0) {
+        return PESinkHardReset;
+    }
+
+    /* Wait for a response */
+    evt = chEvtWaitAnyTimeout(PDB_EVT_PE_MSG_RX | PDB_EVT_PE_RESET,
+            PD_T_SENDER_RESPONSE);
+    /* If we got reset signaling, transition to default */
+    if (evt & PDB_EVT_PE_RESET) {
+        return PESinkTransitionDefault;
+    }
+    /* If we didn't get a response before the timeout, carry on without the
+     * extended capabilities */
+    if (evt == 0) {
+        return PESinkReady;
+    }
+
+    /* Get the response message */
+    if (chMBFetchTimeout(&cfg->pe.mailbox, (msg_t *) &cfg->pe._message, TIME_IMMEDIATE) == MSG_OK) {
+        /* If we got the extended capabilities in one chunk, give them to the
+         * DPM */
+        if ((cfg->pe._message->hdr & PD_HDR_EXT)
+                && PD_MSGTYPE_GET(cfg->pe._message) == PD_MSGTYPE_SOURCE_CAPABILITIES_EXTENDED
+                && PD_CHUNK_NUMBER_GET(cfg->pe._message) == 0
+                && PD_DATA_SIZE_GET(cfg->pe._message) >= PD_SCEDB_SIZE_REV30
+                && PD_DATA_SIZE_GET(cfg->pe._message) <= PD_MAX_EXT_MSG_CHUNK_LEN) {
+            cfg->dpm.source_capabilities_extended(cfg, cfg->pe._message);
+
+            chPoolFree(&pdb_msg_pool, cfg->pe._message);
+            cfg->pe._message = NULL;
+            return PESinkReady;
+        /* If the source doesn't support it, that's fine too */
+        } else if (PD_MSGTYPE_GET(cfg->pe._message) == PD_MSGTYPE_NOT_SUPPORTED
+                && PD_NUMOBJ_GET(cfg->pe._message) == 0) {
+            chPoolFree(&pdb_msg_pool, cfg->pe._message);
+            cfg->pe._message = NULL;
+            return PESinkNotSupportedReceived;
+        /* If the message was a Soft_Reset, do the soft reset procedure */
+        } else if (PD_MSGTYPE_GET(cfg->pe._message) == PD_MSGTYPE_SOFT_RESET
+                && PD_NUMOBJ_GET(cfg->pe._message) == 0) {
+            chPoolFree(&pdb_msg_pool, cfg->pe._message);
+            cfg->pe._message = NULL;
+            return PESinkSoftReset;
+        /* Otherwise, send a soft reset */
+        } else {
+            chPoolFree(&pdb_msg_pool, cfg->pe._message);
+            cfg->pe._message = NULL;
+            return PESinkSendSoftReset;
+        }
+    }
+    return PESinkHardReset;
+}
+
+static enum policy_engine_state pe_sink_get_pps_status(struct pdb_config *cfg)
+{
+    /* Get a message object */
+    union pd_msg *get_pps_status = chPoolAlloc(&pdb_msg_pool);
+    /* Make a Get_PPS_Status message */
+    get_pps_status->hdr = cfg->pe.hdr_template | PD_MSGTYPE_GET_PPS_STATUS
+        | PD_NUMOBJ(0);
+    /* Transmit the Get_PPS_Status */
+    chMBPostTimeout(&cfg->prl.tx_mailbox, (msg_t) get_pps_status, TIME_IMMEDIATE);
+    chEvtSignal(cfg->prl.tx_thread, PDB_EVT_PRLTX_MSG_TX);
+    eventmask_t evt = chEvtWaitAny(PDB_EVT_PE_TX_DONE | PDB_EVT_PE_TX_ERR
+            | PDB_EVT_PE_RESET);
+    /* Free the sent message */
+    chPoolFree(&pdb_msg_pool, get_pps_status);
+    get_pps_status = NULL;
+    /* If we got reset signaling, transition to default */
+    if (evt & PDB_EVT_PE_RESET) {
+        return PESinkTransitionDefault;
+    }
+    /* If the message transmission failed, send a hard reset */
+    if ((evt & PDB_EVT_PE_TX_DONE) == 0) {
+        return PESinkHardReset;
+    }
+
+    /* Wait for a response */
+    evt = chEvtWaitAnyTimeout(PDB_EVT_PE_MSG_RX | PDB_EVT_PE_RESET,
+            PD_T_SENDER_RESPONSE);
+    /* If we got reset signaling, transition to default */
+    if (evt & PDB_EVT_PE_RESET) {
+        return PESinkTransitionDefault;
+    }
+    /* If we didn't get a response before the timeout, try again next time */
+    if (evt == 0) {
+        return PESinkReady;
+    }
+
+    /* Get the response message */
+    if (chMBFetchTimeout(&cfg->pe.mailbox, (msg_t *) &cfg->pe._message, TIME_IMMEDIATE) == MSG_OK) {
+        /* If we got the PPS status, give it to the DPM */
+        if ((cfg->pe._message->hdr & PD_HDR_EXT)
+                && PD_MSGTYPE_GET(cfg->pe._message) == PD_MSGTYPE_PPS_STATUS
+                && PD_CHUNK_NUMBER_GET(cfg->pe._message) == 0
+                && PD_DATA_SIZE_GET(cfg->pe._message) >= PD_PPSSDB_SIZE) {
+            cfg->dpm.pps_status(cfg, cfg->pe._message);
+
+            chPoolFree(&pdb_msg_pool, cfg->pe._message);
+            cfg->pe._message = NULL;
+            return PESinkReady;
+        /* If the source doesn't support it, stop asking */
+        } else if (PD_MSGTYPE_GET(cfg->pe._message) == PD_MSGTYPE_NOT_SUPPORTED
+                && PD_NUMOBJ_GET(cfg->pe._message) == 0) {
+            chVTReset(&cfg->pe._pps_status_timer);
+
+            chPoolFree(&pdb_msg_pool, cfg->pe._message);
+            cfg->pe._message = NULL;
+            return PESinkNotSupportedReceived;
+        /* If the message was a Soft_Reset, do the soft reset procedure */
+        } else if (PD_MSGTYPE_GET(cfg->pe._message) == PD_MSGTYPE_SOFT_RESET
+                && PD_NUMOBJ_GET(cfg->pe._message) == 0) {
+            chPoolFree(&pdb_msg_pool, cfg->pe._message);
+            cfg->pe._message = NULL;
+            return PESinkSoftReset;
+        /* Otherwise, send a soft reset */
+        } else {
+            chPoolFree(&pdb_msg_pool, cfg->pe._message);
+            cfg->pe._message = NULL;
+            return PESinkSendSoftReset;
+        }
+    }
+    return PESinkHardReset;
+}
+
+static enum policy_engine_state pe_sink_respond_vdm(struct pdb_config *cfg)
+{
+    bool pd3 = (cfg->pe.hdr_template & PD_HDR_SPECREV) == PD_SPECREV_3_0;
+
+    /* All we need from the request is its VDM Header */
+    uint32_t vdm_header = cfg->pe._message->obj[0];
+    chPoolFree(&pdb_msg_pool, cfg->pe._message);
+    cfg->pe._message = NULL;
+
+    /* If we can't handle this VDM, tell the source so with PD 3.0, or ignore
+     * it with PD 2.0 */
+    if (!(vdm_header & PD_VDM_STRUCTURED) || cfg->dpm.get_identity == NULL) {
+        if (pd3) {
+            return PESinkSendNotSupported;
+        }
+        return PESinkReady;
+    }
+    /* Only requests get a response.  Attention never gets one. */
+    if (PD_VDM_CMDTYPE_GET(vdm_header) != PD_VDM_CMDTYPE_REQ
+            || PD_VDM_CMD_GET(vdm_header) == PD_VDM_CMD_ATTENTION) {
+        return PESinkReady;
+    }
+
+    /* Get a message object */
+    union pd_msg *vdm = chPoolAlloc(&pdb_msg_pool);
+    int numobj = 1;
+
+    /* Answer with the highest Structured VDM version we both support */
+    uint8_t version = pd3 ? PD_VDM_VERSION_2_0 : PD_VDM_VERSION_1_0;
+    if (PD_VDM_VERSION_GET(vdm_header) < version) {
+        version = PD_VDM_VERSION_GET(vdm_header);
+    }
+    vdm_header &= ~(PD_VDM_VERSION | PD_VDM_CMDTYPE);
+    vdm_header |= PD_VDM_VERSION_SET(version);
+
+    /* We only answer Discover Identity, and only for the PD SID.  Since we
+     * don't support Modal Operation, we have no SVIDs or Modes to tell about,
+     * and all other commands are NAKed. */
+    if (PD_VDM_CMD_GET(vdm_header) == PD_VDM_CMD_DISCOVER_IDENTITY
+            && PD_VDM_SVID_GET(vdm_header) == PD_SVID_PD_SID) {
+        const struct pdb_dpm_identity *id = cfg->dpm.get_identity(cfg);
+        uint32_t id_header = id->id_header;
+        uint8_t product_type_numobj = id->product_type_numobj;
+
+        /* Structured VDM 1.0 has no DFP or connector types, and its only UFP
+         * product types are hubs and peripherals.  Anything else, like a
+         * PSD, is reported as undefined, with no Product Type VDOs. */
+        if (version == PD_VDM_VERSION_1_0) {
+            uint32_t ufp_type = id_header & PD_VDO_IDH_UFP_TYPE;
+            if (ufp_type != PD_VDO_IDH_UFP_TYPE_HUB
+                    && ufp_type != PD_VDO_IDH_UFP_TYPE_PERIPHERAL) {
+                ufp_type = PD_VDO_IDH_UFP_TYPE_UNDEFINED;
+            }
+            id_header &= ~(PD_VDO_IDH_UFP_TYPE | PD_VDO_IDH_DFP_TYPE
+                    | PD_VDO_IDH_CONNECTOR);
+            id_header |= ufp_type;
+            product_type_numobj = 0;
+        }
+
+        vdm_header |= PD_VDM_CMDTYPE_SET(PD_VDM_CMDTYPE_ACK);
+        vdm->obj[numobj++] = id_header;
+        vdm->obj[numobj++] = id->cert_stat;
+        vdm->obj[numobj++] = id->product;
+        for (int i = 0; i < product_type_numobj && numobj < 7; i++) {
+            vdm->obj[numobj++] = id->product_type[i];
+        }
+    } else {
+        vdm_header |= PD_VDM_CMDTYPE_SET(PD_VDM_CMDTYPE_NAK);
+    }
+
+    /* Make the response */
+    vdm->hdr = cfg->pe.hdr_template | PD_MSGTYPE_VENDOR_DEFINED
+        | PD_NUMOBJ(numobj);
+    vdm->obj[0] = vdm_header;
+
+    /* Transmit the response */
+    chMBPostTimeout(&cfg->prl.tx_mailbox, (msg_t) vdm, TIME_IMMEDIATE);
+    chEvtSignal(cfg->prl.tx_thread, PDB_EVT_PRLTX_MSG_TX);
+    eventmask_t evt = chEvtWaitAny(PDB_EVT_PE_TX_DONE | PDB_EVT_PE_TX_ERR
+            | PDB_EVT_PE_RESET);
+
+    /* Free the message */
+    chPoolFree(&pdb_msg_pool, vdm);
+    vdm = NULL;
+
+    /* If we got reset signaling, transition to default */
+    if (evt & PDB_EVT_PE_RESET) {
+        return PESinkTransitionDefault;
+    }
+    /* If the message transmission failed, send a soft reset */
+    if ((evt & PDB_EVT_PE_TX_DONE) == 0) {
+        return PESinkSendSoftReset;
+    }
+
+    return PESinkReady;
+}
+
+/*
+ * Start over with a newly attached source
+ */
+static enum policy_engine_state pe_sink_source_reattached(struct pdb_config *cfg)
+{
+    cfg->pe._source_detached = false;
+
+    /* The cable may have been plugged in the other way around this time, so
+     * set up the PHY from scratch. */
+    fusb_setup(&cfg->fusb);
+
+    /* Reset the protocol layer, like a hard reset would */
+    cfg->prl._rx_messageid = -1;
+    cfg->prl._tx_messageidcounter = 0;
+    chEvtSignal(cfg->prl.rx_thread, PDB_EVT_PRLRX_RESET);
+    chEvtSignal(cfg->prl.tx_thread, PDB_EVT_PRLTX_RESET);
+    chThdYield();
+
+    /* Forget everything we knew about the old source */
+    cfg->pe.hdr_template = PD_DATAROLE_UFP | PD_POWERROLE_SINK;
+    cfg->pe._hard_reset_counter = 0;
+    cfg->pe._old_tcc_match = -1;
+    cfg->pe._unresponsive_backoff = TIME_MS2I(PDB_SRC_UNRESPONSIVE_BACKOFF_MIN);
+
+    return PESinkStartup;
+}
+
 /*
  * When Power Delivery is unresponsive, fall back to Type-C Current
  */
 static enum policy_engine_state pe_sink_source_unresponsive(struct pdb_config *cfg)
 {
+    /* If VBUS is gone, the source has been detached */
+    if (!fusb_get_vbusok(&cfg->fusb)) {
+        if (!cfg->pe._source_detached) {
+            cfg->pe._source_detached = true;
+            cfg->pe._old_tcc_match = -1;
+            /* Make sure the output is off for whatever gets attached next */
+            cfg->dpm.transition_default(cfg);
+        }
+
+        /* Wait tPDDebounce between measurements */
+        pe_idle_set(cfg, true);
+        chThdSleep(PD_T_PD_DEBOUNCE);
+
+        return PESinkSourceUnresponsive;
+    }
+
+    /* If VBUS is back after a detach, negotiate with the new source */
+    if (cfg->pe._source_detached) {
+        pe_idle_set(cfg, false);
+        return pe_sink_source_reattached(cfg);
+    }
+
+    /* If Type-C Current doesn't give us what we want and we've waited long
+     * enough, give Power Delivery another try. */
+    if (cfg->pe._old_tcc_match != 1
+            && chVTTimeElapsedSinceX(cfg->pe._unresponsive_start)
+                >= cfg->pe._unresponsive_backoff) {
+        /* Wait longer next time, in case the source is still unresponsive */
+        if (cfg->pe._unresponsive_backoff
+                < TIME_MS2I(PDB_SRC_UNRESPONSIVE_BACKOFF_MAX) / 2) {
+            cfg->pe._unresponsive_backoff *= 2;
+        } else {
+            cfg->pe._unresponsive_backoff = TIME_MS2I(PDB_SRC_UNRESPONSIVE_BACKOFF_MAX);
+        }
+
+        cfg->pe._hard_reset_counter = 0;
+        cfg->pe._old_tcc_match = -1;
+        pe_idle_set(cfg, false);
+        return PESinkHardReset;
+    }
+
     /* If the DPM can evaluate the Type-C Current advertisement */
     if (cfg->dpm.evaluate_typec_current != NULL) {
         /* Make the DPM evaluate the Type-C Current advertisement */
@@ -768,12 +1609,27 @@ static enum policy_engine_state pe_sink_source_unresponsive(struct pdb_config *c
         cfg->pe._old_tcc_match = tcc_match;
     }
 
-    /* Wait tPDDebounce between measurements */
+    /* Wait tPDDebounce between measurements.  Without PD, there are no
+     * deadlines to miss. */
+    pe_idle_set(cfg, true);
     chThdSleep(PD_T_PD_DEBOUNCE);
 
     return PESinkSourceUnresponsive;
 }
 
+/*
+ * Note that the Policy Engine entered the given state, for crash reports
+ */
+static void pe_trace(struct pdb_config *cfg, enum policy_engine_state state)
+{
+    struct pdb_pe_trace *t = &cfg->pe._trace[cfg->pe._trace_next];
+
+    t->time = TIME_I2MS(chVTGetSystemTime());
+    t->state = state;
+    cfg->pe._trace_next = (cfg->pe._trace_next + 1) % PDB_PE_TRACE_LEN;
+    cfg->pe._state = state;
+}
+
 /*
  * Policy Engine state machine thread
  */
@@ -785,16 +1641,34 @@ static THD_FUNCTION(PolicyEngine, vcfg) {
     chMBObjectInit(&cfg->pe.mailbox, cfg->pe._mailbox_queue, PDB_MSG_POOL_SIZE);
     /* Initialize the VT for SinkPPSPeriodicTimer */
     chVTObjectInit(&cfg->pe._sink_pps_periodic_timer);
+    /* Initialize the VT for SinkEPRKeepAliveTimer */
+    chVTObjectInit(&cfg->pe._sink_epr_keepalive_timer);
+    /* Initialize the VT for polling PPS_Status */
+    chVTObjectInit(&cfg->pe._pps_status_timer);
     /* Initialize the old_tcc_match */
     cfg->pe._old_tcc_match = -1;
-    /* Initialize the pps_index */
-    cfg->pe._pps_index = 8;
+    /* Initialize the pps_mask */
+    cfg->pe._pps_mask = 0;
     /* Initialize the last_pps */
-    cfg->pe._last_pps = 8;
+    cfg->pe._last_pps = 0;
+    /* Initialize the SourceUnresponsive backoff */
+    cfg->pe._source_detached = false;
+    cfg->pe._unresponsive_backoff = TIME_MS2I(PDB_SRC_UNRESPONSIVE_BACKOFF_MIN);
+    /* We're busy starting up */
+    cfg->pe._idle = false;
     /* Initialize the PD message header template */
     cfg->pe.hdr_template = PD_DATAROLE_UFP | PD_POWERROLE_SINK;
+    /* Start with an empty trace */
+    for (int i = 0; i < PDB_PE_TRACE_LEN; i++) {
+        cfg->pe._trace[i].state = UINT8_MAX;
+    }
+    cfg->pe._trace_next = 0;
+    pe_trace(cfg, state);
+
+    chRegSetThreadName("PE");
 
     while (true) {
+        enum policy_engine_state last = state;
         switch (state) {
             case PESinkStartup:
                 state = pe_sink_startup(cfg);
@@ -847,12 +1721,36 @@ static THD_FUNCTION(PolicyEngine, vcfg) {
             case PESinkNotSupportedReceived:
                 state = pe_sink_not_supported_received(cfg);
                 break;
+            case PESinkEPRModeEntry:
+                state = pe_sink_epr_mode_entry(cfg);
+                break;
+            case PESinkEPRModeExit:
+                state = pe_sink_epr_mode_exit(cfg);
+                break;
+            case PESinkEPREvalCap:
+                state = pe_sink_epr_eval_cap(cfg);
+                break;
+            case PESinkEPRKeepAlive:
+                state = pe_sink_epr_keep_alive(cfg);
+                break;
+            case PESinkGetSourceCapExt:
+                state = pe_sink_get_source_cap_ext(cfg);
+                break;
+            case PESinkGetPPSStatus:
+                state = pe_sink_get_pps_status(cfg);
+                break;
+            case PESinkRespondVDM:
+                state = pe_sink_respond_vdm(cfg);
+                break;
             default:
                 /* This is an error.  It really shouldn't happen.  We might
                  * want to handle it anyway, though. */
                 state = PESinkStartup;
                 break;
         }
+        if (state != last) {
+            pe_trace(cfg, state);
+        }
     }
 }
 
@@ -861,3 +1759,13 @@ void pdb_pe_run(struct pdb_config *cfg)
     cfg->pe.thread = chThdCreateStatic(cfg->pe._wa, sizeof(cfg->pe._wa),
             PDB_PRIO_PE, PolicyEngine, cfg);
 }
+
+bool pdb_pe_idle(struct pdb_config *cfg, sysinterval_t quiet)
+{
+    chSysLock();
+    bool idle = cfg->pe._idle
+        && chVTTimeElapsedSinceX(cfg->pe._idle_since) >= quiet;
+    chSysUnlock();
+
+    return idle;
+}
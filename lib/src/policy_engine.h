@@ -35,6 +35,8 @@
 #define PDB_EVT_PE_HARD_SENT EVENT_MASK(4)
 #define PDB_EVT_PE_I_OVRTEMP EVENT_MASK(5)
 #define PDB_EVT_PE_PPS_REQUEST EVENT_MASK(6)
+#define PDB_EVT_PE_EPR_KEEPALIVE EVENT_MASK(9)
+#define PDB_EVT_PE_PPS_STATUS EVENT_MASK(10)
 
 
 /*
@@ -147,10 +147,14 @@ static enum protocol_rx_state protocol_rx_store_messageid(struct pdb_config *cfg
 /*
  * Protocol layer RX state machine thread
  */
-static THD_FUNCTION(ProtocolRX, cfg) {
+static THD_FUNCTION(ProtocolRX, vcfg) {
+    struct pdb_config *cfg = vcfg;
     enum protocol_rx_state state = PRLRxWaitPHY;
 
+    chRegSetThreadName("PRL RX");
+
     while (true) {
+        cfg->prl._rx_state = state;
         switch (state) {
             case PRLRxWaitPHY:
                 state = protocol_rx_wait_phy(cfg);
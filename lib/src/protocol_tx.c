@@ -240,10 +240,13 @@ static THD_FUNCTION(ProtocolTX, vcfg) {
 
     enum protocol_tx_state state = PRLTxPHYReset;
 
+    chRegSetThreadName("PRL TX");
+
     /* Initialize the mailbox */
     chMBObjectInit(&cfg->prl.tx_mailbox, cfg->prl._tx_mailbox_queue, PDB_MSG_POOL_SIZE);
 
     while (true) {
+        cfg->prl._tx_state = state;
         switch (state) {
             case PRLTxPHYReset:
                 state = protocol_tx_phy_reset(cfg);
@@ -37,5 +37,13 @@
 /* Size of the INT_N thread's working area */
 #define PDB_INT_N_WA_SIZE 128
 
+/* Time to wait in PESinkSourceUnresponsive before giving Power Delivery
+ * another try, in milliseconds.  The wait starts at the minimum and doubles
+ * every time the source turns out to be unresponsive again, up to the
+ * maximum.  It returns to the minimum after an explicit contract or when the
+ * source is detached. */
+#define PDB_SRC_UNRESPONSIVE_BACKOFF_MIN 1000
+#define PDB_SRC_UNRESPONSIVE_BACKOFF_MAX 64000
+
 
 #endif /* PDB_CONF_H */
@@ -0,0 +1,175 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Firmware slots and boot state, shared by the firmware and the boot selector
+ * in boot/.
+ *
+ * Flash is laid out as follows:
+ *
+ *   0x08000000   2 KiB  boot selector
+ *   0x08000800   2 KiB  boot state
+ *   0x08001000  50 KiB  slot A
+ *   0x0800D800   8 KiB  history log (PDBS_HISTORY_BASE)
+ *   0x0800F800   8 KiB  configuration (PDBS_CONFIG_BASE)
+ *   0x08011800  50 KiB  slot B
+ *   0x0801E000   4 KiB  charger database (PDBS_CHARGER_BASE)
+ *   0x0801F000   4 KiB  crash log (PDBS_CRASH_BASE)
+ *
+ * The firmware is linked to run from one slot or the other.  The boot
+ * selector starts the one the boot state says to, trying a new image once and
+ * going back to the old one if the new one never confirms itself.  The boot
+ * selector's binary includes a blank boot state page, so flashing it starts
+ * slot A.
+ *
+ * This header is included by the boot selector too, so it must only depend on
+ * the CMSIS device header.
+ */
+
+#ifndef PDBS_BOOT_SELECT_H
+#define PDBS_BOOT_SELECT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <stm32f0xx.h>
+
+
+/* Firmware slots */
+#define PDBS_SLOT_A_BASE 0x08001000
+#define PDBS_SLOT_B_BASE 0x08011800
+#define PDBS_SLOT_SIZE (50 * 1024)
+
+/* The page of flash the boot state is kept in */
+#define PDBS_BOOT_STATE_BASE 0x08000800
+#define PDBS_BOOT_STATE_SIZE 2048
+
+/* Words in the vector table, which the boot selector copies to the start of
+ * RAM since the Cortex-M0 can't relocate it.  Firmware RAM starts after it. */
+#define PDBS_BOOT_VECTORS 48
+
+/* Marks a boot record as written */
+#define PDBS_BOOT_MAGIC 0xB007
+
+
+/*
+ * Firmware slots
+ */
+enum pdbs_slot {
+    PDBS_SLOT_A,
+    PDBS_SLOT_B
+};
+
+/*
+ * A record of which slot to boot
+ *
+ * Records are appended to the boot state page, and the last one with the
+ * magic number set is the one that counts.  The magic number is written last.
+ * tried and confirmed are cleared after the fact, which flash allows for
+ * zeroes.  If a new image doesn't work, the boot selector clears its record's
+ * magic number, so the record before it, for the image that was running
+ * before, counts again.  The firmware makes sure there's one before starting
+ * an update, so the boot selector never has to write a record of its own.
+ */
+struct pdbs_boot_record {
+    /* PDBS_BOOT_MAGIC once the record is written */
+    uint16_t magic;
+    /* The slot to boot, from enum pdbs_slot */
+    uint16_t slot;
+    /* Length and CRC-32 of the image in the slot, checked before it's tried */
+    uint32_t length;
+    uint32_t crc;
+    /* Zero once the boot selector has started the image */
+    uint16_t tried;
+    /* Zero once the image has confirmed that it works */
+    uint16_t confirmed;
+};
+
+#define PDBS_BOOT_RECORDS (PDBS_BOOT_STATE_SIZE / sizeof(struct pdbs_boot_record))
+
+
+/*
+ * Return the address of the given slot
+ */
+static inline uint32_t pdbs_slot_base(uint8_t slot)
+{
+    return (slot == PDBS_SLOT_B) ? PDBS_SLOT_B_BASE : PDBS_SLOT_A_BASE;
+}
+
+/*
+ * Return the boot record at the given index of the boot state page
+ */
+static inline const struct pdbs_boot_record *pdbs_boot_record(uint32_t index)
+{
+    return (const struct pdbs_boot_record *) PDBS_BOOT_STATE_BASE + index;
+}
+
+/*
+ * Return the boot record that counts, or NULL if there isn't one
+ */
+static inline const struct pdbs_boot_record *pdbs_boot_record_latest(void)
+{
+    const struct pdbs_boot_record *latest = NULL;
+
+    for (uint32_t i = 0; i < PDBS_BOOT_RECORDS; i++) {
+        if (pdbs_boot_record(i)->magic == PDBS_BOOT_MAGIC) {
+            latest = pdbs_boot_record(i);
+        }
+    }
+    return latest;
+}
+
+/*
+ * Return whether the given vector table looks like it belongs to firmware
+ * linked for the given slot
+ */
+static inline bool pdbs_slot_vectors_valid(const uint32_t *vectors,
+        uint8_t slot)
+{
+    uint32_t base = pdbs_slot_base(slot);
+
+    return (vectors[0] & 0xFFFF0000) == SRAM_BASE
+        && vectors[1] >= base && vectors[1] < base + PDBS_SLOT_SIZE;
+}
+
+/*
+ * Compute the CRC-32 (as used by zlib) of len bytes at data, a nibble at a
+ * time.  This is done in software so the boot selector, the firmware, and the
+ * host tests all compute it the same way, and it's only needed once per
+ * update.
+ */
+static inline uint32_t pdbs_boot_crc32(const uint8_t *data, uint32_t len)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+        0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+        0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+    };
+    uint32_t crc = 0xFFFFFFFF;
+
+    for (uint32_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        crc = (crc >> 4) ^ table[crc & 0xF];
+        crc = (crc >> 4) ^ table[crc & 0xF];
+    }
+    return crc ^ 0xFFFFFFFF;
+}
+
+#endif /* PDBS_BOOT_SELECT_H */
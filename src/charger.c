@@ -0,0 +1,317 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "charger.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include <pd.h>
+
+#include "flash.h"
+#include "priorities.h"
+
+
+/* FNV-1a parameters */
+#define CHARGER_FNV_OFFSET 0x811C9DC5
+#define CHARGER_FNV_PRIME 0x01000193
+
+/* Event telling the charger thread the database changed */
+#define CHARGER_EVT_CHANGED EVENT_MASK(0)
+
+
+/*
+ * Copy of the whole database, written to flash as a unit.  The CRC is written
+ * last, so a snapshot only counts once everything in it has been written.
+ */
+struct charger_snapshot {
+    /* Sequence number, one more than that of the snapshot before it */
+    uint32_t seq;
+    struct pdbs_charger entries[PDBS_CHARGER_ENTRIES];
+    /* CRC of everything above */
+    uint16_t crc;
+    /* Left erased */
+    uint16_t _reserved;
+};
+
+/* Snapshots that fit in a page, and in the database's flash */
+#define CHARGER_SLOTS_PER_PAGE (PDBS_FLASH_PAGE_SIZE / sizeof(struct charger_snapshot))
+#define CHARGER_SLOTS (CHARGER_SLOTS_PER_PAGE * PDBS_CHARGER_PAGES)
+
+
+/* The database */
+static struct pdbs_charger charger_db[PDBS_CHARGER_ENTRIES];
+/* The last_seen of the most recently seen charger */
+static uint32_t charger_clock;
+
+/* Sequence number of the last snapshot written */
+static uint32_t charger_seq;
+/* The slot the next snapshot goes in */
+static uint8_t charger_slot;
+
+/* The snapshot being written, too big for the charger thread's stack */
+static struct charger_snapshot charger_snap;
+
+/* How the database has been used since startup */
+static struct pdbs_charger_stats charger_stats;
+
+/* The thread writing the database to flash */
+static thread_t *charger_thread;
+
+
+/*
+ * Return a pointer to the given snapshot slot in flash
+ */
+static const struct charger_snapshot *charger_slot_get(uint8_t slot)
+{
+    return (const struct charger_snapshot *) (PDBS_CHARGER_BASE
+            + (slot / CHARGER_SLOTS_PER_PAGE) * PDBS_FLASH_PAGE_SIZE
+            + (slot % CHARGER_SLOTS_PER_PAGE) * sizeof(struct charger_snapshot));
+}
+
+/*
+ * Return the CRC of the given snapshot
+ */
+static uint16_t charger_crc(const struct charger_snapshot *snap)
+{
+    return pdbs_flash_crc(snap, offsetof(struct charger_snapshot, crc), 0xFFFF);
+}
+
+/*
+ * Continue an FNV-1a hash with len bytes at data
+ */
+static uint32_t charger_fnv(uint32_t hash, const void *data, size_t len)
+{
+    const uint8_t *bytes = data;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= CHARGER_FNV_PRIME;
+    }
+    return hash;
+}
+
+uint32_t pdbs_charger_fingerprint(const union pd_msg *caps)
+{
+    uint8_t numobj = PD_NUMOBJ_GET(caps);
+    uint8_t rev = (caps->hdr & PD_HDR_SPECREV) >> PD_HDR_SPECREV_SHIFT;
+
+    uint32_t hash = charger_fnv(CHARGER_FNV_OFFSET, &rev, sizeof(rev));
+    for (uint8_t i = 0; i < numobj; i++) {
+        uint32_t pdo = caps->obj[i];
+        /* Whether the source is unconstrained can change with what it's
+         * plugged into, but it's the same charger */
+        if (i == 0) {
+            pdo &= ~PD_PDO_SRC_FIXED_UNCONSTRAINED;
+        }
+        hash = charger_fnv(hash, &pdo, sizeof(pdo));
+    }
+
+    /* 0 marks an unused entry */
+    return (hash == 0) ? 1 : hash;
+}
+
+void pdbs_charger_init(void)
+{
+    const struct charger_snapshot *newest = NULL;
+    uint8_t newest_slot = 0;
+
+    /* Find the newest complete snapshot */
+    for (uint8_t slot = 0; slot < CHARGER_SLOTS; slot++) {
+        const struct charger_snapshot *snap = charger_slot_get(slot);
+        if (snap->crc != charger_crc(snap)
+                || pdbs_flash_blank(snap, sizeof(*snap))) {
+            continue;
+        }
+        if (newest == NULL || (int32_t) (snap->seq - newest->seq) > 0) {
+            newest = snap;
+            newest_slot = slot;
+        }
+    }
+
+    if (newest == NULL) {
+        /* Start from nothing */
+        memset(charger_db, 0, sizeof(charger_db));
+        charger_seq = 0;
+        charger_slot = 0;
+    } else {
+        memcpy(charger_db, newest->entries, sizeof(charger_db));
+        charger_seq = newest->seq;
+        charger_slot = (newest_slot + 1) % CHARGER_SLOTS;
+    }
+
+    /* Carry on from the most recently seen charger */
+    charger_clock = 0;
+    for (int i = 0; i < PDBS_CHARGER_ENTRIES; i++) {
+        if (charger_db[i].fingerprint != 0
+                && charger_db[i].last_seen > charger_clock) {
+            charger_clock = charger_db[i].last_seen;
+        }
+    }
+}
+
+/*
+ * Write a snapshot of the database to the next free slot in flash
+ */
+static void charger_write(void)
+{
+    struct charger_snapshot *snap = &charger_snap;
+
+    /* Take the snapshot all at once, so it's consistent */
+    chSysLock();
+    memcpy(snap->entries, charger_db, sizeof(snap->entries));
+    chSysUnlock();
+    snap->seq = charger_seq + 1;
+    snap->crc = charger_crc(snap);
+    snap->_reserved = 0xFFFF;
+
+    pdbs_flash_acquire();
+
+    /* Skip anything a power loss left part way written */
+    for (uint8_t tries = 0; tries < CHARGER_SLOTS; tries++) {
+        /* Starting a page, erase it.  The newest snapshot is in the other
+         * one. */
+        if (charger_slot % CHARGER_SLOTS_PER_PAGE == 0) {
+            pdbs_flash_erase((void *) charger_slot_get(charger_slot));
+        }
+        if (pdbs_flash_blank(charger_slot_get(charger_slot), sizeof(*snap))) {
+            break;
+        }
+        charger_slot = (charger_slot + 1) % CHARGER_SLOTS;
+    }
+
+    /* Write everything but the CRC, then the CRC */
+    void *dst = (void *) charger_slot_get(charger_slot);
+    pdbs_flash_write(dst, snap, offsetof(struct charger_snapshot, crc));
+    pdbs_flash_write_halfword(&((struct charger_snapshot *) dst)->crc,
+            snap->crc);
+
+    pdbs_flash_release();
+
+    charger_seq = snap->seq;
+    charger_slot = (charger_slot + 1) % CHARGER_SLOTS;
+}
+
+/*
+ * Charger thread, writing the database to flash at low priority once it's
+ * stopped changing
+ */
+static THD_WORKING_AREA(waCharger, 256);
+static THD_FUNCTION(Charger, arg) {
+    (void) arg;
+
+    chRegSetThreadName("Charger");
+
+    while (true) {
+        chEvtWaitAny(CHARGER_EVT_CHANGED);
+
+        /* Wait for the changes to settle */
+        while (chEvtWaitAnyTimeout(CHARGER_EVT_CHANGED,
+                    PDBS_CHARGER_WRITE_DELAY) != 0) {
+        }
+
+        charger_write();
+    }
+}
+
+void pdbs_charger_run(void)
+{
+    charger_thread = chThdCreateStatic(waCharger, sizeof(waCharger),
+            PDBS_PRIO_CHARGER, Charger, NULL);
+}
+
+struct pdbs_charger *pdbs_charger_find(uint32_t fingerprint)
+{
+    struct pdbs_charger *found = NULL;
+    struct pdbs_charger *oldest = &charger_db[0];
+
+    for (int i = 0; i < PDBS_CHARGER_ENTRIES; i++) {
+        if (charger_db[i].fingerprint == fingerprint) {
+            found = &charger_db[i];
+            break;
+        }
+        /* Unused entries count as the oldest of all */
+        if (charger_db[i].fingerprint == 0) {
+            if (oldest->fingerprint != 0) {
+                oldest = &charger_db[i];
+            }
+        } else if (oldest->fingerprint != 0
+                && charger_db[i].last_seen < oldest->last_seen) {
+            oldest = &charger_db[i];
+        }
+    }
+
+    chSysLock();
+    charger_stats.lookups++;
+    if (found != NULL) {
+        charger_stats.hits++;
+    } else {
+        /* Forget the charger seen least recently to make room */
+        found = oldest;
+        memset(found, 0, sizeof(*found));
+        found->fingerprint = fingerprint;
+    }
+    found->last_seen = ++charger_clock;
+    chSysUnlock();
+
+    return found;
+}
+
+void pdbs_charger_changed(void)
+{
+    if (charger_thread != NULL) {
+        chEvtSignal(charger_thread, CHARGER_EVT_CHANGED);
+    }
+}
+
+void pdbs_charger_avoided(void)
+{
+    chSysLock();
+    charger_stats.avoided++;
+    chSysUnlock();
+}
+
+bool pdbs_charger_get(int index, struct pdbs_charger *ch)
+{
+    if (index < 0 || index >= PDBS_CHARGER_ENTRIES) {
+        return false;
+    }
+
+    chSysLock();
+    *ch = charger_db[index];
+    chSysUnlock();
+    return true;
+}
+
+void pdbs_charger_forget(void)
+{
+    chSysLock();
+    memset(charger_db, 0, sizeof(charger_db));
+    charger_clock = 0;
+    chSysUnlock();
+
+    /* An empty snapshot supersedes the old ones */
+    pdbs_charger_changed();
+}
+
+void pdbs_charger_stats_get(struct pdbs_charger_stats *stats)
+{
+    chSysLock();
+    *stats = charger_stats;
+    chSysUnlock();
+}
@@ -0,0 +1,137 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PDBS_CHARGER_H
+#define PDBS_CHARGER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <ch.h>
+
+#include <pdb_msg.h>
+
+
+/* The number of chargers remembered.  When a new one is seen, the one seen
+ * least recently is forgotten. */
+#define PDBS_CHARGER_ENTRIES 16
+
+/* The number of flash pages the database is kept in, starting at
+ * PDBS_CHARGER_BASE.  PDBS_CHARGER_BASE is set in the Makefile. */
+#define PDBS_CHARGER_PAGES 2
+
+/* How long after the last change to wait before writing the database to
+ * flash, so a whole negotiation's worth of changes is written at once */
+#define PDBS_CHARGER_WRITE_DELAY TIME_S2I(5)
+
+
+/*
+ * What we've learned about a charger
+ *
+ * Chargers are told apart by a fingerprint of their Source_Capabilities.
+ */
+struct pdbs_charger {
+    /* Fingerprint of the charger's Source_Capabilities, or 0 if the entry is
+     * unused */
+    uint32_t fingerprint;
+    /* When the charger was last seen, in attaches since the database was
+     * made */
+    uint32_t last_seen;
+    /* Bit n is set if a hard reset followed requesting the PDO at object
+     * position n + 1 */
+    uint16_t avoid;
+    /* How long the charger took to go from Accept to PS_RDY the last time,
+     * in milliseconds */
+    uint16_t transition_time;
+    /* Object position of the PDO of the last contract, or 0 if there hasn't
+     * been one */
+    uint8_t pdo;
+    /* Hard resets seen with the charger, stopping at UINT8_MAX */
+    uint8_t resets;
+    /* Left zero */
+    uint16_t _reserved;
+};
+
+/*
+ * How the database has been used since startup
+ */
+struct pdbs_charger_stats {
+    /* Lookups, and how many of them found a known charger */
+    uint32_t lookups;
+    uint32_t hits;
+    /* Requests steered away from a PDO that caused a reset before */
+    uint32_t avoided;
+};
+
+
+/*
+ * Return the fingerprint of the given Source_Capabilities message: a hash of
+ * its PDOs and specification revision.  Never 0.
+ */
+uint32_t pdbs_charger_fingerprint(const union pd_msg *caps);
+
+/*
+ * Load the database from flash.  Must be called once at startup, before any
+ * of the other pdbs_charger_* functions.
+ */
+void pdbs_charger_init(void);
+
+/*
+ * Start the thread that writes the database to flash
+ */
+void pdbs_charger_run(void);
+
+/*
+ * Find the charger with the given fingerprint, adding it in place of the one
+ * seen least recently if it's new, and note that it's been seen.  Never
+ * returns NULL.
+ *
+ * The entry may be changed until the next call.  Call pdbs_charger_changed
+ * afterwards to get the changes written to flash.
+ */
+struct pdbs_charger *pdbs_charger_find(uint32_t fingerprint);
+
+/*
+ * Get the changes to the database written to flash, after
+ * PDBS_CHARGER_WRITE_DELAY
+ */
+void pdbs_charger_changed(void);
+
+/*
+ * Note that the DPM steered away from a PDO because of the database
+ */
+void pdbs_charger_avoided(void);
+
+/*
+ * Copy the entry at the given index of the database to ch.  Returns false if
+ * the index is out of range.
+ */
+bool pdbs_charger_get(int index, struct pdbs_charger *ch);
+
+/*
+ * Forget every charger, in flash too
+ */
+void pdbs_charger_forget(void);
+
+/*
+ * Get how the database has been used since startup.
+ */
+void pdbs_charger_stats_get(struct pdbs_charger_stats *stats);
+
+
+#endif /* PDBS_CHARGER_H */
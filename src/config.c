@@ -18,18 +18,138 @@
 
 #include "config.h"
 
+#include <stddef.h>
+#include <string.h>
+
 #include "chprintf.h"
 
 #include <pd.h>
 
+#include "flash.h"
+#include "priorities.h"
+#include "device_policy_manager.h"
+
+
+/* Magic number marking a page header as written.  Neither it nor anything
+ * programming it part way can produce is a valid status for the first object
+ * of a configuration array from before the journal. */
+#define CONFIG_PAGE_MAGIC 0x5043
+
+/* Statuses of records holding a struct config_meta instead of a
+ * configuration object */
+#define CONFIG_STATUS_NAME 0x4E4D
+#define CONFIG_STATUS_ACTIVE 0x4143
+
+/* Length of the configuration array from before the journal */
+#define CONFIG_LEGACY_LEN 128
+
+/* Event telling the configuration thread there's a request for it */
+#define CONFIG_EVT_REQUEST EVENT_MASK(0)
 
-/* Initialize the location of the configuration array.  PDBS_CONFIG_BASE is set
- * in the Makefile. */
-struct pdbs_config *pdbs_config_array = (struct pdbs_config *) PDBS_CONFIG_BASE;
 
-/* The location of the current configuration object.  NULL if not known or
- * there is no current configuration. */
-struct pdbs_config *config_cur = NULL;
+/*
+ * Header at the start of each configuration page.  The magic number is
+ * written last, so a page only counts once everything in it has been written.
+ */
+struct config_page_header {
+    /* CONFIG_PAGE_MAGIC if the page is in use */
+    uint16_t magic;
+    /* CRC of gen */
+    uint16_t crc;
+    /* Generation of the page, one more than that of the page before it */
+    uint32_t gen;
+};
+
+/*
+ * Setting of a profile other than its configuration, stored in a record in
+ * place of a configuration object
+ */
+struct config_meta {
+    /* CONFIG_STATUS_NAME to name the profile, or CONFIG_STATUS_ACTIVE to make
+     * it the active profile */
+    uint16_t status;
+    /* Index of the profile */
+    uint16_t profile;
+    /* For CONFIG_STATUS_NAME, the name, padded with NULs.  An empty name
+     * removes the profile's name. */
+    char name[PDBS_CONFIG_NAME_LEN];
+} __attribute__((packed));
+
+/*
+ * Record in the configuration journal
+ */
+struct config_record {
+    union {
+        /* The configuration, with status VALID, or INVALID if the record
+         * removes the profile's configuration and name */
+        struct pdbs_config cfg;
+        /* Any other setting, told apart by its status */
+        struct config_meta meta;
+    };
+    /* Sequence number, one more than that of the record before it */
+    uint32_t seq;
+    /* CRC of the configuration and sequence number.  It's written last, so a
+     * record cut short by a power loss fails the check. */
+    uint16_t crc;
+    /* Left erased */
+    uint16_t _reserved;
+};
+
+/* The number of records that fit in a page */
+#define CONFIG_PAGE_RECORDS ((PDBS_FLASH_PAGE_SIZE \
+            - sizeof(struct config_page_header)) / sizeof(struct config_record))
+
+
+/* The location of each profile's configuration object.  NULL if the profile
+ * has no configuration. */
+static struct pdbs_config *config_cur[PDBS_CONFIG_PROFILES];
+/* The location of each profile's name.  NULL if the profile has no name. */
+static struct config_meta *config_name[PDBS_CONFIG_PROFILES];
+/* The active profile, and whether one is stored */
+static uint8_t config_active;
+static bool config_active_stored;
+
+/* The page being written */
+static uint8_t config_page;
+/* The generation of the page being written */
+static uint32_t config_gen;
+/* The next sequence number */
+static uint32_t config_seq;
+/* The next empty record in the page being written, or NULL if it's full */
+static struct config_record *config_free;
+
+/*
+ * Requests for the configuration thread
+ */
+enum config_op {
+    CONFIG_OP_APPEND,
+    CONFIG_OP_ERASE
+};
+
+/* The configuration thread, and the PD Buddy configuration whose DPM is told
+ * about changes */
+static thread_t *config_thread;
+static struct pdb_config *config_pdb;
+/* Lets one request at a time through to the configuration thread */
+static mutex_t config_mtx;
+/* Signaled by the configuration thread when it's done with a request */
+static binary_semaphore_t config_done;
+/* The request, and the record to append for CONFIG_OP_APPEND */
+static enum config_op config_op;
+static struct config_record config_req;
+
+
+/*
+ * Return the index of the profile the given configuration object belongs to
+ */
+static uint8_t config_profile(const struct pdbs_config *cfg)
+{
+    /* Objects from before profiles existed belong to profile 0 */
+    if (cfg->profile == 0xFFFF) {
+        return 0;
+    }
+    return cfg->profile;
+}
 
 
 void pdbs_config_print(BaseSequentialStream *chp, const struct pdbs_config *cfg)
@@ -53,6 +173,9 @@ void pdbs_config_print(BaseSequentialStream *chp, const struct pdbs_config *cfg)
             break;
     }
 
+    /* Print the profile */
+    chprintf(chp, "profile: %d\r\n", config_profile(cfg));
+
     /* Print the flags */
     chprintf(chp, "flags:");
     if ((cfg->flags & ~PDBS_CONFIG_FLAGS_CURRENT_DEFN) == 0) {
@@ -67,6 +190,12 @@ void pdbs_config_print(BaseSequentialStream *chp, const struct pdbs_config *cfg)
     if (cfg->flags & PDBS_CONFIG_FLAGS_HV_PREFERRED) {
         chprintf(chp, " HV_Preferred");
     }
+    if (cfg->flags & PDBS_CONFIG_FLAGS_PEAK_CURRENT) {
+        chprintf(chp, " Peak_Current");
+    }
+    if (cfg->flags & PDBS_CONFIG_FLAGS_PPS_PREFERRED) {
+        chprintf(chp, " PPS_Preferred");
+    }
     chprintf(chp, "\r\n");
 
     /* Print voltage */
@@ -93,179 +222,511 @@ void pdbs_config_print(BaseSequentialStream *chp, const struct pdbs_config *cfg)
 }
 
 /*
- * Unlock the flash interface
+ * Return the header of the given configuration page
+ */
+static struct config_page_header *config_page_header(uint8_t page)
+{
+    return (struct config_page_header *) (PDBS_CONFIG_BASE
+            + page * PDBS_FLASH_PAGE_SIZE);
+}
+
+/*
+ * Return the first record of the given configuration page
+ */
+static struct config_record *config_page_records(uint8_t page)
+{
+    return (struct config_record *) (config_page_header(page) + 1);
+}
+
+/*
+ * Return whether the given page header was completely written
  */
-static void flash_unlock(void)
+static bool config_header_valid(const struct config_page_header *hdr)
 {
-    /* Wait till no operation is on going */
-    while ((FLASH->SR & FLASH_SR_BSY) != 0) {
-        /* Note: we might want a timeout here */
+    return hdr->magic == CONFIG_PAGE_MAGIC
+        && hdr->crc == pdbs_flash_crc(&hdr->gen, sizeof(hdr->gen),
+                0xFFFF);
+}
+
+/*
+ * Return the index of the profile the given record is about, or
+ * PDBS_CONFIG_PROFILES if it isn't a kind of record we know
+ */
+static uint8_t config_record_profile(const struct config_record *rec)
+{
+    uint16_t profile;
+
+    switch (rec->cfg.status) {
+        case PDBS_CONFIG_STATUS_VALID:
+        case PDBS_CONFIG_STATUS_INVALID:
+            profile = rec->cfg.profile;
+            break;
+        case CONFIG_STATUS_NAME:
+        case CONFIG_STATUS_ACTIVE:
+            profile = rec->meta.profile;
+            break;
+        default:
+            return PDBS_CONFIG_PROFILES;
+    }
+
+    return (profile < PDBS_CONFIG_PROFILES) ? profile : PDBS_CONFIG_PROFILES;
+}
+
+/*
+ * Return whether the given record was completely written
+ */
+static bool config_record_valid(const struct config_record *rec)
+{
+    return rec->crc == pdbs_flash_crc(rec,
+            offsetof(struct config_record, crc), 0xFFFF)
+        && config_record_profile(rec) < PDBS_CONFIG_PROFILES;
+}
+
+/*
+ * Update the index of where everything is with the given valid record
+ */
+static void config_apply(struct config_record *rec)
+{
+    uint8_t profile = config_record_profile(rec);
+
+    switch (rec->cfg.status) {
+        case PDBS_CONFIG_STATUS_VALID:
+            config_cur[profile] = &rec->cfg;
+            break;
+        case PDBS_CONFIG_STATUS_INVALID:
+            config_cur[profile] = NULL;
+            config_name[profile] = NULL;
+            break;
+        case CONFIG_STATUS_NAME:
+            config_name[profile] = (rec->meta.name[0] != '\0')
+                ? &rec->meta : NULL;
+            break;
+        case CONFIG_STATUS_ACTIVE:
+            config_active = profile;
+            config_active_stored = true;
+            break;
     }
+}
+
+/*
+ * Erase the given configuration page if it isn't already
+ */
+static void config_page_erase(uint8_t page)
+{
+    pdbs_flash_erase(config_page_header(page));
+}
+
+/*
+ * Give the record the next sequence number, and compute its CRC
+ */
+static void config_record_seal(struct config_record *rec)
+{
+    rec->seq = config_seq++;
+    rec->crc = pdbs_flash_crc(rec, offsetof(struct config_record, crc),
+            0xFFFF);
+    rec->_reserved = 0xFFFF;
+}
 
-    /* Check that the Flash is locked */
-    if ((FLASH->CR & FLASH_CR_LOCK) != 0) {
-        /* Perform unlock sequence */
-        FLASH->KEYR = FLASH_KEY1;
-        FLASH->KEYR = FLASH_KEY2;
+/*
+ * Write a record to the given empty flash location
+ */
+static void flash_write_record(struct config_record *dst,
+        const struct config_record *src)
+{
+    /* Write everything up to the CRC, then the CRC */
+    pdbs_flash_write(dst, src, offsetof(struct config_record, crc));
+    pdbs_flash_write_halfword(&dst->crc, src->crc);
+}
+
+/*
+ * Point config_free at the given record of the page being written, or NULL if
+ * it's past the end of the page
+ */
+static void config_free_set(struct config_record *rec)
+{
+    if (rec < config_page_records(config_page) + CONFIG_PAGE_RECORDS) {
+        config_free = rec;
+    } else {
+        config_free = NULL;
     }
 }
 
 /*
- * Lock the flash interface
+ * Write the given record to the next record of the page being written, and
+ * point the index at it
+ */
+static void config_write(struct config_record **dst, struct config_record *rec)
+{
+    config_record_seal(rec);
+    flash_write_record(*dst, rec);
+    config_apply(*dst);
+    (*dst)++;
+}
+
+/*
+ * Move everything in the index to the next page, adding the given record to
+ * it first if it isn't NULL, and make that page the one being written.
+ *
+ * Until its header is written, the new page doesn't count, so a power loss
+ * part way through leaves the old page in use.  Moving through the pages in
+ * turn spreads the erasures evenly across them.
  */
-static void flash_lock(void)
+static void config_rotate(struct config_record *add)
 {
-    /* Wait till no operation is on going */
-    while ((FLASH->SR & FLASH_SR_BSY) != 0) {
-        /* Note: we might want a timeout here */
+    uint8_t page = (config_page + 1) % PDBS_CONFIG_PAGES;
+    struct config_record *dst = config_page_records(page);
+    struct config_record rec;
+
+    config_page_erase(page);
+
+    /* The new record only needs to be written if the index still points to
+     * it afterwards */
+    if (add != NULL) {
+        config_apply(add);
     }
 
-    /* Check that the Flash is unlocked */
-    if ((FLASH->CR & FLASH_CR_LOCK) == 0) {
-        /* Lock the flash */
-        FLASH->CR |= FLASH_CR_LOCK;
+    /* Copy every profile's configuration and name */
+    for (uint8_t p = 0; p < PDBS_CONFIG_PROFILES; p++) {
+        if (config_cur[p] != NULL) {
+            rec.cfg = *config_cur[p];
+            rec.cfg.profile = p;
+            config_write(&dst, &rec);
+        }
+        if (config_name[p] != NULL) {
+            rec.meta = *config_name[p];
+            config_write(&dst, &rec);
+        }
+    }
+
+    /* Copy the active profile */
+    if (config_active_stored) {
+        memset(&rec.meta, 0xFF, sizeof(rec.meta));
+        rec.meta.status = CONFIG_STATUS_ACTIVE;
+        rec.meta.profile = config_active;
+        config_write(&dst, &rec);
     }
+
+    /* Write the header, magic number last, to put the page in use */
+    struct config_page_header *hdr = config_page_header(page);
+    uint32_t gen = config_gen + 1;
+    pdbs_flash_write_halfword((uint16_t *) &hdr->gen, gen & 0xFFFF);
+    pdbs_flash_write_halfword((uint16_t *) &hdr->gen + 1, gen >> 16);
+    pdbs_flash_write_halfword(&hdr->crc,
+            pdbs_flash_crc(&gen, sizeof(gen), 0xFFFF));
+    pdbs_flash_write_halfword(&hdr->magic, CONFIG_PAGE_MAGIC);
+
+    config_page = page;
+    config_gen = gen;
+    config_free_set(dst);
 }
 
 /*
- * Write one halfword to flash
+ * Add the given record to the journal
  */
-static void flash_write_halfword(uint16_t *addr, uint16_t data)
+static void config_append(struct config_record *rec)
 {
-    /* Set the PG bit in the FLASH_CR register to enable programming */
-    FLASH->CR |= FLASH_CR_PG;
-    /* Perform the data write (half-word) at the desired address */
-    *(__IO uint16_t*)(addr) = data;
-    /* Wait until the BSY bit is reset in the FLASH_SR register */
-    while ((FLASH->SR & FLASH_SR_BSY) != 0) {
-        /* For robust implementation, add here time-out management */
-    }
-    /* Check the EOP flag in the FLASH_SR register */
-    if ((FLASH->SR & FLASH_SR_EOP) != 0) {
-        /* clear it by software by writing it at 1 */
-        FLASH->SR = FLASH_SR_EOP;
-    } else {
-        /* Manage the error cases */
+    /* If the page is full, start the next one */
+    if (config_free == NULL) {
+        config_rotate(rec);
+        return;
     }
-    /* Reset the PG Bit to disable programming */
-    FLASH->CR &= ~FLASH_CR_PG;
+
+    struct config_record *dst = config_free;
+    config_write(&dst, rec);
+    config_free_set(dst);
 }
 
 /*
- * Erase the configuration page, without any locking
+ * Forget the location of everything stored
  */
-static void flash_erase(void)
+static void config_index_clear(void)
 {
-    /* Set the PER bit in the FLASH_CR register to enable page erasing */
-    FLASH->CR |= FLASH_CR_PER;
-    /* Program the FLASH_AR register to select a page to erase */
-    FLASH->AR = (int) pdbs_config_array;
-    /* Set the STRT bit in the FLASH_CR register to start the erasing */
-    FLASH->CR |= FLASH_CR_STRT;
-    /* Wait till no operation is on going */
-    while ((FLASH->SR & FLASH_SR_BSY) != 0) {
-        /* Note: we might want a timeout here */
-    }
-    /* Check the EOP flag in the FLASH_SR register */
-    if ((FLASH->SR & FLASH_SR_EOP) != 0) {
-        /* Clear EOP flag by software by writing EOP at 1 */
-        FLASH->SR = FLASH_SR_EOP;
+    for (int i = 0; i < PDBS_CONFIG_PROFILES; i++) {
+        config_cur[i] = NULL;
+        config_name[i] = NULL;
+    }
+    config_active = 0;
+    config_active_stored = false;
+}
+
+/*
+ * Find the configuration written before the journal existed, as an array of
+ * objects at PDBS_CONFIG_BASE.  Returns true if there is any.
+ */
+static bool config_legacy_find(void)
+{
+    struct pdbs_config *array = (struct pdbs_config *) PDBS_CONFIG_BASE;
+
+    /* Configuration pages start with a header instead */
+    if (array[0].status != PDBS_CONFIG_STATUS_VALID
+            && array[0].status != PDBS_CONFIG_STATUS_INVALID) {
+        return false;
+    }
+
+    /* Everything after the first empty structure is empty too */
+    for (int i = 0; i < CONFIG_LEGACY_LEN; i++) {
+        if (array[i].status == PDBS_CONFIG_STATUS_EMPTY) {
+            return i > 0;
+        }
+        if (array[i].status == PDBS_CONFIG_STATUS_VALID
+                && config_profile(&array[i]) < PDBS_CONFIG_PROFILES) {
+            config_cur[config_profile(&array[i])] = &array[i];
+        }
+    }
+    return true;
+}
+
+void pdbs_config_flash_init(void)
+{
+    bool found = false;
+
+    config_index_clear();
+    config_seq = 0;
+
+    /* The page being written is the newest one in use */
+    for (uint8_t page = 0; page < PDBS_CONFIG_PAGES; page++) {
+        struct config_page_header *hdr = config_page_header(page);
+        if (config_header_valid(hdr) && (!found || hdr->gen > config_gen)) {
+            found = true;
+            config_page = page;
+            config_gen = hdr->gen;
+        }
+    }
+
+    if (!found) {
+        /* With no page in use, act as if the last page were full, so the
+         * first write goes to the first page.  If configuration from before
+         * the journal is in the first page, act as if that page were full
+         * instead, so the first write moves it to the second. */
+        config_gen = 0;
+        config_free = NULL;
+        config_page = config_legacy_find() ? 0 : PDBS_CONFIG_PAGES - 1;
+        return;
+    }
+
+    /* Replay the page's records in the order they were written.  Records
+     * that weren't completely written are skipped, as is the space they
+     * took. */
+    struct config_record *rec = config_page_records(config_page);
+    struct config_record *last = NULL;
+    for (size_t i = 0; i < CONFIG_PAGE_RECORDS; i++, rec++) {
+        if (pdbs_flash_blank(rec, sizeof(*rec))) {
+            continue;
+        }
+        last = rec;
+        if (!config_record_valid(rec)) {
+            continue;
+        }
+        config_apply(rec);
+        config_seq = rec->seq + 1;
+    }
+
+    if (last == NULL) {
+        config_free_set(config_page_records(config_page));
     } else {
-        /* Manage the error cases */
+        config_free_set(last + 1);
     }
-    /* Reset the PER Bit to disable the page erase */
-    FLASH->CR &= ~FLASH_CR_PER;
+}
+
+/*
+ * Hand the request in config_op and config_req to the configuration thread,
+ * and wait for it to be done.  config_mtx must be locked.
+ */
+static void config_submit(enum config_op op)
+{
+    config_op = op;
+    chEvtSignal(config_thread, CONFIG_EVT_REQUEST);
+    chBSemWait(&config_done);
 }
 
 void pdbs_config_flash_erase(void)
 {
-    /* Enter a critical zone */
-    chSysLock();
+    /* The change counts from now, however long flash takes */
+    systime_t since = chVTGetSystemTime();
 
-    flash_unlock();
+    chMtxLock(&config_mtx);
+    config_submit(CONFIG_OP_ERASE);
+    chMtxUnlock(&config_mtx);
 
-    /* Erase the flash page */
-    flash_erase();
+    pdbs_dpm_config_changed(config_pdb, PDBS_CONFIG_PROFILES, since);
+}
 
-    flash_lock();
+void pdbs_config_flash_update(const struct pdbs_config *cfg)
+{
+    uint8_t profile = config_profile(cfg);
+    systime_t since = chVTGetSystemTime();
 
-    /* There is no configuration now, so update config_cur to reflect this */
-    config_cur = NULL;
+    /* Ignore configuration for profiles we can't store */
+    if (profile >= PDBS_CONFIG_PROFILES) {
+        return;
+    }
+
+    chMtxLock(&config_mtx);
+
+    /* Write the new configuration */
+    config_req.cfg = *cfg;
+    config_req.cfg.status = PDBS_CONFIG_STATUS_VALID;
+    config_req.cfg.profile = profile;
+    config_submit(CONFIG_OP_APPEND);
+
+    chMtxUnlock(&config_mtx);
 
-    /* Exit the critical zone */
-    chSysUnlock();
+    pdbs_dpm_config_changed(config_pdb, profile, since);
 }
 
-void pdbs_config_flash_update(const struct pdbs_config *cfg)
+void pdbs_config_flash_remove(uint8_t profile)
+{
+    systime_t since = chVTGetSystemTime();
+
+    /* Nothing to do if the profile has no configuration */
+    if (pdbs_config_flash_read(profile) == NULL) {
+        return;
+    }
+
+    chMtxLock(&config_mtx);
+
+    /* Write a record saying the profile has no configuration or name */
+    memset(&config_req.cfg, 0xFF, sizeof(config_req.cfg));
+    config_req.cfg.status = PDBS_CONFIG_STATUS_INVALID;
+    config_req.cfg.profile = profile;
+    config_submit(CONFIG_OP_APPEND);
+
+    chMtxUnlock(&config_mtx);
+
+    pdbs_dpm_config_changed(config_pdb, profile, since);
+}
+
+struct pdbs_config *pdbs_config_flash_read(uint8_t profile)
 {
-    /* Enter a critical zone */
-    chSysLock();
+    /* There's nothing to find for profiles we can't store */
+    if (profile >= PDBS_CONFIG_PROFILES) {
+        return NULL;
+    }
 
-    flash_unlock();
+    return config_cur[profile];
+}
 
-    /* If there is an old entry, invalidate it. */
-    struct pdbs_config *old = pdbs_config_flash_read();
-    if (old != NULL) {
-        flash_write_halfword(&(old->status), PDBS_CONFIG_STATUS_INVALID);
+bool pdbs_config_flash_get_name(uint8_t profile, char *name)
+{
+    /* Copy the name while it's sure to be where the index says */
+    chMtxLock(&config_mtx);
+    struct config_meta *meta = (profile < PDBS_CONFIG_PROFILES)
+        ? config_name[profile] : NULL;
+    if (meta != NULL) {
+        memcpy(name, meta->name, PDBS_CONFIG_NAME_LEN);
+        name[PDBS_CONFIG_NAME_LEN] = '\0';
     }
+    chMtxUnlock(&config_mtx);
 
-    /* Find the first empty entry */
-    struct pdbs_config *empty = NULL;
-    for (int i = 0; i < PDBS_CONFIG_ARRAY_LEN; i++) {
-        /* If we've found it, return it. */
-        if (pdbs_config_array[i].status == PDBS_CONFIG_STATUS_EMPTY) {
-            empty = &pdbs_config_array[i];
-            break;
-        }
+    return meta != NULL;
+}
+
+void pdbs_config_flash_set_name(uint8_t profile, const char *name)
+{
+    char old[PDBS_CONFIG_NAME_LEN + 1];
+
+    /* Ignore names for profiles we can't store */
+    if (profile >= PDBS_CONFIG_PROFILES) {
+        return;
     }
-    /* If empty is still NULL, the page is full.  Erase it. */
-    if (empty == NULL) {
-        flash_erase();
-        /* Write to the first element */
-        empty = &pdbs_config_array[0];
+
+    /* Nothing to do if the name isn't changing */
+    if (!pdbs_config_flash_get_name(profile, old)) {
+        old[0] = '\0';
+    }
+    if (strncmp(old, name, PDBS_CONFIG_NAME_LEN) == 0) {
+        return;
     }
 
-    /* Write the new configuration */
-    flash_write_halfword(&(empty->status), cfg->status);
-    flash_write_halfword(&(empty->flags), cfg->flags);
-    flash_write_halfword(&(empty->v), cfg->v);
-    flash_write_halfword(&(empty->i), cfg->i);
-    flash_write_halfword(&(empty->vmin), cfg->vmin);
-    flash_write_halfword(&(empty->vmax), cfg->vmax);
+    chMtxLock(&config_mtx);
 
-    flash_lock();
+    /* Write the new name */
+    config_req.meta.status = CONFIG_STATUS_NAME;
+    config_req.meta.profile = profile;
+    strncpy(config_req.meta.name, name, PDBS_CONFIG_NAME_LEN);
+    config_submit(CONFIG_OP_APPEND);
 
-    /* Update config_cur for the new configuration */
-    config_cur = empty;
+    chMtxUnlock(&config_mtx);
+}
 
-    /* Exit the critical zone */
-    chSysUnlock();
+uint8_t pdbs_config_flash_get_active(void)
+{
+    return config_active;
 }
 
-struct pdbs_config *pdbs_config_flash_read(void)
+void pdbs_config_flash_set_active(uint8_t profile)
 {
-    /* If we already know where the configuration is, return its location */
-    if (config_cur != NULL) {
-        return config_cur;
+    /* Ignore profiles we can't store */
+    if (profile >= PDBS_CONFIG_PROFILES) {
+        return;
+    }
+
+    chMtxLock(&config_mtx);
+
+    /* Only write the active profile if it's changing */
+    if (!config_active_stored || config_active != profile) {
+        memset(&config_req.meta, 0xFF, sizeof(config_req.meta));
+        config_req.meta.status = CONFIG_STATUS_ACTIVE;
+        config_req.meta.profile = profile;
+        config_submit(CONFIG_OP_APPEND);
     }
 
-    /* We don't know where the configuration is (config_cur == NULL), so we
-     * need to find it and store its location if applicable. */
+    chMtxUnlock(&config_mtx);
+}
 
-    /* If the first element is empty, there is no valid structure. */
-    if (pdbs_config_array[0].status == PDBS_CONFIG_STATUS_EMPTY) {
+struct pdbs_config *pdbs_config_flash_get(int index)
+{
+    if (index < 0 || index >= (int) CONFIG_PAGE_RECORDS) {
         return NULL;
     }
 
-    /* Find the valid structure, if there is one. */
-    for (int i = 0; i < PDBS_CONFIG_ARRAY_LEN; i++) {
-        /* If we've found it, return it. */
-        if (pdbs_config_array[i].status == PDBS_CONFIG_STATUS_VALID) {
-            config_cur = &pdbs_config_array[i];
-            return config_cur;
+    return &config_page_records(config_page)[index].cfg;
+}
+
+/*
+ * Configuration thread, writing to flash at low priority so the PD threads
+ * keep running meanwhile
+ */
+static THD_WORKING_AREA(waConfig, 256);
+static THD_FUNCTION(Config, arg) {
+    (void) arg;
+
+    chRegSetThreadName("Config");
+
+    while (true) {
+        chEvtWaitAny(CONFIG_EVT_REQUEST);
+
+        pdbs_flash_acquire();
+
+        if (config_op == CONFIG_OP_ERASE) {
+            /* Start a new page with no configuration in it.  That's as
+             * atomic as any other page change, and keeps the pages' wear
+             * even. */
+            config_index_clear();
+            config_rotate(NULL);
+
+            /* Then erase the rest, which no longer count */
+            for (uint8_t page = 0; page < PDBS_CONFIG_PAGES; page++) {
+                if (page != config_page) {
+                    config_page_erase(page);
+                }
+            }
+        } else {
+            config_append(&config_req);
         }
+
+        pdbs_flash_release();
+
+        chBSemSignal(&config_done);
     }
+}
+
+void pdbs_config_flash_run(struct pdb_config *cfg)
+{
+    config_pdb = cfg;
 
-    /* If we got to the end, none of the structures is valid. */
-    return NULL;
+    chMtxObjectInit(&config_mtx);
+    chBSemObjectInit(&config_done, true);
+    config_thread = chThdCreateStatic(waConfig, sizeof(waConfig),
+            PDBS_PRIO_CONFIG, Config, NULL);
 }
@@ -19,11 +19,14 @@
 #ifndef PDBS_CONFIG_H
 #define PDBS_CONFIG_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include <ch.h>
 #include <hal.h>
 
+#include <pdb.h>
+
 
 /*
  * PD Buddy Sink configuration structure
@@ -49,14 +52,18 @@ struct pdbs_config {
     uint16_t vmin;
     /* Upper end of voltage range, in millivolts. */
     uint16_t vmax;
+    /* Index of the profile this configuration belongs to.  Configuration
+     * objects written before profiles existed leave this erased (0xFFFF),
+     * which is read as profile 0. */
+    uint16_t profile;
     /* Extra bytes reserved for future use. */
-    uint16_t _reserved[2];
+    uint16_t _reserved;
 } __attribute__((packed));
 
 /* Status for configuration structures.  EMPTY indicates that the struct is
- * ready to be written, including a status update to VALID.  Once the struct is
- * no longer needed, the status is updated to INVALID.  Erasing the flash page
- * resets all structures to EMPTY. */
+ * ready to be written.  Stored configuration is written as VALID, and a
+ * profile is removed by writing a structure for it with status INVALID.
+ * Erasing a flash page resets all structures to EMPTY. */
 #define PDBS_CONFIG_STATUS_INVALID 0x0000
 #define PDBS_CONFIG_STATUS_VALID 0xBEEF
 #define PDBS_CONFIG_STATUS_EMPTY 0xFFFF
@@ -64,7 +71,7 @@ struct pdbs_config {
 /* Flags for configuration structures. */
 /* GiveBack supported */
 #define PDBS_CONFIG_FLAGS_GIVEBACK (1 << 0)
-/* Variable and battery PDOs preferred (FIXME: not implemented) */
+/* Variable and battery PDOs preferred */
 #define PDBS_CONFIG_FLAGS_VAR_BAT (1 << 1)
 /* High voltages preferred */
 #define PDBS_CONFIG_FLAGS_HV_PREFERRED (1 << 2)
@@ -74,13 +81,23 @@ struct pdbs_config {
 #define PDBS_CONFIG_FLAGS_CURRENT_DEFN_I (0 << PDBS_CONFIG_FLAGS_CURRENT_DEFN_SHIFT)
 #define PDBS_CONFIG_FLAGS_CURRENT_DEFN_P (1 << PDBS_CONFIG_FLAGS_CURRENT_DEFN_SHIFT)
 #define PDBS_CONFIG_FLAGS_CURRENT_DEFN_R (2 << PDBS_CONFIG_FLAGS_CURRENT_DEFN_SHIFT)
+/* The configured current is only needed for short peaks */
+#define PDBS_CONFIG_FLAGS_PEAK_CURRENT (1 << 5)
+/* PPS and AVS APDOs preferred over fixed PDOs */
+#define PDBS_CONFIG_FLAGS_PPS_PREFERRED (1 << 6)
+
 
+/* The number of flash pages configuration is journaled across, starting at
+ * PDBS_CONFIG_BASE.  PDBS_CONFIG_BASE is set in the Makefile. */
+#ifndef PDBS_CONFIG_PAGES
+#define PDBS_CONFIG_PAGES 4
+#endif
 
-/* Flash configuration array */
-extern struct pdbs_config *pdbs_config_array;
+/* The number of profiles that can be stored */
+#define PDBS_CONFIG_PROFILES 8
 
-/* The number of elements in the pdbs_config_array */
-#define PDBS_CONFIG_ARRAY_LEN 128
+/* The longest name a profile can have, in bytes */
+#define PDBS_CONFIG_NAME_LEN 12
 
 
 /*
@@ -89,27 +106,79 @@ extern struct pdbs_config *pdbs_config_array;
 void pdbs_config_print(BaseSequentialStream *chp, const struct pdbs_config *cfg);
 
 /*
- * Erase the flash page used for configuration
+ * Find the stored configuration.  Must be called once at startup, before any
+ * of the other pdbs_config_flash_* functions.
+ */
+void pdbs_config_flash_init(void);
+
+/*
+ * Start the thread that writes configuration to flash.  The given
+ * configuration's DPM is told whenever stored configuration changes.
+ */
+void pdbs_config_flash_run(struct pdb_config *cfg);
+
+/*
+ * Erase all stored configuration.  Returns once it's done.
  */
 void pdbs_config_flash_erase(void);
 
 /*
- * Write a configuration structure to flash, invalidating the previous
- * configuration.  If necessary, the flash page is erased before writing the
- * new structure.
+ * Write a configuration structure to flash as its profile, replacing the
+ * profile's previous configuration.  When the page being written fills up,
+ * every profile's configuration is moved to the next page.  Returns once
+ * it's done.
+ *
+ * The writing is done by a low priority thread which only locks the system
+ * for one halfword at a time, so other threads keep running meanwhile.
  */
 void pdbs_config_flash_update(const struct pdbs_config *cfg);
 
 /*
- * Get the first valid configuration strucure.  If the flash page is empty,
- * return NULL instead.
+ * Remove the configuration and name of the given profile, if it has them.
+ * Returns once it's done.
+ */
+void pdbs_config_flash_remove(uint8_t profile);
+
+/*
+ * Get the valid configuration strucure of the given profile.  If the profile
+ * has no configuration, return NULL instead.
  *
- * The location of the configuration is cached, and the cache is updated when
- * pdbs_config_flash_erase and pdbs_config_flash_update are called.  The full
- * lookup is only performed the first time this function is called, so there's
- * very little penalty to calling it repeatedly.
+ * The location of each profile's configuration is found by
+ * pdbs_config_flash_init and kept up to date by the other
+ * pdbs_config_flash_* functions, so this is just a table lookup.
+ */
+struct pdbs_config *pdbs_config_flash_read(uint8_t profile);
+
+/*
+ * Get the configuration structure at the given index of the flash page being
+ * written, whatever its status, or NULL if the index is out of range.
+ */
+struct pdbs_config *pdbs_config_flash_get(int index);
+
+/*
+ * Copy the name of the given profile into name, which must have room for
+ * PDBS_CONFIG_NAME_LEN + 1 bytes.  Returns false if the profile has no name.
+ */
+bool pdbs_config_flash_get_name(uint8_t profile, char *name);
+
+/*
+ * Name the given profile, writing the name to flash if it's changed.  Names
+ * longer than PDBS_CONFIG_NAME_LEN are cut short, and an empty name removes
+ * the profile's name.  Returns once it's done.
+ */
+void pdbs_config_flash_set_name(uint8_t profile, const char *name);
+
+/*
+ * Return the active profile, the one to negotiate at startup.  0 if none has
+ * been stored.
+ */
+uint8_t pdbs_config_flash_get_active(void);
+
+/*
+ * Make the given profile the active one, writing it to flash if it's changed.
+ * Returns once it's done.
  */
-struct pdbs_config *pdbs_config_flash_read(void);
+void pdbs_config_flash_set_active(uint8_t profile);
 
 
 #endif /* PDBS_CONFIG_H */
@@ -0,0 +1,344 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "crash.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include <hal.h>
+
+#include "flash.h"
+#include "priorities.h"
+
+
+/* Sequence number marking a report in RAM as captured.  Reports in flash
+ * are numbered from 1, so they never have it. */
+#define CRASH_RAM_MAGIC 0x43525348
+
+/* Reports that fit in a page, and in the log */
+#define CRASH_SLOTS_PER_PAGE (PDBS_FLASH_PAGE_SIZE / sizeof(struct pdbs_crash))
+#define CRASH_SLOTS (CRASH_SLOTS_PER_PAGE * PDBS_CRASH_PAGES)
+
+/* Bit 2 of EXC_RETURN is set if the exception frame is on the process stack */
+#define CRASH_EXC_RETURN_PSP 0x4
+
+/* Limits of RAM, for checking a stack pointer before following it */
+#define CRASH_RAM_START 0x20000000
+#define CRASH_RAM_END 0x20004000
+
+
+/* The report captured at a crash.  It's in a section that isn't cleared at
+ * startup, so it survives the reset. */
+static struct pdbs_crash crash_ram __attribute__((section(".ram0")));
+
+/* The report taken at startup, waiting to be logged */
+static struct pdbs_crash crash_pending;
+static bool crash_pending_valid;
+
+/* The PD Buddy configuration whose state crash reports capture */
+static struct pdb_config *crash_pdb;
+
+/* Sequence number of the newest report in the log */
+static uint32_t crash_seq;
+/* The slot the next report goes in */
+static uint8_t crash_slot;
+
+
+/*
+ * Return a pointer to the given report slot in flash
+ */
+static const struct pdbs_crash *crash_slot_get(uint8_t slot)
+{
+    return (const struct pdbs_crash *) (PDBS_CRASH_BASE
+            + (slot / CRASH_SLOTS_PER_PAGE) * PDBS_FLASH_PAGE_SIZE
+            + (slot % CRASH_SLOTS_PER_PAGE) * sizeof(struct pdbs_crash));
+}
+
+/*
+ * Return the CRC of the given report
+ */
+static uint16_t crash_crc(const struct pdbs_crash *c)
+{
+    return pdbs_flash_crc(c, offsetof(struct pdbs_crash, crc), 0xFFFF);
+}
+
+/*
+ * Return whether the given slot holds a complete report
+ */
+static bool crash_slot_valid(const struct pdbs_crash *c)
+{
+    return !pdbs_flash_blank(c, sizeof(*c)) && c->crc == crash_crc(c);
+}
+
+/*
+ * Copy the name of the given thread into the report in RAM
+ */
+static void crash_name(const thread_t *tp)
+{
+    if (tp != NULL && tp->name != NULL) {
+        strncpy(crash_ram.thread, tp->name, PDBS_CRASH_NAME_LEN - 1);
+    }
+}
+
+/*
+ * Return the thread whose working area starts closest above the given stack
+ * pointer: the one that overflowed its stack to get there.  Walks the
+ * registry directly, since the system is halted.
+ */
+static const thread_t *crash_overflowed(uint32_t sp)
+{
+    const thread_t *found = NULL;
+
+    for (const thread_t *tp = ch.rlist.newer;
+            tp != (const thread_t *) &ch.rlist; tp = tp->newer) {
+        if ((uint32_t) tp->wabase > sp
+                && (found == NULL || tp->wabase < found->wabase)) {
+            found = tp;
+        }
+    }
+    return found;
+}
+
+/*
+ * Finish the report of a crash in RAM and reset.  frame is the exception
+ * frame of a fault, or NULL.
+ *
+ * This runs in a fixed number of steps with nothing to wait for, so the
+ * device resets within microseconds.
+ */
+static void __attribute__((noreturn)) crash_capture(uint8_t cause,
+        const uint32_t *frame)
+{
+    struct pdbs_crash *c = &crash_ram;
+
+    c->seq = CRASH_RAM_MAGIC;
+    c->uptime = TIME_I2MS(chVTGetSystemTimeX());
+    c->cause = cause;
+    if (frame != NULL) {
+        c->lr = frame[5];
+        c->pc = frame[6];
+        c->psr = frame[7];
+    }
+
+    /* Only look at the PD state once the PD threads are running */
+    if (crash_pdb != NULL && crash_pdb->pe.thread != NULL) {
+        c->pe_state = crash_pdb->pe._state;
+        c->prl_rx_state = crash_pdb->prl._rx_state;
+        c->prl_tx_state = crash_pdb->prl._tx_state;
+        c->hardrst_state = crash_pdb->prl._hardrst_state;
+        /* Unroll the trace, oldest first */
+        for (uint8_t i = 0; i < PDB_PE_TRACE_LEN; i++) {
+            c->trace[i] = crash_pdb->pe._trace[(crash_pdb->pe._trace_next + i)
+                % PDB_PE_TRACE_LEN];
+        }
+    } else {
+        c->pe_state = UINT8_MAX;
+        c->prl_rx_state = UINT8_MAX;
+        c->prl_tx_state = UINT8_MAX;
+        c->hardrst_state = UINT8_MAX;
+        for (uint8_t i = 0; i < PDB_PE_TRACE_LEN; i++) {
+            c->trace[i].state = UINT8_MAX;
+        }
+    }
+
+    c->crc = crash_crc(c);
+
+    NVIC_SystemReset();
+    while (true) {
+    }
+}
+
+/*
+ * Capture a report of a HardFault, given the exception frame and EXC_RETURN.
+ * Called by HardFault_Handler, in crash_fault.S.
+ */
+void crash_hard_fault(const uint32_t *frame, uint32_t exc_return)
+    __attribute__((noreturn, used));
+void crash_hard_fault(const uint32_t *frame, uint32_t exc_return)
+{
+    memset(&crash_ram, 0, sizeof(crash_ram));
+
+    if (exc_return & CRASH_EXC_RETURN_PSP) {
+        crash_name(chThdGetSelfX());
+    } else {
+        strcpy(crash_ram.thread, "ISR");
+    }
+
+    /* Only follow the stack pointer if it's in RAM.  If the fault was a
+     * stack overflow, it might not be. */
+    if ((uint32_t) frame < CRASH_RAM_START
+            || (uint32_t) frame > CRASH_RAM_END - 8 * sizeof(uint32_t)) {
+        frame = NULL;
+    }
+
+    crash_capture(PDBS_CRASH_HARD_FAULT, frame);
+}
+
+void pdbs_crash_halt(const char *reason)
+{
+    memset(&crash_ram, 0, sizeof(crash_ram));
+
+    /* A stack overflow is caught as the overflowing thread is switched out,
+     * while its stack is still in use */
+    const thread_t *tp = chThdGetSelfX();
+    if (strcmp(reason, "stack overflow") == 0) {
+        const thread_t *of = crash_overflowed(__get_PSP());
+        if (of != NULL) {
+            tp = of;
+        }
+    }
+    crash_name(tp);
+    strncpy(crash_ram.reason, reason, PDBS_CRASH_REASON_LEN - 1);
+
+    crash_capture(PDBS_CRASH_HALT, NULL);
+}
+
+void pdbs_crash_init(struct pdb_config *cfg)
+{
+    crash_pdb = cfg;
+
+    /* Find out why we reset, and clear the flags for next time */
+    uint8_t reset = RCC->CSR >> 24;
+    RCC->CSR |= RCC_CSR_RMVF;
+
+    /* Take the report from before the reset, if there is one, so it's only
+     * logged once */
+    if (crash_ram.seq == CRASH_RAM_MAGIC && crash_ram.crc == crash_crc(&crash_ram)) {
+        crash_pending = crash_ram;
+        crash_pending.reset = reset;
+        crash_pending_valid = true;
+    } else if (reset & ((RCC_CSR_IWDGRSTF | RCC_CSR_WWDGRSTF) >> 24)) {
+        /* A watchdog reset us with nothing captured */
+        memset(&crash_pending, 0, sizeof(crash_pending));
+        crash_pending.cause = PDBS_CRASH_WATCHDOG;
+        crash_pending.reset = reset;
+        crash_pending.pe_state = UINT8_MAX;
+        crash_pending.prl_rx_state = UINT8_MAX;
+        crash_pending.prl_tx_state = UINT8_MAX;
+        crash_pending.hardrst_state = UINT8_MAX;
+        for (uint8_t i = 0; i < PDB_PE_TRACE_LEN; i++) {
+            crash_pending.trace[i].state = UINT8_MAX;
+        }
+        crash_pending_valid = true;
+    }
+    crash_ram.seq = 0;
+
+    /* Find the newest report in the log */
+    const struct pdbs_crash *newest = NULL;
+    uint8_t newest_slot = 0;
+    for (uint8_t slot = 0; slot < CRASH_SLOTS; slot++) {
+        const struct pdbs_crash *c = crash_slot_get(slot);
+        if (crash_slot_valid(c)
+                && (newest == NULL || (int32_t) (c->seq - newest->seq) > 0)) {
+            newest = c;
+            newest_slot = slot;
+        }
+    }
+
+    if (newest == NULL) {
+        crash_seq = 0;
+        crash_slot = 0;
+    } else {
+        crash_seq = newest->seq;
+        crash_slot = (newest_slot + 1) % CRASH_SLOTS;
+    }
+}
+
+/*
+ * Write the given report to the next free slot in the log.  The flash
+ * interface must be acquired.
+ */
+static void crash_write(struct pdbs_crash *c)
+{
+    c->seq = crash_seq + 1;
+    c->_reserved2 = 0xFFFF;
+    c->crc = crash_crc(c);
+
+    /* Skip anything a power loss left part way written */
+    for (uint8_t tries = 0; tries < CRASH_SLOTS; tries++) {
+        /* Starting a page, erase it, dropping the oldest reports */
+        if (crash_slot % CRASH_SLOTS_PER_PAGE == 0) {
+            pdbs_flash_erase((void *) crash_slot_get(crash_slot));
+        }
+        if (pdbs_flash_blank(crash_slot_get(crash_slot), sizeof(*c))) {
+            break;
+        }
+        crash_slot = (crash_slot + 1) % CRASH_SLOTS;
+    }
+
+    /* Write everything but the CRC, then the CRC */
+    struct pdbs_crash *dst = (struct pdbs_crash *) crash_slot_get(crash_slot);
+    pdbs_flash_write(dst, c, offsetof(struct pdbs_crash, crc));
+    pdbs_flash_write_halfword(&dst->crc, c->crc);
+
+    crash_seq = c->seq;
+    crash_slot = (crash_slot + 1) % CRASH_SLOTS;
+}
+
+/*
+ * Crash thread, logging the report taken at startup at low priority, so the
+ * device gets back to negotiating power first
+ */
+static THD_WORKING_AREA(waCrash, 256);
+static THD_FUNCTION(Crash, arg) {
+    (void) arg;
+
+    chRegSetThreadName("Crash");
+
+    pdbs_flash_acquire();
+    crash_write(&crash_pending);
+    pdbs_flash_release();
+}
+
+void pdbs_crash_run(void)
+{
+    if (crash_pending_valid) {
+        chThdCreateStatic(waCrash, sizeof(waCrash), PDBS_PRIO_CRASH, Crash,
+                NULL);
+    }
+}
+
+const struct pdbs_crash *pdbs_crash_next(const struct pdbs_crash *prev)
+{
+    const struct pdbs_crash *next = NULL;
+
+    /* Find the report with the lowest sequence number after prev's */
+    for (uint8_t slot = 0; slot < CRASH_SLOTS; slot++) {
+        const struct pdbs_crash *c = crash_slot_get(slot);
+        if (!crash_slot_valid(c)
+                || (prev != NULL && (int32_t) (c->seq - prev->seq) <= 0)) {
+            continue;
+        }
+        if (next == NULL || (int32_t) (c->seq - next->seq) < 0) {
+            next = c;
+        }
+    }
+    return next;
+}
+
+void pdbs_crash_clear(void)
+{
+    pdbs_flash_acquire();
+    for (uint8_t page = 0; page < PDBS_CRASH_PAGES; page++) {
+        pdbs_flash_erase((void *) (PDBS_CRASH_BASE
+                    + page * PDBS_FLASH_PAGE_SIZE));
+    }
+    crash_slot = 0;
+    pdbs_flash_release();
+}
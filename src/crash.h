@@ -0,0 +1,125 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PDBS_CRASH_H
+#define PDBS_CRASH_H
+
+#include <stdint.h>
+
+#include <ch.h>
+
+#include <pdb.h>
+
+
+/* The number of flash pages the crash log is kept in, starting at
+ * PDBS_CRASH_BASE.  PDBS_CRASH_BASE is set in the Makefile. */
+#define PDBS_CRASH_PAGES 2
+
+/* Length of the thread name and halt reason in a crash report, including the
+ * terminating NUL */
+#define PDBS_CRASH_NAME_LEN 12
+#define PDBS_CRASH_REASON_LEN 16
+
+
+/*
+ * What made the device reset
+ */
+enum pdbs_crash_cause {
+    /* A HardFault exception */
+    PDBS_CRASH_HARD_FAULT,
+    /* ChibiOS halted the system, e.g. for a stack overflow */
+    PDBS_CRASH_HALT,
+    /* A watchdog reset the device without a crash being captured first */
+    PDBS_CRASH_WATCHDOG
+};
+
+/*
+ * Crash report
+ *
+ * When the firmware crashes, a report is captured in RAM that survives the
+ * reset that follows.  At the next startup, it's moved to a log in flash.
+ */
+struct pdbs_crash {
+    /* Sequence number, one more than that of the report before it */
+    uint32_t seq;
+    /* How long the device had been running, in milliseconds */
+    uint32_t uptime;
+    /* The faulting instruction, the link register, and the program status
+     * register, or 0 if there was no fault */
+    uint32_t pc;
+    uint32_t lr;
+    uint32_t psr;
+    /* What happened, from enum pdbs_crash_cause */
+    uint8_t cause;
+    /* Reset flags: RCC_CSR bits 24-31 */
+    uint8_t reset;
+    /* States of the Policy Engine, the protocol layer RX and TX threads,
+     * and the hard reset thread */
+    uint8_t pe_state;
+    uint8_t prl_rx_state;
+    uint8_t prl_tx_state;
+    uint8_t hardrst_state;
+    /* Left zero */
+    uint16_t _reserved;
+    /* Name of the thread that crashed, or "ISR" if it was an interrupt
+     * handler */
+    char thread[PDBS_CRASH_NAME_LEN];
+    /* Why ChibiOS halted, for PDBS_CRASH_HALT */
+    char reason[PDBS_CRASH_REASON_LEN];
+    /* The Policy Engine's last state changes, oldest first */
+    struct pdb_pe_trace trace[PDB_PE_TRACE_LEN];
+    /* CRC of everything above */
+    uint16_t crc;
+    /* Left erased */
+    uint16_t _reserved2;
+};
+
+
+/*
+ * Find the crash log, and take any crash report captured before the last
+ * reset along with why the device reset.  Crashes are captured with the given
+ * configuration's PD state from then on.  Must be called once at startup,
+ * before any of the other pdbs_crash_* functions.
+ */
+void pdbs_crash_init(struct pdb_config *cfg);
+
+/*
+ * Start a thread to add any crash report taken by pdbs_crash_init to the
+ * log.  Nothing happens if there isn't one.
+ */
+void pdbs_crash_run(void);
+
+/*
+ * Capture a crash report for a ChibiOS system halt and reset.  Called from
+ * CH_CFG_SYSTEM_HALT_HOOK.
+ */
+void pdbs_crash_halt(const char *reason) __attribute__((noreturn));
+
+/*
+ * Return the report after prev in the log, oldest first, or the oldest one if
+ * prev is NULL.  Returns NULL after the newest one.
+ */
+const struct pdbs_crash *pdbs_crash_next(const struct pdbs_crash *prev);
+
+/*
+ * Erase the crash log
+ */
+void pdbs_crash_clear(void);
+
+
+#endif /* PDBS_CRASH_H */
@@ -26,22 +26,47 @@
 
 #include "led.h"
 #include "config.h"
+#include "telemetry.h"
+#include "charger.h"
+#include "history.h"
 
 
 /* The current draw when the output is disabled */
 #define DPM_MIN_CURRENT PD_MA2PDI(30)
 
+/* The number of built-in profiles */
+#define DPM_DEFAULT_PROFILES 4
+
+/* The resistance we assume for the cable (VBUS and ground together) when
+ * scoring PDOs, in milliohms */
+#define DPM_CABLE_RESISTANCE 200
+
+/* The most power a sink may draw during a voltage transition (pSnkStdby), in
+ * centiwatts */
+#define DPM_SNK_STDBY_POWER 250
+
+/* How often the thermal governor checks the temperature, and the power
+ * governor the output current */
+#define DPM_THERMAL_PERIOD TIME_S2I(1)
+
+/* How long after PS_RDY a hard reset is blamed on the new contract */
+#define DPM_CHARGER_SETTLE TIME_S2I(5)
+
 
 /*
  * Return the current specified by the given PDBS configuration object at the
  * given voltage (in millivolts), in centiamperes.
  */
-static uint16_t dpm_get_current(struct pdbs_config *scfg, uint16_t mv)
+static uint16_t dpm_get_current(const struct pdbs_config *scfg, uint16_t mv)
 {
     switch (scfg->flags & PDBS_CONFIG_FLAGS_CURRENT_DEFN) {
     case PDBS_CONFIG_FLAGS_CURRENT_DEFN_I:
         return scfg->i;
     case PDBS_CONFIG_FLAGS_CURRENT_DEFN_P:
+        /* No current gives any power at 0 V */
+        if (mv == 0) {
+            return PD_CA_MAX + 1;
+        }
         return (scfg->p * 1000 + mv - 1) / mv;
     case PDBS_CONFIG_FLAGS_CURRENT_DEFN_R:
         return (mv * 10 + scfg->r - 1) / scfg->r;
@@ -54,17 +79,220 @@ static uint16_t dpm_get_current(struct pdbs_config *scfg, uint16_t mv)
 
 
 /*
- * Find the index of the first PDO from capabilities in the voltage range,
- * using the desired order.
+ * Return the current to request from fixed PDOs at our preferred voltage and
+ * programmable APDOs, in centiamperes.
+ */
+static uint16_t dpm_get_governed_current(const struct pdbs_dpm_data *dpm_data,
+        const struct pdbs_config *scfg)
+{
+    /* As we want/need current anyway, ask for zero when not governing */
+    if (!dpm_data->governor.enabled) {
+        return 0;
+    }
+
+    /* Until the load has been measured, ask for everything it may need.
+     * Never ask for more than that. */
+    uint16_t current = dpm_get_current(scfg, scfg->v);
+    if (dpm_data->governor._current == 0
+            || dpm_data->governor._current > current) {
+        return current;
+    }
+    return dpm_data->governor._current;
+}
+
+/*
+ * Return the most power the thermal governor lets us ask for, in centiwatts,
+ * or 0 if it doesn't limit us.  Full power is what the configuration needs at
+ * its preferred voltage.
+ */
+static uint32_t dpm_get_thermal_power_cap(const struct pdbs_dpm_data *dpm_data,
+        const struct pdbs_config *scfg)
+{
+    uint8_t level = dpm_data->thermal._level;
+    if (level == 0) {
+        return 0;
+    }
+
+    uint32_t full = (uint32_t) scfg->v * dpm_get_current(scfg, scfg->v) / 1000;
+    uint32_t cap = full * (100 - level * PDBS_DPM_THERMAL_LEVEL_PERCENT) / 100;
+    return (cap > 0) ? cap : 1;
+}
+
+/*
+ * Return the most current the requested contract lets us draw, in
+ * centiamperes.  Exact fixed and programmable matches ask for no current when
+ * the current governor is off, so the PDO's current is the limit then.
+ */
+static uint16_t dpm_get_contract_current(const struct pdbs_dpm_data *dpm_data)
+{
+    if (dpm_data->_requested_current > 0) {
+        return dpm_data->_requested_current;
+    }
+    return dpm_data->_requested_imax;
+}
+
+/*
+ * Return the largest duty cycle of the output switch that keeps the load
+ * within the requested contract and the thermal governor's power cap at the
+ * given voltage (in millivolts), in tenths of a percent.  While the switch is
+ * on, the load draws the configured current at that voltage, so on average it
+ * draws that times the duty cycle.  Only resistive loads are held to the
+ * contract's current, since the others are assumed to draw no more than they
+ * asked for.
+ */
+static uint16_t dpm_get_duty_limit(const struct pdbs_dpm_data *dpm_data,
+        const struct pdbs_config *scfg, int mv)
+{
+    if (scfg == NULL || mv <= 0) {
+        return PDBS_SOFTSTART_DUTY_MAX;
+    }
+    uint32_t load = dpm_get_current(scfg, mv);
+    if (load == 0) {
+        return PDBS_SOFTSTART_DUTY_MAX;
+    }
+
+    /* Find the most current the load may draw on average */
+    uint32_t allowed = load;
+    uint16_t contract = dpm_get_contract_current(dpm_data);
+    if ((scfg->flags & PDBS_CONFIG_FLAGS_CURRENT_DEFN)
+                == PDBS_CONFIG_FLAGS_CURRENT_DEFN_R
+            && contract > 0 && contract < allowed) {
+        allowed = contract;
+    }
+    uint32_t power_cap = dpm_get_thermal_power_cap(dpm_data, scfg);
+    if (power_cap > 0 && power_cap * 1000 / mv < allowed) {
+        allowed = power_cap * 1000 / mv;
+    }
+
+    return allowed * PDBS_SOFTSTART_DUTY_MAX / load;
+}
+
+/*
+ * Profiles to use when none are stored in flash: the common fixed voltages at
+ * 1 A
+ */
+static const struct pdbs_config dpm_default_profiles[DPM_DEFAULT_PROFILES] = {
+    {
+        .status = PDBS_CONFIG_STATUS_VALID,
+        .flags = PDBS_CONFIG_FLAGS_CURRENT_DEFN_I,
+        .v = 5000,
+        .i = PD_MA2PDI(1000),
+        .profile = 0
+    },
+    {
+        .status = PDBS_CONFIG_STATUS_VALID,
+        .flags = PDBS_CONFIG_FLAGS_CURRENT_DEFN_I,
+        .v = 9000,
+        .i = PD_MA2PDI(1000),
+        .profile = 1
+    },
+    {
+        .status = PDBS_CONFIG_STATUS_VALID,
+        .flags = PDBS_CONFIG_FLAGS_CURRENT_DEFN_I,
+        .v = 15000,
+        .i = PD_MA2PDI(1000),
+        .profile = 2
+    },
+    {
+        .status = PDBS_CONFIG_STATUS_VALID,
+        .flags = PDBS_CONFIG_FLAGS_CURRENT_DEFN_I,
+        .v = 20000,
+        .i = PD_MA2PDI(1000),
+        .profile = 3
+    }
+};
+
+/*
+ * Return whether or not any profiles are stored in flash
+ */
+static bool dpm_profiles_stored(void)
+{
+    for (uint8_t p = 0; p < PDBS_CONFIG_PROFILES; p++) {
+        if (pdbs_config_flash_read(p) != NULL) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Return the configuration of the selected profile.
  *
- * If there is no such PDO, returns -1 instead.
+ * If the selected profile isn't stored, the first stored profile is used
+ * instead.  If no profiles are stored, the built-in ones are used.
  */
-static int8_t dpm_get_range_fixed_pdo_index(const union pd_msg *caps,
-        struct pdbs_config *scfg)
+static const struct pdbs_config *dpm_get_config(struct pdb_config *cfg)
 {
-    /* Get the number of PDOs */
-    uint8_t numobj = PD_NUMOBJ_GET(caps);
+    const struct pdbs_config *scfg = pdbs_config_flash_read(cfg->state);
+    if (scfg != NULL) {
+        return scfg;
+    }
 
+    for (uint8_t p = 0; p < PDBS_CONFIG_PROFILES; p++) {
+        scfg = pdbs_config_flash_read(p);
+        if (scfg != NULL) {
+            return scfg;
+        }
+    }
+
+    return &dpm_default_profiles[cfg->state % DPM_DEFAULT_PROFILES];
+}
+
+
+/*
+ * Return a pointer to the data objects of the given message.
+ *
+ * The bytes of a union pd_msg start two bytes before the first data object,
+ * so this avoids taking the address of a packed member.
+ */
+static const uint32_t *dpm_msg_pdos(const union pd_msg *msg)
+{
+    return (const uint32_t *) &msg->bytes[2];
+}
+
+
+/*
+ * Return the most current we can count on drawing for short peaks from a
+ * fixed PDO offering the given operating current, in centiamperes.
+ *
+ * This is only more than the operating current if we're configured for peak
+ * current and the source told us how much overload it can handle.
+ */
+static uint16_t dpm_get_peak_current(const struct pdbs_dpm_data *dpm_data,
+        const struct pdbs_config *scfg, uint16_t ioc)
+{
+    if (!(scfg->flags & PDBS_CONFIG_FLAGS_PEAK_CURRENT)
+            || !dpm_data->source_cap_ext_valid) {
+        return ioc;
+    }
+
+    /* Find the largest overload the source allows */
+    uint8_t overload = 0;
+    for (int i = 0; i < 3; i++) {
+        uint8_t o = PD_SCEDB_PEAK_OVERLOAD_GET(dpm_data->source_cap_ext.peak_current[i]);
+        if (o > overload) {
+            overload = o;
+        }
+    }
+    if (overload > PD_SCEDB_PEAK_OVERLOAD_MAX) {
+        overload = PD_SCEDB_PEAK_OVERLOAD_MAX;
+    }
+
+    /* The overload is a percentage of the operating current, in 10% units */
+    uint32_t peak = (uint32_t) ioc * overload / 10;
+    return (peak > ioc) ? peak : ioc;
+}
+
+/*
+ * Find the index of the first PDO from pdos in the voltage range, using the
+ * desired order.
+ *
+ * If there is no such PDO, returns -1 instead.
+ */
+static int8_t dpm_get_range_fixed_pdo_index(
+        const struct pdbs_dpm_data *dpm_data, const uint32_t *pdos,
+        uint8_t numobj, const struct pdbs_config *scfg)
+{
     /* Get ready to iterate over the PDOs */
     int8_t i;
     int8_t step;
@@ -78,11 +306,15 @@ static int8_t dpm_get_range_fixed_pdo_index(const union pd_msg *caps,
 
     /* Look at the PDOs to see if one falls in our voltage range. */
     while (0 <= i && i < numobj) {
-        /* If we have a fixed PDO, its V is within our range, and its I is at
-         * least our desired I */
-        uint16_t v = PD_PDO_SRC_FIXED_VOLTAGE_GET(caps->obj[i]);
-        if ((caps->obj[i] & PD_PDO_TYPE) == PD_PDO_TYPE_FIXED
-                && PD_PDO_SRC_FIXED_CURRENT_GET(caps->obj[i]) >= dpm_get_current(scfg, PD_PDV2MV(v))
+        /* If we have a fixed PDO that isn't EPR padding, its V is within our
+         * range, and its I (allowing for peaks if configured to) is at least
+         * our desired I */
+        uint16_t v = PD_PDO_SRC_FIXED_VOLTAGE_GET(pdos[i]);
+        if (pdos[i] != 0
+                && (pdos[i] & PD_PDO_TYPE) == PD_PDO_TYPE_FIXED
+                && dpm_get_peak_current(dpm_data, scfg,
+                    PD_PDO_SRC_FIXED_CURRENT_GET(pdos[i]))
+                    >= dpm_get_current(scfg, PD_PDV2MV(v))
                 && v >= PD_MV2PDV(scfg->vmin)
                 && v <= PD_MV2PDV(scfg->vmax)) {
             return i;
@@ -92,152 +324,626 @@ static int8_t dpm_get_range_fixed_pdo_index(const union pd_msg *caps,
     return -1;
 }
 
-bool pdbs_dpm_evaluate_capability(struct pdb_config *cfg,
-                                  const union pd_msg *caps, union pd_msg *request)
+/*
+ * Return the most current the given PDBS configuration object needs anywhere
+ * from vmin to vmax (in millivolts), in centiamperes.
+ */
+static uint16_t dpm_get_max_current(const struct pdbs_config *scfg,
+        uint16_t vmin, uint16_t vmax)
+{
+    uint16_t imin = dpm_get_current(scfg, vmin);
+    uint16_t imax = dpm_get_current(scfg, vmax);
+
+    return (imin > imax) ? imin : imax;
+}
+
+/*
+ * Return the most power the given PDBS configuration object needs anywhere
+ * from vmin to vmax (in millivolts), in centiwatts.
+ */
+static uint16_t dpm_get_max_power(const struct pdbs_config *scfg,
+        uint16_t vmin, uint16_t vmax)
 {
+    uint32_t pmin = ((uint32_t) vmin * dpm_get_current(scfg, vmin) + 999) / 1000;
+    uint32_t pmax = ((uint32_t) vmax * dpm_get_current(scfg, vmax) + 999) / 1000;
 
+    return (pmin > pmax) ? pmin : pmax;
+}
+
+/*
+ * Return whether or not the given Variable or Battery PDO can power us
+ * anywhere in its voltage range.
+ */
+static bool dpm_var_bat_pdo_ok(uint32_t pdo, const struct pdbs_config *scfg)
+{
+    /* The source may give us any voltage in the PDO's range, so that range
+     * must lie within ours.  Without a range, only our preferred voltage will
+     * do. */
+    uint16_t vmin = scfg->v;
+    uint16_t vmax = scfg->v;
+    if (scfg->vmin != 0 || scfg->vmax != 0) {
+        vmin = scfg->vmin;
+        vmax = scfg->vmax;
+    }
+
+    /* If we have a Variable PDO, its V range is within our range, and its I
+     * is at least the most I we need in that range */
+    if ((pdo & PD_PDO_TYPE) == PD_PDO_TYPE_VARIABLE) {
+        uint16_t pdo_vmin = PD_PDO_SRC_VARIABLE_MIN_VOLTAGE_GET(pdo);
+        uint16_t pdo_vmax = PD_PDO_SRC_VARIABLE_MAX_VOLTAGE_GET(pdo);
+        return pdo_vmin > 0
+            && pdo_vmin >= PD_MV2PDV(vmin)
+            && pdo_vmax <= PD_MV2PDV(vmax)
+            && PD_PDO_SRC_VARIABLE_CURRENT_GET(pdo)
+                >= dpm_get_max_current(scfg, PD_PDV2MV(pdo_vmin), PD_PDV2MV(pdo_vmax));
+    }
+    /* If we have a Battery PDO, its V range is within our range, and its P
+     * is at least the most P we need in that range */
+    if ((pdo & PD_PDO_TYPE) == PD_PDO_TYPE_BATTERY) {
+        uint16_t pdo_vmin = PD_PDO_SRC_BATTERY_MIN_VOLTAGE_GET(pdo);
+        uint16_t pdo_vmax = PD_PDO_SRC_BATTERY_MAX_VOLTAGE_GET(pdo);
+        return pdo_vmin > 0
+            && pdo_vmin >= PD_MV2PDV(vmin)
+            && pdo_vmax <= PD_MV2PDV(vmax)
+            && PD_PDO_SRC_BATTERY_POWER_GET(pdo)
+                >= PD_CW2PDW((uint32_t) dpm_get_max_power(scfg,
+                        PD_PDV2MV(pdo_vmin), PD_PDV2MV(pdo_vmax)));
+    }
+    return false;
+}
+
+/*
+ * Build a Request for the Variable or Battery PDO at index i of pdos.
+ */
+static void dpm_request_var_bat(struct pdb_config *cfg,
+        const struct pdbs_config *scfg, const uint32_t *pdos, int8_t i,
+        union pd_msg *request)
+{
     /* Cast the dpm_data to the right type */
     struct pdbs_dpm_data *dpm_data = cfg->dpm_data;
 
-    /* Update the stored Source_Capabilities */
-    if (caps != NULL) {
-        if (dpm_data->capabilities != NULL) {
-            chPoolFree(&pdb_msg_pool, (union pd_msg *) dpm_data->capabilities);
+    request->hdr = cfg->pe.hdr_template | PD_MSGTYPE_REQUEST | PD_NUMOBJ(1);
+
+    if ((pdos[i] & PD_PDO_TYPE) == PD_PDO_TYPE_VARIABLE) {
+        uint16_t vmin = PD_PDV2MV(PD_PDO_SRC_VARIABLE_MIN_VOLTAGE_GET(pdos[i]));
+        uint16_t vmax = PD_PDV2MV(PD_PDO_SRC_VARIABLE_MAX_VOLTAGE_GET(pdos[i]));
+        /* Get the most current we need in the PDO's range */
+        uint16_t current = dpm_get_max_current(scfg, vmin, vmax);
+        if (scfg->flags & PDBS_CONFIG_FLAGS_GIVEBACK) {
+            /* GiveBack enabled */
+            request->obj[0] = PD_RDO_FV_MIN_CURRENT_SET(DPM_MIN_CURRENT)
+                              | PD_RDO_FV_CURRENT_SET(current)
+                              | PD_RDO_GIVEBACK;
+        } else {
+            /* GiveBack disabled */
+            request->obj[0] = PD_RDO_FV_MAX_CURRENT_SET(current)
+                              | PD_RDO_FV_CURRENT_SET(current);
         }
-        dpm_data->capabilities = caps;
+
+        /* Update requested voltage.  The source may give us anything in the
+         * PDO's range, so plan for the highest. */
+        dpm_data->_requested_voltage = vmax;
+        dpm_data->_requested_current = current;
     } else {
-        /* No new capabilities; use a shorter name for the stored ones. */
-        caps = dpm_data->capabilities;
+        uint16_t vmin = PD_PDV2MV(PD_PDO_SRC_BATTERY_MIN_VOLTAGE_GET(pdos[i]));
+        uint16_t vmax = PD_PDV2MV(PD_PDO_SRC_BATTERY_MAX_VOLTAGE_GET(pdos[i]));
+        /* Get the most power we need in the PDO's range */
+        uint16_t power = PD_CW2PDW(dpm_get_max_power(scfg, vmin, vmax));
+        if (scfg->flags & PDBS_CONFIG_FLAGS_GIVEBACK) {
+            /* GiveBack enabled */
+            request->obj[0] = PD_RDO_BATT_MIN_POWER_SET(PD_CW2PDW((uint32_t) vmax * DPM_MIN_CURRENT / 1000))
+                              | PD_RDO_BATT_POWER_SET(power)
+                              | PD_RDO_GIVEBACK;
+        } else {
+            /* GiveBack disabled */
+            request->obj[0] = PD_RDO_BATT_MAX_POWER_SET(power)
+                              | PD_RDO_BATT_POWER_SET(power);
+        }
+
+        /* Update requested voltage.  The source may give us anything in the
+         * PDO's range, so plan for the highest. */
+        dpm_data->_requested_voltage = vmax;
+        dpm_data->_requested_current = (PD_PDW2CW((uint32_t) power) * 1000
+                + vmax - 1) / vmax;
+    }
+    request->obj[0] |= PD_RDO_NO_USB_SUSPEND | PD_RDO_OBJPOS_SET(i + 1);
+    if (dpm_data->usb_comms) {
+        request->obj[0] |= PD_RDO_USB_COMMS;
     }
 
-    /* Get the current configuration */
-    struct pdbs_config *scfg = pdbs_config_flash_read();
-    /* Get the number of PDOs */
-    uint8_t numobj = PD_NUMOBJ_GET(caps);
+    dpm_data->_capability_match = true;
+}
 
-    /* Make the LED blink to indicate ongoing power negotiations */
-    if (dpm_data->led_pd_status) {
-        chEvtSignal(pdbs_led_thread, PDBS_EVT_LED_NEGOTIATING);
+/*
+ * Build a Request for the fixed PDO at index i of pdos, asking for the given
+ * current (in centiamperes).
+ */
+static void dpm_request_fixed(struct pdb_config *cfg,
+        const struct pdbs_config *scfg, const uint32_t *pdos, int8_t i, uint16_t current,
+        union pd_msg *request)
+{
+    /* Cast the dpm_data to the right type */
+    struct pdbs_dpm_data *dpm_data = cfg->dpm_data;
+
+    request->hdr = cfg->pe.hdr_template | PD_MSGTYPE_REQUEST | PD_NUMOBJ(1);
+    if (scfg->flags & PDBS_CONFIG_FLAGS_GIVEBACK) {
+        /* GiveBack enabled */
+        request->obj[0] = PD_RDO_FV_MIN_CURRENT_SET(DPM_MIN_CURRENT)
+                          | PD_RDO_FV_CURRENT_SET(current)
+                          | PD_RDO_GIVEBACK;
+    } else {
+        /* GiveBack disabled */
+        request->obj[0] = PD_RDO_FV_MAX_CURRENT_SET(current)
+                          | PD_RDO_FV_CURRENT_SET(current);
+    }
+    request->obj[0] |= PD_RDO_NO_USB_SUSPEND | PD_RDO_OBJPOS_SET(i + 1);
+    if (dpm_data->usb_comms) {
+        request->obj[0] |= PD_RDO_USB_COMMS;
     }
 
-    /* Get whether or not the power supply is constrained */
-    dpm_data->_unconstrained_power = caps->obj[0] & PD_PDO_SRC_FIXED_UNCONSTRAINED;
+    /* Update requested voltage */
+    dpm_data->_requested_voltage = PD_PDV2MV(PD_PDO_SRC_FIXED_VOLTAGE_GET(pdos[i]));
+    dpm_data->_requested_current = current;
 
-    /* Get the current we want */
-    /* As we want/need current anyway, lets set it to zero for now */
-    uint16_t current = 0;//dpm_get_current(scfg, scfg->v);
+    dpm_data->_capability_match = true;
+}
 
+/*
+ * Build a Request for our configured voltage from the PPS or AVS APDO at
+ * index i of pdos, asking for the given current (in centiamperes).
+ */
+static void dpm_request_programmable(struct pdb_config *cfg,
+        const struct pdbs_config *scfg, const uint32_t *pdos, int8_t i,
+        uint16_t current, union pd_msg *request)
+{
+    /* Cast the dpm_data to the right type */
+    struct pdbs_dpm_data *dpm_data = cfg->dpm_data;
 
-    /*select the voltage */
-    uint16_t voltage = 0;
-    uint16_t pd_profiles[] = {5000, 9000, 15000, 20000};
-    if (cfg->state <= 3) {
-        voltage = pd_profiles[cfg->state];
+    request->hdr = cfg->pe.hdr_template | PD_MSGTYPE_REQUEST | PD_NUMOBJ(1);
+    if ((pdos[i] & PD_APDO_TYPE) == PD_APDO_TYPE_PPS) {
+        request->obj[0] = PD_RDO_PROG_CURRENT_SET(PD_CA2PAI(current))
+                          | PD_RDO_PROG_VOLTAGE_SET(PD_MV2PRV(scfg->v));
+
+        /* Update requested voltage */
+        dpm_data->_requested_voltage = PD_PRV2MV(PD_MV2PRV(scfg->v));
     } else {
-        voltage = pd_profiles[0];
-        cfg->state = 0;             // does not jump back :(
-    }
-
-    /* Make sure we have configuration */
-    if (scfg != NULL && dpm_data->output_enabled) {
-        /* Look at the PDOs to see if one matches our desires */
-        for (uint8_t i = 0; i < numobj; i++) {
-            /* If we have a fixed PDO, its V equals our desired V, and its I is
-             * at least our desired I */
-            if ((caps->obj[i] & PD_PDO_TYPE) == PD_PDO_TYPE_FIXED
-                    && PD_PDO_SRC_FIXED_VOLTAGE_GET(caps->obj[i]) == PD_MV2PDV(voltage)
-                    && PD_PDO_SRC_FIXED_CURRENT_GET(caps->obj[i]) >= current) {
-                /* We got what we wanted, so build a request for that */
-                request->hdr = cfg->pe.hdr_template | PD_MSGTYPE_REQUEST
-                               | PD_NUMOBJ(1);
-                if (scfg->flags & PDBS_CONFIG_FLAGS_GIVEBACK) {
-                    /* GiveBack enabled */
-                    request->obj[0] = PD_RDO_FV_MIN_CURRENT_SET(DPM_MIN_CURRENT)
-                                      | PD_RDO_FV_CURRENT_SET(current)
-                                      | PD_RDO_NO_USB_SUSPEND | PD_RDO_GIVEBACK
-                                      | PD_RDO_OBJPOS_SET(i + 1);
-                } else {
-                    /* GiveBack disabled */
-                    request->obj[0] = PD_RDO_FV_MAX_CURRENT_SET(current)
-                                      | PD_RDO_FV_CURRENT_SET(current)
-                                      | PD_RDO_NO_USB_SUSPEND | PD_RDO_OBJPOS_SET(i + 1);
-                }
-                if (dpm_data->usb_comms) {
-                    request->obj[0] |= PD_RDO_USB_COMMS;
-                }
+        /* AVS voltages have 100 mV resolution, even though the RDO uses
+         * 25 mV units. */
+        request->obj[0] = PD_RDO_AVS_CURRENT_SET(PD_CA2PAI(current))
+                          | PD_RDO_AVS_VOLTAGE_SET(PD_MV2ASV(PD_PAV2MV(PD_MV2PAV(scfg->v))));
+
+        /* Update requested voltage */
+        dpm_data->_requested_voltage = PD_PAV2MV(PD_MV2PAV(scfg->v));
+    }
+    /* The current has 50 mA resolution in both */
+    dpm_data->_requested_current = PD_PAI2CA(PD_CA2PAI(current));
+    request->obj[0] |= PD_RDO_NO_USB_SUSPEND | PD_RDO_OBJPOS_SET(i + 1);
+    if (dpm_data->usb_comms) {
+        request->obj[0] |= PD_RDO_USB_COMMS;
+    }
+
+    dpm_data->_capability_match = true;
+}
+
+/*
+ * Ways a PDO can satisfy our configuration
+ */
+enum dpm_match {
+    /* The PDO is no use to us */
+    DPM_MATCH_NONE,
+    /* A fixed PDO at the voltage we're looking for */
+    DPM_MATCH_FIXED,
+    /* A PPS or AVS APDO covering our configured voltage */
+    DPM_MATCH_PROGRAMMABLE,
+    /* A fixed PDO in our configured voltage range */
+    DPM_MATCH_RANGE,
+    /* A Variable or Battery PDO lying within our configured range */
+    DPM_MATCH_VAR_BAT
+};
+
+/*
+ * A PDO being scored by dpm_cost
+ */
+struct dpm_candidate {
+    /* How the PDO matches, from enum dpm_match */
+    uint8_t match;
+    /* Whether the contract needs periodic Requests to stay alive */
+    bool keepalive;
+    /* The voltage we'd get and the voltage we'd most like, in millivolts */
+    uint16_t mv;
+    uint16_t pref_mv;
+    /* The current we'd request and the most the PDO offers at mv, in
+     * centiamperes */
+    uint16_t current;
+    uint16_t imax;
+    /* The current the load would draw at mv, in centiamperes.  This can
+     * differ from the current we'd request, which is zero for exact matches
+     * when the power governor is off. */
+    uint16_t load;
+    /* How far the load would exceed the thermal power cap at mv, in
+     * centiwatts */
+    uint16_t over_cap;
+    /* Whether requesting the PDO made this source reset before */
+    bool avoided;
+};
+
+/*
+ * Weights of the terms of the PDO cost function.  Every PDO gets a cost, and
+ * the cheapest one wins, with ties going to the first.
+ */
+struct dpm_cost_weights {
+    /* Base cost of each kind of match.  Fixed matches cost nothing. */
+    int32_t programmable;
+    int32_t range;
+    int32_t var_bat;
+    /* Base cost of Variable and Battery PDOs when they're preferred */
+    int32_t var_bat_preferred;
+    /* Base cost of PPS and AVS APDOs when they're preferred */
+    int32_t programmable_preferred;
+    /* Cost per volt of distance from the preferred voltage */
+    int32_t distance;
+    /* Cost per milliwatt of I²R loss in the cable */
+    int32_t cable_loss;
+    /* Cost per percent of the PDO's current the load would use */
+    int32_t current_used;
+    /* Cost of a contract that needs keep-alive Requests (PPS) */
+    int32_t keepalive;
+    /* Cost of a fixed or programmable match the load would draw more than
+     * the PDO's current from */
+    int32_t overload;
+    /* Cost per watt delivered.  Negative to favour more power. */
+    int32_t power;
+    /* Base cost of a PDO the load would draw more than the thermal power cap
+     * from, and cost per watt over the cap */
+    int32_t over_cap;
+    int32_t over_cap_power;
+    /* Cost of a PDO that made this source reset before */
+    int32_t avoided;
+};
+
+/*
+ * The base costs are far enough apart that the kinds of match keep the order
+ * the first-match search used to give them: exact voltages, then the range,
+ * then Variable and Battery PDOs (first instead, if preferred).  PPS and AVS
+ * APDOs cost a little more than fixed PDOs at the same voltage, and
+ * preferring them outweighs that and the keep-alive cost, putting them ahead.
+ * A load that would draw more than the PDO offers trips the source's
+ * overcurrent protection, so that costs more than any kind of match.  Going
+ * over the thermal power cap costs more than any
+ * kind of match, so when throttled, a voltage the load draws less power at
+ * wins if there is one.  A PDO the charger database says made this source
+ * reset costs more than everything else put together, so it's only chosen if
+ * nothing else matches.  The other terms choose within each kind.
+ */
+static const struct dpm_cost_weights dpm_weights = {
+    .programmable = 1000,
+    .range = 100000,
+    .var_bat = 200000,
+    .var_bat_preferred = -100000,
+    .programmable_preferred = -5000,
+    .distance = 1000,
+    .cable_loss = 1,
+    .current_used = 10,
+    .keepalive = 2000,
+    .overload = 250000,
+    .power = -10,
+    .over_cap = 300000,
+    .over_cap_power = 1000,
+    .avoided = 1000000
+};
+
+/*
+ * Return the cost of the given candidate PDO.
+ */
+static int32_t dpm_cost(const struct dpm_candidate *c,
+        const struct pdbs_config *scfg)
+{
+    int32_t cost;
+
+    /* Start with the base cost of the match */
+    switch (c->match) {
+    case DPM_MATCH_RANGE:
+        cost = dpm_weights.range;
+        break;
+    case DPM_MATCH_VAR_BAT:
+        cost = (scfg->flags & PDBS_CONFIG_FLAGS_VAR_BAT)
+            ? dpm_weights.var_bat_preferred : dpm_weights.var_bat;
+        break;
+    case DPM_MATCH_PROGRAMMABLE:
+        cost = (scfg->flags & PDBS_CONFIG_FLAGS_PPS_PREFERRED)
+            ? dpm_weights.programmable_preferred : dpm_weights.programmable;
+        break;
+    default:
+        cost = 0;
+        break;
+    }
+
+    /* Distance from the preferred voltage */
+    int32_t dv = (int32_t) c->mv - c->pref_mv;
+    if (dv < 0) {
+        dv = -dv;
+    }
+    cost += dpm_weights.distance * dv / 1000;
+
+    /* I²R loss in the cable, in milliwatts */
+    cost += dpm_weights.cable_loss * (int32_t) ((uint32_t) c->load
+            * c->load * DPM_CABLE_RESISTANCE / 10000);
+
+    /* Share of the PDO's current the load would use, in percent */
+    if (c->imax > 0) {
+        cost += dpm_weights.current_used
+            * (int32_t) ((uint32_t) c->load * 100 / c->imax);
+    }
+
+    if (c->keepalive) {
+        cost += dpm_weights.keepalive;
+    }
+
+    if ((c->match == DPM_MATCH_FIXED || c->match == DPM_MATCH_PROGRAMMABLE)
+            && c->load > c->imax) {
+        cost += dpm_weights.overload;
+    }
+
+    /* Power delivered, in watts */
+    cost += dpm_weights.power * (int32_t) ((uint32_t) c->mv * c->load / 100000);
+
+    /* Power over the thermal cap, in watts */
+    if (c->over_cap > 0) {
+        cost += dpm_weights.over_cap
+            + dpm_weights.over_cap_power * (c->over_cap / 100);
+    }
+
+    if (c->avoided) {
+        cost += dpm_weights.avoided;
+    }
 
-                /* Update requested voltage */
-                dpm_data->_requested_voltage = PD_PDV2MV(PD_MV2PDV(scfg->v));
+    return cost;
+}
 
-                dpm_data->_capability_match = true;
-                return true;
+/*
+ * Build a Request for the PDO from pdos that best matches our configuration,
+ * preferring a fixed PDO at the given voltage (in millivolts).
+ *
+ * Every PDO is scored by dpm_cost in a single pass.
+ *
+ * Returns true if a PDO matched, false otherwise.
+ */
+static bool dpm_evaluate_pdos(struct pdb_config *cfg,
+        const struct pdbs_config *scfg, const uint32_t *pdos, uint8_t numobj, uint16_t voltage,
+        union pd_msg *request)
+{
+    /* Cast the dpm_data to the right type */
+    struct pdbs_dpm_data *dpm_data = cfg->dpm_data;
+
+    /* The voltage we'd most like from our range: the top if higher voltages
+     * are preferred, the bottom otherwise */
+    uint16_t range_mv = scfg->v;
+    if (scfg->vmin != 0 || scfg->vmax != 0) {
+        range_mv = (scfg->flags & PDBS_CONFIG_FLAGS_HV_PREFERRED)
+            ? scfg->vmax : scfg->vmin;
+    }
+
+    int8_t best = -1;
+    uint8_t best_match = DPM_MATCH_NONE;
+    uint16_t best_current = 0;
+    uint16_t best_imax = 0;
+    int32_t best_cost = INT32_MAX;
+    bool best_avoided = false;
+    /* The cost the cheapest avoided PDO would have had otherwise */
+    int32_t avoided_cost = INT32_MAX;
+
+    /* PDOs that made this source reset before */
+    uint16_t avoid = (dpm_data->_charger != NULL)
+        ? dpm_data->_charger->avoid : 0;
+
+    uint16_t governed = dpm_get_governed_current(dpm_data, scfg);
+    uint32_t power_cap = dpm_get_thermal_power_cap(dpm_data, scfg);
+
+    for (int8_t i = 0; i < numobj; i++) {
+        /* EPR_Source_Capabilities pad the SPR PDOs out to seven with zeros,
+         * which look like 0 V fixed PDOs but aren't PDOs at all */
+        if (pdos[i] == 0) {
+            continue;
+        }
+
+        struct dpm_candidate c = {
+            .match = DPM_MATCH_NONE,
+            .keepalive = false,
+            .mv = 0,
+            .pref_mv = voltage,
+            .current = 0,
+            .imax = 0,
+            .load = 0,
+            .over_cap = 0,
+            .avoided = i < 16 && (avoid & (1 << i)) != 0
+        };
+
+        if ((pdos[i] & PD_PDO_TYPE) == PD_PDO_TYPE_FIXED) {
+            uint16_t v = PD_PDO_SRC_FIXED_VOLTAGE_GET(pdos[i]);
+            c.mv = PD_PDV2MV(v);
+            c.imax = PD_PDO_SRC_FIXED_CURRENT_GET(pdos[i]);
+            if (v == PD_MV2PDV(voltage)) {
+                /* The fixed PDO is at our desired V */
+                c.match = DPM_MATCH_FIXED;
+            } else if (v >= PD_MV2PDV(scfg->vmin)
+                    && v <= PD_MV2PDV(scfg->vmax)
+                    && dpm_get_peak_current(dpm_data, scfg, c.imax)
+                        >= dpm_get_current(scfg, c.mv)) {
+                /* The fixed PDO is in our range, and its I (allowing for
+                 * peaks if configured to) is at least our desired I */
+                c.match = DPM_MATCH_RANGE;
+                c.pref_mv = range_mv;
+                c.current = dpm_get_current(scfg, c.mv);
+                /* If that's only a peak the source can handle as an
+                 * overload, ask for the operating current instead so we
+                 * don't get rejected */
+                if (c.current > c.imax) {
+                    c.current = c.imax;
+                }
             }
-            /* If we have a PPS APDO, our desired V lies within its range, and
-             * its I is at least our desired I */
-            if ((caps->obj[i] & PD_PDO_TYPE) == PD_PDO_TYPE_AUGMENTED
-                    && (caps->obj[i] & PD_APDO_TYPE) == PD_APDO_TYPE_PPS
-                    && PD_APDO_PPS_MAX_VOLTAGE_GET(caps->obj[i]) >= PD_MV2PAV(scfg->v)
-                    && PD_APDO_PPS_MIN_VOLTAGE_GET(caps->obj[i]) <= PD_MV2PAV(scfg->v)
-                    && PD_APDO_PPS_CURRENT_GET(caps->obj[i]) >= PD_CA2PAI(current)) {
-                /* We got what we wanted, so build a request for that */
-                request->hdr = cfg->pe.hdr_template | PD_MSGTYPE_REQUEST
-                               | PD_NUMOBJ(1);
-
-                /* Build a request */
-                request->obj[0] = PD_RDO_PROG_CURRENT_SET(PD_CA2PAI(current))
-                                  | PD_RDO_PROG_VOLTAGE_SET(PD_MV2PRV(scfg->v))
-                                  | PD_RDO_NO_USB_SUSPEND | PD_RDO_OBJPOS_SET(i + 1);
-                if (dpm_data->usb_comms) {
-                    request->obj[0] |= PD_RDO_USB_COMMS;
+        } else if ((pdos[i] & PD_PDO_TYPE) == PD_PDO_TYPE_AUGMENTED) {
+            c.mv = scfg->v;
+            switch (pdos[i] & PD_APDO_TYPE) {
+            case PD_APDO_TYPE_PPS:
+                /* Our desired V lies within the PPS APDO's range */
+                if (PD_APDO_PPS_MAX_VOLTAGE_GET(pdos[i]) >= PD_MV2PAV(scfg->v)
+                        && PD_APDO_PPS_MIN_VOLTAGE_GET(pdos[i]) <= PD_MV2PAV(scfg->v)) {
+                    c.match = DPM_MATCH_PROGRAMMABLE;
+                    c.keepalive = true;
+                    c.imax = PD_PAI2CA(PD_APDO_PPS_CURRENT_GET(pdos[i]));
+                }
+                break;
+            case PD_APDO_TYPE_SPR_AVS:
+                /* Our desired V lies within the part of the SPR AVS APDO's
+                 * range it offers current for */
+                if (scfg->v >= PD_SPR_AVS_MIN_MV
+                        && scfg->v <= PD_SPR_AVS_15V_MAX_MV) {
+                    c.match = DPM_MATCH_PROGRAMMABLE;
+                    c.imax = PD_APDO_SPR_AVS_CURRENT_15V_GET(pdos[i]);
+                } else if (scfg->v > PD_SPR_AVS_15V_MAX_MV
+                        && scfg->v <= PD_SPR_AVS_20V_MAX_MV
+                        && PD_APDO_SPR_AVS_CURRENT_20V_GET(pdos[i]) > 0) {
+                    c.match = DPM_MATCH_PROGRAMMABLE;
+                    c.imax = PD_APDO_SPR_AVS_CURRENT_20V_GET(pdos[i]);
+                }
+                break;
+            case PD_APDO_TYPE_EPR_AVS:
+                /* Our desired V lies within the EPR AVS APDO's range.  Its
+                 * I is whatever its PDP allows at that V, up to the 5 A an EPR
+                 * cable carries. */
+                if (PD_APDO_EPR_AVS_MAX_VOLTAGE_GET(pdos[i]) >= PD_MV2PAV(scfg->v)
+                        && PD_APDO_EPR_AVS_MIN_VOLTAGE_GET(pdos[i]) <= PD_MV2PAV(scfg->v)) {
+                    c.match = DPM_MATCH_PROGRAMMABLE;
+                    c.imax = PD_APDO_EPR_AVS_PDP_GET(pdos[i]) * 100000 / scfg->v;
+                    if (c.imax > PD_MA2CA(5000)) {
+                        c.imax = PD_MA2CA(5000);
+                    }
                 }
+                break;
+            default:
+                break;
+            }
+        } else if (dpm_var_bat_pdo_ok(pdos[i], scfg)) {
+            /* The source may give us anything in the PDO's range, so score
+             * it at the highest */
+            uint16_t vmin;
+            c.match = DPM_MATCH_VAR_BAT;
+            c.pref_mv = range_mv;
+            if ((pdos[i] & PD_PDO_TYPE) == PD_PDO_TYPE_VARIABLE) {
+                vmin = PD_PDV2MV(PD_PDO_SRC_VARIABLE_MIN_VOLTAGE_GET(pdos[i]));
+                c.mv = PD_PDV2MV(PD_PDO_SRC_VARIABLE_MAX_VOLTAGE_GET(pdos[i]));
+                c.imax = PD_PDO_SRC_VARIABLE_CURRENT_GET(pdos[i]);
+            } else {
+                vmin = PD_PDV2MV(PD_PDO_SRC_BATTERY_MIN_VOLTAGE_GET(pdos[i]));
+                c.mv = PD_PDV2MV(PD_PDO_SRC_BATTERY_MAX_VOLTAGE_GET(pdos[i]));
+                c.imax = (uint32_t) PD_PDW2CW(PD_PDO_SRC_BATTERY_POWER_GET(pdos[i]))
+                    * 1000 / c.mv;
+            }
+            c.current = dpm_get_max_current(scfg, vmin, c.mv);
+        }
 
-                /* Update requested voltage */
-                dpm_data->_requested_voltage = PD_PRV2MV(PD_MV2PRV(scfg->v));
+        if (c.match == DPM_MATCH_NONE) {
+            continue;
+        }
 
-                dpm_data->_capability_match = true;
-                return true;
-            }
+        /* Exact and programmable matches ask for the governed current, as
+         * much of it as the PDO offers */
+        if (c.match == DPM_MATCH_FIXED || c.match == DPM_MATCH_PROGRAMMABLE) {
+            c.current = (governed < c.imax) ? governed : c.imax;
         }
-        /* If there's a PDO in the voltage range, use it */
-        int8_t i = dpm_get_range_fixed_pdo_index(caps, scfg);
-        if (i >= 0) {
-            /* We got what we wanted, so build a request for that */
-            request->hdr = cfg->pe.hdr_template | PD_MSGTYPE_REQUEST
-                           | PD_NUMOBJ(1);
-            /* Get the current we need at this voltage */
-            current = dpm_get_current(scfg, PD_PDV2MV(PD_PDO_SRC_FIXED_VOLTAGE_GET(caps->obj[i])));
-            if (scfg->flags & PDBS_CONFIG_FLAGS_GIVEBACK) {
-                /* GiveBack enabled */
-                request->obj[0] = PD_RDO_FV_MIN_CURRENT_SET(DPM_MIN_CURRENT)
-                                  | PD_RDO_FV_CURRENT_SET(current)
-                                  | PD_RDO_NO_USB_SUSPEND | PD_RDO_GIVEBACK
-                                  | PD_RDO_OBJPOS_SET(i + 1);
-            } else {
-                /* GiveBack disabled */
-                request->obj[0] = PD_RDO_FV_MAX_CURRENT_SET(current)
-                                  | PD_RDO_FV_CURRENT_SET(current)
-                                  | PD_RDO_NO_USB_SUSPEND | PD_RDO_OBJPOS_SET(i + 1);
+
+        /* Score the PDO by what the load would draw, whatever we ask for.
+         * From a Variable or Battery PDO, that's the most it draws anywhere
+         * in the PDO's range. */
+        c.load = (c.match == DPM_MATCH_VAR_BAT) ? c.current
+            : dpm_get_current(scfg, c.mv);
+
+        /* When throttled, note how far over the power cap the load would go
+         * at this voltage, and don't ask for or draw more current than the
+         * cap allows */
+        if (power_cap > 0 && c.mv > 0) {
+            uint32_t load = (uint32_t) c.mv * dpm_get_current(scfg, c.mv) / 1000;
+            if (load > power_cap) {
+                c.over_cap = load - power_cap;
             }
-            if (dpm_data->usb_comms) {
-                request->obj[0] |= PD_RDO_USB_COMMS;
+            uint32_t limit = power_cap * 1000 / c.mv;
+            if (c.current > limit) {
+                c.current = limit;
             }
+            if (c.load > limit) {
+                c.load = limit;
+            }
+        }
 
-            /* Update requested voltage */
-            dpm_data->_requested_voltage = PD_PDV2MV(PD_PDO_SRC_FIXED_VOLTAGE_GET(caps->obj[i]));
-
-            dpm_data->_capability_match = true;
-            return true;
+        /* Keep the cheapest PDO so far */
+        int32_t cost = dpm_cost(&c, scfg);
+        if (c.avoided && cost - dpm_weights.avoided < avoided_cost) {
+            avoided_cost = cost - dpm_weights.avoided;
+        }
+        if (cost < best_cost) {
+            best = i;
+            best_match = c.match;
+            best_current = c.current;
+            best_imax = c.imax;
+            best_cost = cost;
+            best_avoided = c.avoided;
         }
     }
-    /* Nothing matched (or no configuration), so get 5 V at low current */
+
+    /* Note if the charger database changed our mind */
+    if (best_match != DPM_MATCH_NONE && !best_avoided
+            && avoided_cost < best_cost) {
+        pdbs_charger_avoided();
+    }
+
+    /* Build a request for the winner, if any */
+    dpm_data->_requested_imax = best_imax;
+    switch (best_match) {
+    case DPM_MATCH_FIXED:
+    case DPM_MATCH_RANGE:
+        dpm_request_fixed(cfg, scfg, pdos, best, best_current, request);
+        return true;
+    case DPM_MATCH_PROGRAMMABLE:
+        dpm_request_programmable(cfg, scfg, pdos, best, best_current, request);
+        return true;
+    case DPM_MATCH_VAR_BAT:
+        dpm_request_var_bat(cfg, scfg, pdos, best, request);
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Return whether we want the output on: it's enabled, and the thermal
+ * governor hasn't turned it off.
+ */
+static bool dpm_output_wanted(const struct pdbs_dpm_data *dpm_data)
+{
+    return dpm_data->output_enabled
+        && dpm_data->thermal._level < PDBS_DPM_THERMAL_OFF;
+}
+
+/*
+ * Build a Request for vSafe5V at low current, for when nothing matched.
+ *
+ * Returns true if that's enough power, false otherwise.
+ */
+static bool dpm_request_vsafe5v(struct pdb_config *cfg, union pd_msg *request)
+{
+    /* Cast the dpm_data to the right type */
+    struct pdbs_dpm_data *dpm_data = cfg->dpm_data;
+    /* We want more power if the output is enabled and not too hot */
+    bool want_power = dpm_output_wanted(dpm_data);
+
     request->hdr = cfg->pe.hdr_template | PD_MSGTYPE_REQUEST | PD_NUMOBJ(1);
     request->obj[0] = PD_RDO_FV_MAX_CURRENT_SET(DPM_MIN_CURRENT)
                       | PD_RDO_FV_CURRENT_SET(DPM_MIN_CURRENT)
                       | PD_RDO_NO_USB_SUSPEND
                       | PD_RDO_OBJPOS_SET(1);
-    /* If the output is enabled and we got here, it must be a capability
+    /* If we want more power and we got here, it must be a capability
      * mismatch. */
-    if (dpm_data->output_enabled) {
+    if (want_power) {
         request->obj[0] |= PD_RDO_CAP_MISMATCH;
     }
     /* If we can do USB communications, tell the power supply */
@@ -247,10 +953,410 @@ bool pdbs_dpm_evaluate_capability(struct pdb_config *cfg,
 
     /* Update requested voltage */
     dpm_data->_requested_voltage = 5000;
+    dpm_data->_requested_current = DPM_MIN_CURRENT;
 
-    /* At this point, we have a capability match iff the output is disabled */
-    dpm_data->_capability_match = !dpm_data->output_enabled;
-    return !dpm_data->output_enabled;
+    /* At this point, we have a capability match iff we don't want power */
+    dpm_data->_capability_match = !want_power;
+    return !want_power;
+}
+
+/*
+ * Remember the Request we just made, in case the source resets over it.
+ */
+static void dpm_request_made(struct pdbs_dpm_data *dpm_data,
+        const union pd_msg *request)
+{
+    dpm_data->_requested_pdo = PD_RDO_OBJPOS_GET(request);
+    dpm_data->_request_pending = true;
+
+    /* A configuration change that leaves the Request as it was doesn't
+     * change the contract, so there's nothing to time */
+    if (dpm_data->_config_changed
+            && request->obj[0] == dpm_data->_requested_rdo) {
+        dpm_data->_config_changed = false;
+    }
+    dpm_data->_requested_rdo = request->obj[0];
+}
+
+bool pdbs_dpm_evaluate_capability(struct pdb_config *cfg,
+                                  const union pd_msg *caps, union pd_msg *request)
+{
+
+    /* Cast the dpm_data to the right type */
+    struct pdbs_dpm_data *dpm_data = cfg->dpm_data;
+
+    /* Update the stored Source_Capabilities */
+    if (caps != NULL) {
+        if (dpm_data->capabilities != NULL) {
+            chPoolFree(&pdb_msg_pool, (union pd_msg *) dpm_data->capabilities);
+        }
+        dpm_data->capabilities = caps;
+        /* New SPR capabilities mean we're not in EPR Mode anymore */
+        dpm_data->epr_capabilities = NULL;
+        dpm_data->epr_numobj = 0;
+        /* Look up what we've learned about the source */
+        dpm_data->_charger = pdbs_charger_find(pdbs_charger_fingerprint(caps));
+        pdbs_charger_changed();
+    } else {
+        /* No new capabilities; use a shorter name for the stored ones. */
+        caps = dpm_data->capabilities;
+    }
+
+    /* Get the current configuration */
+    const struct pdbs_config *scfg = dpm_get_config(cfg);
+
+    /* Make the LED blink to indicate ongoing power negotiations */
+    if (dpm_data->led_pd_status) {
+        chEvtSignal(pdbs_led_thread, PDBS_EVT_LED_NEGOTIATING);
+    }
+
+    /* Get whether or not the power supply is constrained */
+    dpm_data->_unconstrained_power = caps->obj[0] & PD_PDO_SRC_FIXED_UNCONSTRAINED;
+
+    /* Make sure we have configuration, then look for a PDO that matches.  If
+     * nothing matched (or no configuration), get 5 V at low current. */
+    if (scfg == NULL || !dpm_output_wanted(dpm_data)
+            || !dpm_evaluate_pdos(cfg, scfg, dpm_msg_pdos(caps),
+                PD_NUMOBJ_GET(caps), scfg->v, request)) {
+        dpm_request_vsafe5v(cfg, request);
+    }
+
+    dpm_request_made(dpm_data, request);
+
+    return dpm_data->_capability_match;
+}
+
+uint8_t pdbs_dpm_epr_mode_pdp(struct pdb_config *cfg)
+{
+    /* Cast the dpm_data to the right type */
+    struct pdbs_dpm_data *dpm_data = cfg->dpm_data;
+    /* Get the current configuration */
+    const struct pdbs_config *scfg = dpm_get_config(cfg);
+
+    /* We only need EPR Mode if we're configured for more than SPR voltages */
+    if (scfg == NULL || !dpm_data->output_enabled
+            || (scfg->v <= PD_MV_SPR_MAX && scfg->vmax <= PD_MV_SPR_MAX)) {
+        return 0;
+    }
+
+    /* Our Operational PDP is the power we want at our preferred voltage,
+     * rounded up to the next watt */
+    uint32_t pdp = ((uint32_t) scfg->v * dpm_get_current(scfg, scfg->v)
+            + 99999) / 100000;
+    if (pdp < 1) {
+        pdp = 1;
+    } else if (pdp > PD_EPR_PDP_MAX) {
+        pdp = PD_EPR_PDP_MAX;
+    }
+    return pdp;
+}
+
+bool pdbs_dpm_evaluate_epr_capability(struct pdb_config *cfg,
+        const uint32_t *pdos, uint8_t numobj, union pd_msg *request)
+{
+    /* Cast the dpm_data to the right type */
+    struct pdbs_dpm_data *dpm_data = cfg->dpm_data;
+
+    /* Update the stored EPR_Source_Capabilities */
+    dpm_data->epr_capabilities = pdos;
+    dpm_data->epr_numobj = numobj;
+
+    /* Get the current configuration */
+    const struct pdbs_config *scfg = dpm_get_config(cfg);
+
+    /* Make the LED blink to indicate ongoing power negotiations */
+    if (dpm_data->led_pd_status) {
+        chEvtSignal(pdbs_led_thread, PDBS_EVT_LED_NEGOTIATING);
+    }
+
+    /* Get whether or not the power supply is constrained */
+    dpm_data->_unconstrained_power = pdos[0] & PD_PDO_SRC_FIXED_UNCONSTRAINED;
+
+    /* In EPR Mode, look for our preferred voltage directly.  If nothing
+     * matched (or no configuration), get 5 V at low current. */
+    if (scfg == NULL || !dpm_output_wanted(dpm_data)
+            || !dpm_evaluate_pdos(cfg, scfg, pdos, numobj, scfg->v, request)) {
+        dpm_request_vsafe5v(cfg, request);
+    }
+
+    /* Turn the Request into an EPR_Request, which carries a copy of the PDO
+     * being requested */
+    request->hdr = cfg->pe.hdr_template | PD_MSGTYPE_EPR_REQUEST
+                   | PD_NUMOBJ(2);
+    request->obj[1] = pdos[PD_RDO_OBJPOS_GET(request) - 1];
+
+    dpm_request_made(dpm_data, request);
+
+    return dpm_data->_capability_match;
+}
+
+void pdbs_dpm_source_capabilities_extended(struct pdb_config *cfg,
+        const union pd_msg *msg)
+{
+    /* Cast the dpm_data to the right type */
+    struct pdbs_dpm_data *dpm_data = cfg->dpm_data;
+    struct pdbs_dpm_src_cap_ext *ext = &dpm_data->source_cap_ext;
+    const uint8_t *scedb = msg->data;
+
+    /* Pick out the fields we care about */
+    ext->vid = scedb[PD_SCEDB_VID] | (scedb[PD_SCEDB_VID + 1] << 8);
+    ext->pid = scedb[PD_SCEDB_PID] | (scedb[PD_SCEDB_PID + 1] << 8);
+    ext->holdup_time = scedb[PD_SCEDB_HOLDUP_TIME];
+    ext->peak_current[0] = scedb[PD_SCEDB_PEAK_CURRENT1]
+        | (scedb[PD_SCEDB_PEAK_CURRENT1 + 1] << 8);
+    ext->peak_current[1] = scedb[PD_SCEDB_PEAK_CURRENT2]
+        | (scedb[PD_SCEDB_PEAK_CURRENT2 + 1] << 8);
+    ext->peak_current[2] = scedb[PD_SCEDB_PEAK_CURRENT3]
+        | (scedb[PD_SCEDB_PEAK_CURRENT3 + 1] << 8);
+    ext->source_inputs = scedb[PD_SCEDB_SOURCE_INPUTS];
+    ext->batteries = scedb[PD_SCEDB_BATTERIES];
+    ext->pdp = scedb[PD_SCEDB_SPR_PDP];
+    /* Revision 3.0 sources don't tell us their EPR Source PDP Rating */
+    if (PD_DATA_SIZE_GET(msg) >= PD_SCEDB_SIZE) {
+        ext->epr_pdp = scedb[PD_SCEDB_EPR_PDP];
+    } else {
+        ext->epr_pdp = 0;
+    }
+
+    dpm_data->source_cap_ext_valid = true;
+
+    /* The first contract was chosen before we knew the source's peak
+     * current, so if we're configured to count on peaks, choose again */
+    const struct pdbs_config *scfg = dpm_get_config(cfg);
+    if (scfg != NULL && (scfg->flags & PDBS_CONFIG_FLAGS_PEAK_CURRENT)) {
+        chEvtSignal(cfg->pe.thread, PDB_EVT_PE_NEW_POWER);
+    }
+}
+
+void pdbs_dpm_pps_status(struct pdb_config *cfg, const union pd_msg *msg)
+{
+    /* Cast the dpm_data to the right type */
+    struct pdbs_dpm_data *dpm_data = cfg->dpm_data;
+    struct pdbs_dpm_pps_status *status = &dpm_data->pps_status;
+    const uint8_t *ppssdb = msg->data;
+
+    status->voltage = ppssdb[PD_PPSSDB_OUTPUT_VOLTAGE]
+        | (ppssdb[PD_PPSSDB_OUTPUT_VOLTAGE + 1] << 8);
+    status->current = ppssdb[PD_PPSSDB_OUTPUT_CURRENT];
+    status->flags = ppssdb[PD_PPSSDB_REAL_TIME_FLAGS];
+    status->time = chVTGetSystemTime();
+
+    dpm_data->pps_status_valid = true;
+
+    /* Let the governor know what the load is drawing, if the source told us */
+    if (status->current != PD_PPSSDB_OUTPUT_CURRENT_UNSUPPORTED) {
+        pdbs_dpm_load_current(cfg, PD_PAI2CA(status->current));
+    }
+}
+
+/*
+ * Tell the power governor the load's present draw, in centiamperes.  Must be
+ * called from a locked context.
+ *
+ * Returns true if the governor wants a new current requested, false
+ * otherwise.
+ */
+static bool dpm_governor_update(struct pdbs_dpm_governor *gov,
+        const struct pdbs_config *scfg, uint16_t current)
+{
+    if (!gov->enabled || gov->step == 0) {
+        return false;
+    }
+
+    /* Find what we'd like to request: the draw plus the margin, rounded up to
+     * the next step */
+    uint32_t target = (uint32_t) current * (100 + gov->margin) / 100;
+    target = (target / gov->step + 1) * gov->step;
+
+    /* Until the first measurement, we've been asking for everything the load
+     * may need, as dpm_get_governed_current does.  Never ask for more. */
+    uint32_t full = dpm_get_current(scfg, scfg->v);
+    if (target > full) {
+        target = full;
+    }
+    uint32_t requested = gov->_current;
+    if (requested == 0 || requested > full) {
+        requested = full;
+    }
+
+    if ((uint32_t) current * 100 > requested * gov->up_threshold) {
+        /* Step up right away, before the load runs out of headroom */
+        gov->_low = false;
+        if (target <= requested) {
+            return false;
+        }
+    } else if ((uint32_t) current * 100 < requested * gov->down_threshold) {
+        /* Step down once the draw has been low for long enough */
+        if (!gov->_low) {
+            gov->_low = true;
+            gov->_low_since = chVTGetSystemTimeX();
+            return false;
+        }
+        if (chVTTimeElapsedSinceX(gov->_low_since) < gov->hold
+                || target >= requested) {
+            return false;
+        }
+        gov->_low = false;
+    } else {
+        /* The request suits the draw */
+        gov->_low = false;
+        return false;
+    }
+
+    /* Request the new current */
+    gov->_current = target;
+    return true;
+}
+
+void pdbs_dpm_load_current(struct pdb_config *cfg, uint16_t current)
+{
+    /* Cast the dpm_data to the right type */
+    struct pdbs_dpm_data *dpm_data = cfg->dpm_data;
+
+    chSysLock();
+    bool changed = dpm_governor_update(&dpm_data->governor,
+            dpm_get_config(cfg), current);
+    chSysUnlock();
+
+    if (changed) {
+        chEvtSignal(cfg->pe.thread, PDB_EVT_PE_NEW_POWER);
+    }
+}
+
+/*
+ * Return the thermal throttling level for the given temperature (in degrees
+ * Celsius), starting from the present level.  Must be called from a locked
+ * context.
+ */
+static uint8_t dpm_thermal_level(struct pdbs_dpm_thermal *th, int16_t temp)
+{
+    if (!th->enabled) {
+        return 0;
+    }
+
+    /* Find the level the temperature calls for */
+    uint8_t level;
+    if (temp >= th->critical) {
+        level = PDBS_DPM_THERMAL_OFF;
+    } else if (temp < th->warn) {
+        level = 0;
+    } else if (th->step == 0
+            || (temp - th->warn) / th->step >= PDBS_DPM_THERMAL_OFF - 2) {
+        level = PDBS_DPM_THERMAL_OFF - 1;
+    } else {
+        level = 1 + (temp - th->warn) / th->step;
+    }
+
+    /* Go up right away */
+    if (level >= th->_level) {
+        return level;
+    }
+
+    /* Stay put while the PHY cools down */
+    if (th->_ovrtemp) {
+        if (chVTTimeElapsedSinceX(th->_ovrtemp_time) < th->cooldown) {
+            return th->_level;
+        }
+        th->_ovrtemp = false;
+    }
+
+    /* Come down one level at a time, once the temperature is far enough
+     * below the threshold of the present level */
+    int16_t threshold = (th->_level == PDBS_DPM_THERMAL_OFF) ? th->critical
+        : th->warn + (th->_level - 1) * th->step;
+    if (temp <= threshold - th->hysteresis) {
+        return th->_level - 1;
+    }
+    return th->_level;
+}
+
+/*
+ * Governor timer callback, checking the temperature and the output current
+ * and asking for new power if either governor wants it
+ */
+static void dpm_thermal_timer_cb(void *vcfg)
+{
+    struct pdb_config *cfg = vcfg;
+    /* Cast the dpm_data to the right type */
+    struct pdbs_dpm_data *dpm_data = cfg->dpm_data;
+    struct pdbs_dpm_thermal *th = &dpm_data->thermal;
+
+    /* Get the hotter of the temperatures, if they've been measured */
+    struct pdbs_telemetry t;
+    bool measured = pdbs_telemetry_get(&t, 0);
+    int16_t temp = t.temperature;
+    if (measured && t.ntc_temperature > temp) {
+        temp = t.ntc_temperature;
+    }
+
+    chSysLockFromISR();
+    /* Without a measurement, only let go if the governor was disabled */
+    uint8_t level = th->_level;
+    if (measured) {
+        th->_temperature = temp;
+        level = dpm_thermal_level(th, temp);
+    } else if (!th->enabled) {
+        level = 0;
+    }
+    bool renegotiate = level != th->_level;
+    th->_level = level;
+    /* Let the power governor know what the load is drawing */
+    if (measured && dpm_governor_update(&dpm_data->governor,
+                dpm_get_config(cfg), t.current)) {
+        renegotiate = true;
+    }
+    if (renegotiate) {
+        chEvtSignalI(cfg->pe.thread, PDB_EVT_PE_NEW_POWER);
+    }
+    chVTSetI(&th->_timer, DPM_THERMAL_PERIOD, dpm_thermal_timer_cb, cfg);
+    chSysUnlockFromISR();
+}
+
+bool pdbs_dpm_overtemp(struct pdb_config *cfg)
+{
+    /* Cast the dpm_data to the right type */
+    struct pdbs_dpm_data *dpm_data = cfg->dpm_data;
+    struct pdbs_dpm_thermal *th = &dpm_data->thermal;
+
+    /* Without the governor, the Policy Engine has to hard reset */
+    if (!th->enabled) {
+        return false;
+    }
+
+    /* Throttle as far as we can, or turn the output off if that wasn't
+     * enough */
+    chSysLock();
+    th->_level = (th->_level >= PDBS_DPM_THERMAL_OFF - 1)
+        ? PDBS_DPM_THERMAL_OFF : PDBS_DPM_THERMAL_OFF - 1;
+    th->_ovrtemp = true;
+    th->_ovrtemp_time = chVTGetSystemTimeX();
+    chSysUnlock();
+
+    return true;
+}
+
+void pdbs_dpm_soft_reset(struct pdb_config *cfg)
+{
+    (void) cfg;
+
+    pdbs_history_log(PDBS_HISTORY_SOFT_RESET, 0, 0, 0);
+}
+
+void pdbs_dpm_request_rejected(struct pdb_config *cfg)
+{
+    /* Cast the dpm_data to the right type */
+    struct pdbs_dpm_data *dpm_data = cfg->dpm_data;
+
+    /* The old contract stays, so a configuration change won't be applied */
+    dpm_data->_config_changed = false;
+}
+
+const struct pdb_dpm_identity *pdbs_dpm_get_identity(struct pdb_config *cfg)
+{
+    /* Cast the dpm_data to the right type */
+    struct pdbs_dpm_data *dpm_data = cfg->dpm_data;
+
+    return dpm_data->identity;
 }
 
 void pdbs_dpm_get_sink_capability(struct pdb_config *cfg, union pd_msg *cap)
@@ -258,7 +1364,7 @@ void pdbs_dpm_get_sink_capability(struct pdb_config *cfg, union pd_msg *cap)
     /* Keep track of how many PDOs we've added */
     int numobj = 0;
     /* Get the current configuration */
-    struct pdbs_config *scfg = pdbs_config_flash_read();
+    const struct pdbs_config *scfg = dpm_get_config(cfg);
     /* Cast the dpm_data to the right type */
     struct pdbs_dpm_data *dpm_data = cfg->dpm_data;
 
@@ -280,7 +1386,9 @@ void pdbs_dpm_get_sink_capability(struct pdb_config *cfg, union pd_msg *cap)
                              | PD_PDO_SNK_FIXED_CURRENT_SET(current);
 
         /* Get the PDO from the voltage range */
-        int8_t i = dpm_get_range_fixed_pdo_index(dpm_data->capabilities, scfg);
+        int8_t i = dpm_get_range_fixed_pdo_index(dpm_data,
+                dpm_msg_pdos(dpm_data->capabilities),
+                PD_NUMOBJ_GET(dpm_data->capabilities), scfg);
 
         /* If it's vSafe5V, set our vSafe5V's current to what we want */
         if (i == 0) {
@@ -311,8 +1419,10 @@ void pdbs_dpm_get_sink_capability(struct pdb_config *cfg, union pd_msg *cap)
             }
         }
 
-        /* If we're using PD 3.0, add a PPS APDO for our desired voltage */
-        if ((cfg->pe._message->hdr & PD_HDR_SPECREV) >= PD_SPECREV_3_0) {
+        /* If we're using PD 3.0, add a PPS APDO for our desired voltage,
+         * unless it's too high for PPS */
+        if ((cfg->pe.hdr_template & PD_HDR_SPECREV) >= PD_SPECREV_3_0
+                && scfg->v <= PD_MV_SPR_MAX) {
             cap->obj[numobj++] = PD_PDO_TYPE_AUGMENTED | PD_APDO_TYPE_PPS
                                  | PD_APDO_PPS_MAX_VOLTAGE_SET(PD_MV2PAV(scfg->v))
                                  | PD_APDO_PPS_MIN_VOLTAGE_SET(PD_MV2PAV(scfg->v))
@@ -337,8 +1447,7 @@ void pdbs_dpm_get_sink_capability(struct pdb_config *cfg, union pd_msg *cap)
 
 bool pdbs_dpm_giveback_enabled(struct pdb_config *cfg)
 {
-    (void) cfg;
-    struct pdbs_config *scfg = pdbs_config_flash_read();
+    const struct pdbs_config *scfg = dpm_get_config(cfg);
 
     return scfg->flags & PDBS_CONFIG_FLAGS_GIVEBACK;
 }
@@ -346,7 +1455,7 @@ bool pdbs_dpm_giveback_enabled(struct pdb_config *cfg)
 bool pdbs_dpm_evaluate_typec_current(struct pdb_config *cfg,
                                      enum fusb_typec_current tcc)
 {
-    struct pdbs_config *scfg = pdbs_config_flash_read();
+    const struct pdbs_config *scfg = dpm_get_config(cfg);
     /* Cast the dpm_data to the right type */
     struct pdbs_dpm_data *dpm_data = cfg->dpm_data;
 
@@ -356,6 +1465,14 @@ bool pdbs_dpm_evaluate_typec_current(struct pdb_config *cfg,
     /* Make the present Type-C Current advertisement available to the rest of
      * the DPM */
     dpm_data->typec_current = tcc;
+    if (tcc == fusb_tcc_3_0) {
+        dpm_data->_requested_current = 300;
+    } else if (tcc == fusb_tcc_1_5) {
+        dpm_data->_requested_current = 150;
+    } else {
+        /* Default USB current: the least a USB port gives */
+        dpm_data->_requested_current = 50;
+    }
 
     /* If we have no configuration or don't want 5 V, Type-C Current can't
      * possibly satisfy our needs */
@@ -392,6 +1509,23 @@ void pdbs_dpm_pd_start(struct pdb_config *cfg)
     /* Cast the dpm_data to the right type */
     struct pdbs_dpm_data *dpm_data = cfg->dpm_data;
 
+    /* Forget what we knew about the old source */
+    dpm_data->source_cap_ext_valid = false;
+    dpm_data->pps_status_valid = false;
+    /* Nothing has been measured this session */
+    dpm_data->governor._current = 0;
+    dpm_data->governor._low = false;
+    /* A Hard Reset from here on is a new one */
+    dpm_data->_hard_reset_logged = false;
+
+    /* Start checking the temperature, if we aren't already */
+    if (!dpm_data->thermal._running) {
+        dpm_data->thermal._running = true;
+        chVTObjectInit(&dpm_data->thermal._timer);
+        chVTSet(&dpm_data->thermal._timer, DPM_THERMAL_PERIOD,
+                dpm_thermal_timer_cb, cfg);
+    }
+
     if (dpm_data->led_pd_status) {
         chEvtSignal(pdbs_led_thread, PDBS_EVT_LED_NEGOTIATING);
     }
@@ -400,24 +1534,31 @@ void pdbs_dpm_pd_start(struct pdb_config *cfg)
 /*
  * Set the output state, with LED indication.
  */
-static void dpm_output_set(struct pdbs_dpm_data *dpm_data, bool state, bool led)
+static void dpm_output_set(struct pdb_config *cfg, bool state, bool led)
 {
+    /* Cast the dpm_data to the right type */
+    struct pdbs_dpm_data *dpm_data = cfg->dpm_data;
+
     /* Update the present voltage */
     dpm_data->_present_voltage = dpm_data->_requested_voltage;
 
     /* Set the power output */
-    if (state && dpm_data->output_enabled) {
+    if (state && dpm_output_wanted(dpm_data)) {
         /* Turn the output on */
         if (dpm_data->led_pd_status && led) {
             chEvtSignal(pdbs_led_thread, PDBS_EVT_LED_OUTPUT_ON);
         }
-        palSetLine(LINE_OUT_CTRL);
+        /* Use the whole of the new contract, and no more than it or the
+         * thermal governor allows */
+        pdbs_softstart_limit(dpm_get_duty_limit(dpm_data,
+                    dpm_get_config(cfg), dpm_data->_requested_voltage));
+        pdbs_softstart_on(&dpm_data->softstart);
     } else {
         /* Turn the output off */
         if (dpm_data->led_pd_status && led) {
             chEvtSignal(pdbs_led_thread, PDBS_EVT_LED_OUTPUT_OFF);
         }
-        palClearLine(LINE_OUT_CTRL);
+        pdbs_softstart_off();
     }
 }
 
@@ -428,13 +1569,109 @@ void pdbs_dpm_transition_default(struct pdb_config *cfg)
 
     /* Pretend we requested 5 V */
     dpm_data->_requested_voltage = 5000;
+    /* Any voltage transition or configuration change in progress is over */
+    dpm_data->_transition_off = false;
+    dpm_data->_config_changed = false;
+
+    /* If this is a hard reset rather than a detach, and it came while a
+     * Request was outstanding, soon after the new contract started, or during
+     * a PPS contract, blame the PDO we requested */
+    struct pdbs_charger *ch = dpm_data->_charger;
+    if (ch != NULL && !cfg->pe._source_detached) {
+        if (dpm_data->_request_pending
+                || chVTTimeElapsedSinceX(dpm_data->_ready_time)
+                    < DPM_CHARGER_SETTLE
+                || (cfg->pe._pps_mask & (1 << dpm_data->_requested_pdo))) {
+            /* Never avoid vSafe5V, which every source must offer */
+            if (dpm_data->_requested_pdo > 1
+                    && dpm_data->_requested_pdo <= 16) {
+                ch->avoid |= 1 << (dpm_data->_requested_pdo - 1);
+            }
+        }
+        if (ch->resets < UINT8_MAX) {
+            ch->resets++;
+        }
+        pdbs_charger_changed();
+    }
+    /* Until the source sends its capabilities again, it's unidentified, so
+     * the same reset isn't counted twice */
+    dpm_data->_charger = NULL;
+    dpm_data->_request_pending = false;
+
+    /* Log the detach or Hard Reset.  After a protocol error, this is called
+     * both before and after the Hard Reset, but it's only one reset. */
+    if (cfg->pe._source_detached) {
+        pdbs_history_log(PDBS_HISTORY_DETACH, 0, 0, 0);
+    } else if (!dpm_data->_hard_reset_logged) {
+        dpm_data->_hard_reset_logged = true;
+        pdbs_history_log(PDBS_HISTORY_HARD_RESET, 0, 0, 0);
+    }
+
     /* Turn the output off */
-    dpm_output_set(cfg->dpm_data, false, true);
+    dpm_output_set(cfg, false, true);
 }
 
 void pdbs_dpm_transition_min(struct pdb_config *cfg)
 {
-    dpm_output_set(cfg->dpm_data, false, true);
+    dpm_output_set(cfg, false, true);
+}
+
+/*
+ * Return whether the load can stay connected while the voltage changes from
+ * the present voltage to the requested one.
+ */
+static bool dpm_transition_tolerated(struct pdb_config *cfg)
+{
+    /* Cast the dpm_data to the right type */
+    struct pdbs_dpm_data *dpm_data = cfg->dpm_data;
+    /* Get the current configuration */
+    const struct pdbs_config *scfg = dpm_get_config(cfg);
+
+    if (dpm_data->transition == PDBS_DPM_TRANSITION_BREAK || scfg == NULL
+            || (scfg->vmin == 0 && scfg->vmax == 0)) {
+        return false;
+    }
+
+    /* The voltage moves from one to the other, so if the range covers both,
+     * it covers everything in between too */
+    if (dpm_data->_present_voltage < scfg->vmin
+            || dpm_data->_present_voltage > scfg->vmax
+            || dpm_data->_requested_voltage < scfg->vmin
+            || dpm_data->_requested_voltage > scfg->vmax) {
+        return false;
+    }
+
+    if (dpm_data->transition == PDBS_DPM_TRANSITION_STANDBY) {
+        /* The load must already be drawing no more than Sink Standby power.
+         * If it hasn't been measured, assume it isn't. */
+        struct pdbs_telemetry t;
+        if (!pdbs_telemetry_get(&t, 0)
+                || (uint32_t) t.vbus * t.current / 1000 > DPM_SNK_STDBY_POWER) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Return the duty cycle limit that keeps the load within Sink Standby power
+ * while the voltage moves between the given ones (in millivolts).  However
+ * the load is defined, it draws the most at one end or the other.
+ */
+static uint16_t dpm_get_standby_duty_limit(const struct pdbs_config *scfg,
+        uint16_t mv_a, uint16_t mv_b)
+{
+    uint32_t power = (uint32_t) mv_a * dpm_get_current(scfg, mv_a) / 1000;
+    uint32_t power_b = (uint32_t) mv_b * dpm_get_current(scfg, mv_b) / 1000;
+    if (power_b > power) {
+        power = power_b;
+    }
+
+    if (power <= DPM_SNK_STDBY_POWER) {
+        return PDBS_SOFTSTART_DUTY_MAX;
+    }
+    return DPM_SNK_STDBY_POWER * PDBS_SOFTSTART_DUTY_MAX / power;
 }
 
 void pdbs_dpm_transition_standby(struct pdb_config *cfg)
@@ -442,12 +1679,40 @@ void pdbs_dpm_transition_standby(struct pdb_config *cfg)
     /* Cast the dpm_data to the right type */
     struct pdbs_dpm_data *dpm_data = cfg->dpm_data;
 
-    /* If the voltage is changing, enter Sink Standby */
+    /* Time how long the source takes to get the new contract ready */
+    dpm_data->_accept_time = chVTGetSystemTime();
+
+    /* Until the new contract is in place, keep within both it and the old
+     * one */
+    uint16_t limit = dpm_get_duty_limit(dpm_data, dpm_get_config(cfg),
+            dpm_data->_requested_voltage);
+    if (limit < pdbs_softstart_get_limit()) {
+        pdbs_softstart_limit(limit);
+    }
+
+    /* If the voltage is changing, enter Sink Standby unless the load can
+     * take the transition */
     if (dpm_data->_requested_voltage != dpm_data->_present_voltage) {
+        if (dpm_transition_tolerated(cfg)) {
+            /* The load stays connected, but it still has to keep within
+             * Sink Standby power until the new contract is in place */
+            limit = dpm_get_standby_duty_limit(dpm_get_config(cfg),
+                    dpm_data->_present_voltage, dpm_data->_requested_voltage);
+            if (limit < pdbs_softstart_get_limit()) {
+                pdbs_softstart_limit(limit);
+            }
+            dpm_data->transition_off_time = 0;
+            return;
+        }
+        /* Time the interruption, if there is one */
+        if (pdbs_softstart_is_on()) {
+            dpm_data->_transition_off = true;
+            dpm_data->_transition_off_since = chVTGetSystemTime();
+        }
         /* For the PD Buddy Sink, entering Sink Standby is equivalent to
          * turning the output off.  However, we don't want to change the LED
          * state for standby mode. */
-        palClearLine(LINE_OUT_CTRL);
+        pdbs_softstart_off();
     }
 }
 
@@ -456,7 +1721,41 @@ void pdbs_dpm_transition_requested(struct pdb_config *cfg)
     /* Cast the dpm_data to the right type */
     struct pdbs_dpm_data *dpm_data = cfg->dpm_data;
 
-    dpm_output_set(cfg->dpm_data, dpm_data->_capability_match, true);
+    dpm_output_set(cfg, dpm_data->_capability_match, true);
+
+    /* Note how long a voltage transition kept the output off */
+    if (dpm_data->_transition_off) {
+        dpm_data->_transition_off = false;
+        dpm_data->transition_off_time =
+            chVTTimeElapsedSinceX(dpm_data->_transition_off_since);
+    }
+
+    /* Note how long a change to the configuration took to negotiate */
+    if (dpm_data->_config_changed) {
+        dpm_data->_config_changed = false;
+        dpm_data->config_apply_time =
+            chVTTimeElapsedSinceX(dpm_data->_config_changed_since);
+        dpm_data->config_apply_time_valid = true;
+    }
+
+    /* Remember how the contract went for next time.  Only a change of PDO
+     * gets written to flash right away, so PPS keep-alive Requests don't
+     * wear it out. */
+    dpm_data->_request_pending = false;
+    dpm_data->_ready_time = chVTGetSystemTime();
+    struct pdbs_charger *ch = dpm_data->_charger;
+    if (ch != NULL) {
+        uint32_t ms = TIME_I2MS(chVTTimeElapsedSinceX(dpm_data->_accept_time));
+        ch->transition_time = (ms < UINT16_MAX) ? ms : UINT16_MAX;
+        if (ch->pdo != dpm_data->_requested_pdo) {
+            ch->pdo = dpm_data->_requested_pdo;
+            pdbs_charger_changed();
+        }
+    }
+
+    /* Log the contract.  The history leaves out renewals of the same one. */
+    pdbs_history_log(PDBS_HISTORY_CONTRACT, dpm_data->_requested_pdo,
+            dpm_data->_requested_voltage, dpm_data->_requested_current);
 }
 
 void pdbs_dpm_transition_typec(struct pdb_config *cfg)
@@ -471,6 +1770,67 @@ void pdbs_dpm_transition_typec(struct pdb_config *cfg)
     }
 
     /* Set the output, only setting the LED status if it wasn't set above */
-    dpm_output_set(cfg->dpm_data, dpm_data->_capability_match,
+    dpm_output_set(cfg, dpm_data->_capability_match,
                    dpm_data->typec_current != fusb_tcc_default);
 }
+
+void pdbs_dpm_config_changed(struct pdb_config *cfg, uint8_t profile,
+        systime_t since)
+{
+    /* Cast the dpm_data to the right type */
+    struct pdbs_dpm_data *dpm_data = cfg->dpm_data;
+
+    /* Nothing to do if the change doesn't touch the configuration in use.
+     * If the selected profile isn't stored, another one stands in for it,
+     * so any change might. */
+    if (profile < PDBS_CONFIG_PROFILES && profile != cfg->state
+            && pdbs_config_flash_read(cfg->state) != NULL) {
+        return;
+    }
+
+    /* Forget the current the governor settled on for the old configuration */
+    dpm_data->governor._current = 0;
+    dpm_data->governor._low = false;
+
+    /* Time how long the new configuration takes to negotiate, if there's a
+     * contract to renegotiate */
+    if (cfg->pe._explicit_contract) {
+        dpm_data->_config_changed_since = since;
+        dpm_data->_config_changed = true;
+    }
+
+    chEvtSignal(cfg->pe.thread, PDB_EVT_PE_NEW_POWER);
+}
+
+uint8_t pdbs_dpm_first_profile(void)
+{
+    uint8_t active = pdbs_config_flash_get_active();
+
+    /* With no profiles stored, start at the active built-in one */
+    if (!dpm_profiles_stored()) {
+        return active % DPM_DEFAULT_PROFILES;
+    }
+
+    /* Start at the active profile, or the next stored one if it's gone */
+    if (pdbs_config_flash_read(active) != NULL) {
+        return active;
+    }
+    return pdbs_dpm_next_profile(active);
+}
+
+uint8_t pdbs_dpm_next_profile(uint8_t profile)
+{
+    /* With no profiles stored, step through the built-in ones */
+    if (!dpm_profiles_stored()) {
+        return (profile + 1) % DPM_DEFAULT_PROFILES;
+    }
+
+    /* Find the next stored profile, wrapping around to the first */
+    for (uint8_t n = 1; n <= PDBS_CONFIG_PROFILES; n++) {
+        uint8_t p = (profile + n) % PDBS_CONFIG_PROFILES;
+        if (pdbs_config_flash_read(p) != NULL) {
+            return p;
+        }
+    }
+    return profile;
+}
@@ -20,9 +20,140 @@
 #define PDBS_DEVICE_POLICY_MANAGER_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include <pdb.h>
 
+#include "softstart.h"
+#include "charger.h"
+
+
+/*
+ * The parts of a Source_Capabilities_Extended message we use
+ */
+struct pdbs_dpm_src_cap_ext {
+    /* USB Vendor ID */
+    uint16_t vid;
+    /* Product ID */
+    uint16_t pid;
+    /* Holdup time, in milliseconds */
+    uint8_t holdup_time;
+    /* Peak Current fields, as sent by the source */
+    uint16_t peak_current[3];
+    /* Source Inputs field */
+    uint8_t source_inputs;
+    /* Number of Batteries/Battery Slots field */
+    uint8_t batteries;
+    /* SPR Source PDP Rating, in watts */
+    uint8_t pdp;
+    /* EPR Source PDP Rating, in watts, or 0 if not given */
+    uint8_t epr_pdp;
+};
+
+/*
+ * The source's most recent PPS_Status
+ */
+struct pdbs_dpm_pps_status {
+    /* Output voltage, in PRV, or PD_PPSSDB_OUTPUT_VOLTAGE_UNSUPPORTED */
+    uint16_t voltage;
+    /* Output current, in PAI, or PD_PPSSDB_OUTPUT_CURRENT_UNSUPPORTED */
+    uint8_t current;
+    /* Real Time Flags field */
+    uint8_t flags;
+    /* When the PPS_Status was received */
+    systime_t time;
+};
+
+/*
+ * Settings and state of the load-following power governor
+ *
+ * The governor requests only as much current as the load draws, plus a
+ * margin, so a multi-port power supply can give the rest to other ports.  It
+ * steps the request up as soon as the draw nears it, and back down once the
+ * draw has stayed well below it for a while.
+ */
+struct pdbs_dpm_governor {
+    /* Whether the governor is running */
+    bool enabled;
+    /* Granularity of the requested current, in centiamperes */
+    uint16_t step;
+    /* Headroom requested above the measured draw, in percent */
+    uint8_t margin;
+    /* Step up when the draw exceeds this share of the request, in percent */
+    uint8_t up_threshold;
+    /* Step down when the draw stays below this share of the request, in
+     * percent */
+    uint8_t down_threshold;
+    /* How long the draw must stay low before stepping down */
+    sysinterval_t hold;
+
+    /* The current being requested, in centiamperes, or 0 if nothing has been
+     * measured yet this session */
+    uint16_t _current;
+    /* Whether the draw is below down_threshold, and since when */
+    bool _low;
+    systime_t _low_since;
+};
+
+/* The thermal governor's level when the output is off */
+#define PDBS_DPM_THERMAL_OFF 4
+/* The share of full power each thermal throttling level below that takes
+ * away, in percent */
+#define PDBS_DPM_THERMAL_LEVEL_PERCENT 25
+
+/*
+ * Settings and state of the thermal governor
+ *
+ * The governor watches the hotter of the MCU's temperature sensor and the
+ * external NTC, if there is one.  From warn, it lowers the power it requests
+ * by a quarter every step degrees, and at critical it turns the output off.
+ * It only raises the power again, one level per check, once the temperature
+ * has fallen hysteresis degrees below the threshold that lowered it.  If the
+ * PHY reports that it overheated, the governor lowers the power as far as it
+ * can without turning the output off (or turns it off if it already had), and
+ * holds it there for at least cooldown.
+ */
+struct pdbs_dpm_thermal {
+    /* Whether the governor is running */
+    bool enabled;
+    /* Temperature at which throttling starts, in degrees Celsius */
+    int8_t warn;
+    /* Temperature rise per throttling level, in degrees Celsius */
+    uint8_t step;
+    /* How far below a level's threshold the temperature must fall to leave
+     * it, in degrees Celsius */
+    uint8_t hysteresis;
+    /* Temperature at which the output is turned off, in degrees Celsius */
+    int8_t critical;
+    /* How long to stay throttled after the PHY overheats */
+    sysinterval_t cooldown;
+
+    /* The throttling level, from 0 (full power) to PDBS_DPM_THERMAL_OFF */
+    uint8_t _level;
+    /* The hottest temperature seen at the last check, in degrees Celsius */
+    int16_t _temperature;
+    /* Whether the PHY overheated within cooldown, and when it did */
+    bool _ovrtemp;
+    systime_t _ovrtemp_time;
+    /* Whether the temperature is being checked */
+    bool _running;
+    /* Timer for checking the temperature */
+    virtual_timer_t _timer;
+};
+
+/*
+ * What to do with the output while the source changes voltage
+ */
+enum pdbs_dpm_transition {
+    /* Always turn it off (Sink Standby) */
+    PDBS_DPM_TRANSITION_BREAK,
+    /* Keep it on if the configured voltage range covers both the old and the
+     * new voltage, with the duty cycle limited to Sink Standby power */
+    PDBS_DPM_TRANSITION_TOLERANT,
+    /* Keep it on if the range covers both voltages and the load is already
+     * drawing no more than Sink Standby power */
+    PDBS_DPM_TRANSITION_STANDBY
+};
 
 struct pdbs_dpm_data {
     /* The most recently received Source_Capabilities message */
@@ -35,6 +166,37 @@ struct pdbs_dpm_data {
     bool led_pd_status;
     /* Whether the device is capable of USB communications */
     bool usb_comms;
+    /* The PDOs of the most recent EPR_Source_Capabilities, or NULL if we're
+     * not in EPR Mode */
+    const uint32_t *epr_capabilities;
+    /* The number of PDOs in epr_capabilities */
+    uint8_t epr_numobj;
+    /* The source's extended capabilities for this session */
+    struct pdbs_dpm_src_cap_ext source_cap_ext;
+    /* Whether or not source_cap_ext holds the source's extended capabilities */
+    bool source_cap_ext_valid;
+    /* The source's most recent PPS_Status for this session */
+    struct pdbs_dpm_pps_status pps_status;
+    /* Whether or not pps_status holds a PPS_Status */
+    bool pps_status_valid;
+    /* The identity to report in response to Discover Identity, or NULL to
+     * not support Structured VDMs */
+    const struct pdb_dpm_identity *identity;
+    /* The load-following power governor */
+    struct pdbs_dpm_governor governor;
+    /* The thermal governor */
+    struct pdbs_dpm_thermal thermal;
+    /* What to do with the output during voltage transitions */
+    enum pdbs_dpm_transition transition;
+    /* How long the output was off during the last voltage transition */
+    sysinterval_t transition_off_time;
+    /* How long the last change to the configuration in use took to be
+     * negotiated, from the command that changed it to the source's PS_RDY */
+    sysinterval_t config_apply_time;
+    /* Whether config_apply_time has been measured */
+    bool config_apply_time_valid;
+    /* How the output ramps up when it turns on */
+    struct pdbs_softstart softstart;
 
     /* Whether or not the power supply is unconstrained */
     bool _unconstrained_power;
@@ -44,6 +206,32 @@ struct pdbs_dpm_data {
     int _present_voltage;
     /* The requested voltage, in millivolts */
     int _requested_voltage;
+    /* The requested operating current, in centiamperes */
+    uint16_t _requested_current;
+    /* The most current the requested PDO offers, in centiamperes */
+    uint16_t _requested_imax;
+    /* Whether the output was turned off for a voltage transition, and when */
+    bool _transition_off;
+    systime_t _transition_off_since;
+    /* Whether a change to the configuration in use is waiting for a PS_RDY,
+     * and when it was asked for */
+    bool _config_changed;
+    systime_t _config_changed_since;
+    /* The Request Data Object of the last Request we made */
+    uint32_t _requested_rdo;
+    /* What the charger database knows about the source, or NULL if we
+     * haven't identified it */
+    struct pdbs_charger *_charger;
+    /* Object position of the PDO we last requested */
+    uint8_t _requested_pdo;
+    /* Whether a Request is waiting for the source's PS_RDY */
+    bool _request_pending;
+    /* When the source accepted the last Request, and when it said the new
+     * contract was ready */
+    systime_t _accept_time;
+    systime_t _ready_time;
+    /* Whether the last Hard Reset has been logged in the history */
+    bool _hard_reset_logged;
 };
 
 /*
@@ -56,6 +244,64 @@ struct pdbs_dpm_data {
 bool pdbs_dpm_evaluate_capability(struct pdb_config *cfg,
         const union pd_msg *capabilities, union pd_msg *request);
 
+/*
+ * Return our Operational PDP in watts if we're configured for a voltage that
+ * needs EPR Mode, or 0 otherwise.
+ */
+uint8_t pdbs_dpm_epr_mode_pdp(struct pdb_config *cfg);
+
+/*
+ * Create an EPR_Request message based on the given EPR_Source_Capabilities
+ * PDOs.  The PDOs must remain valid until the next call.
+ *
+ * Returns true if sufficient power is available, false otherwise.
+ */
+bool pdbs_dpm_evaluate_epr_capability(struct pdb_config *cfg,
+        const uint32_t *pdos, uint8_t numobj, union pd_msg *request);
+
+/*
+ * Store the extended capabilities from the given Source_Capabilities_Extended
+ * message.
+ */
+void pdbs_dpm_source_capabilities_extended(struct pdb_config *cfg,
+        const union pd_msg *msg);
+
+/*
+ * Store the status from the given PPS_Status message.
+ */
+void pdbs_dpm_pps_status(struct pdb_config *cfg, const union pd_msg *msg);
+
+/*
+ * Report the load's present draw, in centiamperes, to the power governor.
+ *
+ * The DPM measures the draw itself with the output current sense, once a
+ * second, and the source measures it in PPS_Status messages when it can.
+ * Anything else able to measure it may call this too.
+ */
+void pdbs_dpm_load_current(struct pdb_config *cfg, uint16_t current);
+
+/*
+ * Throttle the sink after the PHY overheated.
+ *
+ * Returns true if the thermal governor is running, false otherwise.
+ */
+bool pdbs_dpm_overtemp(struct pdb_config *cfg);
+
+/*
+ * Note that a Soft Reset was sent or received
+ */
+void pdbs_dpm_soft_reset(struct pdb_config *cfg);
+
+/*
+ * Note that the source answered our Request with Reject or Wait
+ */
+void pdbs_dpm_request_rejected(struct pdb_config *cfg);
+
+/*
+ * Return the identity to report in response to Discover Identity.
+ */
+const struct pdb_dpm_identity *pdbs_dpm_get_identity(struct pdb_config *cfg);
+
 /*
  * Create a Sink_Capabilities message for our current capabilities.
  */
@@ -104,5 +350,27 @@ void pdbs_dpm_transition_requested(struct pdb_config *cfg);
  */
 void pdbs_dpm_transition_typec(struct pdb_config *cfg);
 
+/*
+ * Tell the DPM that the stored configuration of the given profile changed, or
+ * of every profile if profile is PDBS_CONFIG_PROFILES.  since is when the
+ * change was asked for.  If that's the configuration in use, the DPM forgets
+ * what it worked out for the old one and negotiates the new one right away.
+ */
+void pdbs_dpm_config_changed(struct pdb_config *cfg, uint8_t profile,
+        systime_t since);
+
+/*
+ * Return the index of the profile to start with: the active one if it's
+ * stored, otherwise the next one stored.  If none are stored, the active
+ * built-in one.
+ */
+uint8_t pdbs_dpm_first_profile(void);
+
+/*
+ * Return the index of the profile after the given one, wrapping around after
+ * the last.  Only stored profiles are considered, unless none are stored.
+ */
+uint8_t pdbs_dpm_next_profile(uint8_t profile);
+
 
 #endif /* PDBS_DEVICE_POLICY_MANAGER_H */
@@ -0,0 +1,237 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "flash.h"
+
+#include <string.h>
+
+#include <hal.h>
+
+
+/* How long the Policy Engine must have been idle before a page is erased */
+#define FLASH_ERASE_QUIET TIME_MS2I(100)
+/* How long to wait for the Policy Engine to be idle before erasing anyway */
+#define FLASH_ERASE_WAIT_MAX TIME_S2I(10)
+/* How often to check whether the Policy Engine is idle */
+#define FLASH_ERASE_POLL TIME_MS2I(10)
+
+/* SysTick ticks per microsecond */
+#define FLASH_TICKS_PER_US (STM32_HCLK / 1000000)
+
+
+/* The PD Buddy configuration whose Policy Engine erasures wait on */
+static struct pdb_config *flash_pdb;
+/* Lets one thread at a time write to flash */
+static mutex_t flash_mtx;
+
+/* Timing of flash writes, only written with the system locked */
+static struct pdbs_flash_stats flash_stats;
+
+
+/*
+ * Return how long it's been since the given SysTick count, in microseconds.
+ * SysTick counts down, wrapping around every 2^24 ticks.
+ */
+static uint32_t flash_us_since(uint32_t start)
+{
+    return ((start - SysTick->VAL) & SysTick_LOAD_RELOAD_Msk)
+        / FLASH_TICKS_PER_US;
+}
+
+void pdbs_flash_init(struct pdb_config *cfg)
+{
+    flash_pdb = cfg;
+    chMtxObjectInit(&flash_mtx);
+
+    /* Let SysTick run free at the core clock, to time how long flash writes
+     * keep the system locked */
+    SysTick->LOAD = SysTick_LOAD_RELOAD_Msk;
+    SysTick->VAL = 0;
+    SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+}
+
+void pdbs_flash_acquire(void)
+{
+    chMtxLock(&flash_mtx);
+
+    /* Wait till no operation is on going */
+    while ((FLASH->SR & FLASH_SR_BSY) != 0) {
+        /* Note: we might want a timeout here */
+    }
+
+    /* Check that the Flash is locked */
+    if ((FLASH->CR & FLASH_CR_LOCK) != 0) {
+        /* Perform unlock sequence */
+        FLASH->KEYR = FLASH_KEY1;
+        FLASH->KEYR = FLASH_KEY2;
+    }
+}
+
+void pdbs_flash_release(void)
+{
+    /* Wait till no operation is on going */
+    while ((FLASH->SR & FLASH_SR_BSY) != 0) {
+        /* Note: we might want a timeout here */
+    }
+
+    /* Check that the Flash is unlocked */
+    if ((FLASH->CR & FLASH_CR_LOCK) == 0) {
+        /* Lock the flash */
+        FLASH->CR |= FLASH_CR_LOCK;
+    }
+
+    chMtxUnlock(&flash_mtx);
+}
+
+void pdbs_flash_write_halfword(uint16_t *addr, uint16_t data)
+{
+    chSysLock();
+    uint32_t start = SysTick->VAL;
+
+    /* Set the PG bit in the FLASH_CR register to enable programming */
+    FLASH->CR |= FLASH_CR_PG;
+    /* Perform the data write (half-word) at the desired address */
+    *(__IO uint16_t*)(addr) = data;
+    /* Wait until the BSY bit is reset in the FLASH_SR register */
+    while ((FLASH->SR & FLASH_SR_BSY) != 0) {
+        /* For robust implementation, add here time-out management */
+    }
+    /* Check the EOP flag in the FLASH_SR register */
+    if ((FLASH->SR & FLASH_SR_EOP) != 0) {
+        /* clear it by software by writing it at 1 */
+        FLASH->SR = FLASH_SR_EOP;
+    } else {
+        /* Manage the error cases */
+    }
+    /* Reset the PG Bit to disable programming */
+    FLASH->CR &= ~FLASH_CR_PG;
+
+    uint32_t us = flash_us_since(start);
+    flash_stats.programs++;
+    if (us > flash_stats.program_max) {
+        flash_stats.program_max = us;
+    }
+    chSysUnlock();
+}
+
+void pdbs_flash_write(void *addr, const void *data, size_t len)
+{
+    uint16_t *d = addr;
+    const uint16_t *s = data;
+
+    for (size_t i = 0; i < len / 2; i++) {
+        pdbs_flash_write_halfword(&d[i], s[i]);
+    }
+}
+
+/*
+ * Erase the given flash page, with the system locked
+ */
+static void flash_erase(void *page)
+{
+    chSysLock();
+    uint32_t start = SysTick->VAL;
+
+    /* Set the PER bit in the FLASH_CR register to enable page erasing */
+    FLASH->CR |= FLASH_CR_PER;
+    /* Program the FLASH_AR register to select a page to erase */
+    FLASH->AR = (int) page;
+    /* Set the STRT bit in the FLASH_CR register to start the erasing */
+    FLASH->CR |= FLASH_CR_STRT;
+    /* Wait till no operation is on going */
+    while ((FLASH->SR & FLASH_SR_BSY) != 0) {
+        /* Note: we might want a timeout here */
+    }
+    /* Check the EOP flag in the FLASH_SR register */
+    if ((FLASH->SR & FLASH_SR_EOP) != 0) {
+        /* Clear EOP flag by software by writing EOP at 1 */
+        FLASH->SR = FLASH_SR_EOP;
+    } else {
+        /* Manage the error cases */
+    }
+    /* Reset the PER Bit to disable the page erase */
+    FLASH->CR &= ~FLASH_CR_PER;
+
+    uint32_t us = flash_us_since(start);
+    flash_stats.erases++;
+    if (us > flash_stats.erase_max) {
+        flash_stats.erase_max = us;
+    }
+    chSysUnlock();
+}
+
+void pdbs_flash_erase(void *page)
+{
+    if (pdbs_flash_blank(page, PDBS_FLASH_PAGE_SIZE)) {
+        return;
+    }
+
+    systime_t start = chVTGetSystemTime();
+    while (!pdb_pe_idle(flash_pdb, FLASH_ERASE_QUIET)
+            && chVTTimeElapsedSinceX(start) < FLASH_ERASE_WAIT_MAX) {
+        chThdSleep(FLASH_ERASE_POLL);
+    }
+    uint32_t ms = TIME_I2MS(chVTTimeElapsedSinceX(start));
+
+    chSysLock();
+    if (ms > flash_stats.erase_wait_max) {
+        flash_stats.erase_wait_max = ms;
+    }
+    chSysUnlock();
+
+    flash_erase(page);
+}
+
+bool pdbs_flash_blank(const void *addr, size_t len)
+{
+    const uint32_t *words = addr;
+
+    for (size_t i = 0; i < len / sizeof(uint32_t); i++) {
+        if (words[i] != 0xFFFFFFFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint16_t pdbs_flash_crc(const void *data, size_t len, uint16_t crc)
+{
+    const uint8_t *bytes = data;
+
+    for (size_t i = 0; i < len; i++) {
+        crc ^= bytes[i] << 8;
+        for (int b = 0; b < 8; b++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+void pdbs_flash_stats_get(struct pdbs_flash_stats *stats)
+{
+    chSysLock();
+    *stats = flash_stats;
+    chSysUnlock();
+}
+
+void pdbs_flash_stats_reset(void)
+{
+    chSysLock();
+    memset(&flash_stats, 0, sizeof(flash_stats));
+    chSysUnlock();
+}
@@ -0,0 +1,115 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PDBS_FLASH_H
+#define PDBS_FLASH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <ch.h>
+
+#include <pdb.h>
+
+
+/* Size of a flash page */
+#define PDBS_FLASH_PAGE_SIZE 2048
+
+
+/*
+ * Timing of flash writes
+ */
+struct pdbs_flash_stats {
+    /* Halfwords programmed, and the longest the system was locked for one, in
+     * microseconds */
+    uint32_t programs;
+    uint16_t program_max;
+    /* Pages erased, and the longest an erasure took, in microseconds.
+     * Nothing else runs during an erasure. */
+    uint32_t erases;
+    uint16_t erase_max;
+    /* The longest an erasure waited for the Policy Engine to be idle, in
+     * milliseconds */
+    uint16_t erase_wait_max;
+};
+
+
+/*
+ * Get ready to write to flash.  Page erasures wait for the given
+ * configuration's Policy Engine to be idle.  Must be called once at startup,
+ * before any of the other pdbs_flash_* functions.
+ */
+void pdbs_flash_init(struct pdb_config *cfg);
+
+/*
+ * Take exclusive use of the flash interface and unlock it for writing
+ */
+void pdbs_flash_acquire(void);
+
+/*
+ * Lock the flash interface and give up exclusive use of it
+ */
+void pdbs_flash_release(void);
+
+/*
+ * Write one halfword to erased flash, with the system locked for just that
+ * long.  The flash interface must be acquired.
+ */
+void pdbs_flash_write_halfword(uint16_t *addr, uint16_t data);
+
+/*
+ * Write len bytes (a multiple of two) to erased flash, one halfword at a
+ * time.  The flash interface must be acquired.
+ */
+void pdbs_flash_write(void *addr, const void *data, size_t len);
+
+/*
+ * Erase the given flash page if it isn't already.  The flash interface must be
+ * acquired.
+ *
+ * The CPU can't fetch instructions from flash while a page is being erased,
+ * so nothing at all runs for the tens of milliseconds that takes.  The
+ * erasure waits for the Policy Engine to be idle so it doesn't miss a PD
+ * deadline, but not forever.  It must not be called from the PD threads.
+ */
+void pdbs_flash_erase(void *page);
+
+/*
+ * Return whether the given words of flash are all erased
+ */
+bool pdbs_flash_blank(const void *addr, size_t len);
+
+/*
+ * Compute the CRC-16/CCITT of len bytes at data, continuing from crc.  Start
+ * from 0xFFFF.
+ */
+uint16_t pdbs_flash_crc(const void *data, size_t len, uint16_t crc);
+
+/*
+ * Get the timing of flash writes.
+ */
+void pdbs_flash_stats_get(struct pdbs_flash_stats *stats);
+
+/*
+ * Reset the timing of flash writes.
+ */
+void pdbs_flash_stats_reset(void);
+
+
+#endif /* PDBS_FLASH_H */
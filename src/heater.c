@@ -0,0 +1,232 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "heater.h"
+
+#include <hal.h>
+
+#include "softstart.h"
+#include "telemetry.h"
+
+
+/* Control periods per second */
+#define HEATER_PERIODS_PER_S (1000000 / (PDBS_HEATER_TICK_US * PDBS_HEATER_PERIOD))
+
+/* The cold junction temperature to assume if the MCU's hasn't been measured,
+ * in tenths of a degree Celsius */
+#define HEATER_DEFAULT_COLD_JUNCTION 250
+
+
+struct pdbs_heater pdbs_heater = {
+    .enabled = false,
+    .setpoint = 320,
+    .max_temp = 450,
+    .max_duty = 90,
+    .kp = 50,
+    .ki = 5,
+    .kd = 100
+};
+
+/* Timing statistics, only written by the timer interrupt or with the system
+ * locked */
+static struct pdbs_heater_stats heater_stats = {
+    .latency_min = UINT16_MAX
+};
+
+/* The timer interrupt's position in the control period */
+static uint8_t heater_tick;
+/* The number of ticks the heater is on for this period */
+static uint8_t heater_on_ticks;
+/* Whether the controller was running in the previous period */
+static bool heater_active;
+/* Time spent in the interrupt handler so far this period, in microseconds */
+static uint32_t heater_busy;
+
+
+/*
+ * Return the tip temperature, in tenths of a degree Celsius.  Only valid
+ * while the heater is off.
+ */
+static int16_t heater_tip_temperature(void)
+{
+    /* The thermocouple measures the tip relative to its cold junction, which
+     * is about as warm as the MCU */
+    int32_t cold = HEATER_DEFAULT_COLD_JUNCTION;
+    struct pdbs_telemetry t;
+    if (pdbs_telemetry_get(&t, 0)) {
+        cold = t.temperature * 10;
+    }
+
+    int32_t temp = cold + pdbs_telemetry_tip_uv() * 10
+        / (PDBS_HEATER_TIP_GAIN * PDBS_HEATER_TIP_UV_PER_C);
+    return (temp > INT16_MAX) ? INT16_MAX : temp;
+}
+
+/*
+ * Run one step of the PID controller for the given tip temperature (in tenths
+ * of a degree Celsius).
+ *
+ * Returns the duty cycle for the next period, in tenths of a percent.
+ */
+static uint16_t heater_control(struct pdbs_heater *h, int16_t temp)
+{
+    int32_t max = h->max_duty * 10;
+
+    /* Differentiate the measurement rather than the error, so setpoint
+     * changes don't kick the output */
+    int32_t rate = h->_primed ? temp - h->_last : 0;
+    h->_last = temp;
+    h->_primed = true;
+
+    /* Never heat past the limit */
+    if (temp >= h->max_temp * 10) {
+        return 0;
+    }
+
+    int32_t error = h->setpoint * 10 - temp;
+
+    /* Integrate, clamping the sum so the integral term alone stays within
+     * the duty cycle limits */
+    h->_integral += error;
+    if (h->_integral < 0) {
+        h->_integral = 0;
+    } else if (h->ki > 0
+            && h->_integral > max * 10 * HEATER_PERIODS_PER_S / h->ki) {
+        h->_integral = max * 10 * HEATER_PERIODS_PER_S / h->ki;
+    }
+
+    int32_t duty = h->kp * error / 10
+        + h->ki * h->_integral / (10 * HEATER_PERIODS_PER_S)
+        - h->kd * rate * HEATER_PERIODS_PER_S / 10;
+
+    if (duty < 0) {
+        return 0;
+    }
+    return (duty > max) ? max : duty;
+}
+
+/*
+ * Timer callback, run every tick.  At the start of each period, the heater
+ * has been off for the whole off window, so the tip is read and the duty
+ * cycle for the period is worked out.  Later in the period, the heater is
+ * turned off when its time is up.
+ */
+static void heater_gpt_cb(GPTDriver *gptp)
+{
+    /* The counter started from zero at the timer event */
+    uint16_t entry = gptGetCounterX(gptp);
+    struct pdbs_heater *h = &pdbs_heater;
+    bool control = (heater_tick == 0);
+
+    if (control) {
+        h->_temperature = heater_tip_temperature();
+        if (!h->enabled) {
+            /* Leave the output on */
+            heater_active = false;
+            h->_duty = 0;
+            heater_on_ticks = 0;
+        } else if (!heater_active) {
+            /* The heater may have been on until now, so start over with a
+             * period off to get a good reading */
+            heater_active = true;
+            h->_integral = 0;
+            h->_primed = false;
+            h->_duty = 0;
+            heater_on_ticks = 0;
+        } else {
+            h->_duty = heater_control(h, h->_temperature);
+            heater_on_ticks = (uint32_t) h->_duty * PDBS_HEATER_PERIOD / 1000;
+            if (heater_on_ticks > PDBS_HEATER_PERIOD - PDBS_HEATER_OFF_WINDOW) {
+                heater_on_ticks = PDBS_HEATER_PERIOD - PDBS_HEATER_OFF_WINDOW;
+            }
+        }
+
+        chSysLockFromISR();
+        pdbs_softstart_gateI(!heater_active || heater_on_ticks > 0);
+        chSysUnlockFromISR();
+    } else if (heater_active && heater_tick == heater_on_ticks) {
+        chSysLockFromISR();
+        pdbs_softstart_gateI(false);
+        chSysUnlockFromISR();
+    }
+
+    if (++heater_tick >= PDBS_HEATER_PERIOD) {
+        heater_tick = 0;
+    }
+
+    /* Account for our own timing */
+    uint16_t elapsed = gptGetCounterX(gptp) - entry;
+    heater_busy += elapsed;
+    if (entry < heater_stats.latency_min) {
+        heater_stats.latency_min = entry;
+    }
+    if (entry > heater_stats.latency_max) {
+        heater_stats.latency_max = entry;
+    }
+    if (control && elapsed > heater_stats.control_max) {
+        heater_stats.control_max = elapsed;
+    }
+    if (heater_tick == 0) {
+        heater_stats.load = heater_busy * 1000
+            / (PDBS_HEATER_TICK_US * PDBS_HEATER_PERIOD);
+        heater_stats.periods++;
+        heater_busy = 0;
+    }
+}
+
+/*
+ * Control loop timer configuration, counting microseconds
+ */
+static const GPTConfig heater_gptcfg = {
+    1000000,
+    heater_gpt_cb,
+    0,
+    0
+};
+
+void pdbs_heater_step_setpoint(void)
+{
+    int16_t setpoint = pdbs_heater.setpoint + PDBS_HEATER_SETPOINT_STEP;
+    if (setpoint > pdbs_heater.max_temp) {
+        setpoint = PDBS_HEATER_SETPOINT_MIN;
+    }
+    pdbs_heater.setpoint = setpoint;
+}
+
+void pdbs_heater_stats_get(struct pdbs_heater_stats *stats)
+{
+    chSysLock();
+    *stats = heater_stats;
+    chSysUnlock();
+}
+
+void pdbs_heater_stats_reset(void)
+{
+    chSysLock();
+    heater_stats.periods = 0;
+    heater_stats.latency_min = UINT16_MAX;
+    heater_stats.latency_max = 0;
+    heater_stats.control_max = 0;
+    chSysUnlock();
+}
+
+void pdbs_heater_run(void)
+{
+    gptStart(&GPTD14, &heater_gptcfg);
+    gptStartContinuous(&GPTD14, PDBS_HEATER_TICK_US);
+}
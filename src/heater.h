@@ -0,0 +1,131 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PDBS_HEATER_H
+#define PDBS_HEATER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <ch.h>
+
+
+/* Tip thermocouple amplifier gain.  This depends on the board, so it may be
+ * overridden in the Makefile. */
+#ifndef PDBS_HEATER_TIP_GAIN
+#define PDBS_HEATER_TIP_GAIN 221
+#endif
+/* Thermocouple sensitivity, in microvolts per degree Celsius.  This depends on
+ * the iron, so it may be overridden in the Makefile. */
+#ifndef PDBS_HEATER_TIP_UV_PER_C
+#define PDBS_HEATER_TIP_UV_PER_C 41
+#endif
+
+/* Control loop timing.  The timer interrupt runs every millisecond, each
+ * control period lasts PDBS_HEATER_PERIOD interrupts, and the heater is held
+ * off for at least the last PDBS_HEATER_OFF_WINDOW of them so the
+ * thermocouple amplifier can settle before the tip is read. */
+#define PDBS_HEATER_TICK_US 1000
+#define PDBS_HEATER_PERIOD 100
+#define PDBS_HEATER_OFF_WINDOW 10
+
+/* How far the button raises the setpoint, and what it wraps around to past
+ * max_temp, in degrees Celsius */
+#define PDBS_HEATER_SETPOINT_STEP 10
+#define PDBS_HEATER_SETPOINT_MIN 150
+
+
+/*
+ * Settings and state of the heater controller
+ *
+ * The controller is a PID loop on the soldering iron's tip temperature,
+ * gating the output switch once per control period.  All gains are in tenths
+ * of a percent of duty cycle.
+ */
+struct pdbs_heater {
+    /* Whether the controller is running.  If not, the output stays on. */
+    bool enabled;
+    /* Tip temperature to hold, in degrees Celsius */
+    int16_t setpoint;
+    /* Tip temperature above which the heater is always off, in degrees
+     * Celsius */
+    int16_t max_temp;
+    /* Largest duty cycle, in percent.  The off window limits it to 90. */
+    uint8_t max_duty;
+    /* Proportional gain, per degree Celsius of error */
+    uint16_t kp;
+    /* Integral gain, per degree Celsius second of error */
+    uint16_t ki;
+    /* Derivative gain, per degree Celsius per second the tip heats up */
+    uint16_t kd;
+
+    /* The newest tip temperature, in tenths of a degree Celsius */
+    int16_t _temperature;
+    /* The duty cycle for this period, in tenths of a percent */
+    uint16_t _duty;
+    /* Sum of the errors of every period, in tenths of a degree Celsius */
+    int32_t _integral;
+    /* The tip temperature of the previous period, in tenths of a degree
+     * Celsius, and whether there was one */
+    int16_t _last;
+    bool _primed;
+};
+
+/*
+ * Timing of the heater control loop, as measured by its own timer
+ */
+struct pdbs_heater_stats {
+    /* Control periods since the statistics were reset */
+    uint32_t periods;
+    /* Shortest and longest time from the timer event to the interrupt
+     * handler, in microseconds.  The difference is the control jitter. */
+    uint16_t latency_min;
+    uint16_t latency_max;
+    /* Longest run time of the control step, in microseconds */
+    uint16_t control_max;
+    /* Time spent in the loop's interrupt handler during the last period, in
+     * tenths of a percent of the CPU */
+    uint16_t load;
+};
+
+/* The heater controller */
+extern struct pdbs_heater pdbs_heater;
+
+/*
+ * Raise the setpoint by PDBS_HEATER_SETPOINT_STEP, wrapping around to
+ * PDBS_HEATER_SETPOINT_MIN after max_temp.
+ */
+void pdbs_heater_step_setpoint(void);
+
+/*
+ * Get the timing statistics of the control loop.
+ */
+void pdbs_heater_stats_get(struct pdbs_heater_stats *stats);
+
+/*
+ * Reset the timing statistics of the control loop.
+ */
+void pdbs_heater_stats_reset(void);
+
+/*
+ * Start the control loop timer
+ */
+void pdbs_heater_run(void);
+
+
+#endif /* PDBS_HEATER_H */
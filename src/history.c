@@ -0,0 +1,855 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "history.h"
+
+#include <string.h>
+
+#include <ch.h>
+
+#include "flash.h"
+#include "priorities.h"
+#include "telemetry.h"
+
+
+/*
+ * Record format
+ *
+ * Every record starts with a tag byte: the record type in bits 7-5, and the
+ * seconds since the record before it in bits 4-0.  If that's
+ * HISTORY_DT_LONG or more, bits 4-0 hold HISTORY_DT_LONG and the whole time
+ * follows as a varint.  Numbers after that are unsigned LEB128 varints, with
+ * differences zigzag encoded first.
+ *
+ *  - SYNC: boot, time, contract PDO, contract V, contract I
+ *  - CONTRACT: PDO, change of V, change of I, from the last contract
+ *  - POWER: change of V, change of I, from the last sample
+ *  - POWER_SAME, HARD_RESET, SOFT_RESET, DETACH: nothing
+ *
+ * A SYNC sets the last sample to the contract's voltage at no current.
+ * Every record ends with a tag or with the last byte of a varint, neither of
+ * which can be 0xFF, so the end of the log is the last halfword in a page
+ * that isn't erased.
+ */
+#define HISTORY_TAG_SYNC 0
+#define HISTORY_TAG_CONTRACT 1
+#define HISTORY_TAG_HARD_RESET 2
+#define HISTORY_TAG_SOFT_RESET 3
+#define HISTORY_TAG_POWER 4
+#define HISTORY_TAG_POWER_SAME 5
+#define HISTORY_TAG_DETACH 6
+#define HISTORY_TAG_RESERVED 7
+
+#define HISTORY_TAG_SHIFT 5
+#define HISTORY_DT_LONG 0x1F
+
+/* Padding, making writes whole halfwords, and erased flash */
+#define HISTORY_PAD 0xE0
+#define HISTORY_END 0xFF
+
+/* The longest varint for a 32-bit number */
+#define HISTORY_VARINT_MAX 5
+
+/* Page header magic number, "HIST" */
+#define HISTORY_MAGIC 0x48495354
+
+/* Events for the history thread */
+#define HISTORY_EVT_LOGGED EVENT_MASK(0)
+#define HISTORY_EVT_CLEAR EVENT_MASK(1)
+
+/* How long to wait after an event for the ones that come with it, so they're
+ * written together */
+#define HISTORY_SETTLE TIME_MS2I(200)
+
+
+/*
+ * Header at the start of every page of the log.  The CRC is written last, so a
+ * page only counts once its header has been written.
+ */
+struct history_header {
+    uint32_t magic;
+    /* Sequence number, one more than that of the page before it */
+    uint32_t seq;
+    /* CRC of everything above */
+    uint16_t crc;
+    /* Left erased */
+    uint16_t _reserved;
+};
+
+#define HISTORY_DATA_START sizeof(struct history_header)
+
+/*
+ * A queued event
+ */
+struct history_entry {
+    /* When the event happened */
+    systime_t time;
+    uint16_t v;
+    uint16_t i;
+    uint8_t type;
+    uint8_t pdo;
+};
+
+
+/* Events waiting for the history thread */
+static struct history_entry history_queue[PDBS_HISTORY_QUEUE_LEN];
+static uint8_t history_queue_head;
+static uint8_t history_queue_count;
+/* The last contract queued since the last reset or detach, or pdo 0 if there
+ * hasn't been one */
+static struct history_entry history_contract;
+
+/* Whether the page in use has a header, which page it is, and its sequence
+ * number */
+static bool history_open;
+static uint8_t history_page;
+static uint32_t history_seq;
+/* Where the next write goes in the page in use */
+static uint16_t history_offset;
+/* A page to erase once the history thread is done writing, if any */
+static bool history_erase_pending;
+static uint8_t history_erase_page;
+
+/* State of the encoder, as of the last record written to the batch */
+static struct pdbs_history_coder history_coder;
+/* Records waiting to be written to flash together */
+static uint8_t history_batch[64];
+static uint8_t history_batch_len;
+
+/* Seconds since startup, and ticks past that */
+static uint32_t history_now;
+static sysinterval_t history_ticks;
+/* When the output was last logged */
+static uint32_t history_power_time;
+
+/* How the log has been used since startup */
+static struct pdbs_history_stats history_stats;
+
+/* The history thread */
+static thread_t *history_thread;
+
+
+/*
+ * Append a varint to buf at pos, returning the new position
+ */
+static size_t history_put_varint(uint8_t *buf, size_t pos, uint32_t value)
+{
+    while (value >= 0x80) {
+        buf[pos++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    buf[pos++] = value;
+    return pos;
+}
+
+/*
+ * Read a varint from the len bytes at buf, starting at pos.  Returns the new
+ * position, or 0 if there isn't a valid varint there.
+ */
+static size_t history_get_varint(const uint8_t *buf, size_t len, size_t pos,
+        uint32_t *value)
+{
+    *value = 0;
+    for (int i = 0; i < HISTORY_VARINT_MAX && pos < len; i++) {
+        uint8_t byte = buf[pos++];
+        *value |= (uint32_t) (byte & 0x7F) << (7 * i);
+        if (!(byte & 0x80)) {
+            return pos;
+        }
+    }
+    return 0;
+}
+
+static uint32_t history_zigzag(int32_t value)
+{
+    return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+}
+
+static int32_t history_unzigzag(uint32_t value)
+{
+    return (int32_t) (value >> 1) ^ -(int32_t) (value & 1);
+}
+
+size_t pdbs_history_encode(struct pdbs_history_coder *st,
+        const struct pdbs_history_event *ev, uint8_t *buf)
+{
+    uint8_t tag;
+    switch (ev->type) {
+        case PDBS_HISTORY_SYNC:
+            tag = HISTORY_TAG_SYNC;
+            break;
+        case PDBS_HISTORY_CONTRACT:
+            tag = HISTORY_TAG_CONTRACT;
+            break;
+        case PDBS_HISTORY_HARD_RESET:
+            tag = HISTORY_TAG_HARD_RESET;
+            break;
+        case PDBS_HISTORY_SOFT_RESET:
+            tag = HISTORY_TAG_SOFT_RESET;
+            break;
+        case PDBS_HISTORY_POWER:
+            tag = (ev->v == st->power_v && ev->i == st->power_i)
+                ? HISTORY_TAG_POWER_SAME : HISTORY_TAG_POWER;
+            break;
+        case PDBS_HISTORY_DETACH:
+        default:
+            tag = HISTORY_TAG_DETACH;
+            break;
+    }
+
+    size_t pos = 1;
+    if (tag == HISTORY_TAG_SYNC) {
+        buf[0] = tag << HISTORY_TAG_SHIFT;
+        pos = history_put_varint(buf, pos, ev->boot);
+        pos = history_put_varint(buf, pos, ev->time);
+        pos = history_put_varint(buf, pos, ev->pdo);
+        pos = history_put_varint(buf, pos, ev->v);
+        pos = history_put_varint(buf, pos, ev->i);
+        st->time = ev->time;
+        st->boot = ev->boot;
+        st->contract_pdo = ev->pdo;
+        st->contract_v = ev->v;
+        st->contract_i = ev->i;
+        st->power_v = ev->v;
+        st->power_i = 0;
+        return pos;
+    }
+
+    /* Time only moves forwards */
+    uint32_t dt = (ev->time > st->time) ? ev->time - st->time : 0;
+    st->time += dt;
+    if (dt < HISTORY_DT_LONG) {
+        buf[0] = (tag << HISTORY_TAG_SHIFT) | dt;
+    } else {
+        buf[0] = (tag << HISTORY_TAG_SHIFT) | HISTORY_DT_LONG;
+        pos = history_put_varint(buf, pos, dt);
+    }
+
+    if (tag == HISTORY_TAG_CONTRACT) {
+        pos = history_put_varint(buf, pos, ev->pdo);
+        pos = history_put_varint(buf, pos,
+                history_zigzag((int32_t) ev->v - st->contract_v));
+        pos = history_put_varint(buf, pos,
+                history_zigzag((int32_t) ev->i - st->contract_i));
+        st->contract_pdo = ev->pdo;
+        st->contract_v = ev->v;
+        st->contract_i = ev->i;
+    } else if (tag == HISTORY_TAG_POWER) {
+        pos = history_put_varint(buf, pos,
+                history_zigzag((int32_t) ev->v - st->power_v));
+        pos = history_put_varint(buf, pos,
+                history_zigzag((int32_t) ev->i - st->power_i));
+        st->power_v = ev->v;
+        st->power_i = ev->i;
+    }
+
+    return pos;
+}
+
+/*
+ * Apply a difference to a 16-bit value, returning false if the result is out
+ * of range
+ */
+static bool history_apply(uint16_t *value, uint32_t zigzag)
+{
+    int32_t result = *value + history_unzigzag(zigzag);
+    if (result < 0 || result > UINT16_MAX) {
+        return false;
+    }
+    *value = result;
+    return true;
+}
+
+size_t pdbs_history_decode(struct pdbs_history_coder *st, const uint8_t *buf,
+        size_t len, struct pdbs_history_event *ev)
+{
+    size_t pos = 0;
+
+    /* Skip padding */
+    while (pos < len && buf[pos] == HISTORY_PAD) {
+        pos++;
+    }
+    if (pos >= len) {
+        return 0;
+    }
+
+    uint8_t tag = buf[pos] >> HISTORY_TAG_SHIFT;
+    uint32_t dt = buf[pos] & HISTORY_DT_LONG;
+    pos++;
+    if (tag == HISTORY_TAG_RESERVED) {
+        return 0;
+    }
+
+    /* Only change the state if the whole record is valid */
+    struct pdbs_history_coder next = *st;
+    uint32_t a, b, c;
+
+    if (tag == HISTORY_TAG_SYNC) {
+        uint32_t boot, time;
+        if ((pos = history_get_varint(buf, len, pos, &boot)) == 0
+                || (pos = history_get_varint(buf, len, pos, &time)) == 0
+                || (pos = history_get_varint(buf, len, pos, &a)) == 0
+                || (pos = history_get_varint(buf, len, pos, &b)) == 0
+                || (pos = history_get_varint(buf, len, pos, &c)) == 0
+                || boot > UINT16_MAX || a > UINT8_MAX || b > UINT16_MAX
+                || c > UINT16_MAX) {
+            return 0;
+        }
+        next.time = time;
+        next.boot = boot;
+        next.contract_pdo = a;
+        next.contract_v = b;
+        next.contract_i = c;
+        next.power_v = b;
+        next.power_i = 0;
+        ev->type = PDBS_HISTORY_SYNC;
+    } else {
+        if (dt == HISTORY_DT_LONG
+                && (pos = history_get_varint(buf, len, pos, &dt)) == 0) {
+            return 0;
+        }
+        next.time += dt;
+
+        switch (tag) {
+            case HISTORY_TAG_CONTRACT:
+                if ((pos = history_get_varint(buf, len, pos, &a)) == 0
+                        || (pos = history_get_varint(buf, len, pos, &b)) == 0
+                        || (pos = history_get_varint(buf, len, pos, &c)) == 0
+                        || a > UINT8_MAX
+                        || !history_apply(&next.contract_v, b)
+                        || !history_apply(&next.contract_i, c)) {
+                    return 0;
+                }
+                next.contract_pdo = a;
+                ev->type = PDBS_HISTORY_CONTRACT;
+                break;
+            case HISTORY_TAG_POWER:
+                if ((pos = history_get_varint(buf, len, pos, &a)) == 0
+                        || (pos = history_get_varint(buf, len, pos, &b)) == 0
+                        || !history_apply(&next.power_v, a)
+                        || !history_apply(&next.power_i, b)) {
+                    return 0;
+                }
+                ev->type = PDBS_HISTORY_POWER;
+                break;
+            case HISTORY_TAG_POWER_SAME:
+                ev->type = PDBS_HISTORY_POWER;
+                break;
+            case HISTORY_TAG_HARD_RESET:
+                ev->type = PDBS_HISTORY_HARD_RESET;
+                break;
+            case HISTORY_TAG_SOFT_RESET:
+                ev->type = PDBS_HISTORY_SOFT_RESET;
+                break;
+            case HISTORY_TAG_DETACH:
+            default:
+                ev->type = PDBS_HISTORY_DETACH;
+                break;
+        }
+    }
+
+    *st = next;
+    ev->time = st->time;
+    ev->boot = st->boot;
+    if (ev->type == PDBS_HISTORY_POWER) {
+        ev->pdo = 0;
+        ev->v = st->power_v;
+        ev->i = st->power_i;
+    } else {
+        ev->pdo = st->contract_pdo;
+        ev->v = st->contract_v;
+        ev->i = st->contract_i;
+    }
+    return pos;
+}
+
+/*
+ * Return a pointer to the start of the given page of the log
+ */
+static const uint8_t *history_page_get(uint8_t page)
+{
+    return (const uint8_t *) (PDBS_HISTORY_BASE
+            + page * PDBS_FLASH_PAGE_SIZE);
+}
+
+/*
+ * Return whether the given page has a valid header
+ */
+static bool history_page_valid(uint8_t page)
+{
+    const struct history_header *hdr =
+        (const struct history_header *) history_page_get(page);
+
+    return hdr->magic == HISTORY_MAGIC
+        && hdr->crc == pdbs_flash_crc(hdr,
+                offsetof(struct history_header, crc), 0xFFFF);
+}
+
+/*
+ * Return the sequence number of the given page, which must be valid
+ */
+static uint32_t history_page_seq(uint8_t page)
+{
+    return ((const struct history_header *) history_page_get(page))->seq;
+}
+
+/*
+ * Return the offset just past the last halfword written in the given page
+ */
+static uint16_t history_page_end(uint8_t page)
+{
+    const uint16_t *data = (const uint16_t *) history_page_get(page);
+
+    uint16_t end = PDBS_FLASH_PAGE_SIZE;
+    while (end > HISTORY_DATA_START && data[end / 2 - 1] == 0xFFFF) {
+        end -= 2;
+    }
+    return end;
+}
+
+/*
+ * Find the newest valid page.  Returns false if there isn't one.
+ */
+static bool history_page_newest(uint8_t *newest)
+{
+    bool found = false;
+
+    for (uint8_t page = 0; page < PDBS_HISTORY_PAGES; page++) {
+        if (!history_page_valid(page)) {
+            continue;
+        }
+        if (!found || (int32_t) (history_page_seq(page)
+                    - history_page_seq(*newest)) > 0) {
+            *newest = page;
+            found = true;
+        }
+    }
+    return found;
+}
+
+void pdbs_history_init(void)
+{
+    uint8_t newest;
+
+    history_open = false;
+    history_page = 0;
+    history_seq = 0;
+    history_stats.boot = 0;
+
+    if (!history_page_newest(&newest)) {
+        return;
+    }
+
+    /* Decode the newest page to find where it ends and which startup wrote
+     * it */
+    struct pdbs_history_coder st;
+    struct pdbs_history_event ev;
+    const uint8_t *data = history_page_get(newest);
+    uint16_t end = history_page_end(newest);
+    size_t pos = HISTORY_DATA_START;
+    size_t n;
+    memset(&st, 0, sizeof(st));
+    while ((n = pdbs_history_decode(&st, data + pos, end - pos, &ev)) != 0) {
+        pos += n;
+    }
+
+    history_stats.boot = st.boot + 1;
+    history_seq = history_page_seq(newest);
+    if (((pos + 1) & ~1) == end) {
+        /* Carry on where the log left off */
+        history_open = true;
+        history_page = newest;
+        history_offset = end;
+    } else {
+        /* The last write was cut short.  Start again on the next page. */
+        history_page = (newest + 1) % PDBS_HISTORY_PAGES;
+    }
+}
+
+/*
+ * Write the batch to flash
+ */
+static void history_flush(void)
+{
+    if (history_batch_len == 0) {
+        return;
+    }
+    if (history_batch_len & 1) {
+        history_batch[history_batch_len++] = HISTORY_PAD;
+    }
+
+    pdbs_flash_acquire();
+    pdbs_flash_write((void *) (history_page_get(history_page)
+                + history_offset), history_batch, history_batch_len);
+    pdbs_flash_release();
+
+    history_offset += history_batch_len;
+    history_stats.bytes += history_batch_len;
+    history_batch_len = 0;
+}
+
+/*
+ * Move the log on to a new page.  The batch must be empty.
+ */
+static void history_page_next(void)
+{
+    if (history_open) {
+        history_page = (history_page + 1) % PDBS_HISTORY_PAGES;
+    }
+
+    struct history_header hdr;
+    hdr.magic = HISTORY_MAGIC;
+    hdr.seq = ++history_seq;
+    hdr.crc = pdbs_flash_crc(&hdr, offsetof(struct history_header, crc),
+            0xFFFF);
+    hdr._reserved = 0xFFFF;
+
+    /* The page should have been erased already, but a power loss could have
+     * stopped that from happening */
+    pdbs_flash_acquire();
+    void *dst = (void *) history_page_get(history_page);
+    pdbs_flash_erase(dst);
+    pdbs_flash_write(dst, &hdr, offsetof(struct history_header, crc));
+    pdbs_flash_write_halfword(&((struct history_header *) dst)->crc, hdr.crc);
+    pdbs_flash_release();
+
+    history_open = true;
+    history_offset = HISTORY_DATA_START;
+
+    /* Get the oldest page ready for next time */
+    history_erase_pending = true;
+    history_erase_page = (history_page + 1) % PDBS_HISTORY_PAGES;
+}
+
+/*
+ * Add an event to the batch, writing the batch and moving on to a new page as
+ * needed
+ */
+static void history_append(const struct pdbs_history_event *ev)
+{
+    uint8_t rec[PDBS_HISTORY_RECORD_MAX];
+    struct pdbs_history_coder st = history_coder;
+    size_t len = pdbs_history_encode(&st, ev, rec);
+
+    /* Make sure the record fits in the batch, with padding */
+    if (history_batch_len + len + 1 > sizeof(history_batch)) {
+        history_flush();
+    }
+
+    /* If the record doesn't fit in the page, start a new one.  Every page
+     * starts with a SYNC so it can be decoded on its own. */
+    if (!history_open || history_offset + history_batch_len + len + 1
+            > PDBS_FLASH_PAGE_SIZE) {
+        history_flush();
+        history_page_next();
+
+        if (ev->type != PDBS_HISTORY_SYNC) {
+            struct pdbs_history_event sync = {
+                .time = history_coder.time,
+                .boot = history_coder.boot,
+                .v = history_coder.contract_v,
+                .i = history_coder.contract_i,
+                .type = PDBS_HISTORY_SYNC,
+                .pdo = history_coder.contract_pdo
+            };
+            history_batch_len = pdbs_history_encode(&history_coder, &sync,
+                    history_batch);
+        }
+
+        st = history_coder;
+        len = pdbs_history_encode(&st, ev, rec);
+    }
+
+    memcpy(history_batch + history_batch_len, rec, len);
+    history_batch_len += len;
+    history_coder = st;
+    history_stats.logged++;
+}
+
+/*
+ * Erase the whole log, and start it again from the first page
+ */
+static void history_erase_all(void)
+{
+    history_batch_len = 0;
+
+    pdbs_flash_acquire();
+    for (uint8_t page = 0; page < PDBS_HISTORY_PAGES; page++) {
+        pdbs_flash_erase((void *) history_page_get(page));
+    }
+    pdbs_flash_release();
+
+    history_open = false;
+    history_page = 0;
+    history_erase_pending = false;
+}
+
+/*
+ * Log the output if it's changed enough, or if it hasn't been logged for a
+ * while
+ */
+static void history_sample(void)
+{
+    struct pdbs_telemetry t;
+    if (!pdbs_telemetry_get(&t, 0)) {
+        return;
+    }
+
+    struct pdbs_history_event ev = {
+        .time = history_now,
+        .v = t.vbus / 10,
+        .i = t.current,
+        .type = PDBS_HISTORY_POWER
+    };
+    int dv = (int) ev.v - history_coder.power_v;
+    int di = (int) ev.i - history_coder.power_i;
+    if (dv >= PDBS_HISTORY_SAMPLE_DV || dv <= -PDBS_HISTORY_SAMPLE_DV
+            || di >= PDBS_HISTORY_SAMPLE_DI || di <= -PDBS_HISTORY_SAMPLE_DI
+            || history_now - history_power_time >= PDBS_HISTORY_HEARTBEAT) {
+        history_append(&ev);
+        history_power_time = history_now;
+    }
+}
+
+/*
+ * History thread, sampling the output and writing the log to flash at low
+ * priority
+ */
+static THD_WORKING_AREA(waHistory, 256);
+static THD_FUNCTION(History, arg) {
+    (void) arg;
+
+    chRegSetThreadName("History");
+
+    systime_t last = chVTGetSystemTime();
+    uint32_t next_sample = PDBS_HISTORY_SAMPLE_PERIOD;
+
+    /* Mark the startup in the log */
+    struct pdbs_history_event ev = {
+        .boot = history_stats.boot,
+        .type = PDBS_HISTORY_SYNC
+    };
+    history_append(&ev);
+
+    while (true) {
+        eventmask_t evt = chEvtWaitAnyTimeout(ALL_EVENTS,
+                TIME_S2I(PDBS_HISTORY_SAMPLE_PERIOD));
+
+        /* Give any events that come with this one time to arrive */
+        if (evt & HISTORY_EVT_LOGGED) {
+            chThdSleep(HISTORY_SETTLE);
+        }
+
+        /* Keep our own time, since the system time wraps after a few days */
+        sysinterval_t elapsed = chVTTimeElapsedSinceX(last);
+        last = chTimeAddX(last, elapsed);
+        history_ticks += elapsed;
+        while (history_ticks >= TIME_S2I(1)) {
+            history_ticks -= TIME_S2I(1);
+            history_now++;
+        }
+
+        if (evt & HISTORY_EVT_CLEAR) {
+            history_erase_all();
+        }
+
+        /* Log the queued events */
+        while (true) {
+            struct history_entry e;
+            chSysLock();
+            if (history_queue_count == 0) {
+                chSysUnlock();
+                break;
+            }
+            e = history_queue[history_queue_head];
+            history_queue_head = (history_queue_head + 1)
+                % PDBS_HISTORY_QUEUE_LEN;
+            history_queue_count--;
+            chSysUnlock();
+
+            uint32_t age = chVTTimeElapsedSinceX(e.time) / TIME_S2I(1);
+            ev.time = (age < history_now) ? history_now - age : 0;
+            ev.v = e.v;
+            ev.i = e.i;
+            ev.type = e.type;
+            ev.pdo = e.pdo;
+            history_append(&ev);
+        }
+
+        if ((int32_t) (history_now - next_sample) >= 0) {
+            next_sample = history_now + PDBS_HISTORY_SAMPLE_PERIOD;
+            history_sample();
+        }
+
+        history_flush();
+
+        /* With nothing left to write, get the next page ready */
+        if (history_erase_pending) {
+            history_erase_pending = false;
+            pdbs_flash_acquire();
+            pdbs_flash_erase((void *) history_page_get(history_erase_page));
+            pdbs_flash_release();
+        }
+    }
+}
+
+void pdbs_history_run(void)
+{
+    history_thread = chThdCreateStatic(waHistory, sizeof(waHistory),
+            PDBS_PRIO_HISTORY, History, NULL);
+}
+
+void pdbs_history_log(enum pdbs_history_type type, uint8_t pdo, int v,
+        uint16_t i)
+{
+    struct history_entry e = {
+        .time = chVTGetSystemTime(),
+        .v = (type == PDBS_HISTORY_CONTRACT) ? v / 10 : 0,
+        .i = (type == PDBS_HISTORY_CONTRACT) ? i : 0,
+        .type = type,
+        .pdo = (type == PDBS_HISTORY_CONTRACT) ? pdo : 0
+    };
+
+    chSysLock();
+    if (type == PDBS_HISTORY_CONTRACT) {
+        /* PPS keep-alive Requests renew the same contract over and over */
+        if (e.pdo == history_contract.pdo && e.v == history_contract.v
+                && e.i == history_contract.i) {
+            chSysUnlock();
+            return;
+        }
+        history_contract = e;
+    } else {
+        /* Whatever contract comes next is news */
+        history_contract.pdo = 0;
+    }
+
+    if (history_queue_count < PDBS_HISTORY_QUEUE_LEN) {
+        history_queue[(history_queue_head + history_queue_count)
+            % PDBS_HISTORY_QUEUE_LEN] = e;
+        history_queue_count++;
+    } else {
+        history_stats.dropped++;
+    }
+    chSysUnlock();
+
+    if (history_thread != NULL) {
+        chEvtSignal(history_thread, HISTORY_EVT_LOGGED);
+    }
+}
+
+/*
+ * Move a reader on to the next page of the log, if there is one
+ */
+static void history_reader_next(struct pdbs_history_reader *r)
+{
+    if (r->pages_left == 0) {
+        r->page = PDBS_HISTORY_PAGES;
+        return;
+    }
+    r->page = (r->page + 1) % PDBS_HISTORY_PAGES;
+    r->pages_left--;
+    r->seq++;
+    r->offset = HISTORY_DATA_START;
+}
+
+/*
+ * Return whether the page a reader is on is still the one it expects
+ */
+static bool history_reader_valid(const struct pdbs_history_reader *r)
+{
+    return r->page < PDBS_HISTORY_PAGES && history_page_valid(r->page)
+        && history_page_seq(r->page) == r->seq;
+}
+
+void pdbs_history_read_start(struct pdbs_history_reader *r)
+{
+    uint8_t newest;
+
+    memset(r, 0, sizeof(*r));
+    r->offset = HISTORY_DATA_START;
+    if (!history_page_newest(&newest)) {
+        r->page = PDBS_HISTORY_PAGES;
+        return;
+    }
+
+    /* Go back through the pages that came just before the newest one */
+    uint32_t seq = history_page_seq(newest);
+    uint8_t count = 1;
+    while (count < PDBS_HISTORY_PAGES) {
+        uint8_t page = (newest + PDBS_HISTORY_PAGES - count)
+            % PDBS_HISTORY_PAGES;
+        if (!history_page_valid(page)
+                || history_page_seq(page) != seq - count) {
+            break;
+        }
+        count++;
+    }
+
+    r->page = (newest + PDBS_HISTORY_PAGES - count + 1) % PDBS_HISTORY_PAGES;
+    r->pages_left = count - 1;
+    r->seq = seq - count + 1;
+}
+
+bool pdbs_history_read(struct pdbs_history_reader *r,
+        struct pdbs_history_event *ev)
+{
+    while (r->page < PDBS_HISTORY_PAGES) {
+        if (history_reader_valid(r)) {
+            size_t n = pdbs_history_decode(&r->coder,
+                    history_page_get(r->page) + r->offset,
+                    PDBS_FLASH_PAGE_SIZE - r->offset, ev);
+            if (n != 0) {
+                r->offset += n;
+                return true;
+            }
+        }
+        history_reader_next(r);
+    }
+    return false;
+}
+
+const uint8_t *pdbs_history_read_page(struct pdbs_history_reader *r,
+        size_t *len)
+{
+    while (r->page < PDBS_HISTORY_PAGES) {
+        uint8_t page = r->page;
+        bool valid = history_reader_valid(r);
+        history_reader_next(r);
+        if (valid) {
+            *len = history_page_end(page);
+            return history_page_get(page);
+        }
+    }
+    return NULL;
+}
+
+void pdbs_history_clear(void)
+{
+    if (history_thread != NULL) {
+        chEvtSignal(history_thread, HISTORY_EVT_CLEAR);
+    }
+}
+
+void pdbs_history_stats_get(struct pdbs_history_stats *stats)
+{
+    chSysLock();
+    *stats = history_stats;
+    chSysUnlock();
+    stats->page_used = history_open ? history_offset : 0;
+}
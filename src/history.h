@@ -0,0 +1,211 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PDBS_HISTORY_H
+#define PDBS_HISTORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* The number of flash pages the history is kept in, starting at
+ * PDBS_HISTORY_BASE.  PDBS_HISTORY_BASE is set in the Makefile.  One page is
+ * always kept erased, ready for the log to move on to. */
+#define PDBS_HISTORY_PAGES 4
+
+/* The number of events that can wait to be written to flash.  Any more are
+ * dropped. */
+#define PDBS_HISTORY_QUEUE_LEN 16
+
+/* How often the output is sampled, in seconds */
+#define PDBS_HISTORY_SAMPLE_PERIOD 10
+/* How much the output must change by to be logged, in 10 mV and 10 mA */
+#define PDBS_HISTORY_SAMPLE_DV 10
+#define PDBS_HISTORY_SAMPLE_DI 5
+/* How long to go without logging the output, in seconds */
+#define PDBS_HISTORY_HEARTBEAT 1800
+
+/* The longest an encoded record can be, in bytes */
+#define PDBS_HISTORY_RECORD_MAX 20
+
+
+/*
+ * Types of history events
+ */
+enum pdbs_history_type {
+    /* The state of the encoder, written at startup and at the start of every
+     * page so the log can be decoded from there */
+    PDBS_HISTORY_SYNC,
+    /* A new explicit contract */
+    PDBS_HISTORY_CONTRACT,
+    /* A Hard Reset */
+    PDBS_HISTORY_HARD_RESET,
+    /* A Soft Reset */
+    PDBS_HISTORY_SOFT_RESET,
+    /* A sample of the output */
+    PDBS_HISTORY_POWER,
+    /* The source was detached */
+    PDBS_HISTORY_DETACH
+};
+
+/*
+ * A history event
+ */
+struct pdbs_history_event {
+    /* When the event happened, in seconds since startup */
+    uint32_t time;
+    /* Which startup it was, counting from when the log was started */
+    uint16_t boot;
+    /* Voltage in 10 mV units and current in 10 mA units, of the contract for
+     * PDBS_HISTORY_CONTRACT and PDBS_HISTORY_SYNC or of the output for
+     * PDBS_HISTORY_POWER */
+    uint16_t v;
+    uint16_t i;
+    /* What happened, from enum pdbs_history_type */
+    uint8_t type;
+    /* Object position of the contract's PDO, for PDBS_HISTORY_CONTRACT and
+     * PDBS_HISTORY_SYNC, or 0 if there's no explicit contract */
+    uint8_t pdo;
+};
+
+/*
+ * State of the history encoder or decoder
+ *
+ * Records are encoded as differences from the ones before them, so the same
+ * state must be kept while decoding as while encoding.  A PDBS_HISTORY_SYNC
+ * record sets all of it.
+ */
+struct pdbs_history_coder {
+    /* Time of the last record */
+    uint32_t time;
+    /* Which startup the records are from */
+    uint16_t boot;
+    /* The last contract */
+    uint16_t contract_v;
+    uint16_t contract_i;
+    uint8_t contract_pdo;
+    /* The last output sample */
+    uint16_t power_v;
+    uint16_t power_i;
+};
+
+/*
+ * Read position in the history log
+ */
+struct pdbs_history_reader {
+    /* The page being read, and how many pages are left after it */
+    uint8_t page;
+    uint8_t pages_left;
+    /* Where in the page to read the next record */
+    uint16_t offset;
+    /* Sequence number the page must have */
+    uint32_t seq;
+    /* State of the decoder */
+    struct pdbs_history_coder coder;
+};
+
+/*
+ * How the history log has been used since startup
+ */
+struct pdbs_history_stats {
+    /* Events logged, and events dropped because the queue was full */
+    uint32_t logged;
+    uint32_t dropped;
+    /* Bytes written to flash, including padding */
+    uint32_t bytes;
+    /* Bytes of the page in use that are written */
+    uint16_t page_used;
+    /* This startup's number */
+    uint16_t boot;
+};
+
+
+/*
+ * Encode an event as a record in buf, which must have room for
+ * PDBS_HISTORY_RECORD_MAX bytes.  Returns the length of the record.
+ *
+ * The encoder uses no ChibiOS or hardware functions, so it can be tested on a
+ * host.
+ */
+size_t pdbs_history_encode(struct pdbs_history_coder *st,
+        const struct pdbs_history_event *ev, uint8_t *buf);
+
+/*
+ * Decode the record at the start of the len bytes at buf into ev, skipping any
+ * padding before it.  Returns the number of bytes used, or 0 if there are no
+ * more records, or if what's there isn't a valid one.
+ */
+size_t pdbs_history_decode(struct pdbs_history_coder *st, const uint8_t *buf,
+        size_t len, struct pdbs_history_event *ev);
+
+/*
+ * Find the log in flash and figure out which startup this is.  Must be called
+ * once at startup, before any of the other pdbs_history_* functions.
+ */
+void pdbs_history_init(void);
+
+/*
+ * Start the thread that samples the output and writes the log to flash
+ */
+void pdbs_history_run(void);
+
+/*
+ * Log an event of the given type.  pdo, v, and i are only used for
+ * PDBS_HISTORY_CONTRACT, in which case v is in millivolts and i is in
+ * centiamperes.  The event is queued for the history thread, so this never
+ * waits for flash, and can be called from the PD threads.
+ *
+ * A contract the same as the last one logged since the last reset or detach
+ * isn't logged again.
+ */
+void pdbs_history_log(enum pdbs_history_type type, uint8_t pdo, int v,
+        uint16_t i);
+
+/*
+ * Start reading the log from its oldest record
+ */
+void pdbs_history_read_start(struct pdbs_history_reader *r);
+
+/*
+ * Read the next record of the log into ev.  Returns false when there are no
+ * more.
+ */
+bool pdbs_history_read(struct pdbs_history_reader *r,
+        struct pdbs_history_event *ev);
+
+/*
+ * Return the raw bytes of the page the reader is on, and start reading the
+ * next one.  len is set to the number of bytes written in the page, counting
+ * from its start.  Returns NULL when there are no more pages.
+ */
+const uint8_t *pdbs_history_read_page(struct pdbs_history_reader *r,
+        size_t *len);
+
+/*
+ * Erase the log.  It starts again with the next event.
+ */
+void pdbs_history_clear(void);
+
+/*
+ * Get how the history log has been used since startup.
+ */
+void pdbs_history_stats_get(struct pdbs_history_stats *stats);
+
+
+#endif /* PDBS_HISTORY_H */
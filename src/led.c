@@ -50,6 +50,8 @@ static THD_FUNCTION(LED, arg) {
     /* Counter for blinking modes */
     int i = 0;
 
+    chRegSetThreadName("LED");
+
     while (true) {
         /* Wait for any event except the last one we saw */
         newstate = chEvtWaitOneTimeout(ALL_EVENTS & ~state, timeout);
@@ -41,6 +41,15 @@
 #include <pdb.h>
 #include <pd.h>
 #include "led.h"
+#include "config.h"
+#include "flash.h"
+#include "charger.h"
+#include "crash.h"
+#include "history.h"
+#include "update.h"
+#include "telemetry.h"
+#include "softstart.h"
+#include "heater.h"
 #include "device_policy_manager.h"
 #include "stm32f072_bootloader.h"
 #include "ssd1306.h"
@@ -48,20 +57,6 @@
 #include <string.h>
 #include <stdio.h>
 
-// ADCConfig structure for stm32 MCUs is empty
-/*
-static const ADCConversionGroup adcgrpcfg2 = {
-  TRUE,
-  ADC_GRP2_NUM_CHANNELS,
-  adccallback,
-  adcerrorcallback,
-  ADC_CFGR1_CONT | ADC_CFGR1_RES_12BIT,             /* CFGR1 */
-//  ADC_TR(0, 0),                                     /* TR */
-//  ADC_SMPR_SMP_28P5,                                /* SMPR */
-//  ADC_CHSELR_CHSEL10 | ADC_CHSELR_CHSEL11 |
-//  ADC_CHSELR_CHSEL16 | ADC_CHSELR_CHSEL17           /* CHSELR */
-//};
-
 /*
  * I2C configuration object.
  * I2C2_TIMINGR: 1000 kHz with I2CCLK = 48 MHz, rise time = 100 ns,
@@ -73,6 +68,21 @@ static const I2CConfig i2c2config = {
     0
 };
 
+/*
+ * Identity reported in response to Discover Identity
+ *
+ * We're a Power Sink Device with a receptacle, using the same VID, PID, and
+ * bcdDevice as our USB descriptor.  We aren't certified, so our XID is 0.
+ */
+static const struct pdb_dpm_identity identity = {
+    .id_header = PD_VDO_IDH_UFP_TYPE_PSD | PD_VDO_IDH_CONNECTOR_RECEPTACLE
+        | PD_VDO_IDH_VID_SET(0x1209),
+    .cert_stat = 0,
+    .product = PD_VDO_PRODUCT_PID_SET(0x9DB5)
+        | PD_VDO_PRODUCT_BCDDEVICE_SET(0x0200),
+    .product_type_numobj = 0
+};
+
 /*
  * PD Buddy Sink DPM data
  */
@@ -82,6 +92,28 @@ static struct pdbs_dpm_data dpm_data = {
     true,
     true,
     false,
+    .identity = &identity,
+    .governor = {
+        .enabled = false,
+        .step = PD_MA2CA(250),
+        .margin = 25,
+        .up_threshold = 80,
+        .down_threshold = 50,
+        .hold = TIME_S2I(5)
+    },
+    .thermal = {
+        .enabled = true,
+        .warn = 60,
+        .step = 5,
+        .hysteresis = 3,
+        .critical = 85,
+        .cooldown = TIME_S2I(30)
+    },
+    .transition = PDBS_DPM_TRANSITION_BREAK,
+    .softstart = {
+        .ramp = TIME_MS2I(20),
+        .start_duty = 10
+    },
     ._present_voltage = 5000
 };
 
@@ -105,7 +137,15 @@ static struct pdb_config pdb_config = {
         pdbs_dpm_transition_standby,
         pdbs_dpm_transition_requested,
         pdbs_dpm_transition_typec,
-        NULL /* not_supported_received */
+        NULL, /* not_supported_received */
+        pdbs_dpm_epr_mode_pdp,
+        pdbs_dpm_evaluate_epr_capability,
+        pdbs_dpm_source_capabilities_extended,
+        pdbs_dpm_pps_status,
+        pdbs_dpm_get_identity,
+        pdbs_dpm_overtemp,
+        pdbs_dpm_soft_reset,
+        pdbs_dpm_request_rejected
     },
     .dpm_data = &dpm_data,
     .state = 0
@@ -151,21 +191,29 @@ static void sink(void)
     pdb_init(&pdb_config);
     chThdSleepMilliseconds(100);
     //palSetLine(LINE_FET);
-    pdb_config.state = 0;
+    pdb_config.state = pdbs_dpm_first_profile();
     chThdSleepMilliseconds(10);
     chEvtSignal(pdb_config.pe.thread, PDB_EVT_PE_NEW_POWER);
-    uint8_t _cnt = 1;
     /* Wait, letting all the other threads do their work. */
     while (true) {
         //palSetLine(LINE_LED);
         chThdSleepMilliseconds(10);
 
+        /* Step to the next profile when the button is pressed, or raise the
+         * heater setpoint when it's held for a second */
         if (palReadLine(LINE_BUTTON) == PAL_HIGH) {
             palClearLine(LINE_LED);
-            pdb_config.state = ++_cnt;
-            if (_cnt > 3) _cnt = 0;
+            systime_t pressed = chVTGetSystemTime();
             while (palReadLine(LINE_BUTTON) == PAL_HIGH) chThdSleepMilliseconds(10);
-            chEvtSignal(pdb_config.pe.thread, PDB_EVT_PE_NEW_POWER);
+            if (pdbs_heater.enabled
+                    && chVTTimeElapsedSinceX(pressed) >= TIME_S2I(1)) {
+                pdbs_heater_step_setpoint();
+            } else {
+                pdb_config.state = pdbs_dpm_next_profile(pdb_config.state);
+                chEvtSignal(pdb_config.pe.thread, PDB_EVT_PE_NEW_POWER);
+                /* Start with this profile next time too */
+                pdbs_config_flash_set_active(pdb_config.state);
+            }
         }
 
     }
@@ -188,21 +236,18 @@ static __attribute__((noreturn)) THD_FUNCTION(OledDisplay, arg) {
     ssd1306FillScreen(&SSD1306D1, 0x00);
 
     char otter[10];
-    uint16_t pd_profiles[] = {5, 9, 15, 20};
-    uint16_t i = 0;
+    struct pdbs_telemetry t;
 
     while (TRUE) {
-        adcStartConversion(&ADCD1, &adccg, &samples_buf[0], ADC_BUF_DEPTH);
-
-        i = samples_buf[0];
-        chsnprintf(otter, sizeof(otter), "%d", i);
-        ssd1306GotoXy(&SSD1306D1, 5, 0);
-        ssd1306Puts(&SSD1306D1, otter, &ssd1306_font_7x10, SSD1306_COLOR_WHITE);
-
-        //i = samples_buf[1];
-        //chsnprintf(otter, sizeof(otter), "%d", i);
-        //ssd1306GotoXy(&SSD1306D1, 5, 15);
-        //ssd1306Puts(&SSD1306D1, otter, &ssd1306_font_7x10, SSD1306_COLOR_WHITE);
+        if (pdbs_telemetry_get(&t, 0)) {
+            chsnprintf(otter, sizeof(otter), "%d", t.vbus);
+            ssd1306GotoXy(&SSD1306D1, 5, 0);
+            ssd1306Puts(&SSD1306D1, otter, &ssd1306_font_7x10, SSD1306_COLOR_WHITE);
+
+            chsnprintf(otter, sizeof(otter), "%d", t.current);
+            ssd1306GotoXy(&SSD1306D1, 5, 15);
+            ssd1306Puts(&SSD1306D1, otter, &ssd1306_font_7x10, SSD1306_COLOR_WHITE);
+        }
 
         ssd1306UpdateScreen(&SSD1306D1);
         chThdSleepMilliseconds(300);
@@ -225,9 +270,40 @@ int main(void) {
     chSysInit();
     //i2cInit();
 
+    /* Find out whether we crashed before this reset */
+    pdbs_crash_init(&pdb_config);
+
+    /* Find the stored configuration */
+    pdbs_flash_init(&pdb_config);
+    pdbs_config_flash_init();
+    pdbs_config_flash_run(&pdb_config);
+
+    /* Load what we've learned about chargers */
+    pdbs_charger_init();
+    pdbs_charger_run();
+
+    /* Log the crash from before this reset, if there was one */
+    pdbs_crash_run();
+
+    /* Start the contract and power history log */
+    pdbs_history_init();
+    pdbs_history_run();
+
+    /* If we were just updated, confirm that we work once we've run a while */
+    pdbs_update_run();
+
     /* Create the LED thread. */
     pdbs_led_run();
 
+    /* Start measuring VBUS, output current, and temperature */
+    pdbs_telemetry_run();
+
+    /* Put the output switch under PWM control, turned off */
+    pdbs_softstart_init();
+
+    /* Start the soldering iron temperature control loop */
+    pdbs_heater_run();
+
     /* Start I2C2 to make communication with the PHY possible */
 
     i2cStart(pdb_config.fusb.i2cp, &i2c2config);
@@ -236,27 +312,20 @@ int main(void) {
     //palSetPadMode(IOPORT2, 6, PAL_STM32_OTYPE_OPENDRAIN | PAL_MODE_ALTERNATE(1));
     //palSetPadMode(IOPORT2, 7, PAL_STM32_OTYPE_OPENDRAIN | PAL_MODE_ALTERNATE(1));
 
-    //palSetPadMode(IOPORT1, 1, PAL_MODE_INPUT_ANALOG);
-    //palSetPadMode(IOPORT1, 2, PAL_MODE_INPUT_ANALOG);
-    //adcSTM32SetCCR(ADC_CCR_VBATEN | ADC_CCR_TSEN | ADC_CCR_VREFEN);
-    //adcSTM32SetCCR(ADC_CCR_VREFEN);
-
-
-    //adcInit();
-    //adcStart(&ADCD1, &adccfg);
-    //adcSTM32EnableVREF();
-    //setup();
-    sink();
-    /*
+    /* Go into setup mode, with the USB serial shell, if the button is held
+     * at startup, or into the ROM bootloader if it's held for three seconds.
+     * Otherwise, just be a sink. */
     if (palReadLine(LINE_BUTTON) == PAL_HIGH) {
-        systime_t now = chVTGetSystemTime();
+        systime_t pressed = chVTGetSystemTime();
         while (palReadLine(LINE_BUTTON) == PAL_HIGH) {
-            if (chVTGetSystemTime() - now >= 3000) dfu_run_bootloader();
+            if (chVTTimeElapsedSinceX(pressed) >= TIME_S2I(3)) {
+                dfu_run_bootloader();
+            }
+            chThdSleepMilliseconds(10);
         }
         setup();
     } else {
         //chThdCreateStatic(waOledDisplay, sizeof(waOledDisplay), NORMALPRIO, OledDisplay, NULL);
         sink();
     }
-    */
 }
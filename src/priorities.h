@@ -24,6 +24,11 @@
 
 /* PD Buddy Sink thread priorities */
 #define PDBS_PRIO_LED HIGHPRIO
+#define PDBS_PRIO_CONFIG LOWPRIO
+#define PDBS_PRIO_CHARGER LOWPRIO
+#define PDBS_PRIO_CRASH LOWPRIO
+#define PDBS_PRIO_HISTORY LOWPRIO
+#define PDBS_PRIO_UPDATE LOWPRIO
 
 
 #endif /* PDBS_PRIORITIES_H */
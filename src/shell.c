@@ -43,15 +43,25 @@
 #include <pd.h>
 #include "usbcfg.h"
 #include "config.h"
+#include "flash.h"
+#include "charger.h"
+#include "crash.h"
+#include "history.h"
+#include "update.h"
 #include "led.h"
+#include "telemetry.h"
+#include "heater.h"
 #include "device_policy_manager.h"
 #include "stm32f072_bootloader.h"
 
 
 /* Buffer for unwritten configuration */
 static struct pdbs_config tmpcfg = {
-    .status = PDBS_CONFIG_STATUS_VALID
+    .status = PDBS_CONFIG_STATUS_VALID,
+    .profile = 0
 };
+/* Buffer for the unwritten name of tmpcfg's profile */
+static char tmpname[PDBS_CONFIG_NAME_LEN + 1];
 
 /* Pointer to the PD Buddy firmware library configuration */
 static struct pdb_config *pdb_config;
@@ -102,6 +112,12 @@ static void print_src_fixed_pdo(BaseSequentialStream *chp, uint32_t pdo)
         chprintf(chp, "\tunchunked_ext_msg: %d\r\n", tmp);
     }
 
+    /* EPR Mode Capable */
+    tmp = (pdo & PD_PDO_SRC_FIXED_EPR_CAPABLE) >> PD_PDO_SRC_FIXED_EPR_CAPABLE_SHIFT;
+    if (tmp) {
+        chprintf(chp, "\tepr_mode_capable: %d\r\n", tmp);
+    }
+
     /* Peak Current */
     tmp = (pdo & PD_PDO_SRC_FIXED_PEAK_CURRENT) >> PD_PDO_SRC_FIXED_PEAK_CURRENT_SHIFT;
     if (tmp) {
@@ -117,6 +133,44 @@ static void print_src_fixed_pdo(BaseSequentialStream *chp, uint32_t pdo)
     chprintf(chp, "\ti: %d.%02d A\r\n", PD_PDI_A(tmp), PD_PDI_CA(tmp));
 }
 
+static void print_src_variable_pdo(BaseSequentialStream *chp, uint32_t pdo)
+{
+    int tmp;
+
+    chprintf(chp, "variable\r\n");
+
+    /* Minimum voltage */
+    tmp = (pdo & PD_PDO_SRC_VARIABLE_MIN_VOLTAGE) >> PD_PDO_SRC_VARIABLE_MIN_VOLTAGE_SHIFT;
+    chprintf(chp, "\tvmin: %d.%02d V\r\n", PD_PDV_V(tmp), PD_PDV_CV(tmp));
+
+    /* Maximum voltage */
+    tmp = (pdo & PD_PDO_SRC_VARIABLE_MAX_VOLTAGE) >> PD_PDO_SRC_VARIABLE_MAX_VOLTAGE_SHIFT;
+    chprintf(chp, "\tvmax: %d.%02d V\r\n", PD_PDV_V(tmp), PD_PDV_CV(tmp));
+
+    /* Maximum Current */
+    tmp = (pdo & PD_PDO_SRC_VARIABLE_CURRENT) >> PD_PDO_SRC_VARIABLE_CURRENT_SHIFT;
+    chprintf(chp, "\ti: %d.%02d A\r\n", PD_PDI_A(tmp), PD_PDI_CA(tmp));
+}
+
+static void print_src_battery_pdo(BaseSequentialStream *chp, uint32_t pdo)
+{
+    int tmp;
+
+    chprintf(chp, "battery\r\n");
+
+    /* Minimum voltage */
+    tmp = (pdo & PD_PDO_SRC_BATTERY_MIN_VOLTAGE) >> PD_PDO_SRC_BATTERY_MIN_VOLTAGE_SHIFT;
+    chprintf(chp, "\tvmin: %d.%02d V\r\n", PD_PDV_V(tmp), PD_PDV_CV(tmp));
+
+    /* Maximum voltage */
+    tmp = (pdo & PD_PDO_SRC_BATTERY_MAX_VOLTAGE) >> PD_PDO_SRC_BATTERY_MAX_VOLTAGE_SHIFT;
+    chprintf(chp, "\tvmax: %d.%02d V\r\n", PD_PDV_V(tmp), PD_PDV_CV(tmp));
+
+    /* Maximum Allowable Power */
+    tmp = (pdo & PD_PDO_SRC_BATTERY_POWER) >> PD_PDO_SRC_BATTERY_POWER_SHIFT;
+    chprintf(chp, "\tp: %d.%02d W\r\n", PD_PDW_W(tmp), PD_PDW_CW(tmp));
+}
+
 static void print_src_pps_apdo(BaseSequentialStream *chp, uint32_t pdo)
 {
     int tmp;
@@ -136,6 +190,54 @@ static void print_src_pps_apdo(BaseSequentialStream *chp, uint32_t pdo)
     chprintf(chp, "\ti: %d.%02d A\r\n", PD_PAI_A(tmp), PD_PAI_CA(tmp));
 }
 
+static void print_src_spr_avs_apdo(BaseSequentialStream *chp, uint32_t pdo)
+{
+    int tmp;
+
+    chprintf(chp, "spr_avs\r\n");
+
+    /* Peak Current */
+    tmp = (pdo & PD_APDO_SPR_AVS_PEAK_CURRENT) >> PD_APDO_SPR_AVS_PEAK_CURRENT_SHIFT;
+    if (tmp) {
+        chprintf(chp, "\tpeak_i: %d\r\n", tmp);
+    }
+
+    /* Maximum current from 9 V to 15 V */
+    tmp = (pdo & PD_APDO_SPR_AVS_CURRENT_15V) >> PD_APDO_SPR_AVS_CURRENT_15V_SHIFT;
+    chprintf(chp, "\ti_15v: %d.%02d A\r\n", PD_PDI_A(tmp), PD_PDI_CA(tmp));
+
+    /* Maximum current from 15 V to 20 V */
+    tmp = (pdo & PD_APDO_SPR_AVS_CURRENT_20V) >> PD_APDO_SPR_AVS_CURRENT_20V_SHIFT;
+    if (tmp) {
+        chprintf(chp, "\ti_20v: %d.%02d A\r\n", PD_PDI_A(tmp), PD_PDI_CA(tmp));
+    }
+}
+
+static void print_src_epr_avs_apdo(BaseSequentialStream *chp, uint32_t pdo)
+{
+    int tmp;
+
+    chprintf(chp, "epr_avs\r\n");
+
+    /* Peak Current */
+    tmp = (pdo & PD_APDO_EPR_AVS_PEAK_CURRENT) >> PD_APDO_EPR_AVS_PEAK_CURRENT_SHIFT;
+    if (tmp) {
+        chprintf(chp, "\tpeak_i: %d\r\n", tmp);
+    }
+
+    /* Minimum voltage */
+    tmp = (pdo & PD_APDO_EPR_AVS_MIN_VOLTAGE) >> PD_APDO_EPR_AVS_MIN_VOLTAGE_SHIFT;
+    chprintf(chp, "\tvmin: %d.%02d V\r\n", PD_PAV_V(tmp), PD_PAV_CV(tmp));
+
+    /* Maximum voltage */
+    tmp = (pdo & PD_APDO_EPR_AVS_MAX_VOLTAGE) >> PD_APDO_EPR_AVS_MAX_VOLTAGE_SHIFT;
+    chprintf(chp, "\tvmax: %d.%02d V\r\n", PD_PAV_V(tmp), PD_PAV_CV(tmp));
+
+    /* PDP */
+    tmp = (pdo & PD_APDO_EPR_AVS_PDP) >> PD_APDO_EPR_AVS_PDP_SHIFT;
+    chprintf(chp, "\tp: %d W\r\n", tmp);
+}
+
 static void print_src_pdo(BaseSequentialStream *chp, uint32_t pdo, uint8_t index)
 {
     /* If we have a positive index, print a label for the PDO */
@@ -146,9 +248,19 @@ static void print_src_pdo(BaseSequentialStream *chp, uint32_t pdo, uint8_t index
     /* Select the appropriate method for printing the PDO itself */
     if ((pdo & PD_PDO_TYPE) == PD_PDO_TYPE_FIXED) {
         print_src_fixed_pdo(chp, pdo);
+    } else if ((pdo & PD_PDO_TYPE) == PD_PDO_TYPE_VARIABLE) {
+        print_src_variable_pdo(chp, pdo);
+    } else if ((pdo & PD_PDO_TYPE) == PD_PDO_TYPE_BATTERY) {
+        print_src_battery_pdo(chp, pdo);
     } else if ((pdo & PD_PDO_TYPE) == PD_PDO_TYPE_AUGMENTED
             && (pdo & PD_APDO_TYPE) == PD_APDO_TYPE_PPS) {
         print_src_pps_apdo(chp, pdo);
+    } else if ((pdo & PD_PDO_TYPE) == PD_PDO_TYPE_AUGMENTED
+            && (pdo & PD_APDO_TYPE) == PD_APDO_TYPE_SPR_AVS) {
+        print_src_spr_avs_apdo(chp, pdo);
+    } else if ((pdo & PD_PDO_TYPE) == PD_PDO_TYPE_AUGMENTED
+            && (pdo & PD_APDO_TYPE) == PD_APDO_TYPE_EPR_AVS) {
+        print_src_epr_avs_apdo(chp, pdo);
     } else {
         /* Unknown PDO, just print it as hex */
         chprintf(chp, "%08X\r\n", pdo);
@@ -212,6 +324,18 @@ static void cmd_boot(BaseSequentialStream *chp, int argc, char *argv[])
     dfu_run_bootloader();
 }
 
+/*
+ * Print the stored name of the given profile, if it has one
+ */
+static void print_name(BaseSequentialStream *chp, uint8_t profile)
+{
+    char name[PDBS_CONFIG_NAME_LEN + 1];
+
+    if (pdbs_config_flash_get_name(profile, name)) {
+        chprintf(chp, "name: %s\r\n", name);
+    }
+}
+
 static void cmd_get_cfg(BaseSequentialStream *chp, int argc, char *argv[])
 {
     struct pdbs_config *cfg = NULL;
@@ -221,9 +345,9 @@ static void cmd_get_cfg(BaseSequentialStream *chp, int argc, char *argv[])
         return;
     }
 
-    /* With no arguments, find the current configuration */
+    /* With no arguments, find the configuration of the buffer's profile */
     if (argc == 0) {
-        cfg = pdbs_config_flash_read();
+        cfg = pdbs_config_flash_read(tmpcfg.profile);
         if (cfg == NULL) {
             chprintf(chp, "No configuration\r\n");
             return;
@@ -232,15 +356,19 @@ static void cmd_get_cfg(BaseSequentialStream *chp, int argc, char *argv[])
     } else if (argc == 1) {
         char *endptr;
         long i = strtol(argv[0], &endptr, 0);
-        if (i >= 0 && i < PDBS_CONFIG_ARRAY_LEN && endptr > argv[0]) {
-            cfg = &pdbs_config_array[i];
-        } else {
+        if (endptr > argv[0]) {
+            cfg = pdbs_config_flash_get(i);
+        }
+        if (cfg == NULL) {
             chprintf(chp, "Invalid index\r\n");
             return;
         }
     }
-    /* Print the configuration */
+    /* Print the configuration, and the profile's name if it's the buffer's */
     pdbs_config_print(chp, cfg);
+    if (argc == 0) {
+        print_name(chp, tmpcfg.profile);
+    }
 }
 
 static void cmd_load(BaseSequentialStream *chp, int argc, char *argv[])
@@ -251,8 +379,8 @@ static void cmd_load(BaseSequentialStream *chp, int argc, char *argv[])
         return;
     }
 
-    /* Get the current configuration */
-    struct pdbs_config *cfg = pdbs_config_flash_read();
+    /* Get the configuration of the buffer's profile */
+    struct pdbs_config *cfg = pdbs_config_flash_read(tmpcfg.profile);
     if (cfg == NULL) {
         /* When we run this at shell startup, we want it to be quiet */
         if (chp != NULL) {
@@ -268,6 +396,77 @@ static void cmd_load(BaseSequentialStream *chp, int argc, char *argv[])
     tmpcfg.i = cfg->i;
     tmpcfg.vmin = cfg->vmin;
     tmpcfg.vmax = cfg->vmax;
+
+    /* Load the profile's name too */
+    if (!pdbs_config_flash_get_name(tmpcfg.profile, tmpname)) {
+        tmpname[0] = '\0';
+    }
+}
+
+static void cmd_profile(BaseSequentialStream *chp, int argc, char *argv[])
+{
+    if (argc == 0) {
+        /* With no arguments, print the buffer's profile */
+        chprintf(chp, "%d\r\n", tmpcfg.profile);
+    } else if (argc == 1) {
+        char *endptr;
+        long i = strtol(argv[0], &endptr, 0);
+        if (i >= 0 && i < PDBS_CONFIG_PROFILES && endptr > argv[0]) {
+            /* Set the buffer's profile, and select it for negotiation, now
+             * and at startup */
+            tmpcfg.profile = i;
+            pdb_config->state = i;
+            chEvtSignal(pdb_config->pe.thread, PDB_EVT_PE_NEW_POWER);
+            pdbs_config_flash_set_active(i);
+        } else {
+            chprintf(chp, "Invalid profile\r\n");
+        }
+    } else {
+        /* If there are too many arguments, print a usage message */
+        chprintf(chp, "Usage: profile [index]\r\n");
+    }
+}
+
+static void cmd_get_profiles(BaseSequentialStream *chp, int argc, char *argv[])
+{
+    (void) argv;
+    if (argc > 0) {
+        chprintf(chp, "Usage: get_profiles\r\n");
+        return;
+    }
+
+    /* Print the configuration of every stored profile */
+    bool stored = false;
+    for (int i = 0; i < PDBS_CONFIG_PROFILES; i++) {
+        struct pdbs_config *cfg = pdbs_config_flash_read(i);
+        if (cfg != NULL) {
+            if (stored) {
+                chprintf(chp, "\r\n");
+            }
+            pdbs_config_print(chp, cfg);
+            print_name(chp, i);
+            stored = true;
+        }
+    }
+    if (!stored) {
+        chprintf(chp, "No configuration\r\n");
+    }
+}
+
+static void cmd_remove_profile(BaseSequentialStream *chp, int argc, char *argv[])
+{
+    if (argc != 1) {
+        chprintf(chp, "Usage: remove_profile index\r\n");
+        return;
+    }
+
+    char *endptr;
+    long i = strtol(argv[0], &endptr, 0);
+    if (i >= 0 && i < PDBS_CONFIG_PROFILES && endptr > argv[0]) {
+        pdbs_config_flash_remove(i);
+    } else {
+        chprintf(chp, "Invalid profile\r\n");
+    }
 }
 
 static void cmd_write(BaseSequentialStream *chp, int argc, char *argv[])
@@ -278,9 +477,9 @@ static void cmd_write(BaseSequentialStream *chp, int argc, char *argv[])
         return;
     }
 
+    /* The DPM negotiates the new configuration if it's in use */
     pdbs_config_flash_update(&tmpcfg);
-
-    chEvtSignal(pdb_config->pe.thread, PDB_EVT_PE_NEW_POWER);
+    pdbs_config_flash_set_name(tmpcfg.profile, tmpname);
 }
 
 static void cmd_erase(BaseSequentialStream *chp, int argc, char *argv[])
@@ -303,6 +502,23 @@ static void cmd_get_tmpcfg(BaseSequentialStream *chp, int argc, char *argv[])
     }
 
     pdbs_config_print(chp, &tmpcfg);
+    if (tmpname[0] != '\0') {
+        chprintf(chp, "name: %s\r\n", tmpname);
+    }
+}
+
+static void cmd_set_name(BaseSequentialStream *chp, int argc, char *argv[])
+{
+    if (argc == 0) {
+        /* With no arguments, clear the name */
+        tmpname[0] = '\0';
+    } else if (argc == 1 && strlen(argv[0]) <= PDBS_CONFIG_NAME_LEN) {
+        strcpy(tmpname, argv[0]);
+    } else if (argc == 1) {
+        chprintf(chp, "Name too long\r\n");
+    } else {
+        chprintf(chp, "Usage: set_name [name]\r\n");
+    }
 }
 
 static void cmd_clear_flags(BaseSequentialStream *chp, int argc, char *argv[])
@@ -316,7 +532,9 @@ static void cmd_clear_flags(BaseSequentialStream *chp, int argc, char *argv[])
     /* Clear all flags that can be toggled with toggle_* commands */
     tmpcfg.flags &= ~(PDBS_CONFIG_FLAGS_GIVEBACK
             | PDBS_CONFIG_FLAGS_VAR_BAT
-            | PDBS_CONFIG_FLAGS_HV_PREFERRED);
+            | PDBS_CONFIG_FLAGS_HV_PREFERRED
+            | PDBS_CONFIG_FLAGS_PEAK_CURRENT
+            | PDBS_CONFIG_FLAGS_PPS_PREFERRED);
 }
 
 static void cmd_toggle_giveback(BaseSequentialStream *chp, int argc, char *argv[])
@@ -331,6 +549,18 @@ static void cmd_toggle_giveback(BaseSequentialStream *chp, int argc, char *argv[
     tmpcfg.flags ^= PDBS_CONFIG_FLAGS_GIVEBACK;
 }
 
+static void cmd_toggle_var_bat(BaseSequentialStream *chp, int argc, char *argv[])
+{
+    (void) argv;
+    if (argc > 0) {
+        chprintf(chp, "Usage: toggle_var_bat\r\n");
+        return;
+    }
+
+    /* Toggle the Var/Bat flag */
+    tmpcfg.flags ^= PDBS_CONFIG_FLAGS_VAR_BAT;
+}
+
 static void cmd_toggle_hv_preferred(BaseSequentialStream *chp, int argc, char *argv[])
 {
     (void) argv;
@@ -343,6 +573,30 @@ static void cmd_toggle_hv_preferred(BaseSequentialStream *chp, int argc, char *a
     tmpcfg.flags ^= PDBS_CONFIG_FLAGS_HV_PREFERRED;
 }
 
+static void cmd_toggle_peak_current(BaseSequentialStream *chp, int argc, char *argv[])
+{
+    (void) argv;
+    if (argc > 0) {
+        chprintf(chp, "Usage: toggle_peak_current\r\n");
+        return;
+    }
+
+    /* Toggle the Peak_Current flag */
+    tmpcfg.flags ^= PDBS_CONFIG_FLAGS_PEAK_CURRENT;
+}
+
+static void cmd_toggle_pps_preferred(BaseSequentialStream *chp, int argc, char *argv[])
+{
+    (void) argv;
+    if (argc > 0) {
+        chprintf(chp, "Usage: toggle_pps_preferred\r\n");
+        return;
+    }
+
+    /* Toggle the PPS_Preferred flag */
+    tmpcfg.flags ^= PDBS_CONFIG_FLAGS_PPS_PREFERRED;
+}
+
 static void cmd_set_v(BaseSequentialStream *chp, int argc, char *argv[])
 {
     if (argc != 1) {
@@ -503,6 +757,17 @@ static void cmd_get_source_cap(BaseSequentialStream *chp, int argc, char *argv[]
         }
     }
 
+    /* If we're in EPR Mode, print all the EPR_Source_Capabilities PDOs,
+     * skipping the unused SPR object positions */
+    if (pdbs_dpm_data->epr_capabilities != NULL) {
+        for (uint8_t i = 0; i < pdbs_dpm_data->epr_numobj; i++) {
+            if (pdbs_dpm_data->epr_capabilities[i] != 0) {
+                print_src_pdo(chp, pdbs_dpm_data->epr_capabilities[i], i+1);
+            }
+        }
+        return;
+    }
+
     /* Print all the PDOs */
     uint8_t numobj = PD_NUMOBJ_GET(pdbs_dpm_data->capabilities);
     for (uint8_t i = 0; i < numobj; i++) {
@@ -510,6 +775,842 @@ static void cmd_get_source_cap(BaseSequentialStream *chp, int argc, char *argv[]
     }
 }
 
+static void print_src_peak_current(BaseSequentialStream *chp, int n,
+        uint16_t pc)
+{
+    int overload = PD_SCEDB_PEAK_OVERLOAD_GET(pc);
+    if (overload > PD_SCEDB_PEAK_OVERLOAD_MAX) {
+        overload = PD_SCEDB_PEAK_OVERLOAD_MAX;
+    }
+
+    chprintf(chp, "peak_i%d: %d%% %d ms %d%%", n, overload * 10,
+             PD_SCEDB_PEAK_PERIOD_GET(pc) * 20,
+             PD_SCEDB_PEAK_DUTY_CYCLE_GET(pc) * 5);
+    if (pc & PD_SCEDB_PEAK_VBUS_DROOP) {
+        chprintf(chp, " droop");
+    }
+    chprintf(chp, "\r\n");
+}
+
+static void cmd_get_source_cap_ext(BaseSequentialStream *chp, int argc, char *argv[])
+{
+    (void) argv;
+    if (argc > 0) {
+        chprintf(chp, "Usage: get_source_cap_ext\r\n");
+        return;
+    }
+
+    /* If we haven't seen any Source_Capabilities_Extended */
+    if (!pdbs_dpm_data->source_cap_ext_valid) {
+        chprintf(chp, "No Source_Capabilities_Extended\r\n");
+        return;
+    }
+
+    const struct pdbs_dpm_src_cap_ext *ext = &pdbs_dpm_data->source_cap_ext;
+
+    chprintf(chp, "vid: %04X\r\n", ext->vid);
+    chprintf(chp, "pid: %04X\r\n", ext->pid);
+    chprintf(chp, "holdup_time: %d ms\r\n", ext->holdup_time);
+    for (int i = 0; i < 3; i++) {
+        print_src_peak_current(chp, i + 1, ext->peak_current[i]);
+    }
+
+    /* Print the source inputs */
+    chprintf(chp, "source_inputs:");
+    if (ext->source_inputs == 0) {
+        chprintf(chp, " (none)");
+    }
+    if (ext->source_inputs & PD_SCEDB_SOURCE_INPUTS_EXTERNAL) {
+        chprintf(chp, " external");
+    }
+    if (ext->source_inputs & PD_SCEDB_SOURCE_INPUTS_EXTERNAL_UNCONSTRAINED) {
+        chprintf(chp, " unconstrained");
+    }
+    if (ext->source_inputs & PD_SCEDB_SOURCE_INPUTS_INTERNAL_BATTERY) {
+        chprintf(chp, " battery");
+    }
+    chprintf(chp, "\r\n");
+
+    chprintf(chp, "batteries: %d fixed, %d hot_swappable\r\n",
+             (ext->batteries & PD_SCEDB_BATTERIES_FIXED) >> PD_SCEDB_BATTERIES_FIXED_SHIFT,
+             (ext->batteries & PD_SCEDB_BATTERIES_HOT_SWAPPABLE) >> PD_SCEDB_BATTERIES_HOT_SWAPPABLE_SHIFT);
+    chprintf(chp, "pdp: %d W\r\n", ext->pdp);
+    if (ext->epr_pdp != 0) {
+        chprintf(chp, "epr_pdp: %d W\r\n", ext->epr_pdp);
+    }
+}
+
+static void cmd_get_pps_status(BaseSequentialStream *chp, int argc, char *argv[])
+{
+    (void) argv;
+    if (argc > 0) {
+        chprintf(chp, "Usage: get_pps_status\r\n");
+        return;
+    }
+
+    /* If we haven't seen any PPS_Status */
+    if (!pdbs_dpm_data->pps_status_valid) {
+        chprintf(chp, "No PPS_Status\r\n");
+        return;
+    }
+
+    const struct pdbs_dpm_pps_status *status = &pdbs_dpm_data->pps_status;
+    int tmp;
+
+    /* Output voltage */
+    if (status->voltage == PD_PPSSDB_OUTPUT_VOLTAGE_UNSUPPORTED) {
+        chprintf(chp, "v: unsupported\r\n");
+    } else {
+        tmp = PD_PRV2MV(status->voltage);
+        chprintf(chp, "v: %d.%03d V\r\n", PD_MV_V(tmp), PD_MV_MV(tmp));
+    }
+
+    /* Output current */
+    if (status->current == PD_PPSSDB_OUTPUT_CURRENT_UNSUPPORTED) {
+        chprintf(chp, "i: unsupported\r\n");
+    } else {
+        chprintf(chp, "i: %d.%02d A\r\n", PD_PAI_A(status->current),
+                 PD_PAI_CA(status->current));
+    }
+
+    /* Present Temperature Flag */
+    chprintf(chp, "ptf: ");
+    switch (PD_PPSSDB_PTF_GET(status->flags)) {
+        case PD_PPSSDB_PTF_NOT_SUPPORTED:
+            chprintf(chp, "unsupported\r\n");
+            break;
+        case PD_PPSSDB_PTF_NORMAL:
+            chprintf(chp, "normal\r\n");
+            break;
+        case PD_PPSSDB_PTF_WARNING:
+            chprintf(chp, "warning\r\n");
+            break;
+        case PD_PPSSDB_PTF_OVER_TEMPERATURE:
+            chprintf(chp, "over_temperature\r\n");
+            break;
+    }
+
+    /* Operating Mode Flag */
+    if (status->flags & PD_PPSSDB_OMF) {
+        chprintf(chp, "omf: current_limit\r\n");
+    } else {
+        chprintf(chp, "omf: constant_voltage\r\n");
+    }
+
+    /* How long ago the source sent it */
+    chprintf(chp, "age: %d ms\r\n",
+             (int) TIME_I2MS(chVTTimeElapsedSinceX(status->time)));
+}
+
+static void cmd_pps_status_interval(BaseSequentialStream *chp, int argc, char *argv[])
+{
+    if (argc == 0) {
+        /* With no arguments, print the polling interval */
+        chprintf(chp, "%d ms\r\n",
+                 (int) TIME_I2MS(pdb_config->pe.pps_status_interval));
+    } else if (argc == 1) {
+        char *endptr;
+        long i = strtol(argv[0], &endptr, 0);
+        /* Allow up to a minute between polls, or 0 to stop polling */
+        if (i >= 0 && i <= 60000 && endptr > argv[0]) {
+            /* Set the polling interval.  It takes effect at the next PPS
+             * request. */
+            pdb_config->pe.pps_status_interval = TIME_MS2I(i);
+        } else {
+            chprintf(chp, "Invalid interval\r\n");
+        }
+    } else {
+        /* If there are too many arguments, print a usage message */
+        chprintf(chp, "Usage: pps_status_interval [interval_in_ms]\r\n");
+    }
+}
+
+static void cmd_get_apply_time(BaseSequentialStream *chp, int argc, char *argv[])
+{
+    (void) argv;
+    if (argc > 0) {
+        chprintf(chp, "Usage: get_apply_time\r\n");
+        return;
+    }
+
+    /* Print how long the last configuration change took to negotiate */
+    if (pdbs_dpm_data->config_apply_time_valid) {
+        chprintf(chp, "%d ms\r\n",
+                 (int) TIME_I2MS(pdbs_dpm_data->config_apply_time));
+    } else {
+        chprintf(chp, "No configuration applied\r\n");
+    }
+}
+
+static void cmd_get_telemetry(BaseSequentialStream *chp, int argc, char *argv[])
+{
+    (void) argv;
+    if (argc > 0) {
+        chprintf(chp, "Usage: get_telemetry\r\n");
+        return;
+    }
+
+    /* Get the newest filtered sample */
+    struct pdbs_telemetry t;
+    if (!pdbs_telemetry_get(&t, 0)) {
+        chprintf(chp, "No telemetry\r\n");
+        return;
+    }
+
+    chprintf(chp, "vbus: %d.%03d V\r\n", PD_MV_V(t.vbus), PD_MV_MV(t.vbus));
+    chprintf(chp, "i: %d.%02d A\r\n", PD_PDI_A(t.current), PD_PDI_CA(t.current));
+    chprintf(chp, "temp: %d \302\260C\r\n", t.temperature);
+    if (t.ntc_temperature != PDBS_TELEMETRY_NO_TEMP) {
+        chprintf(chp, "ntc: %d \302\260C\r\n", t.ntc_temperature);
+    }
+    chprintf(chp, "vdda: %d.%03d V\r\n", PD_MV_V(t.vdda), PD_MV_MV(t.vdda));
+    chprintf(chp, "age: %d ms\r\n",
+             (int) TIME_I2MS(chVTTimeElapsedSinceX(t.time)));
+}
+
+static void cmd_governor(BaseSequentialStream *chp, int argc, char *argv[])
+{
+    struct pdbs_dpm_governor *gov = &pdbs_dpm_data->governor;
+
+    if (argc == 0) {
+        /* With no arguments, print the governor's settings and state */
+        chprintf(chp, "%s\r\n", gov->enabled ? "enabled" : "disabled");
+        chprintf(chp, "step: %d.%02d A\r\n", PD_PDI_A(gov->step),
+                 PD_PDI_CA(gov->step));
+        chprintf(chp, "margin: %d %%\r\n", gov->margin);
+        chprintf(chp, "up: %d %%\r\n", gov->up_threshold);
+        chprintf(chp, "down: %d %%\r\n", gov->down_threshold);
+        chprintf(chp, "hold: %d ms\r\n", (int) TIME_I2MS(gov->hold));
+        if (gov->enabled && gov->_current != 0) {
+            chprintf(chp, "i: %d.%02d A\r\n", PD_PDI_A(gov->_current),
+                     PD_PDI_CA(gov->_current));
+        }
+    } else if (argc == 1) {
+        /* Enable or disable the governor and re-negotiate power */
+        if (strcmp(argv[0], "enable") == 0) {
+            gov->_current = 0;
+            gov->_low = false;
+            gov->enabled = true;
+            chEvtSignal(pdb_config->pe.thread, PDB_EVT_PE_NEW_POWER);
+        } else if (strcmp(argv[0], "disable") == 0) {
+            gov->enabled = false;
+            chEvtSignal(pdb_config->pe.thread, PDB_EVT_PE_NEW_POWER);
+        } else {
+            chprintf(chp, "Usage: governor [enable|disable|setting value]\r\n");
+        }
+    } else {
+        /* Change a setting */
+        char *endptr;
+        long i = strtol(argv[1], &endptr, 0);
+        if (endptr <= argv[1]) {
+            chprintf(chp, "Invalid value\r\n");
+        } else if (strcmp(argv[0], "step") == 0) {
+            if (i >= 10 && i <= PD_MA_MAX) {
+                gov->step = PD_MA2CA(i);
+            } else {
+                chprintf(chp, "Invalid current\r\n");
+            }
+        } else if (strcmp(argv[0], "margin") == 0) {
+            if (i >= 0 && i <= 100) {
+                gov->margin = i;
+            } else {
+                chprintf(chp, "Invalid percentage\r\n");
+            }
+        } else if (strcmp(argv[0], "up") == 0) {
+            if (i > gov->down_threshold && i <= 100) {
+                gov->up_threshold = i;
+            } else {
+                chprintf(chp, "Invalid percentage\r\n");
+            }
+        } else if (strcmp(argv[0], "down") == 0) {
+            if (i >= 0 && i < gov->up_threshold) {
+                gov->down_threshold = i;
+            } else {
+                chprintf(chp, "Invalid percentage\r\n");
+            }
+        } else if (strcmp(argv[0], "hold") == 0) {
+            /* Allow up to a minute, like pps_status_interval */
+            if (i >= 0 && i <= 60000) {
+                gov->hold = TIME_MS2I(i);
+            } else {
+                chprintf(chp, "Invalid interval\r\n");
+            }
+        } else {
+            chprintf(chp, "Usage: governor [enable|disable|setting value]\r\n");
+        }
+    }
+}
+
+static void cmd_thermal(BaseSequentialStream *chp, int argc, char *argv[])
+{
+    struct pdbs_dpm_thermal *th = &pdbs_dpm_data->thermal;
+
+    if (argc == 0) {
+        /* With no arguments, print the governor's settings and state */
+        chprintf(chp, "%s\r\n", th->enabled ? "enabled" : "disabled");
+        chprintf(chp, "warn: %d \302\260C\r\n", th->warn);
+        chprintf(chp, "step: %d \302\260C\r\n", th->step);
+        chprintf(chp, "hysteresis: %d \302\260C\r\n", th->hysteresis);
+        chprintf(chp, "critical: %d \302\260C\r\n", th->critical);
+        chprintf(chp, "cooldown: %d ms\r\n", (int) TIME_I2MS(th->cooldown));
+        if (th->enabled) {
+            chprintf(chp, "temp: %d \302\260C\r\n", th->_temperature);
+            if (th->_level == PDBS_DPM_THERMAL_OFF) {
+                chprintf(chp, "power: off\r\n");
+            } else {
+                chprintf(chp, "power: %d %%\r\n",
+                         100 - PDBS_DPM_THERMAL_LEVEL_PERCENT * th->_level);
+            }
+        }
+    } else if (argc == 1) {
+        /* Enable or disable the governor.  It takes effect at the next
+         * temperature check. */
+        if (strcmp(argv[0], "enable") == 0) {
+            th->enabled = true;
+        } else if (strcmp(argv[0], "disable") == 0) {
+            th->enabled = false;
+        } else {
+            chprintf(chp, "Usage: thermal [enable|disable|setting value]\r\n");
+        }
+    } else {
+        /* Change a setting */
+        char *endptr;
+        long i = strtol(argv[1], &endptr, 0);
+        if (endptr <= argv[1]) {
+            chprintf(chp, "Invalid value\r\n");
+        } else if (strcmp(argv[0], "warn") == 0) {
+            if (i >= -40 && i < th->critical) {
+                th->warn = i;
+            } else {
+                chprintf(chp, "Invalid temperature\r\n");
+            }
+        } else if (strcmp(argv[0], "step") == 0) {
+            if (i >= 0 && i <= 50) {
+                th->step = i;
+            } else {
+                chprintf(chp, "Invalid temperature\r\n");
+            }
+        } else if (strcmp(argv[0], "hysteresis") == 0) {
+            if (i >= 0 && i <= 50) {
+                th->hysteresis = i;
+            } else {
+                chprintf(chp, "Invalid temperature\r\n");
+            }
+        } else if (strcmp(argv[0], "critical") == 0) {
+            if (i > th->warn && i <= 125) {
+                th->critical = i;
+            } else {
+                chprintf(chp, "Invalid temperature\r\n");
+            }
+        } else if (strcmp(argv[0], "cooldown") == 0) {
+            /* Allow up to ten minutes */
+            if (i >= 0 && i <= 600000) {
+                th->cooldown = TIME_MS2I(i);
+            } else {
+                chprintf(chp, "Invalid interval\r\n");
+            }
+        } else {
+            chprintf(chp, "Usage: thermal [enable|disable|setting value]\r\n");
+        }
+    }
+}
+
+static void cmd_transition(BaseSequentialStream *chp, int argc, char *argv[])
+{
+    static const char *const policies[] = {"break", "tolerant", "standby"};
+
+    if (argc == 0) {
+        /* With no arguments, print the policy and how long the last voltage
+         * transition kept the output off */
+        chprintf(chp, "%s\r\n", policies[pdbs_dpm_data->transition]);
+        chprintf(chp, "last_off: %d ms\r\n",
+                 (int) TIME_I2MS(pdbs_dpm_data->transition_off_time));
+    } else if (argc == 1) {
+        /* Set the policy.  It takes effect at the next voltage transition. */
+        for (unsigned i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+            if (strcmp(argv[0], policies[i]) == 0) {
+                pdbs_dpm_data->transition = i;
+                return;
+            }
+        }
+        chprintf(chp, "Usage: transition [break|tolerant|standby]\r\n");
+    } else {
+        /* If there are too many arguments, print a usage message */
+        chprintf(chp, "Usage: transition [break|tolerant|standby]\r\n");
+    }
+}
+
+static void cmd_softstart(BaseSequentialStream *chp, int argc, char *argv[])
+{
+    struct pdbs_softstart *ss = &pdbs_dpm_data->softstart;
+
+    if (argc == 0) {
+        /* With no arguments, print the ramp profile */
+        chprintf(chp, "ramp: %d ms\r\n", (int) TIME_I2MS(ss->ramp));
+        chprintf(chp, "start: %d %%\r\n", ss->start_duty);
+        /* And the duty cycle limit, if the contract needs one */
+        uint16_t limit = pdbs_softstart_get_limit();
+        if (limit < PDBS_SOFTSTART_DUTY_MAX) {
+            chprintf(chp, "limit: %d.%d %%\r\n", limit / 10, limit % 10);
+        }
+    } else if (argc == 2) {
+        char *endptr;
+        long ramp = strtol(argv[0], &endptr, 0);
+        if (endptr <= argv[0]) {
+            chprintf(chp, "Invalid interval\r\n");
+            return;
+        }
+        long start = strtol(argv[1], &endptr, 0);
+        if (endptr <= argv[1]) {
+            chprintf(chp, "Invalid percentage\r\n");
+            return;
+        }
+        /* Allow up to a second */
+        if (ramp < 0 || ramp > 1000) {
+            chprintf(chp, "Invalid interval\r\n");
+        } else if (start < 0 || start > 100) {
+            chprintf(chp, "Invalid percentage\r\n");
+        } else {
+            /* Set the profile.  It takes effect the next time the output
+             * turns on. */
+            ss->ramp = TIME_MS2I(ramp);
+            ss->start_duty = start;
+        }
+    } else {
+        /* If the number of arguments is wrong, print a usage message */
+        chprintf(chp, "Usage: softstart [ramp_in_ms start_percent]\r\n");
+    }
+}
+
+static void cmd_heater(BaseSequentialStream *chp, int argc, char *argv[])
+{
+    struct pdbs_heater *h = &pdbs_heater;
+
+    if (argc == 0) {
+        /* With no arguments, print the controller's settings and state */
+        chprintf(chp, "%s\r\n", h->enabled ? "enabled" : "disabled");
+        chprintf(chp, "setpoint: %d \302\260C\r\n", h->setpoint);
+        chprintf(chp, "max_temp: %d \302\260C\r\n", h->max_temp);
+        chprintf(chp, "max_duty: %d %%\r\n", h->max_duty);
+        chprintf(chp, "kp: %d\r\n", h->kp);
+        chprintf(chp, "ki: %d\r\n", h->ki);
+        chprintf(chp, "kd: %d\r\n", h->kd);
+        if (h->enabled) {
+            chprintf(chp, "temp: %d \302\260C\r\n", h->_temperature / 10);
+            chprintf(chp, "duty: %d.%d %%\r\n", h->_duty / 10, h->_duty % 10);
+        }
+    } else if (argc == 1) {
+        /* Start or stop the controller.  It takes effect at the start of the
+         * next control period. */
+        if (strcmp(argv[0], "enable") == 0) {
+            h->enabled = true;
+        } else if (strcmp(argv[0], "disable") == 0) {
+            h->enabled = false;
+        } else {
+            chprintf(chp, "Usage: heater [enable|disable|setting value]\r\n");
+        }
+    } else {
+        /* Change a setting */
+        char *endptr;
+        long i = strtol(argv[1], &endptr, 0);
+        if (endptr <= argv[1]) {
+            chprintf(chp, "Invalid value\r\n");
+        } else if (strcmp(argv[0], "setpoint") == 0) {
+            if (i >= PDBS_HEATER_SETPOINT_MIN && i <= h->max_temp) {
+                h->setpoint = i;
+            } else {
+                chprintf(chp, "Invalid temperature\r\n");
+            }
+        } else if (strcmp(argv[0], "max_temp") == 0) {
+            if (i >= PDBS_HEATER_SETPOINT_MIN && i <= 500) {
+                h->max_temp = i;
+                if (h->setpoint > i) {
+                    h->setpoint = i;
+                }
+            } else {
+                chprintf(chp, "Invalid temperature\r\n");
+            }
+        } else if (strcmp(argv[0], "max_duty") == 0) {
+            if (i >= 0 && i <= 100 - 100 * PDBS_HEATER_OFF_WINDOW / PDBS_HEATER_PERIOD) {
+                h->max_duty = i;
+            } else {
+                chprintf(chp, "Invalid percentage\r\n");
+            }
+        } else if (i < 0 || i > 10000) {
+            chprintf(chp, "Invalid value\r\n");
+        } else if (strcmp(argv[0], "kp") == 0) {
+            h->kp = i;
+        } else if (strcmp(argv[0], "ki") == 0) {
+            h->ki = i;
+        } else if (strcmp(argv[0], "kd") == 0) {
+            h->kd = i;
+        } else {
+            chprintf(chp, "Usage: heater [enable|disable|setting value]\r\n");
+        }
+    }
+}
+
+static void cmd_heater_stats(BaseSequentialStream *chp, int argc, char *argv[])
+{
+    if (argc == 0) {
+        /* With no arguments, print the control loop's timing */
+        struct pdbs_heater_stats stats;
+        pdbs_heater_stats_get(&stats);
+        if (stats.periods == 0) {
+            chprintf(chp, "No control periods\r\n");
+            return;
+        }
+        chprintf(chp, "periods: %d\r\n", (int) stats.periods);
+        chprintf(chp, "latency: %d-%d us\r\n", stats.latency_min,
+                 stats.latency_max);
+        chprintf(chp, "jitter: %d us\r\n",
+                 stats.latency_max - stats.latency_min);
+        chprintf(chp, "control: %d us\r\n", stats.control_max);
+        chprintf(chp, "load: %d.%d %%\r\n", stats.load / 10, stats.load % 10);
+    } else if (argc == 1 && strcmp(argv[0], "reset") == 0) {
+        pdbs_heater_stats_reset();
+    } else {
+        chprintf(chp, "Usage: heater_stats [reset]\r\n");
+    }
+}
+
+static void cmd_flash_stats(BaseSequentialStream *chp, int argc, char *argv[])
+{
+    if (argc == 0) {
+        /* With no arguments, print the timing of flash writes */
+        struct pdbs_flash_stats stats;
+        pdbs_flash_stats_get(&stats);
+        chprintf(chp, "programs: %d\r\n", (int) stats.programs);
+        chprintf(chp, "program: %d us\r\n", stats.program_max);
+        chprintf(chp, "erases: %d\r\n", (int) stats.erases);
+        chprintf(chp, "erase: %d us\r\n", stats.erase_max);
+        chprintf(chp, "erase_wait: %d ms\r\n", stats.erase_wait_max);
+    } else if (argc == 1 && strcmp(argv[0], "reset") == 0) {
+        pdbs_flash_stats_reset();
+    } else {
+        chprintf(chp, "Usage: flash_stats [reset]\r\n");
+    }
+}
+
+static void cmd_chargers(BaseSequentialStream *chp, int argc, char *argv[])
+{
+    if (argc == 0) {
+        /* With no arguments, print the charger database */
+        struct pdbs_charger_stats stats;
+        pdbs_charger_stats_get(&stats);
+        chprintf(chp, "lookups: %d\r\n", (int) stats.lookups);
+        chprintf(chp, "hits: %d\r\n", (int) stats.hits);
+        chprintf(chp, "avoided: %d\r\n", (int) stats.avoided);
+
+        struct pdbs_charger ch;
+        for (int i = 0; pdbs_charger_get(i, &ch); i++) {
+            if (ch.fingerprint == 0) {
+                continue;
+            }
+            chprintf(chp, "%d: %08X\r\n", i, (unsigned) ch.fingerprint);
+            chprintf(chp, "\tseen: %d\r\n", (int) ch.last_seen);
+            if (ch.pdo != 0) {
+                chprintf(chp, "\tpdo: %d\r\n", ch.pdo);
+                chprintf(chp, "\ttransition: %d ms\r\n", ch.transition_time);
+            }
+            chprintf(chp, "\tresets: %d\r\n", ch.resets);
+            if (ch.avoid != 0) {
+                chprintf(chp, "\tavoid:");
+                for (int pos = 1; pos <= 16; pos++) {
+                    if (ch.avoid & (1 << (pos - 1))) {
+                        chprintf(chp, " %d", pos);
+                    }
+                }
+                chprintf(chp, "\r\n");
+            }
+        }
+    } else if (argc == 1 && strcmp(argv[0], "forget") == 0) {
+        pdbs_charger_forget();
+    } else {
+        chprintf(chp, "Usage: chargers [forget]\r\n");
+    }
+}
+
+/*
+ * Print the names of the reset flags set in the given RCC_CSR bits 24-31
+ */
+static void print_reset_flags(BaseSequentialStream *chp, uint8_t reset)
+{
+    static const struct {
+        uint32_t flag;
+        const char *name;
+    } flags[] = {
+        {RCC_CSR_PORRSTF, "power"},
+        {RCC_CSR_PINRSTF, "pin"},
+        {RCC_CSR_SFTRSTF, "software"},
+        {RCC_CSR_IWDGRSTF, "iwdg"},
+        {RCC_CSR_WWDGRSTF, "wwdg"},
+        {RCC_CSR_LPWRRSTF, "low_power"},
+        {RCC_CSR_OBLRSTF, "option_bytes"}
+    };
+
+    chprintf(chp, "\treset:");
+    for (unsigned i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+        if (reset & (flags[i].flag >> 24)) {
+            chprintf(chp, " %s", flags[i].name);
+        }
+    }
+    chprintf(chp, "\r\n");
+}
+
+static void cmd_crashes(BaseSequentialStream *chp, int argc, char *argv[])
+{
+    static const char *causes[] = {
+        [PDBS_CRASH_HARD_FAULT] = "hard_fault",
+        [PDBS_CRASH_HALT] = "halt",
+        [PDBS_CRASH_WATCHDOG] = "watchdog"
+    };
+
+    if (argc == 0) {
+        /* With no arguments, print the crash log, oldest first */
+        const struct pdbs_crash *c = pdbs_crash_next(NULL);
+        if (c == NULL) {
+            chprintf(chp, "No crashes\r\n");
+            return;
+        }
+        for (; c != NULL; c = pdbs_crash_next(c)) {
+            chprintf(chp, "%d: %s\r\n", (int) c->seq,
+                     (c->cause <= PDBS_CRASH_WATCHDOG)
+                        ? causes[c->cause] : "unknown");
+            print_reset_flags(chp, c->reset);
+            if (c->cause == PDBS_CRASH_WATCHDOG) {
+                continue;
+            }
+            chprintf(chp, "\tuptime: %d ms\r\n", (int) c->uptime);
+            if (c->thread[0] != '\0') {
+                chprintf(chp, "\tthread: %s\r\n", c->thread);
+            }
+            if (c->cause == PDBS_CRASH_HALT) {
+                chprintf(chp, "\treason: %s\r\n", c->reason);
+            } else {
+                chprintf(chp, "\tpc: 0x%08X\r\n", (unsigned) c->pc);
+                chprintf(chp, "\tlr: 0x%08X\r\n", (unsigned) c->lr);
+                chprintf(chp, "\tpsr: 0x%08X\r\n", (unsigned) c->psr);
+            }
+            if (c->pe_state == UINT8_MAX) {
+                continue;
+            }
+            chprintf(chp, "\tpe: %d\r\n", c->pe_state);
+            chprintf(chp, "\tprl_rx: %d\r\n", c->prl_rx_state);
+            chprintf(chp, "\tprl_tx: %d\r\n", c->prl_tx_state);
+            chprintf(chp, "\thardrst: %d\r\n", c->hardrst_state);
+            chprintf(chp, "\ttrace:");
+            for (int i = 0; i < PDB_PE_TRACE_LEN; i++) {
+                if (c->trace[i].state != UINT8_MAX) {
+                    chprintf(chp, " %d@%d", c->trace[i].state,
+                             c->trace[i].time);
+                }
+            }
+            chprintf(chp, "\r\n");
+        }
+    } else if (argc == 1 && strcmp(argv[0], "clear") == 0) {
+        pdbs_crash_clear();
+    } else {
+        chprintf(chp, "Usage: crashes [clear]\r\n");
+    }
+}
+
+static void cmd_telemetry_stats(BaseSequentialStream *chp, int argc,
+        char *argv[])
+{
+    if (argc == 0) {
+        /* With no arguments, print the cost of the decimation filter */
+        struct pdbs_telemetry_stats stats;
+        pdbs_telemetry_stats_get(&stats);
+        if (stats.filtered == 0) {
+            chprintf(chp, "No half buffers filtered\r\n");
+            return;
+        }
+        uint32_t avg = stats.filter_cycles / stats.filtered;
+        chprintf(chp, "filtered: %d\r\n", (int) stats.filtered);
+        chprintf(chp, "filter: %d cycles, %d us\r\n", (int) avg,
+                 (int) (avg / (STM32_HCLK / 1000000)));
+        chprintf(chp, "filter_max: %d cycles, %d us\r\n",
+                 (int) stats.filter_max,
+                 (int) (stats.filter_max / (STM32_HCLK / 1000000)));
+    } else if (argc == 1 && strcmp(argv[0], "reset") == 0) {
+        pdbs_telemetry_stats_reset();
+    } else {
+        chprintf(chp, "Usage: telemetry_stats [reset]\r\n");
+    }
+}
+
+static void cmd_history(BaseSequentialStream *chp, int argc, char *argv[])
+{
+    static const char *types[] = {
+        [PDBS_HISTORY_SYNC] = "sync",
+        [PDBS_HISTORY_CONTRACT] = "contract",
+        [PDBS_HISTORY_HARD_RESET] = "hard_reset",
+        [PDBS_HISTORY_SOFT_RESET] = "soft_reset",
+        [PDBS_HISTORY_POWER] = "power",
+        [PDBS_HISTORY_DETACH] = "detach"
+    };
+    struct pdbs_history_reader r;
+
+    if (argc == 0) {
+        /* With no arguments, print the log, oldest first */
+        struct pdbs_history_stats stats;
+        pdbs_history_stats_get(&stats);
+        chprintf(chp, "boot: %d\r\n", stats.boot);
+        chprintf(chp, "logged: %d\r\n", (int) stats.logged);
+        chprintf(chp, "dropped: %d\r\n", (int) stats.dropped);
+        chprintf(chp, "written: %d B\r\n", (int) stats.bytes);
+        chprintf(chp, "page_used: %d B\r\n", stats.page_used);
+
+        struct pdbs_history_event ev;
+        bool started = false;
+        uint16_t boot = 0;
+        pdbs_history_read_start(&r);
+        while (pdbs_history_read(&r, &ev)) {
+            /* A SYNC only matters to us when a new startup begins */
+            if (ev.type == PDBS_HISTORY_SYNC) {
+                if (started && ev.boot == boot) {
+                    continue;
+                }
+                started = true;
+                boot = ev.boot;
+                chprintf(chp, "%d:\r\n", boot);
+                continue;
+            }
+            chprintf(chp, "\t%d s: %s", (int) ev.time, types[ev.type]);
+            if (ev.type == PDBS_HISTORY_CONTRACT) {
+                chprintf(chp, " %d", ev.pdo);
+            }
+            if (ev.type == PDBS_HISTORY_CONTRACT
+                    || ev.type == PDBS_HISTORY_POWER) {
+                chprintf(chp, " %d.%02d V %d.%02d A", ev.v / 100, ev.v % 100,
+                         ev.i / 100, ev.i % 100);
+            }
+            chprintf(chp, "\r\n");
+        }
+    } else if (argc == 1 && strcmp(argv[0], "raw") == 0) {
+        /* Dump the pages of the log in hex, oldest first */
+        const uint8_t *page;
+        size_t len;
+        pdbs_history_read_start(&r);
+        while ((page = pdbs_history_read_page(&r, &len)) != NULL) {
+            for (size_t i = 0; i < len; i++) {
+                chprintf(chp, "%02X", page[i]);
+                if (i % 32 == 31 || i == len - 1) {
+                    chprintf(chp, "\r\n");
+                }
+            }
+            chprintf(chp, "\r\n");
+        }
+    } else if (argc == 1 && strcmp(argv[0], "clear") == 0) {
+        pdbs_history_clear();
+    } else {
+        chprintf(chp, "Usage: history [raw|clear]\r\n");
+    }
+}
+
+static void cmd_update(BaseSequentialStream *chp, int argc, char *argv[])
+{
+    static const char *errors[] = {
+        [PDBS_UPDATE_UNCONFIRMED] = "running image not confirmed yet",
+        [PDBS_UPDATE_TOO_BIG] = "image too big",
+        [PDBS_UPDATE_WRONG_SLOT] = "image not linked for this slot",
+        [PDBS_UPDATE_OUT_OF_ORDER] = "block out of order",
+        [PDBS_UPDATE_BAD_CRC] = "CRC mismatch"
+    };
+    /* One block at a time, too big for the shell's stack */
+    static uint8_t frame[4 + PDBS_UPDATE_BLOCK_SIZE];
+
+    if (argc == 0) {
+        /* With no arguments, print the state of the slots */
+        uint8_t slot = pdbs_update_slot();
+        chprintf(chp, "slot: %c\r\n", 'a' + slot);
+        chprintf(chp, "confirmed: %s\r\n",
+                 pdbs_update_confirmed() ? "yes" : "no");
+        chprintf(chp, "target: %c\r\n", 'a' + !slot);
+        chprintf(chp, "block: %d\r\n", PDBS_UPDATE_BLOCK_SIZE);
+        return;
+    }
+    if (argc != 2) {
+        chprintf(chp, "Usage: update [length crc32]\r\n");
+        return;
+    }
+
+    char *endptr;
+    unsigned long length = strtoul(argv[0], &endptr, 0);
+    char *endptr2;
+    unsigned long crc = strtoul(argv[1], &endptr2, 16);
+    if (endptr <= argv[0] || endptr2 <= argv[1]) {
+        chprintf(chp, "Usage: update [length crc32]\r\n");
+        return;
+    }
+
+    systime_t start = chVTGetSystemTime();
+    enum pdbs_update_status status = pdbs_update_begin(length, crc);
+    if (status != PDBS_UPDATE_OK) {
+        chprintf(chp, "Error: %s\r\n", errors[status]);
+        return;
+    }
+    chprintf(chp, "ready\r\n");
+
+    /* Take the image a block at a time.  Each block is its number and the
+     * CRC-16 of its data, both little-endian, then the data, padded with
+     * 0xFF.  A block that's already been taken is acknowledged again, in case
+     * the acknowledgement was lost. */
+    systime_t transfer_start = chVTGetSystemTime();
+    uint32_t blocks = (length + PDBS_UPDATE_BLOCK_SIZE - 1)
+        / PDBS_UPDATE_BLOCK_SIZE;
+    uint32_t next = 0;
+    while (next < blocks) {
+        if (chnReadTimeout((BaseAsynchronousChannel *) chp, frame,
+                    sizeof(frame), PDBS_UPDATE_BLOCK_TIMEOUT)
+                != sizeof(frame)) {
+            chprintf(chp, "Error: timed out\r\n");
+            return;
+        }
+
+        uint16_t n = frame[0] | (frame[1] << 8);
+        uint16_t block_crc = frame[2] | (frame[3] << 8);
+        if (n > next || pdbs_flash_crc(frame + 4, PDBS_UPDATE_BLOCK_SIZE,
+                    0xFFFF) != block_crc) {
+            chprintf(chp, "retry %d\r\n", (int) next);
+            continue;
+        }
+        if (n == next) {
+            uint32_t offset = next * PDBS_UPDATE_BLOCK_SIZE;
+            status = pdbs_update_write(offset, frame + 4,
+                    (length - offset < PDBS_UPDATE_BLOCK_SIZE)
+                        ? length - offset : PDBS_UPDATE_BLOCK_SIZE);
+            if (status != PDBS_UPDATE_OK) {
+                chprintf(chp, "Error: %s\r\n", errors[status]);
+                return;
+            }
+            next++;
+        }
+        chprintf(chp, "ok %d\r\n", n);
+    }
+    uint32_t transfer_ms = TIME_I2MS(chVTTimeElapsedSinceX(transfer_start));
+
+    status = pdbs_update_finish();
+    if (status != PDBS_UPDATE_OK) {
+        chprintf(chp, "Error: %s\r\n", errors[status]);
+        return;
+    }
+    uint32_t total_ms = TIME_I2MS(chVTTimeElapsedSinceX(start));
+
+    chprintf(chp, "transfer: %d B in %d ms (%d B/s)\r\n", (int) length,
+             (int) transfer_ms,
+             (int) (length * 1000 / (transfer_ms ? transfer_ms : 1)));
+    chprintf(chp, "total: %d ms\r\n", (int) total_ms);
+    chprintf(chp, "Rebooting into slot %c\r\n", 'a' + !pdbs_update_slot());
+
+    /* Give the host time to read that before we disappear */
+    chThdSleep(TIME_MS2I(100));
+    sduStop(&SDU1);
+    usbDisconnectBus(serusbcfg.usbp);
+    NVIC_SystemReset();
+}
+
 /*
  * List of shell commands
  */
@@ -521,11 +1622,17 @@ static const struct pdbs_shell_cmd commands[] = {
     {"load", cmd_load, "Load the stored configuration into the buffer"},
     {"write", cmd_write, "Store the configuration buffer"},
     {"erase", cmd_erase, "Erase all stored configuration"},
+    {"profile", cmd_profile, "Get or set the profile of the buffer"},
+    {"get_profiles", cmd_get_profiles, "Print the configuration of every stored profile"},
+    {"remove_profile", cmd_remove_profile, "Remove a stored profile"},
     {"get_tmpcfg", cmd_get_tmpcfg, "Print the configuration buffer"},
+    {"set_name", cmd_set_name, "Set or clear the name of the buffer's profile"},
     {"clear_flags", cmd_clear_flags, "Clear all flags"},
     {"toggle_giveback", cmd_toggle_giveback, "Toggle the GiveBack flag"},
     {"toggle_hv_preferred", cmd_toggle_hv_preferred, "Toggle the HV_Preferred flag"},
-    /* TODO {"toggle_var_bat", cmd_toggle_var_bat, "Toggle the Var/Bat flag"},*/
+    {"toggle_var_bat", cmd_toggle_var_bat, "Toggle the Var/Bat flag"},
+    {"toggle_peak_current", cmd_toggle_peak_current, "Toggle the Peak_Current flag"},
+    {"toggle_pps_preferred", cmd_toggle_pps_preferred, "Toggle the PPS_Preferred flag"},
     {"set_v", cmd_set_v, "Set the voltage in millivolts"},
     {"set_vrange", cmd_set_vrange, "Set the minimum and maximum voltage in millivolts"},
     {"set_i", cmd_set_i, "Set the current in milliamps"},
@@ -533,6 +1640,23 @@ static const struct pdbs_shell_cmd commands[] = {
     {"set_r", cmd_set_r, "Set the resistance in milliohms"},
     {"output", cmd_output, "Get or set the output status"},
     {"get_source_cap", cmd_get_source_cap, "Print the capabilities of the PD source"},
+    {"get_source_cap_ext", cmd_get_source_cap_ext, "Print the extended capabilities of the PD source"},
+    {"get_pps_status", cmd_get_pps_status, "Print the most recent PPS status of the PD source"},
+    {"pps_status_interval", cmd_pps_status_interval, "Get or set the PPS status polling interval in milliseconds"},
+    {"get_apply_time", cmd_get_apply_time, "Print how long the last configuration change took to negotiate"},
+    {"get_telemetry", cmd_get_telemetry, "Print the measured VBUS, output current, and temperature"},
+    {"governor", cmd_governor, "Get or set the load-following power governor"},
+    {"thermal", cmd_thermal, "Get or set the thermal governor"},
+    {"transition", cmd_transition, "Get or set what happens to the output during voltage transitions"},
+    {"softstart", cmd_softstart, "Get or set the output soft-start ramp"},
+    {"heater", cmd_heater, "Get or set the soldering iron temperature controller"},
+    {"heater_stats", cmd_heater_stats, "Print or reset the timing of the temperature control loop"},
+    {"flash_stats", cmd_flash_stats, "Print or reset the timing of flash writes"},
+    {"chargers", cmd_chargers, "Print or forget what's been learned about chargers"},
+    {"crashes", cmd_crashes, "Print or clear the crash log"},
+    {"telemetry_stats", cmd_telemetry_stats, "Print or reset the CPU cost of the telemetry filter"},
+    {"history", cmd_history, "Print or clear the contract and power history"},
+    {"update", cmd_update, "Update the firmware in the other slot"},
     {NULL, NULL, NULL}
 };
 
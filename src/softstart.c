@@ -0,0 +1,217 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "softstart.h"
+
+#include <hal.h>
+
+
+/* The output switch is on PB8, which is TIM16_CH1 as alternate function 2 */
+#define SOFTSTART_TIM TIM16
+#define SOFTSTART_AF 2
+
+/* Auto-reload value giving the PWM frequency */
+#define SOFTSTART_ARR (STM32_TIMCLK1 / PDBS_SOFTSTART_FREQUENCY - 1)
+
+/* Output compare modes.  Forcing the output takes effect immediately, without
+ * waiting for the end of a PWM period. */
+#define SOFTSTART_OC1M_OFF TIM_CCMR1_OC1M_2
+#define SOFTSTART_OC1M_ON (TIM_CCMR1_OC1M_2 | TIM_CCMR1_OC1M_0)
+#define SOFTSTART_OC1M_PWM (TIM_CCMR1_OC1M_2 | TIM_CCMR1_OC1M_1)
+
+
+/*
+ * States of the output switch
+ */
+enum softstart_state {
+    SOFTSTART_OFF,
+    SOFTSTART_RAMP,
+    SOFTSTART_ON
+};
+
+/* The state of the output switch, only changed with the system locked */
+static volatile uint8_t softstart_state = SOFTSTART_OFF;
+
+/* Whether the switch is gated on while the output is on */
+static volatile bool softstart_gate = true;
+
+/* The largest duty cycle the switch may have, in tenths of a percent */
+static volatile uint16_t softstart_limit = PDBS_SOFTSTART_DUTY_MAX;
+
+/* The profile of the ramp in progress, and when it started */
+static struct pdbs_softstart softstart_profile;
+static systime_t softstart_start;
+
+/* Timer for raising the duty cycle */
+static virtual_timer_t softstart_timer;
+
+
+/*
+ * Set the compare value for the given duty cycle, in tenths of a percent.
+ */
+static void softstart_set_duty(uint16_t duty)
+{
+    SOFTSTART_TIM->CCR1 = (uint32_t) duty * (SOFTSTART_ARR + 1)
+        / PDBS_SOFTSTART_DUTY_MAX;
+}
+
+/*
+ * Drive the switch for the on state: off if gated off, PWM at the limit if
+ * there is one, or fully on otherwise.  Must be called with the system locked.
+ */
+static void softstart_on_apply(void)
+{
+    if (!softstart_gate) {
+        SOFTSTART_TIM->CCMR1 = SOFTSTART_OC1M_OFF;
+    } else if (softstart_limit >= PDBS_SOFTSTART_DUTY_MAX) {
+        SOFTSTART_TIM->CCMR1 = SOFTSTART_OC1M_ON;
+    } else {
+        softstart_set_duty(softstart_limit);
+        SOFTSTART_TIM->CCMR1 = SOFTSTART_OC1M_PWM;
+    }
+}
+
+/*
+ * Ramp timer callback, raising the duty cycle or finishing the ramp
+ */
+static void softstart_timer_cb(void *p)
+{
+    (void) p;
+
+    chSysLockFromISR();
+    /* The output may have been turned off meanwhile */
+    if (softstart_state == SOFTSTART_RAMP) {
+        sysinterval_t elapsed = chVTTimeElapsedSinceX(softstart_start);
+        if (elapsed >= softstart_profile.ramp) {
+            /* The ramp is over, so leave the switch on */
+            softstart_state = SOFTSTART_ON;
+            softstart_on_apply();
+        } else {
+            softstart_set_duty(pdbs_softstart_duty(&softstart_profile,
+                        elapsed));
+            chVTSetI(&softstart_timer, PDBS_SOFTSTART_STEP,
+                    softstart_timer_cb, NULL);
+        }
+    }
+    chSysUnlockFromISR();
+}
+
+uint16_t pdbs_softstart_duty(const struct pdbs_softstart *ss,
+        sysinterval_t elapsed)
+{
+    /* Read the limit once, since it may change from another thread */
+    uint16_t limit = softstart_limit;
+    if (elapsed >= ss->ramp) {
+        return limit;
+    }
+
+    uint16_t start = ss->start_duty * 10;
+    if (start > PDBS_SOFTSTART_DUTY_MAX) {
+        start = PDBS_SOFTSTART_DUTY_MAX;
+    }
+    uint16_t duty = start + (uint32_t) (PDBS_SOFTSTART_DUTY_MAX - start)
+        * elapsed / ss->ramp;
+    return (duty > limit) ? limit : duty;
+}
+
+void pdbs_softstart_init(void)
+{
+    chVTObjectInit(&softstart_timer);
+
+    /* Run the timer at the PWM frequency, with the switch forced off */
+    rccEnableTIM16(true);
+    SOFTSTART_TIM->CR1 = 0;
+    SOFTSTART_TIM->PSC = 0;
+    SOFTSTART_TIM->ARR = SOFTSTART_ARR;
+    SOFTSTART_TIM->CCR1 = 0;
+    SOFTSTART_TIM->CCMR1 = SOFTSTART_OC1M_OFF;
+    SOFTSTART_TIM->CCER = TIM_CCER_CC1E;
+    SOFTSTART_TIM->BDTR = TIM_BDTR_MOE;
+    SOFTSTART_TIM->EGR = TIM_EGR_UG;
+    SOFTSTART_TIM->CR1 = TIM_CR1_CEN;
+
+    /* Hand the switch over to the timer */
+    palSetLineMode(LINE_OUT_CTRL, PAL_MODE_ALTERNATE(SOFTSTART_AF));
+}
+
+void pdbs_softstart_on(const struct pdbs_softstart *ss)
+{
+    chSysLock();
+    if (softstart_state == SOFTSTART_OFF) {
+        if (ss->ramp == 0) {
+            /* Switch hard on */
+            softstart_state = SOFTSTART_ON;
+            softstart_on_apply();
+        } else {
+            /* Start the ramp */
+            softstart_profile = *ss;
+            softstart_start = chVTGetSystemTimeX();
+            softstart_set_duty(pdbs_softstart_duty(ss, 0));
+            SOFTSTART_TIM->CCMR1 = SOFTSTART_OC1M_PWM;
+            softstart_state = SOFTSTART_RAMP;
+            chVTSetI(&softstart_timer, PDBS_SOFTSTART_STEP,
+                    softstart_timer_cb, NULL);
+        }
+    }
+    chSysUnlock();
+}
+
+void pdbs_softstart_off(void)
+{
+    chSysLock();
+    /* Open the switch first, then clean up */
+    SOFTSTART_TIM->CCMR1 = SOFTSTART_OC1M_OFF;
+    softstart_state = SOFTSTART_OFF;
+    if (chVTIsArmedI(&softstart_timer)) {
+        chVTResetI(&softstart_timer);
+    }
+    chSysUnlock();
+}
+
+void pdbs_softstart_gateI(bool on)
+{
+    softstart_gate = on;
+    if (softstart_state == SOFTSTART_ON) {
+        softstart_on_apply();
+    }
+}
+
+void pdbs_softstart_limit(uint16_t duty)
+{
+    chSysLock();
+    softstart_limit = duty;
+    /* The compare register isn't preloaded, so this takes effect within the
+     * PWM period in progress */
+    if (softstart_state == SOFTSTART_ON) {
+        softstart_on_apply();
+    } else if (softstart_state == SOFTSTART_RAMP) {
+        softstart_set_duty(pdbs_softstart_duty(&softstart_profile,
+                    chVTTimeElapsedSinceX(softstart_start)));
+    }
+    chSysUnlock();
+}
+
+uint16_t pdbs_softstart_get_limit(void)
+{
+    return softstart_limit;
+}
+
+bool pdbs_softstart_is_on(void)
+{
+    return softstart_state != SOFTSTART_OFF;
+}
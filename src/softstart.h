@@ -0,0 +1,100 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PDBS_SOFTSTART_H
+#define PDBS_SOFTSTART_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <ch.h>
+
+
+/* Frequency of the PWM on the output switch, in hertz */
+#define PDBS_SOFTSTART_FREQUENCY 20000
+
+/* How often the duty cycle is raised during a ramp */
+#define PDBS_SOFTSTART_STEP TIME_MS2I(1)
+
+/* Full duty cycle.  Duty cycles are in tenths of a percent. */
+#define PDBS_SOFTSTART_DUTY_MAX 1000
+
+
+/*
+ * Soft-start ramp profile
+ *
+ * When the output turns on, the switch is driven with PWM, its duty cycle
+ * rising linearly from start_duty to full over ramp.  Then it's left on.
+ */
+struct pdbs_softstart {
+    /* How long the ramp takes, or 0 to switch the output hard on */
+    sysinterval_t ramp;
+    /* Duty cycle the ramp starts from, in percent */
+    uint8_t start_duty;
+};
+
+/*
+ * Return the duty cycle for the given time since the start of a ramp with the
+ * given profile, in tenths of a percent, never more than the duty cycle limit.
+ */
+uint16_t pdbs_softstart_duty(const struct pdbs_softstart *ss,
+        sysinterval_t elapsed);
+
+/*
+ * Set up the timer driving the output switch, with the output off
+ */
+void pdbs_softstart_init(void);
+
+/*
+ * Turn the output on, ramping it up with the given profile.  Does nothing if
+ * the output is already on or ramping up.
+ */
+void pdbs_softstart_on(const struct pdbs_softstart *ss);
+
+/*
+ * Turn the output off immediately, aborting any ramp
+ */
+void pdbs_softstart_off(void);
+
+/*
+ * Gate the switch while the output is on, for heater control.  A gated-off
+ * output still counts as on, and a ramp ends in the gated state.  Must be
+ * called from a locked context.
+ */
+void pdbs_softstart_gateI(bool on);
+
+/*
+ * Limit the duty cycle of the switch, in tenths of a percent.  While the limit
+ * is below PDBS_SOFTSTART_DUTY_MAX, the switch is driven with PWM at the limit
+ * instead of being left fully on, and ramps stop rising at the limit.  Takes
+ * effect immediately.
+ */
+void pdbs_softstart_limit(uint16_t duty);
+
+/*
+ * Return the duty cycle limit of the switch, in tenths of a percent.
+ */
+uint16_t pdbs_softstart_get_limit(void);
+
+/*
+ * Return whether the output is on or ramping up.
+ */
+bool pdbs_softstart_is_on(void);
+
+
+#endif /* PDBS_SOFTSTART_H */
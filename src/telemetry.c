@@ -0,0 +1,323 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "telemetry.h"
+
+#include <string.h>
+
+
+#if PDBS_TELEMETRY_VBUS_CHANNEL >= PDBS_TELEMETRY_ISENSE_CHANNEL \
+    || PDBS_TELEMETRY_ISENSE_CHANNEL >= 16
+#error "PDBS_TELEMETRY_VBUS_CHANNEL must be below PDBS_TELEMETRY_ISENSE_CHANNEL, below 16"
+#endif
+#if defined(PDBS_TELEMETRY_NTC_CHANNEL) \
+    && (PDBS_TELEMETRY_ISENSE_CHANNEL >= PDBS_TELEMETRY_NTC_CHANNEL \
+        || PDBS_TELEMETRY_NTC_CHANNEL >= PDBS_TELEMETRY_TIP_CHANNEL)
+#error "PDBS_TELEMETRY_NTC_CHANNEL must be above PDBS_TELEMETRY_ISENSE_CHANNEL, below PDBS_TELEMETRY_TIP_CHANNEL"
+#endif
+#if PDBS_TELEMETRY_ISENSE_CHANNEL >= PDBS_TELEMETRY_TIP_CHANNEL \
+    || PDBS_TELEMETRY_TIP_CHANNEL >= 16
+#error "PDBS_TELEMETRY_TIP_CHANNEL must be above PDBS_TELEMETRY_ISENSE_CHANNEL, below 16"
+#endif
+
+/* Channels in the order the ADC converts them (ascending channel number) */
+#define TELEMETRY_VBUS 0
+#define TELEMETRY_ISENSE 1
+#ifdef PDBS_TELEMETRY_NTC_CHANNEL
+#define TELEMETRY_NTC 2
+#define TELEMETRY_TIP 3
+#else
+#define TELEMETRY_TIP 2
+#endif
+#define TELEMETRY_TEMP (TELEMETRY_TIP + 1)
+#define TELEMETRY_VREF (TELEMETRY_TIP + 2)
+#define TELEMETRY_CHANNELS (TELEMETRY_TIP + 3)
+
+/* The number of conversion sequences in the DMA buffer.  The ADC converts
+ * continuously from HSI14, each conversion taking 252 cycles (239.5 sampling,
+ * as the temperature sensor needs at least 17.1 us, plus 12.5), so a sequence
+ * of five channels takes 90 us (108 us with the NTC).  Each half of the
+ * buffer then fills every 2.9 ms. */
+#define TELEMETRY_DEPTH 64
+
+/* The number of half buffers averaged into each filtered sample, for one
+ * sample about every 23 ms */
+#define TELEMETRY_DECIMATION 8
+
+/* Factory calibration values */
+/* VREFINT reading at 3.3 V */
+#define TELEMETRY_VREFINT_CAL (*(const uint16_t *) 0x1FFFF7BA)
+/* Temperature sensor readings at 3.3 V, 30 and 110 degrees Celsius */
+#define TELEMETRY_TS_CAL1 (*(const uint16_t *) 0x1FFFF7B8)
+#define TELEMETRY_TS_CAL2 (*(const uint16_t *) 0x1FFFF7C2)
+#define TELEMETRY_TS_CAL1_TEMP 30
+#define TELEMETRY_TS_CAL2_TEMP 110
+/* The supply voltage the calibration values were taken at, in millivolts */
+#define TELEMETRY_CAL_VDDA 3300
+
+#ifdef PDBS_TELEMETRY_NTC_CHANNEL
+/* Readings from the NTC divider every 10 degrees Celsius, starting at
+ * TELEMETRY_NTC_MIN_TEMP.  The divider is ratiometric, so these don't depend
+ * on VDDA. */
+#define TELEMETRY_NTC_MIN_TEMP -20
+#define TELEMETRY_NTC_TEMP_STEP 10
+static const uint16_t telemetry_ntc_table[] = {
+    3740, 3495, 3156, 2738, 2278, 1825, 1419, 1081, 815,
+    613, 462, 350, 267, 206, 160, 126, 100, 80
+};
+#define TELEMETRY_NTC_POINTS \
+    ((int) (sizeof(telemetry_ntc_table) / sizeof(telemetry_ntc_table[0])))
+#endif
+
+
+/*
+ * Averaged raw readings, as stored in the history
+ */
+struct telemetry_raw {
+    adcsample_t sample[TELEMETRY_CHANNELS];
+    systime_t time;
+};
+
+/* DMA buffer, filled continuously by the ADC */
+static adcsample_t telemetry_buf[TELEMETRY_DEPTH * TELEMETRY_CHANNELS];
+
+/* Decimation filter state, only touched by the ADC callback */
+static uint32_t telemetry_acc[TELEMETRY_CHANNELS];
+static uint8_t telemetry_acc_count;
+
+/* History of filtered samples.  Only the ADC callback writes it; it fills
+ * telemetry_history[telemetry_head % PDBS_TELEMETRY_HISTORY] and then
+ * increments telemetry_head, so readers can tell when a slot they're copying
+ * was overwritten. */
+static volatile struct telemetry_raw telemetry_history[PDBS_TELEMETRY_HISTORY];
+static volatile uint32_t telemetry_head;
+
+/* CPU cost of the filter, only written by the ADC callback */
+static struct pdbs_telemetry_stats telemetry_stats;
+
+
+/*
+ * ADC callback, run when each half of the DMA buffer is full
+ *
+ * This is the whole filter: the samples are summed here, in interrupt context,
+ * so no thread is woken for them.
+ */
+static void telemetry_adc_cb(ADCDriver *adcp, adcsample_t *buffer, size_t n)
+{
+    (void) adcp;
+    uint32_t start = SysTick->VAL;
+
+    /* Sum this half of the buffer, keeping the sums in registers */
+    uint32_t vbus = 0;
+    uint32_t isense = 0;
+    uint32_t temp = 0;
+    uint32_t vref = 0;
+#ifdef PDBS_TELEMETRY_NTC_CHANNEL
+    uint32_t ntc = 0;
+#endif
+    for (size_t i = 0; i < n; i++) {
+        vbus += buffer[TELEMETRY_VBUS];
+        isense += buffer[TELEMETRY_ISENSE];
+#ifdef PDBS_TELEMETRY_NTC_CHANNEL
+        ntc += buffer[TELEMETRY_NTC];
+#endif
+        temp += buffer[TELEMETRY_TEMP];
+        vref += buffer[TELEMETRY_VREF];
+        buffer += TELEMETRY_CHANNELS;
+    }
+    telemetry_acc[TELEMETRY_VBUS] += vbus;
+    telemetry_acc[TELEMETRY_ISENSE] += isense;
+#ifdef PDBS_TELEMETRY_NTC_CHANNEL
+    telemetry_acc[TELEMETRY_NTC] += ntc;
+#endif
+    telemetry_acc[TELEMETRY_TEMP] += temp;
+    telemetry_acc[TELEMETRY_VREF] += vref;
+
+    if (++telemetry_acc_count >= TELEMETRY_DECIMATION) {
+        /* Store the averages as the newest sample */
+        uint32_t count = n * TELEMETRY_DECIMATION;
+        volatile struct telemetry_raw *raw =
+            &telemetry_history[telemetry_head % PDBS_TELEMETRY_HISTORY];
+        for (int i = 0; i < TELEMETRY_CHANNELS; i++) {
+            raw->sample[i] = telemetry_acc[i] / count;
+            telemetry_acc[i] = 0;
+        }
+        raw->time = chVTGetSystemTimeX();
+        telemetry_acc_count = 0;
+
+        /* Publish it */
+        telemetry_head++;
+    }
+
+    /* Note how long that took.  SysTick counts down, wrapping around every
+     * 2^24 cycles. */
+    uint32_t cycles = (start - SysTick->VAL) & SysTick_LOAD_RELOAD_Msk;
+    telemetry_stats.filtered++;
+    telemetry_stats.filter_cycles += cycles;
+    if (cycles > telemetry_stats.filter_max) {
+        telemetry_stats.filter_max = cycles;
+    }
+}
+
+#ifdef PDBS_TELEMETRY_NTC_CHANNEL
+/*
+ * Convert an NTC divider reading to degrees Celsius, interpolating linearly
+ * between the points of the table and clamping at its ends
+ */
+static int16_t telemetry_ntc_temp(uint16_t raw)
+{
+    if (raw >= telemetry_ntc_table[0]) {
+        return TELEMETRY_NTC_MIN_TEMP;
+    }
+    for (uint8_t i = 1; i < TELEMETRY_NTC_POINTS; i++) {
+        if (raw >= telemetry_ntc_table[i]) {
+            return TELEMETRY_NTC_MIN_TEMP + (i - 1) * TELEMETRY_NTC_TEMP_STEP
+                + (telemetry_ntc_table[i - 1] - raw) * TELEMETRY_NTC_TEMP_STEP
+                / (telemetry_ntc_table[i - 1] - telemetry_ntc_table[i]);
+        }
+    }
+    return TELEMETRY_NTC_MIN_TEMP
+        + (TELEMETRY_NTC_POINTS - 1) * TELEMETRY_NTC_TEMP_STEP;
+}
+#endif
+
+/*
+ * Conversion group for all the telemetry channels, converted continuously
+ */
+static const ADCConversionGroup telemetry_adcgrp = {
+    true,
+    TELEMETRY_CHANNELS,
+    telemetry_adc_cb,
+    NULL,
+    ADC_CFGR1_CONT | ADC_CFGR1_RES_12BIT,               /* CFGR1 */
+    ADC_TR(0, 0),                                       /* TR */
+    ADC_SMPR_SMP_239P5,                                 /* SMPR */
+    (1 << PDBS_TELEMETRY_VBUS_CHANNEL)
+        | (1 << PDBS_TELEMETRY_ISENSE_CHANNEL)
+#ifdef PDBS_TELEMETRY_NTC_CHANNEL
+        | (1 << PDBS_TELEMETRY_NTC_CHANNEL)
+#endif
+        | (1 << PDBS_TELEMETRY_TIP_CHANNEL)
+        | ADC_CHSELR_CHSEL16 | ADC_CHSELR_CHSEL17       /* CHSELR */
+};
+
+bool pdbs_telemetry_get(struct pdbs_telemetry *t, uint8_t age)
+{
+    struct telemetry_raw raw;
+
+    /* Slots further back than this may be overwritten while we read them */
+    if (age >= PDBS_TELEMETRY_HISTORY - 1) {
+        return false;
+    }
+
+    /* Copy the sample, trying again if it was overwritten meanwhile */
+    uint32_t head;
+    do {
+        head = telemetry_head;
+        if (head <= age) {
+            return false;
+        }
+        raw = telemetry_history[(head - 1 - age) % PDBS_TELEMETRY_HISTORY];
+    } while (telemetry_head - head >= PDBS_TELEMETRY_HISTORY - 1U - age);
+
+    /* Find the supply voltage from the internal reference */
+    uint32_t vdda = (uint32_t) TELEMETRY_CAL_VDDA * TELEMETRY_VREFINT_CAL
+        / (raw.sample[TELEMETRY_VREF] ? raw.sample[TELEMETRY_VREF] : 1);
+    t->vdda = vdda;
+
+    /* Convert the external inputs to millivolts at the pins, then scale */
+    uint32_t mv = raw.sample[TELEMETRY_VBUS] * vdda / 4095;
+    t->vbus = mv * PDBS_TELEMETRY_VBUS_DIV_NUM / PDBS_TELEMETRY_VBUS_DIV_DEN;
+    mv = raw.sample[TELEMETRY_ISENSE] * vdda / 4095;
+    t->current = mv * 100 / (PDBS_TELEMETRY_SHUNT * PDBS_TELEMETRY_ISENSE_GAIN);
+
+    /* Scale the temperature reading to the calibration supply voltage, then
+     * interpolate between the calibration points */
+    int32_t ts = raw.sample[TELEMETRY_TEMP] * vdda / TELEMETRY_CAL_VDDA;
+    t->temperature = (ts - TELEMETRY_TS_CAL1)
+        * (TELEMETRY_TS_CAL2_TEMP - TELEMETRY_TS_CAL1_TEMP)
+        / (TELEMETRY_TS_CAL2 - TELEMETRY_TS_CAL1) + TELEMETRY_TS_CAL1_TEMP;
+
+#ifdef PDBS_TELEMETRY_NTC_CHANNEL
+    t->ntc_temperature = telemetry_ntc_temp(raw.sample[TELEMETRY_NTC]);
+#else
+    t->ntc_temperature = PDBS_TELEMETRY_NO_TEMP;
+#endif
+
+    t->time = raw.time;
+
+    return true;
+}
+
+uint32_t pdbs_telemetry_tip_uv(void)
+{
+    /* Find the newest complete conversion sequence from how far the DMA has
+     * got through the buffer */
+    size_t pos = TELEMETRY_DEPTH * TELEMETRY_CHANNELS
+        - dmaStreamGetTransactionSize(ADCD1.dmastp);
+    size_t seq = pos / TELEMETRY_CHANNELS + TELEMETRY_DEPTH - 1;
+
+    /* Average the tip readings back from there */
+    uint32_t sum = 0;
+    for (int i = 0; i < PDBS_TELEMETRY_TIP_SAMPLES; i++) {
+        sum += telemetry_buf[((seq - i) % TELEMETRY_DEPTH) * TELEMETRY_CHANNELS
+            + TELEMETRY_TIP];
+    }
+
+    /* Convert to microvolts using the latest supply voltage, or the
+     * calibration voltage if there isn't one yet */
+    uint32_t vdda = TELEMETRY_CAL_VDDA;
+    struct pdbs_telemetry t;
+    if (pdbs_telemetry_get(&t, 0)) {
+        vdda = t.vdda;
+    }
+    return sum * vdda / 4095 * 1000 / PDBS_TELEMETRY_TIP_SAMPLES;
+}
+
+void pdbs_telemetry_stats_get(struct pdbs_telemetry_stats *stats)
+{
+    chSysLock();
+    *stats = telemetry_stats;
+    chSysUnlock();
+}
+
+void pdbs_telemetry_stats_reset(void)
+{
+    chSysLock();
+    memset(&telemetry_stats, 0, sizeof(telemetry_stats));
+    chSysUnlock();
+}
+
+void pdbs_telemetry_run(void)
+{
+    /* Set up the external inputs */
+    palSetLineMode(PDBS_TELEMETRY_VBUS_LINE, PAL_MODE_INPUT_ANALOG);
+    palSetLineMode(PDBS_TELEMETRY_ISENSE_LINE, PAL_MODE_INPUT_ANALOG);
+#ifdef PDBS_TELEMETRY_NTC_CHANNEL
+    palSetLineMode(PDBS_TELEMETRY_NTC_LINE, PAL_MODE_INPUT_ANALOG);
+#endif
+    palSetLineMode(PDBS_TELEMETRY_TIP_LINE, PAL_MODE_INPUT_ANALOG);
+
+    /* Start the ADC with the temperature sensor and internal reference */
+    adcStart(&ADCD1, NULL);
+    adcSTM32SetCCR(ADC_CCR_TSEN | ADC_CCR_VREFEN);
+
+    /* Convert continuously into the circular buffer */
+    adcStartConversion(&ADCD1, &telemetry_adcgrp, telemetry_buf,
+            TELEMETRY_DEPTH);
+}
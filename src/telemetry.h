@@ -0,0 +1,140 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PDBS_TELEMETRY_H
+#define PDBS_TELEMETRY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <ch.h>
+#include <hal.h>
+
+
+/* Analog inputs.  These depend on the board, so they may be overridden in the
+ * Makefile, each channel together with its line.  The VBUS channel must be
+ * lower than the current sense channel, and both must be below 16. */
+/* VBUS through a divider */
+#ifndef PDBS_TELEMETRY_VBUS_CHANNEL
+#define PDBS_TELEMETRY_VBUS_CHANNEL 2
+#define PDBS_TELEMETRY_VBUS_LINE PAL_LINE(GPIOA, 2U)
+#endif
+/* Output current shunt amplifier */
+#ifndef PDBS_TELEMETRY_ISENSE_CHANNEL
+#define PDBS_TELEMETRY_ISENSE_CHANNEL 4
+#define PDBS_TELEMETRY_ISENSE_LINE PAL_LINE(GPIOA, 4U)
+#endif
+/* Optional external NTC thermistor, a 10k B3950 to ground with a 10k pull-up
+ * to VDDA.  If the board has one, define its channel (above the current sense
+ * channel and below the tip channel) and line in the Makefile. */
+/* #define PDBS_TELEMETRY_NTC_CHANNEL 5 */
+/* #define PDBS_TELEMETRY_NTC_LINE PAL_LINE(GPIOA, 5U) */
+/* Soldering iron tip thermocouple amplifier.  Only meaningful while the
+ * heater is off, so it isn't part of the filtered samples. */
+#ifndef PDBS_TELEMETRY_TIP_CHANNEL
+#define PDBS_TELEMETRY_TIP_CHANNEL 6
+#define PDBS_TELEMETRY_TIP_LINE PAL_LINE(GPIOA, 6U)
+#endif
+
+/* VBUS divider ratio: VBUS = input voltage * NUM / DEN */
+#ifndef PDBS_TELEMETRY_VBUS_DIV_NUM
+#define PDBS_TELEMETRY_VBUS_DIV_NUM 16
+#define PDBS_TELEMETRY_VBUS_DIV_DEN 1
+#endif
+
+/* Current shunt resistance, in milliohms, and amplifier gain */
+#ifndef PDBS_TELEMETRY_SHUNT
+#define PDBS_TELEMETRY_SHUNT 10
+#define PDBS_TELEMETRY_ISENSE_GAIN 50
+#endif
+
+/* Temperature reported for a sensor that isn't there */
+#define PDBS_TELEMETRY_NO_TEMP INT16_MIN
+
+/* The number of filtered samples kept */
+#define PDBS_TELEMETRY_HISTORY 16
+
+/* The number of the newest conversions averaged for a tip reading, about
+ * 1.4 ms worth */
+#define PDBS_TELEMETRY_TIP_SAMPLES 16
+
+
+/*
+ * One filtered telemetry sample
+ */
+struct pdbs_telemetry {
+    /* VBUS voltage, in millivolts */
+    uint16_t vbus;
+    /* Output current, in centiamperes */
+    uint16_t current;
+    /* MCU die temperature, in degrees Celsius */
+    int16_t temperature;
+    /* External NTC temperature, in degrees Celsius, or PDBS_TELEMETRY_NO_TEMP
+     * if there is no NTC */
+    int16_t ntc_temperature;
+    /* Analog supply voltage, in millivolts */
+    uint16_t vdda;
+    /* When the sample was completed */
+    systime_t time;
+};
+
+/*
+ * CPU cost of the decimation filter, in core clock cycles as counted by
+ * SysTick
+ */
+struct pdbs_telemetry_stats {
+    /* Half buffers filtered */
+    uint32_t filtered;
+    /* Cycles spent filtering them in all, and the most for one */
+    uint32_t filter_cycles;
+    uint32_t filter_max;
+};
+
+
+/*
+ * Get the filtered sample from age samples ago (0 for the newest).  Safe to
+ * call from any thread.
+ *
+ * Returns true if there is such a sample, false otherwise.
+ */
+bool pdbs_telemetry_get(struct pdbs_telemetry *t, uint8_t age);
+
+/*
+ * Get the average of the newest tip conversions, as the voltage at the pin in
+ * microvolts.  Safe to call from any context, but the ADC must be running.
+ */
+uint32_t pdbs_telemetry_tip_uv(void);
+
+/*
+ * Start continuous acquisition.  SysTick must already be running free, as
+ * pdbs_flash_init leaves it, to time the filter.
+ */
+void pdbs_telemetry_run(void);
+
+/*
+ * Get the CPU cost of the decimation filter.
+ */
+void pdbs_telemetry_stats_get(struct pdbs_telemetry_stats *stats);
+
+/*
+ * Reset the CPU cost of the decimation filter.
+ */
+void pdbs_telemetry_stats_reset(void);
+
+
+#endif /* PDBS_TELEMETRY_H */
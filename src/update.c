@@ -0,0 +1,229 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "update.h"
+
+#include <string.h>
+
+#include <hal.h>
+
+#include "flash.h"
+#include "priorities.h"
+
+
+/* Whether an image is being written, and where it's up to */
+static bool update_active;
+static uint8_t update_target;
+static uint32_t update_length;
+static uint32_t update_crc;
+static uint32_t update_offset;
+
+
+uint8_t pdbs_update_slot(void)
+{
+    /* We're running from whichever slot the boot selector copied the vector
+     * table from */
+    return (((const uint32_t *) SRAM_BASE)[1] >= PDBS_SLOT_B_BASE)
+        ? PDBS_SLOT_B : PDBS_SLOT_A;
+}
+
+bool pdbs_update_confirmed(void)
+{
+    const struct pdbs_boot_record *rec = pdbs_boot_record_latest();
+
+    /* Without a record of our own, nothing newer is waiting to prove
+     * itself */
+    return rec == NULL || rec->slot != pdbs_update_slot()
+        || rec->confirmed == 0;
+}
+
+/*
+ * Update thread, confirming that the running image works once it's been
+ * running for a while
+ */
+static THD_WORKING_AREA(waUpdate, 256);
+static THD_FUNCTION(Update, arg) {
+    (void) arg;
+
+    chRegSetThreadName("Update");
+
+    chThdSleep(PDBS_UPDATE_CONFIRM_DELAY);
+
+    pdbs_flash_acquire();
+    const struct pdbs_boot_record *rec = pdbs_boot_record_latest();
+    if (rec != NULL && rec->slot == pdbs_update_slot()
+            && rec->confirmed != 0) {
+        pdbs_flash_write_halfword((uint16_t *) &rec->confirmed, 0);
+    }
+    pdbs_flash_release();
+}
+
+void pdbs_update_run(void)
+{
+    if (!pdbs_update_confirmed()) {
+        chThdCreateStatic(waUpdate, sizeof(waUpdate), PDBS_PRIO_UPDATE,
+                Update, NULL);
+    }
+}
+
+/*
+ * Return the blank record after the last one written, or NULL if the boot
+ * state page is full.  Records after the first blank one are checked too, in
+ * case an erasure was cut short.
+ */
+static const struct pdbs_boot_record *update_record_blank(void)
+{
+    for (uint32_t i = PDBS_BOOT_RECORDS; i > 0; i--) {
+        if (!pdbs_flash_blank(pdbs_boot_record(i - 1),
+                    sizeof(struct pdbs_boot_record))) {
+            return (i < PDBS_BOOT_RECORDS) ? pdbs_boot_record(i) : NULL;
+        }
+    }
+    return pdbs_boot_record(0);
+}
+
+/*
+ * Append a boot record for the given slot, if there's room.  The flash
+ * interface must be acquired.
+ */
+static void update_record_append(uint8_t slot, uint32_t length, uint32_t crc,
+        bool confirmed)
+{
+    struct pdbs_boot_record rec = {
+        .magic = PDBS_BOOT_MAGIC,
+        .slot = slot,
+        .length = length,
+        .crc = crc,
+        .tried = confirmed ? 0 : 0xFFFF,
+        .confirmed = confirmed ? 0 : 0xFFFF
+    };
+
+    const struct pdbs_boot_record *dst = update_record_blank();
+    if (dst == NULL) {
+        return;
+    }
+
+    /* Write the magic number last, so the record only counts once it's
+     * whole */
+    pdbs_flash_write((uint8_t *) dst + sizeof(rec.magic),
+            (uint8_t *) &rec + sizeof(rec.magic),
+            sizeof(rec) - sizeof(rec.magic));
+    pdbs_flash_write_halfword((uint16_t *) &dst->magic, rec.magic);
+}
+
+enum pdbs_update_status pdbs_update_begin(uint32_t length, uint32_t crc)
+{
+    update_active = false;
+
+    /* Don't overwrite the last image known to work */
+    if (!pdbs_update_confirmed()) {
+        return PDBS_UPDATE_UNCONFIRMED;
+    }
+    if (length == 0 || length > PDBS_SLOT_SIZE) {
+        return PDBS_UPDATE_TOO_BIG;
+    }
+
+    uint8_t slot = pdbs_update_slot();
+    update_target = !slot;
+    update_length = length;
+    update_crc = crc;
+    update_offset = 0;
+
+    /* Erase one page at a time, so nothing else waits for all of them */
+    uint32_t base = pdbs_slot_base(update_target);
+    for (uint32_t off = 0; off < length; off += PDBS_FLASH_PAGE_SIZE) {
+        pdbs_flash_acquire();
+        pdbs_flash_erase((void *) (base + off));
+        pdbs_flash_release();
+    }
+
+    /* Make sure the boot selector has a record of this image to go back to,
+     * with room after it for the new image's, so it never has to write one
+     * itself.  The new image's vector table is erased by now, so if the
+     * power fails while the boot state is blank, this image is the only one
+     * that can start. */
+    pdbs_flash_acquire();
+    const struct pdbs_boot_record *rec = pdbs_boot_record_latest();
+    const struct pdbs_boot_record *blank = update_record_blank();
+    bool append = rec == NULL || rec->slot != slot;
+    if (blank == NULL
+            || blank + append >= pdbs_boot_record(PDBS_BOOT_RECORDS)) {
+        pdbs_flash_erase((void *) PDBS_BOOT_STATE_BASE);
+        append = true;
+    }
+    if (append) {
+        update_record_append(slot, 0, 0, true);
+    }
+    pdbs_flash_release();
+
+    update_active = true;
+    return PDBS_UPDATE_OK;
+}
+
+enum pdbs_update_status pdbs_update_write(uint32_t offset, const uint8_t *data,
+        size_t len)
+{
+    if (!update_active || offset != update_offset
+            || len > update_length - offset
+            || (len % 2 != 0 && offset + len != update_length)) {
+        return PDBS_UPDATE_OUT_OF_ORDER;
+    }
+
+    /* Make sure the image will run where it's going */
+    if (offset == 0) {
+        uint32_t vectors[2] = {0, 0};
+        memcpy(vectors, data, (len < sizeof(vectors)) ? len : sizeof(vectors));
+        if (!pdbs_slot_vectors_valid(vectors, update_target)) {
+            update_active = false;
+            return PDBS_UPDATE_WRONG_SLOT;
+        }
+    }
+
+    uint8_t *dst = (uint8_t *) pdbs_slot_base(update_target) + offset;
+    pdbs_flash_acquire();
+    pdbs_flash_write(dst, data, len & ~1);
+    if (len % 2 != 0) {
+        /* Pad the last byte out to a halfword */
+        pdbs_flash_write_halfword((uint16_t *) (dst + len - 1),
+                0xFF00 | data[len - 1]);
+    }
+    pdbs_flash_release();
+
+    update_offset += len;
+    return PDBS_UPDATE_OK;
+}
+
+enum pdbs_update_status pdbs_update_finish(void)
+{
+    if (!update_active || update_offset != update_length) {
+        return PDBS_UPDATE_OUT_OF_ORDER;
+    }
+    update_active = false;
+
+    if (pdbs_boot_crc32((const uint8_t *) pdbs_slot_base(update_target),
+                update_length) != update_crc) {
+        return PDBS_UPDATE_BAD_CRC;
+    }
+
+    /* Have the boot selector try the new image */
+    pdbs_flash_acquire();
+    update_record_append(update_target, update_length, update_crc, false);
+    pdbs_flash_release();
+
+    return PDBS_UPDATE_OK;
+}
@@ -0,0 +1,99 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PDBS_UPDATE_H
+#define PDBS_UPDATE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <ch.h>
+
+#include "boot_select.h"
+
+
+/* Size of the blocks an image is sent in, and how long to wait for one before
+ * giving up */
+#define PDBS_UPDATE_BLOCK_SIZE 256
+#define PDBS_UPDATE_BLOCK_TIMEOUT TIME_S2I(2)
+
+/* How long the firmware must run before it confirms that it works */
+#define PDBS_UPDATE_CONFIRM_DELAY TIME_S2I(30)
+
+
+/*
+ * Results of firmware update operations
+ */
+enum pdbs_update_status {
+    /* Success */
+    PDBS_UPDATE_OK,
+    /* The running image hasn't confirmed itself yet, so the other slot holds
+     * the only image known to work */
+    PDBS_UPDATE_UNCONFIRMED,
+    /* The image is too big for a slot */
+    PDBS_UPDATE_TOO_BIG,
+    /* The image isn't linked for the slot it's being written to */
+    PDBS_UPDATE_WRONG_SLOT,
+    /* The image was written out of order, or past its end */
+    PDBS_UPDATE_OUT_OF_ORDER,
+    /* The image written doesn't match its CRC */
+    PDBS_UPDATE_BAD_CRC
+};
+
+
+/*
+ * Return the slot the firmware is running from
+ */
+uint8_t pdbs_update_slot(void);
+
+/*
+ * Return whether the running image has confirmed that it works
+ */
+bool pdbs_update_confirmed(void);
+
+/*
+ * Start a thread that confirms the running image works once it's been
+ * running for PDBS_UPDATE_CONFIRM_DELAY.  If the image was just updated and
+ * the device resets before then, the boot selector goes back to the old
+ * image.
+ */
+void pdbs_update_run(void);
+
+/*
+ * Start writing an image of the given length and CRC-32 to the slot we're not
+ * running from, erasing as much of it as the image needs.  The boot state is
+ * made to record the running image, so the boot selector can go back to it.
+ */
+enum pdbs_update_status pdbs_update_begin(uint32_t length, uint32_t crc);
+
+/*
+ * Write len bytes of the image at the given offset.  Writes must be in order,
+ * with every one but the last a multiple of two bytes long.
+ */
+enum pdbs_update_status pdbs_update_write(uint32_t offset, const uint8_t *data,
+        size_t len);
+
+/*
+ * Check the written image against its CRC, and if it matches, have the boot
+ * selector try it at the next reset.
+ */
+enum pdbs_update_status pdbs_update_finish(void);
+
+
+#endif /* PDBS_UPDATE_H */
@@ -0,0 +1,515 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ch.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "chprintf.h"
+
+
+/* Host stack for each thread, much more than the firmware gives them since
+ * host code needs more */
+#define HOST_STACK_SIZE (256 * 1024)
+
+/* The most threads a test can start */
+#define HOST_THREADS 16
+
+
+
+ch_system_t ch = {{(thread_t *) &ch.rlist}};
+
+static struct host_thread host_threads[HOST_THREADS];
+static int host_nthreads;
+static thread_t *host_current;
+static ucontext_t host_harness;
+static systime_t host_now;
+static uint32_t host_switches;
+static bool host_was_reset;
+static void (*host_main)(void);
+static virtual_timer_t *host_timers;
+
+
+/*
+ * Go back to the scheduler from the current thread
+ */
+static void host_switch(void)
+{
+    thread_t *self = host_current;
+
+    swapcontext(&self->ctx, &host_harness);
+}
+
+static void host_thread_start(void)
+{
+    thread_t *self = host_current;
+
+    self->func(self->arg);
+    self->state = HOST_DONE;
+    host_switch();
+}
+
+static thread_t *host_thread_new(const char *name, tprio_t prio, tfunc_t pf,
+        void *arg)
+{
+    if (host_nthreads >= HOST_THREADS) {
+        fprintf(stderr, "host: too many threads\n");
+        abort();
+    }
+    thread_t *tp = &host_threads[host_nthreads++];
+
+    tp->wabase = NULL;
+    tp->newer = NULL;
+    tp->stack = malloc(HOST_STACK_SIZE);
+    getcontext(&tp->ctx);
+    tp->ctx.uc_stack.ss_sp = tp->stack;
+    tp->ctx.uc_stack.ss_size = HOST_STACK_SIZE;
+    tp->ctx.uc_link = NULL;
+    makecontext(&tp->ctx, host_thread_start, 0);
+    tp->name = name;
+    tp->prio = prio;
+    tp->state = HOST_READY;
+    tp->events = 0;
+    tp->func = pf;
+    tp->arg = arg;
+    tp->ran = 0;
+    return tp;
+}
+
+/*
+ * Fire the virtual timers that are due
+ */
+static void host_timers_fire(void)
+{
+    bool fired = true;
+
+    while (fired) {
+        fired = false;
+        for (virtual_timer_t **vtpp = &host_timers; *vtpp != NULL;
+                vtpp = &(*vtpp)->next) {
+            virtual_timer_t *vtp = *vtpp;
+            if ((int32_t) (host_now - vtp->when) >= 0) {
+                *vtpp = vtp->next;
+                vtp->armed = false;
+                vtp->func(vtp->par);
+                fired = true;
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * Move time on to the next timeout, returning false if there isn't one
+ */
+static bool host_advance(void)
+{
+    bool found = false;
+    systime_t next = 0;
+
+    for (int i = 0; i < host_nthreads; i++) {
+        thread_t *tp = &host_threads[i];
+        if (tp->state != HOST_READY && tp->state != HOST_DONE && tp->timed
+                && (!found || (int32_t) (tp->wake - next) < 0)) {
+            next = tp->wake;
+            found = true;
+        }
+    }
+    for (virtual_timer_t *vtp = host_timers; vtp != NULL; vtp = vtp->next) {
+        if (!found || (int32_t) (vtp->when - next) < 0) {
+            next = vtp->when;
+            found = true;
+        }
+    }
+    if (!found) {
+        return false;
+    }
+
+    if ((int32_t) (next - host_now) > 0) {
+        host_now = next;
+    }
+    host_timers_fire();
+    for (int i = 0; i < host_nthreads; i++) {
+        thread_t *tp = &host_threads[i];
+        if (tp->state != HOST_READY && tp->state != HOST_DONE && tp->timed
+                && (int32_t) (host_now - tp->wake) >= 0) {
+            tp->state = HOST_READY;
+            tp->wait_obj = NULL;
+        }
+    }
+    return true;
+}
+
+static void host_main_thread(void *arg)
+{
+    (void) arg;
+
+    host_main();
+}
+
+bool host_run(void (*fn)(void))
+{
+    for (int i = 0; i < host_nthreads; i++) {
+        free(host_threads[i].stack);
+    }
+    host_nthreads = 0;
+    host_timers = NULL;
+    host_now = 0;
+    host_was_reset = false;
+
+    host_main = fn;
+    thread_t *main_thread = host_thread_new("main", NORMALPRIO,
+            host_main_thread, NULL);
+
+    while (main_thread->state != HOST_DONE && !host_was_reset) {
+        /* Run the highest priority ready thread, taking turns */
+        thread_t *next = NULL;
+        for (int i = 0; i < host_nthreads; i++) {
+            thread_t *tp = &host_threads[i];
+            if (tp->state == HOST_READY && (next == NULL
+                        || tp->prio > next->prio
+                        || (tp->prio == next->prio && tp->ran < next->ran))) {
+                next = tp;
+            }
+        }
+        if (next == NULL) {
+            if (!host_advance()) {
+                fprintf(stderr, "host: deadlock\n");
+                for (int i = 0; i < host_nthreads; i++) {
+                    fprintf(stderr, "  %s: state %d\n",
+                            host_threads[i].name ? host_threads[i].name : "?",
+                            host_threads[i].state);
+                }
+                abort();
+            }
+            continue;
+        }
+        next->ran = ++host_switches;
+        host_current = next;
+        swapcontext(&host_harness, &next->ctx);
+        host_current = NULL;
+    }
+
+    return !host_was_reset;
+}
+
+void host_reset(void)
+{
+    host_was_reset = true;
+    host_switch();
+    abort();
+}
+
+/*
+ * Wait for something, with the given timeout
+ */
+static void host_wait(enum host_state state, void *obj, sysinterval_t timeout)
+{
+    thread_t *self = host_current;
+
+    self->state = state;
+    self->wait_obj = obj;
+    self->timed = timeout != TIME_INFINITE;
+    self->wake = host_now + timeout;
+    host_switch();
+}
+
+static void host_wake(thread_t *tp)
+{
+    tp->state = HOST_READY;
+    tp->wait_obj = NULL;
+}
+
+
+thread_t *chThdCreateStatic(void *wsp, size_t size, tprio_t prio,
+        tfunc_t pf, void *arg)
+{
+    (void) wsp;
+    (void) size;
+
+    return host_thread_new(NULL, prio, pf, arg);
+}
+
+thread_t *chThdGetSelfX(void)
+{
+    return host_current;
+}
+
+void chRegSetThreadName(const char *name)
+{
+    host_current->name = name;
+}
+
+void chThdSleep(sysinterval_t time)
+{
+    host_wait(HOST_SLEEPING, NULL, time);
+}
+
+void chThdSleepMilliseconds(uint32_t ms)
+{
+    chThdSleep(TIME_MS2I(ms));
+}
+
+void chThdYield(void)
+{
+    host_current->ran = ++host_switches;
+    host_switch();
+}
+
+
+systime_t chVTGetSystemTime(void)
+{
+    return host_now;
+}
+
+systime_t chVTGetSystemTimeX(void)
+{
+    return host_now;
+}
+
+sysinterval_t chVTTimeElapsedSinceX(systime_t start)
+{
+    return host_now - start;
+}
+
+void chVTObjectInit(virtual_timer_t *vtp)
+{
+    vtp->armed = false;
+}
+
+void chVTSet(virtual_timer_t *vtp, sysinterval_t delay, vtfunc_t vtfunc,
+        void *par)
+{
+    chVTReset(vtp);
+    vtp->when = host_now + ((delay > 0) ? delay : 1);
+    vtp->func = vtfunc;
+    vtp->par = par;
+    vtp->armed = true;
+    vtp->next = host_timers;
+    host_timers = vtp;
+}
+
+void chVTSetI(virtual_timer_t *vtp, sysinterval_t delay, vtfunc_t vtfunc,
+        void *par)
+{
+    chVTSet(vtp, delay, vtfunc, par);
+}
+
+void chVTReset(virtual_timer_t *vtp)
+{
+    for (virtual_timer_t **vtpp = &host_timers; *vtpp != NULL;
+            vtpp = &(*vtpp)->next) {
+        if (*vtpp == vtp) {
+            *vtpp = vtp->next;
+            break;
+        }
+    }
+    vtp->armed = false;
+}
+
+void chVTResetI(virtual_timer_t *vtp)
+{
+    chVTReset(vtp);
+}
+
+bool chVTIsArmed(const virtual_timer_t *vtp)
+{
+    return vtp->armed;
+}
+
+bool chVTIsArmedI(const virtual_timer_t *vtp)
+{
+    return vtp->armed;
+}
+
+
+void chSysLock(void)
+{
+}
+
+void chSysUnlock(void)
+{
+}
+
+void chSysLockFromISR(void)
+{
+}
+
+void chSysUnlockFromISR(void)
+{
+}
+
+
+void chEvtSignal(thread_t *tp, eventmask_t events)
+{
+    tp->events |= events;
+    if (tp->state == HOST_WAIT_EVT && (tp->events & tp->wait_events)) {
+        host_wake(tp);
+    }
+}
+
+void chEvtSignalI(thread_t *tp, eventmask_t events)
+{
+    chEvtSignal(tp, events);
+}
+
+eventmask_t chEvtWaitAnyTimeout(eventmask_t events, sysinterval_t timeout)
+{
+    thread_t *self = host_current;
+
+    if ((self->events & events) == 0) {
+        if (timeout == TIME_IMMEDIATE) {
+            return 0;
+        }
+        self->wait_events = events;
+        host_wait(HOST_WAIT_EVT, self, timeout);
+    }
+    eventmask_t got = self->events & events;
+    self->events &= ~got;
+    return got;
+}
+
+eventmask_t chEvtWaitAny(eventmask_t events)
+{
+    return chEvtWaitAnyTimeout(events, TIME_INFINITE);
+}
+
+eventmask_t chEvtGetAndClearEvents(eventmask_t events)
+{
+    eventmask_t got = host_current->events & events;
+
+    host_current->events &= ~got;
+    return got;
+}
+
+
+void chMtxObjectInit(mutex_t *mp)
+{
+    mp->owner = NULL;
+}
+
+void chMtxLock(mutex_t *mp)
+{
+    while (mp->owner != NULL) {
+        host_wait(HOST_WAIT_MTX, mp, TIME_INFINITE);
+    }
+    mp->owner = host_current;
+}
+
+void chMtxUnlock(mutex_t *mp)
+{
+    mp->owner = NULL;
+    for (int i = 0; i < host_nthreads; i++) {
+        if (host_threads[i].state == HOST_WAIT_MTX
+                && host_threads[i].wait_obj == mp) {
+            host_wake(&host_threads[i]);
+        }
+    }
+}
+
+void chBSemObjectInit(binary_semaphore_t *bsp, bool taken)
+{
+    bsp->taken = taken;
+}
+
+msg_t chBSemWait(binary_semaphore_t *bsp)
+{
+    while (bsp->taken) {
+        host_wait(HOST_WAIT_SEM, bsp, TIME_INFINITE);
+    }
+    bsp->taken = true;
+    return MSG_OK;
+}
+
+void chBSemSignal(binary_semaphore_t *bsp)
+{
+    bsp->taken = false;
+    for (int i = 0; i < host_nthreads; i++) {
+        if (host_threads[i].state == HOST_WAIT_SEM
+                && host_threads[i].wait_obj == bsp) {
+            host_wake(&host_threads[i]);
+            break;
+        }
+    }
+}
+
+
+void chMBObjectInit(mailbox_t *mbp, msg_t *buf, size_t n)
+{
+    mbp->buf = buf;
+    mbp->size = n;
+    mbp->rd = 0;
+    mbp->cnt = 0;
+}
+
+msg_t chMBPostI(mailbox_t *mbp, msg_t msg)
+{
+    if (mbp->cnt == mbp->size) {
+        return MSG_TIMEOUT;
+    }
+    mbp->buf[(mbp->rd + mbp->cnt++) % mbp->size] = msg;
+    return MSG_OK;
+}
+
+msg_t chMBPostTimeout(mailbox_t *mbp, msg_t msg, sysinterval_t timeout)
+{
+    (void) timeout;
+
+    return chMBPostI(mbp, msg);
+}
+
+msg_t chMBFetchTimeout(mailbox_t *mbp, msg_t *msgp, sysinterval_t timeout)
+{
+    (void) timeout;
+
+    if (mbp->cnt == 0) {
+        return MSG_TIMEOUT;
+    }
+    *msgp = mbp->buf[mbp->rd];
+    mbp->rd = (mbp->rd + 1) % mbp->size;
+    mbp->cnt--;
+    return MSG_OK;
+}
+
+
+void *chPoolAlloc(memory_pool_t *mp)
+{
+    return malloc(mp->size);
+}
+
+void chPoolFree(memory_pool_t *mp, void *objp)
+{
+    (void) mp;
+
+    free(objp);
+}
+
+
+int chprintf(BaseSequentialStream *chp, const char *fmt, ...)
+{
+    va_list ap;
+
+    (void) chp;
+
+    va_start(ap, fmt);
+    int n = vprintf(fmt, ap);
+    va_end(ap);
+    return n;
+}
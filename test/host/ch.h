@@ -0,0 +1,219 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The parts of the ChibiOS API the firmware uses, for running it on a host.
+ *
+ * Threads are run one at a time, switching only when one waits, so the tests
+ * are repeatable.  Time only passes when every thread is waiting, and then it
+ * jumps straight to the next timeout.
+ */
+
+#ifndef HOST_CH_H
+#define HOST_CH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <ucontext.h>
+
+
+typedef uint32_t eventmask_t;
+/* Wide enough for the message pointers posted to mailboxes */
+typedef intptr_t msg_t;
+typedef uint32_t systime_t;
+typedef uint32_t sysinterval_t;
+typedef uint32_t time_msecs_t;
+typedef uint8_t tprio_t;
+typedef uint32_t stkalign_t;
+
+typedef struct host_thread thread_t;
+typedef void (*tfunc_t)(void *);
+typedef void (*vtfunc_t)(void *);
+
+enum host_state {
+    HOST_READY,
+    HOST_SLEEPING,
+    HOST_WAIT_EVT,
+    HOST_WAIT_MTX,
+    HOST_WAIT_SEM,
+    HOST_DONE
+};
+
+struct host_thread {
+    /* What the firmware looks at, as in ChibiOS.  Host threads have no
+     * working area and aren't in the registry, so these are NULL. */
+    const char *name;
+    stkalign_t *wabase;
+    thread_t *newer;
+    /* The rest is the scheduler's */
+    ucontext_t ctx;
+    void *stack;
+    tprio_t prio;
+    enum host_state state;
+    /* Pending events, and the ones being waited for */
+    eventmask_t events;
+    eventmask_t wait_events;
+    /* What the thread is waiting on, and until when */
+    void *wait_obj;
+    bool timed;
+    systime_t wake;
+    tfunc_t func;
+    void *arg;
+    /* When the thread last ran, for round robin */
+    uint32_t ran;
+};
+
+/* The system, with just its registry, which stays empty */
+typedef struct {
+    struct {
+        thread_t *newer;
+    } rlist;
+} ch_system_t;
+
+extern ch_system_t ch;
+
+typedef struct {
+    thread_t *owner;
+} mutex_t;
+
+typedef struct {
+    bool taken;
+} binary_semaphore_t;
+
+typedef struct virtual_timer {
+    struct virtual_timer *next;
+    systime_t when;
+    vtfunc_t func;
+    void *par;
+    bool armed;
+} virtual_timer_t;
+
+typedef struct {
+    msg_t *buf;
+    size_t size;
+    size_t rd;
+    size_t cnt;
+} mailbox_t;
+
+typedef struct {
+    size_t size;
+} memory_pool_t;
+
+typedef struct {
+    const void *vmt;
+} BaseSequentialStream;
+
+
+#define MSG_OK 0
+#define MSG_TIMEOUT -1
+
+#define LOWPRIO 2
+#define NORMALPRIO 128
+#define HIGHPRIO 255
+
+#define EVENT_MASK(eid) ((eventmask_t) 1 << (eventmask_t) (eid))
+#define ALL_EVENTS ((eventmask_t) -1)
+
+/* System ticks are milliseconds */
+#define CH_CFG_ST_FREQUENCY 1000
+#define TIME_IMMEDIATE ((sysinterval_t) 0)
+#define TIME_INFINITE ((sysinterval_t) -1)
+#define TIME_S2I(s) ((sysinterval_t) ((s) * 1000))
+#define TIME_MS2I(ms) ((sysinterval_t) (ms))
+#define TIME_US2I(us) ((sysinterval_t) (((us) + 999) / 1000))
+#define TIME_I2S(i) ((time_msecs_t) ((i) / 1000))
+#define TIME_I2MS(i) ((time_msecs_t) (i))
+#define chTimeAddX(t, i) ((systime_t) ((t) + (i)))
+#define chTimeDiffX(a, b) ((sysinterval_t) ((b) - (a)))
+
+#define THD_WORKING_AREA(s, n) stkalign_t s[(n) / sizeof(stkalign_t)]
+#define THD_FUNCTION(tname, arg) void tname(void *arg)
+#define MEMORY_POOL_DECL(name, size, align, provider) \
+    memory_pool_t name = {size}
+
+
+/* Threads */
+thread_t *chThdCreateStatic(void *wsp, size_t size, tprio_t prio,
+        tfunc_t pf, void *arg);
+thread_t *chThdGetSelfX(void);
+void chRegSetThreadName(const char *name);
+void chThdSleep(sysinterval_t time);
+void chThdSleepMilliseconds(uint32_t ms);
+void chThdYield(void);
+
+/* Time */
+systime_t chVTGetSystemTime(void);
+systime_t chVTGetSystemTimeX(void);
+sysinterval_t chVTTimeElapsedSinceX(systime_t start);
+void chVTObjectInit(virtual_timer_t *vtp);
+void chVTSet(virtual_timer_t *vtp, sysinterval_t delay, vtfunc_t vtfunc,
+        void *par);
+void chVTSetI(virtual_timer_t *vtp, sysinterval_t delay, vtfunc_t vtfunc,
+        void *par);
+void chVTReset(virtual_timer_t *vtp);
+void chVTResetI(virtual_timer_t *vtp);
+bool chVTIsArmed(const virtual_timer_t *vtp);
+bool chVTIsArmedI(const virtual_timer_t *vtp);
+
+/* Locking does nothing, since threads never preempt each other */
+void chSysLock(void);
+void chSysUnlock(void);
+void chSysLockFromISR(void);
+void chSysUnlockFromISR(void);
+
+/* Events */
+void chEvtSignal(thread_t *tp, eventmask_t events);
+void chEvtSignalI(thread_t *tp, eventmask_t events);
+eventmask_t chEvtWaitAny(eventmask_t events);
+eventmask_t chEvtWaitAnyTimeout(eventmask_t events, sysinterval_t timeout);
+eventmask_t chEvtGetAndClearEvents(eventmask_t events);
+
+/* Mutexes and semaphores */
+void chMtxObjectInit(mutex_t *mp);
+void chMtxLock(mutex_t *mp);
+void chMtxUnlock(mutex_t *mp);
+void chBSemObjectInit(binary_semaphore_t *bsp, bool taken);
+msg_t chBSemWait(binary_semaphore_t *bsp);
+void chBSemSignal(binary_semaphore_t *bsp);
+
+/* Mailboxes */
+void chMBObjectInit(mailbox_t *mbp, msg_t *buf, size_t n);
+msg_t chMBPostTimeout(mailbox_t *mbp, msg_t msg, sysinterval_t timeout);
+msg_t chMBPostI(mailbox_t *mbp, msg_t msg);
+msg_t chMBFetchTimeout(mailbox_t *mbp, msg_t *msgp, sysinterval_t timeout);
+
+/* Memory pools, backed by malloc */
+void *chPoolAlloc(memory_pool_t *mp);
+void chPoolFree(memory_pool_t *mp, void *objp);
+
+
+/*
+ * Run fn as the main thread of a freshly reset device, along with any threads
+ * it starts, until it returns or the device resets.  Returns false if the
+ * device reset, either by itself or because the power failed.
+ */
+bool host_run(void (*fn)(void));
+
+/*
+ * Reset the device, ending host_run.  Must be called from a thread.
+ */
+void host_reset(void) __attribute__((noreturn));
+
+
+#endif /* HOST_CH_H */
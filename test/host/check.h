@@ -0,0 +1,68 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks for the host tests.  A failed check is reported, and the test
+ * carries on so every failure shows up at once.
+ */
+
+#ifndef HOST_CHECK_H
+#define HOST_CHECK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+
+/* Number of checks that have failed */
+static int check_failures;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                    #cond); \
+            check_failures++; \
+        } \
+    } while (0)
+
+#define CHECK_EQ(a, b) \
+    do { \
+        long long check_a = (long long) (a); \
+        long long check_b = (long long) (b); \
+        if (check_a != check_b) { \
+            fprintf(stderr, "%s:%d: check failed: %s == %s (%lld != %lld)\n", \
+                    __FILE__, __LINE__, #a, #b, check_a, check_b); \
+            check_failures++; \
+        } \
+    } while (0)
+
+/*
+ * Report how the checks went, and return the test's exit status
+ */
+static inline int check_done(const char *test)
+{
+    if (check_failures != 0) {
+        fprintf(stderr, "%s: %d check(s) failed\n", test, check_failures);
+        return EXIT_FAILURE;
+    }
+    printf("%s: ok\n", test);
+    return EXIT_SUCCESS;
+}
+
+
+#endif /* HOST_CHECK_H */
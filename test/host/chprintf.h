@@ -0,0 +1,32 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HOST_CHPRINTF_H
+#define HOST_CHPRINTF_H
+
+#include <ch.h>
+
+
+/*
+ * Print to standard output, whatever the stream
+ */
+int chprintf(BaseSequentialStream *chp, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+
+#endif /* HOST_CHPRINTF_H */
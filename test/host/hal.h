@@ -0,0 +1,63 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The parts of the ChibiOS HAL the firmware uses, for running it on a host.
+ * The I/O lines aren't connected to anything.
+ */
+
+#ifndef HOST_HAL_H
+#define HOST_HAL_H
+
+#include <ch.h>
+#include <stm32f0xx.h>
+
+
+#define STM32_HCLK 48000000
+#define STM32_TIMCLK1 48000000
+
+typedef uint32_t ioline_t;
+typedef uint16_t i2caddr_t;
+
+typedef struct {
+    int unused;
+} I2CDriver;
+
+#define PAL_LOW 0
+#define PAL_HIGH 1
+#define PAL_LINE(port, pad) ((ioline_t) (((uint32_t) (port) << 4) | (pad)))
+#define GPIOA 1
+#define GPIOB 2
+#define GPIOC 3
+
+#define LINE_LED PAL_LINE(GPIOB, 13U)
+#define LINE_BUTTON PAL_LINE(GPIOC, 13U)
+#define LINE_OUT_CTRL PAL_LINE(GPIOB, 8U)
+#define LINE_INT_N PAL_LINE(GPIOB, 12U)
+
+#define palReadLine(line) ((void) (line), PAL_LOW)
+#define palSetLine(line) ((void) (line))
+#define palClearLine(line) ((void) (line))
+#define palToggleLine(line) ((void) (line))
+#define palSetLineMode(line, mode) ((void) (line), (void) (mode))
+#define PAL_MODE_ALTERNATE(n) (n)
+
+#define rccEnableTIM16(lp) ((void) (lp))
+
+
+#endif /* HOST_HAL_H */
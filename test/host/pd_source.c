@@ -0,0 +1,181 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pd_source.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "policy_engine.h"
+#include "protocol_tx.h"
+#include "hard_reset.h"
+#include "fusb302b.h"
+
+
+/* The protocol layer's priority, PDB_PRIO_PRL.  Its header can't be included
+ * here, since src/priorities.h has the same name. */
+#define HOST_PD_PRIO (NORMALPRIO - 2)
+
+/* Event telling the source the sink transmitted a message */
+#define HOST_PD_EVT_SENT EVENT_MASK(31)
+
+/* How many transmitted messages the source can fall behind by */
+#define HOST_PD_SENT_LEN 8
+
+
+static thread_t *host_pd_source;
+static struct host_pd_sent host_pd_sent[HOST_PD_SENT_LEN];
+static unsigned host_pd_sent_wr;
+static unsigned host_pd_sent_rd;
+static int host_pd_hardrst_count;
+
+
+/*
+ * Protocol layer TX: transmit each message the Policy Engine posts, and hand
+ * it to the source
+ */
+static THD_FUNCTION(HostPRLTX, vcfg) {
+    struct pdb_config *cfg = vcfg;
+    union pd_msg *msg;
+
+    while (true) {
+        eventmask_t evt = chEvtWaitAny(PDB_EVT_PRLTX_MSG_TX
+                | PDB_EVT_PRLTX_RESET | PDB_EVT_PRLTX_START_AMS);
+        if (!(evt & PDB_EVT_PRLTX_MSG_TX)) {
+            continue;
+        }
+        if (chMBFetchTimeout(&cfg->prl.tx_mailbox, (msg_t *) &msg,
+                    TIME_IMMEDIATE) != MSG_OK) {
+            continue;
+        }
+        chThdSleep(HOST_PD_BUS_TIME);
+
+        if (host_pd_sent_wr - host_pd_sent_rd >= HOST_PD_SENT_LEN) {
+            fprintf(stderr, "host: the source fell behind\n");
+            abort();
+        }
+        struct host_pd_sent *s = &host_pd_sent[host_pd_sent_wr++ % HOST_PD_SENT_LEN];
+        s->time = chVTGetSystemTime();
+        s->msg = *msg;
+
+        chEvtSignal(cfg->pe.thread, PDB_EVT_PE_TX_DONE);
+        chEvtSignal(host_pd_source, HOST_PD_EVT_SENT);
+    }
+}
+
+/*
+ * Protocol layer RX: the source delivers messages itself, so there's nothing
+ * to do but take the Policy Engine's resets
+ */
+static THD_FUNCTION(HostPRLRX, vcfg) {
+    (void) vcfg;
+
+    while (true) {
+        chEvtWaitAny(ALL_EVENTS);
+    }
+}
+
+/*
+ * Hard reset: count them, and tell the Policy Engine they've been sent
+ */
+static THD_FUNCTION(HostHardRst, vcfg) {
+    struct pdb_config *cfg = vcfg;
+
+    while (true) {
+        eventmask_t evt = chEvtWaitAny(PDB_EVT_HARDRST_RESET
+                | PDB_EVT_HARDRST_DONE);
+        if (evt & PDB_EVT_HARDRST_RESET) {
+            host_pd_hardrst_count++;
+            chThdSleep(HOST_PD_BUS_TIME);
+            chEvtSignal(cfg->pe.thread, PDB_EVT_PE_HARD_SENT);
+        }
+    }
+}
+
+void host_pd_start(struct pdb_config *cfg)
+{
+    host_pd_source = chThdGetSelfX();
+    host_pd_sent_wr = 0;
+    host_pd_sent_rd = 0;
+    host_pd_hardrst_count = 0;
+
+    chMBObjectInit(&cfg->prl.tx_mailbox, cfg->prl._tx_mailbox_queue,
+            PDB_MSG_POOL_SIZE);
+    cfg->prl.tx_thread = chThdCreateStatic(cfg->prl._tx_wa,
+            sizeof(cfg->prl._tx_wa), HOST_PD_PRIO, HostPRLTX, cfg);
+    cfg->prl.rx_thread = chThdCreateStatic(cfg->prl._rx_wa,
+            sizeof(cfg->prl._rx_wa), HOST_PD_PRIO, HostPRLRX, cfg);
+    cfg->prl.hardrst_thread = chThdCreateStatic(cfg->prl._hardrst_wa,
+            sizeof(cfg->prl._hardrst_wa), HOST_PD_PRIO, HostHardRst, cfg);
+    pdb_pe_run(cfg);
+
+    /* Let the Policy Engine get ready for messages */
+    chThdSleep(HOST_PD_BUS_TIME);
+}
+
+const struct host_pd_sent *host_pd_receive(sysinterval_t timeout)
+{
+    systime_t start = chVTGetSystemTime();
+
+    while (host_pd_sent_rd == host_pd_sent_wr) {
+        sysinterval_t elapsed = chVTTimeElapsedSinceX(start);
+        if (elapsed >= timeout
+                || chEvtWaitAnyTimeout(HOST_PD_EVT_SENT,
+                    timeout - elapsed) == 0) {
+            return NULL;
+        }
+    }
+    return &host_pd_sent[host_pd_sent_rd++ % HOST_PD_SENT_LEN];
+}
+
+void host_pd_send(struct pdb_config *cfg, const union pd_msg *msg)
+{
+    chThdSleep(HOST_PD_BUS_TIME);
+
+    union pd_msg *rx = chPoolAlloc(&pdb_msg_pool);
+    memcpy(rx, msg, sizeof(*rx));
+    chMBPostTimeout(&cfg->pe.mailbox, (msg_t) rx, TIME_IMMEDIATE);
+    chEvtSignal(cfg->pe.thread, PDB_EVT_PE_MSG_RX);
+}
+
+int host_pd_hard_resets(void)
+{
+    return host_pd_hardrst_count;
+}
+
+
+/*
+ * The FUSB302B: VBUS is always there, at the default Type-C Current
+ */
+void fusb_setup(struct pdb_fusb_config *cfg)
+{
+    (void) cfg;
+}
+
+bool fusb_get_vbusok(struct pdb_fusb_config *cfg)
+{
+    (void) cfg;
+    return true;
+}
+
+enum fusb_typec_current fusb_get_typec_current(struct pdb_fusb_config *cfg)
+{
+    (void) cfg;
+    return fusb_tcc_default;
+}
@@ -0,0 +1,72 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A USB PD source on the other end of the cable, standing in for the
+ * protocol layer and the FUSB302B so the Policy Engine in lib/src can run on
+ * a host.
+ *
+ * The thread that starts the Policy Engine plays the source: it receives the
+ * messages the sink transmits and sends it messages of its own.  Each message
+ * takes HOST_PD_BUS_TIME to transmit, and transmission always succeeds.
+ */
+
+#ifndef HOST_PD_SOURCE_H
+#define HOST_PD_SOURCE_H
+
+#include <ch.h>
+
+#include <pdb.h>
+
+
+/* How long a message and its GoodCRC take on the bus */
+#define HOST_PD_BUS_TIME TIME_MS2I(1)
+
+
+/*
+ * A message the sink transmitted, and when it finished
+ */
+struct host_pd_sent {
+    systime_t time;
+    union pd_msg msg;
+};
+
+
+/*
+ * Start the Policy Engine for cfg, with the calling thread as the source
+ */
+void host_pd_start(struct pdb_config *cfg);
+
+/*
+ * Wait up to timeout for the sink to transmit a message, returning it, or
+ * NULL if it didn't.  The message is valid until the next call.
+ */
+const struct host_pd_sent *host_pd_receive(sysinterval_t timeout);
+
+/*
+ * Send the sink a message, returning once it's on the bus
+ */
+void host_pd_send(struct pdb_config *cfg, const union pd_msg *msg);
+
+/*
+ * Return the number of Hard Resets the sink sent since host_pd_start
+ */
+int host_pd_hard_resets(void);
+
+
+#endif /* HOST_PD_SOURCE_H */
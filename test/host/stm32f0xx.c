@@ -0,0 +1,342 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Flash is mapped read-only, so the first write to each host page since the
+ * flash interface was last accessed traps.  The trap makes the page writable
+ * and notes it, and the next access to the flash interface checks what was
+ * written against a copy of flash, the way the real flash interface would,
+ * before making the page read-only again.
+ */
+
+#define _GNU_SOURCE
+
+#include <stm32f0xx.h>
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <ch.h>
+
+
+/* Size of a page of flash */
+#define HOST_FLASH_PAGE_SIZE 2048
+
+/* Host memory pages are assumed to be this size */
+#define HOST_PAGE_SIZE 4096
+#define HOST_PAGES (FLASH_SIZE / HOST_PAGE_SIZE)
+
+
+RCC_TypeDef host_rcc;
+SYSCFG_TypeDef host_syscfg;
+SysTick_Type host_systick;
+TIM_TypeDef host_tim16;
+
+static FLASH_TypeDef flash_regs = {.CR = FLASH_CR_LOCK};
+static bool flash_key1;
+
+/* What flash should hold, to check writes against */
+static uint8_t flash_copy[FLASH_SIZE];
+/* Host pages of flash that have been written to since they were checked */
+static volatile bool flash_dirty[HOST_PAGES];
+
+/* The flash operation the power fails at, if not negative */
+static int32_t flash_fail_at = -1;
+static bool flash_failed;
+
+static struct host_flash_stats flash_stats;
+/* Erasures of each page of flash, counting those the power failed during */
+static uint32_t flash_page_erases[FLASH_SIZE / HOST_FLASH_PAGE_SIZE];
+static uint32_t host_msp_value;
+
+
+static void host_map(uint32_t addr, size_t len)
+{
+    void *p = mmap((void *) (uintptr_t) addr, len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+
+    if (p != (void *) (uintptr_t) addr) {
+        fprintf(stderr, "host: can't map memory at 0x%08X\n", addr);
+        exit(1);
+    }
+}
+
+static void host_segv(int sig, siginfo_t *info, void *ctx)
+{
+    uintptr_t addr = (uintptr_t) info->si_addr;
+
+    (void) ctx;
+
+    /* Let the write to flash happen, and check it later */
+    if (addr >= FLASH_BASE && addr < FLASH_BASE + FLASH_SIZE) {
+        uint32_t page = (addr - FLASH_BASE) / HOST_PAGE_SIZE;
+        flash_dirty[page] = true;
+        mprotect((void *) (uintptr_t) (FLASH_BASE + page * HOST_PAGE_SIZE),
+                HOST_PAGE_SIZE, PROT_READ | PROT_WRITE);
+        return;
+    }
+
+    /* Anything else is a real crash */
+    signal(sig, SIG_DFL);
+}
+
+/*
+ * Map the device's memory when the test starts
+ */
+__attribute__((constructor))
+static void host_init(void)
+{
+    if (sysconf(_SC_PAGESIZE) != HOST_PAGE_SIZE) {
+        fprintf(stderr, "host: unexpected page size\n");
+        exit(1);
+    }
+
+    host_map(FLASH_BASE, FLASH_SIZE);
+    host_map(SRAM_BASE, SRAM_SIZE);
+    host_map(HOST_SYSMEM_VECTORS & ~(HOST_PAGE_SIZE - 1), HOST_PAGE_SIZE);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = host_segv;
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigaction(SIGSEGV, &sa, NULL);
+
+    host_flash_reset();
+}
+
+/*
+ * Write to flash behind the flash interface's back
+ */
+static void flash_store(uint32_t addr, const void *data, size_t len)
+{
+    uint32_t start = addr & ~(HOST_PAGE_SIZE - 1);
+    uint32_t end = (addr + len + HOST_PAGE_SIZE - 1) & ~(HOST_PAGE_SIZE - 1);
+
+    mprotect((void *) (uintptr_t) start, end - start, PROT_READ | PROT_WRITE);
+    memcpy((void *) (uintptr_t) addr, data, len);
+    memcpy(&flash_copy[addr - FLASH_BASE], data, len);
+    mprotect((void *) (uintptr_t) start, end - start, PROT_READ);
+}
+
+static void flash_fill(uint32_t addr, uint8_t value, size_t len)
+{
+    static uint8_t buf[HOST_FLASH_PAGE_SIZE];
+
+    memset(buf, value, sizeof(buf));
+    while (len > 0) {
+        size_t n = (len < sizeof(buf)) ? len : sizeof(buf);
+        flash_store(addr, buf, n);
+        addr += n;
+        len -= n;
+    }
+}
+
+/*
+ * Lose power, resetting the device
+ */
+static void flash_power_fail(void)
+{
+    flash_fail_at = -1;
+    flash_failed = true;
+    flash_regs = (FLASH_TypeDef) {.CR = FLASH_CR_LOCK};
+    host_reset();
+}
+
+/*
+ * Count a flash operation, returning true if the power fails during it
+ */
+static bool flash_operation(void)
+{
+    if (flash_fail_at == 0) {
+        return true;
+    }
+    if (flash_fail_at > 0) {
+        flash_fail_at--;
+    }
+    return false;
+}
+
+/*
+ * Check what was written to flash since the last access to the flash
+ * interface
+ */
+static void flash_check_writes(void)
+{
+    for (uint32_t page = 0; page < HOST_PAGES; page++) {
+        if (!flash_dirty[page]) {
+            continue;
+        }
+        flash_dirty[page] = false;
+
+        uint32_t base = FLASH_BASE + page * HOST_PAGE_SIZE;
+        uint16_t *mem = (uint16_t *) (uintptr_t) base;
+        uint16_t *copy = (uint16_t *) &flash_copy[page * HOST_PAGE_SIZE];
+        for (uint32_t i = 0; i < HOST_PAGE_SIZE / 2; i++) {
+            if (mem[i] == copy[i]) {
+                continue;
+            }
+            uint16_t written = mem[i];
+            /* Whatever happens, the write goes through the flash interface */
+            mem[i] = copy[i];
+            if (!(flash_regs.CR & FLASH_CR_PG)) {
+                fprintf(stderr, "host: flash written at 0x%08X without PG\n",
+                        (unsigned) (base + i * 2));
+                flash_stats.errors++;
+                continue;
+            }
+            if (flash_operation()) {
+                mprotect(mem, HOST_PAGE_SIZE, PROT_READ);
+                flash_power_fail();
+            }
+            /* A halfword can only be programmed once, or cleared */
+            if (copy[i] != 0xFFFF && written != 0x0000) {
+                fprintf(stderr, "host: flash programmed twice at 0x%08X\n",
+                        (unsigned) (base + i * 2));
+                flash_stats.errors++;
+                flash_regs.SR |= FLASH_SR_PGERR;
+                continue;
+            }
+            mem[i] = written;
+            copy[i] = written;
+            flash_stats.programs++;
+            flash_regs.SR |= FLASH_SR_EOP;
+        }
+        mprotect(mem, HOST_PAGE_SIZE, PROT_READ);
+    }
+}
+
+FLASH_TypeDef *host_flash_interface(void)
+{
+    /* Unlock with the key sequence */
+    if (flash_regs.KEYR != 0) {
+        if (flash_regs.KEYR == FLASH_KEY1) {
+            flash_key1 = true;
+        } else if (flash_regs.KEYR == FLASH_KEY2 && flash_key1) {
+            flash_regs.CR &= ~FLASH_CR_LOCK;
+            flash_key1 = false;
+        } else {
+            flash_key1 = false;
+        }
+        flash_regs.KEYR = 0;
+    }
+
+    /* Nothing but the lock can be set while locked */
+    if (flash_regs.CR & FLASH_CR_LOCK) {
+        flash_regs.CR = FLASH_CR_LOCK;
+    }
+
+    flash_check_writes();
+
+    /* Erase a page when asked to */
+    if ((flash_regs.CR & FLASH_CR_PER) && (flash_regs.CR & FLASH_CR_STRT)) {
+        flash_regs.CR &= ~FLASH_CR_STRT;
+        uint32_t page = flash_regs.AR & ~(HOST_FLASH_PAGE_SIZE - 1);
+        if (page < FLASH_BASE || page >= FLASH_BASE + FLASH_SIZE) {
+            fprintf(stderr, "host: erasing 0x%08X, outside flash\n",
+                    (unsigned) page);
+            flash_stats.errors++;
+        } else if (flash_operation()) {
+            flash_page_erases[(page - FLASH_BASE) / HOST_FLASH_PAGE_SIZE]++;
+            flash_fill(page, 0xFF, HOST_FLASH_PAGE_SIZE / 2);
+            flash_power_fail();
+        } else {
+            flash_fill(page, 0xFF, HOST_FLASH_PAGE_SIZE);
+            flash_page_erases[(page - FLASH_BASE) / HOST_FLASH_PAGE_SIZE]++;
+            flash_stats.erases++;
+            flash_regs.SR |= FLASH_SR_EOP;
+        }
+    }
+
+    /* Flash is never busy, since writes finish right away */
+    flash_regs.SR &= ~FLASH_SR_BSY;
+
+    return &flash_regs;
+}
+
+void NVIC_SystemReset(void)
+{
+    host_rcc.CSR |= RCC_CSR_SFTRSTF;
+    flash_regs = (FLASH_TypeDef) {.CR = FLASH_CR_LOCK};
+    host_reset();
+}
+
+void __set_MSP(uint32_t msp)
+{
+    host_msp_value = msp;
+    flash_regs = (FLASH_TypeDef) {.CR = FLASH_CR_LOCK};
+    host_reset();
+}
+
+uint32_t __get_PSP(void)
+{
+    return 0;
+}
+
+
+void host_flash_reset(void)
+{
+    flash_fill(FLASH_BASE, 0xFF, FLASH_SIZE);
+    memset((void *) (uintptr_t) SRAM_BASE, 0, SRAM_SIZE);
+
+    uint32_t *sysmem = (uint32_t *) (uintptr_t) HOST_SYSMEM_VECTORS;
+    sysmem[0] = SRAM_BASE + 0x1000;
+    sysmem[1] = HOST_SYSMEM_RESET;
+
+    flash_regs = (FLASH_TypeDef) {.CR = FLASH_CR_LOCK};
+    flash_fail_at = -1;
+    flash_failed = false;
+    memset(&flash_stats, 0, sizeof(flash_stats));
+    memset(flash_page_erases, 0, sizeof(flash_page_erases));
+}
+
+void host_flash_poke(uint32_t addr, const void *data, size_t len)
+{
+    flash_store(addr, data, len);
+}
+
+void host_flash_fail_at(int32_t op)
+{
+    flash_fail_at = op;
+}
+
+bool host_flash_failed(void)
+{
+    bool failed = flash_failed;
+
+    flash_failed = false;
+    return failed;
+}
+
+void host_flash_stats_get(struct host_flash_stats *stats)
+{
+    *stats = flash_stats;
+}
+
+uint32_t host_flash_page_erases(uint32_t addr)
+{
+    return flash_page_erases[(addr - FLASH_BASE) / HOST_FLASH_PAGE_SIZE];
+}
+
+uint32_t host_msp(void)
+{
+    return host_msp_value;
+}
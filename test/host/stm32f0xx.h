@@ -0,0 +1,218 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A simulated STM32F072, with just the peripherals the tested code uses.
+ *
+ * Flash, RAM, and the system memory are mapped at their real addresses, so
+ * the firmware's addresses work unchanged.  Flash behaves like the real thing:
+ * it's only written through the flash interface, a halfword can only be
+ * programmed once between erasures (or cleared to zero), and the power can be
+ * made to fail partway through any write.
+ */
+
+#ifndef HOST_STM32F0XX_H
+#define HOST_STM32F0XX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define __IO volatile
+
+#define FLASH_BASE 0x08000000
+#define FLASH_SIZE (128 * 1024)
+#define SRAM_BASE 0x20000000
+#define SRAM_SIZE (16 * 1024)
+
+/* Where the system memory's vector table is, and the reset vector it holds */
+#define HOST_SYSMEM_VECTORS 0x1FFFC800
+#define HOST_SYSMEM_RESET 0x1FFFD5A1
+
+
+typedef struct {
+    __IO uint32_t ACR;
+    __IO uint32_t KEYR;
+    __IO uint32_t OPTKEYR;
+    __IO uint32_t SR;
+    __IO uint32_t CR;
+    __IO uint32_t AR;
+    __IO uint32_t RESERVED;
+    __IO uint32_t OBR;
+    __IO uint32_t WRPR;
+} FLASH_TypeDef;
+
+#define FLASH_SR_BSY 0x01
+#define FLASH_SR_PGERR 0x04
+#define FLASH_SR_WRPRTERR 0x10
+#define FLASH_SR_EOP 0x20
+#define FLASH_CR_PG 0x01
+#define FLASH_CR_PER 0x02
+#define FLASH_CR_STRT 0x40
+#define FLASH_CR_LOCK 0x80
+#define FLASH_KEY1 0x45670123
+#define FLASH_KEY2 0xCDEF89AB
+
+typedef struct {
+    __IO uint32_t CR;
+    __IO uint32_t CFGR;
+    __IO uint32_t CIR;
+    __IO uint32_t APB2RSTR;
+    __IO uint32_t APB1RSTR;
+    __IO uint32_t AHBENR;
+    __IO uint32_t APB2ENR;
+    __IO uint32_t APB1ENR;
+    __IO uint32_t BDCR;
+    __IO uint32_t CSR;
+} RCC_TypeDef;
+
+#define RCC_APB2ENR_SYSCFGCOMPEN 0x01
+
+#define RCC_CSR_RMVF 0x01000000
+#define RCC_CSR_PINRSTF 0x04000000
+#define RCC_CSR_PORRSTF 0x08000000
+#define RCC_CSR_SFTRSTF 0x10000000
+#define RCC_CSR_IWDGRSTF 0x20000000
+#define RCC_CSR_WWDGRSTF 0x40000000
+
+typedef struct {
+    __IO uint32_t CFGR1;
+} SYSCFG_TypeDef;
+
+#define SYSCFG_CFGR1_MEM_MODE 0x03
+#define SYSCFG_CFGR1_MEM_MODE_0 0x01
+
+typedef struct {
+    __IO uint32_t CTRL;
+    __IO uint32_t LOAD;
+    __IO uint32_t VAL;
+    __IO uint32_t CALIB;
+} SysTick_Type;
+
+typedef struct {
+    __IO uint32_t CR1;
+    __IO uint32_t CR2;
+    __IO uint32_t SMCR;
+    __IO uint32_t DIER;
+    __IO uint32_t SR;
+    __IO uint32_t EGR;
+    __IO uint32_t CCMR1;
+    __IO uint32_t CCMR2;
+    __IO uint32_t CCER;
+    __IO uint32_t CNT;
+    __IO uint32_t PSC;
+    __IO uint32_t ARR;
+    __IO uint32_t RCR;
+    __IO uint32_t CCR1;
+    __IO uint32_t CCR2;
+    __IO uint32_t CCR3;
+    __IO uint32_t CCR4;
+    __IO uint32_t BDTR;
+} TIM_TypeDef;
+
+#define TIM_CR1_CEN 0x0001
+#define TIM_EGR_UG 0x0001
+#define TIM_CCMR1_OC1M_0 0x0010
+#define TIM_CCMR1_OC1M_1 0x0020
+#define TIM_CCMR1_OC1M_2 0x0040
+#define TIM_CCMR1_OC1M 0x0070
+#define TIM_CCER_CC1E 0x0001
+#define TIM_BDTR_MOE 0x8000
+
+#define SysTick_CTRL_ENABLE_Msk 0x01
+#define SysTick_CTRL_CLKSOURCE_Msk 0x04
+#define SysTick_LOAD_RELOAD_Msk 0xFFFFFF
+
+/* Every access to the flash interface lets it act on what was done to it
+ * since the last one */
+FLASH_TypeDef *host_flash_interface(void);
+#define FLASH (host_flash_interface())
+
+extern RCC_TypeDef host_rcc;
+#define RCC (&host_rcc)
+extern SYSCFG_TypeDef host_syscfg;
+#define SYSCFG (&host_syscfg)
+extern SysTick_Type host_systick;
+#define SysTick (&host_systick)
+/* The registers are only stored: nothing is driven by them */
+extern TIM_TypeDef host_tim16;
+#define TIM16 (&host_tim16)
+
+/* Reset the device, ending host_run */
+void NVIC_SystemReset(void) __attribute__((noreturn));
+
+/* Start running with the given stack pointer.  On the host, this is where
+ * starting new code ends host_run, as a reset does. */
+void __set_MSP(uint32_t msp);
+
+/* Threads run on host stacks, so there's no process stack pointer to get */
+uint32_t __get_PSP(void);
+
+
+/*
+ * Statistics of the simulated flash
+ */
+struct host_flash_stats {
+    /* Halfwords programmed and pages erased */
+    uint32_t programs;
+    uint32_t erases;
+    /* Writes that real flash would have refused */
+    uint32_t errors;
+};
+
+/*
+ * Erase all of flash, clear RAM, and reset the flash statistics
+ */
+void host_flash_reset(void);
+
+/*
+ * Write to flash directly, as a programmer would
+ */
+void host_flash_poke(uint32_t addr, const void *data, size_t len);
+
+/*
+ * Make the power fail at the given flash operation from now, counting from
+ * zero, or never if it's negative.  A halfword being programmed when the
+ * power fails is left as it was, and a page being erased is left half erased.
+ */
+void host_flash_fail_at(int32_t op);
+
+/*
+ * Return whether the power failed since the last call
+ */
+bool host_flash_failed(void);
+
+/*
+ * Get the statistics of the simulated flash
+ */
+void host_flash_stats_get(struct host_flash_stats *stats);
+
+/*
+ * Return how many times the flash page holding the given address has been
+ * erased, including any erasure the power failed during
+ */
+uint32_t host_flash_page_erases(uint32_t addr);
+
+/*
+ * Return the stack pointer the last code started was given with __set_MSP
+ */
+uint32_t host_msp(void);
+
+
+#endif /* HOST_STM32F0XX_H */
@@ -0,0 +1,449 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Tests of the charger database, replaying recorded sequences of Policy
+ * Engine events through the Device Policy Manager with src/charger.c on
+ * simulated flash.  Each sequence ends with the PDOs the database should
+ * avoid for the charger, and the PDO the DPM should settle on.
+ */
+
+#include <string.h>
+
+#include <ch.h>
+#include <hal.h>
+
+#include "check.h"
+#include "charger.h"
+#include "config.h"
+#include "device_policy_manager.h"
+#include "flash.h"
+#include "history.h"
+#include "led.h"
+#include "telemetry.h"
+
+
+thread_t *pdbs_led_thread;
+MEMORY_POOL_DECL(pdb_msg_pool, sizeof(union pd_msg), PORT_NATURAL_ALIGN, NULL);
+
+/* The configuration of profile 0, the only one stored */
+static struct pdbs_config test_scfg;
+
+struct pdbs_config *pdbs_config_flash_read(uint8_t profile)
+{
+    return (profile == 0) ? &test_scfg : NULL;
+}
+
+uint8_t pdbs_config_flash_get_active(void)
+{
+    return 0;
+}
+
+/* The Policy Engine is always idle, so erasures never wait */
+bool pdb_pe_idle(struct pdb_config *cfg, sysinterval_t quiet)
+{
+    (void) cfg;
+    (void) quiet;
+    return true;
+}
+
+void pdbs_history_log(enum pdbs_history_type type, uint8_t pdo, int v,
+        uint16_t i)
+{
+    (void) type;
+    (void) pdo;
+    (void) v;
+    (void) i;
+}
+
+bool pdbs_telemetry_get(struct pdbs_telemetry *t, uint8_t age)
+{
+    (void) t;
+    (void) age;
+    return false;
+}
+
+void pdbs_softstart_on(const struct pdbs_softstart *ss)
+{
+    (void) ss;
+}
+
+void pdbs_softstart_off(void)
+{
+}
+
+void pdbs_softstart_limit(uint16_t duty)
+{
+    (void) duty;
+}
+
+uint16_t pdbs_softstart_get_limit(void)
+{
+    return 1000;
+}
+
+bool pdbs_softstart_is_on(void)
+{
+    return false;
+}
+
+
+/* A fixed PDO, from millivolts and milliamperes */
+#define FIXED(mv, ma) \
+    (PD_PDO_TYPE_FIXED | (PD_MV2PDV(mv) << PD_PDO_SRC_FIXED_VOLTAGE_SHIFT) \
+     | PD_MA2PDI(ma))
+/* A PPS APDO, from millivolts and milliamperes */
+#define PPS(vmin, vmax, ma) \
+    (PD_PDO_TYPE_AUGMENTED | PD_APDO_TYPE_PPS \
+     | PD_APDO_PPS_MAX_VOLTAGE_SET(PD_MV2PAV(vmax)) \
+     | PD_APDO_PPS_MIN_VOLTAGE_SET(PD_MV2PAV(vmin)) \
+     | PD_APDO_PPS_CURRENT_SET(PD_CA2PAI(PD_MA2PDI(ma))))
+#define SOURCE_CAPS(n, ...) { \
+    .hdr = PD_MSGTYPE_SOURCE_CAPABILITIES | PD_NUMOBJ(n), \
+    .obj = {__VA_ARGS__} \
+}
+
+/* A 65 W charger */
+static const union pd_msg caps_65w = SOURCE_CAPS(4,
+        FIXED(5000, 3000), FIXED(9000, 3000), FIXED(15000, 3000),
+        FIXED(20000, 3250));
+/* A 100 W charger with PPS */
+static const union pd_msg caps_100w = SOURCE_CAPS(5,
+        FIXED(5000, 3000), FIXED(9000, 3000), FIXED(15000, 3000),
+        FIXED(20000, 5000), PPS(3300, 21000, 5000));
+
+/* 2 A at anything from 9 V to 20 V, preferring high voltages */
+static const struct pdbs_config config_range_hv = {
+    .status = PDBS_CONFIG_STATUS_VALID,
+    .flags = PDBS_CONFIG_FLAGS_CURRENT_DEFN_I | PDBS_CONFIG_FLAGS_HV_PREFERRED,
+    .v = 12000,
+    .i = 200,
+    .vmin = 9000,
+    .vmax = 20000,
+    .profile = 0
+};
+/* 5 V at 1 A */
+static const struct pdbs_config config_5v = {
+    .status = PDBS_CONFIG_STATUS_VALID,
+    .flags = PDBS_CONFIG_FLAGS_CURRENT_DEFN_I,
+    .v = 5000,
+    .i = 100,
+    .profile = 0
+};
+/* 9 V at 2 A, preferring PPS */
+static const struct pdbs_config config_9v_pps = {
+    .status = PDBS_CONFIG_STATUS_VALID,
+    .flags = PDBS_CONFIG_FLAGS_CURRENT_DEFN_I
+        | PDBS_CONFIG_FLAGS_PPS_PREFERRED,
+    .v = 9000,
+    .i = 200,
+    .profile = 0
+};
+
+
+/*
+ * What the Policy Engine tells the DPM
+ */
+enum event_type {
+    /* The source sent its capabilities, and we made a Request */
+    EV_CAPS,
+    /* The source accepted the Request */
+    EV_ACCEPT,
+    /* The source said the new contract is ready */
+    EV_PS_RDY,
+    /* Time passed */
+    EV_WAIT,
+    /* A Hard Reset was sent or received */
+    EV_HARD_RESET,
+    /* The source was unplugged */
+    EV_DETACH,
+    /* Nothing more */
+    EV_END
+};
+
+struct event {
+    enum event_type type;
+    /* For EV_WAIT, how long, in milliseconds */
+    uint32_t ms;
+};
+
+/* A contract, made without trouble */
+#define CONTRACT {EV_CAPS, 0}, {EV_ACCEPT, 0}, {EV_PS_RDY, 0}
+
+/*
+ * A recorded sequence, and what the database should make of it
+ */
+struct sequence {
+    const char *name;
+    const union pd_msg *caps;
+    const struct pdbs_config *scfg;
+    /* Object positions the Policy Engine knows to be PPS, as it keeps them */
+    uint16_t pps_mask;
+    struct event events[16];
+    /* The charger's avoid mask and Hard Reset count afterwards */
+    uint16_t avoid;
+    uint8_t resets;
+    /* The PDO of the last contract */
+    uint8_t pdo;
+    /* How many Requests the database steered away from a PDO */
+    uint32_t avoided;
+};
+
+static const struct sequence sequences[] = {
+    {
+        "reset with the Request outstanding", &caps_65w, &config_range_hv, 0,
+        {{EV_CAPS, 0}, {EV_ACCEPT, 0}, {EV_HARD_RESET, 0}, CONTRACT,
+            {EV_END, 0}},
+        1 << 3, 1, 3, 1
+    },
+    {
+        "reset soon after the contract started", &caps_65w, &config_range_hv,
+        0,
+        {CONTRACT, {EV_WAIT, 1000}, {EV_HARD_RESET, 0}, CONTRACT,
+            {EV_END, 0}},
+        1 << 3, 1, 3, 1
+    },
+    {
+        "reset long after the contract started", &caps_65w, &config_range_hv,
+        0,
+        {CONTRACT, {EV_WAIT, 60000}, {EV_HARD_RESET, 0}, CONTRACT,
+            {EV_END, 0}},
+        0, 1, 4, 0
+    },
+    {
+        "unplugged with the Request outstanding", &caps_65w,
+        &config_range_hv, 0,
+        {{EV_CAPS, 0}, {EV_ACCEPT, 0}, {EV_DETACH, 0}, CONTRACT,
+            {EV_END, 0}},
+        0, 0, 4, 0
+    },
+    {
+        "reset twice before the source came back", &caps_65w,
+        &config_range_hv, 0,
+        {{EV_CAPS, 0}, {EV_ACCEPT, 0}, {EV_HARD_RESET, 0},
+            {EV_HARD_RESET, 0}, CONTRACT, {EV_END, 0}},
+        1 << 3, 1, 3, 1
+    },
+    {
+        "reset asking for vSafe5V", &caps_65w, &config_5v, 0,
+        {{EV_CAPS, 0}, {EV_ACCEPT, 0}, {EV_HARD_RESET, 0}, CONTRACT,
+            {EV_END, 0}},
+        0, 1, 1, 0
+    },
+    {
+        "reset long into a PPS contract", &caps_100w, &config_9v_pps, 1 << 5,
+        {CONTRACT, {EV_WAIT, 60000}, {EV_HARD_RESET, 0}, CONTRACT,
+            {EV_END, 0}},
+        1 << 4, 1, 2, 1
+    },
+    {
+        "reset at every PDO in the range", &caps_65w, &config_range_hv, 0,
+        {{EV_CAPS, 0}, {EV_ACCEPT, 0}, {EV_HARD_RESET, 0},
+            {EV_CAPS, 0}, {EV_ACCEPT, 0}, {EV_HARD_RESET, 0},
+            {EV_CAPS, 0}, {EV_ACCEPT, 0}, {EV_HARD_RESET, 0},
+            CONTRACT, {EV_END, 0}},
+        (1 << 1) | (1 << 2) | (1 << 3), 3, 4, 2
+    }
+};
+#define SEQUENCES (sizeof(sequences) / sizeof(sequences[0]))
+
+
+static struct pdbs_dpm_data dpm_data;
+static struct pdb_config pdb_config = {
+    .dpm_data = &dpm_data
+};
+
+/* The sequence the device replays when it's next started, or NULL to just
+ * start */
+static const struct sequence *run_seq;
+/* The charger's entry afterwards, and whether there is one */
+static struct pdbs_charger run_charger;
+static bool run_found;
+/* How the database was used while replaying */
+static struct pdbs_charger_stats run_stats;
+
+/*
+ * Give the DPM a fresh copy of the source's capabilities, as the Policy
+ * Engine does
+ */
+static void source_capabilities(const union pd_msg *caps)
+{
+    union pd_msg *msg = chPoolAlloc(&pdb_msg_pool);
+    union pd_msg request;
+
+    *msg = *caps;
+    pdbs_dpm_evaluate_capability(&pdb_config, msg, &request);
+}
+
+/*
+ * Start the charger database, replay run_seq, and wait for the database to
+ * be written to flash
+ */
+static void device_main(void)
+{
+    struct pdbs_charger_stats start;
+
+    pdbs_flash_init(&pdb_config);
+    pdbs_charger_init();
+    pdbs_charger_run();
+
+    /* The statistics aren't cleared by a reset of the host's device */
+    pdbs_charger_stats_get(&start);
+
+    if (run_seq != NULL) {
+        test_scfg = *run_seq->scfg;
+        pdb_config.pe._pps_mask = run_seq->pps_mask;
+        pdb_config.pe._source_detached = false;
+
+        for (const struct event *ev = run_seq->events; ev->type != EV_END;
+                ev++) {
+            switch (ev->type) {
+            case EV_CAPS:
+                source_capabilities(run_seq->caps);
+                break;
+            case EV_ACCEPT:
+                pdbs_dpm_transition_standby(&pdb_config);
+                break;
+            case EV_PS_RDY:
+                pdbs_dpm_transition_requested(&pdb_config);
+                break;
+            case EV_WAIT:
+                chThdSleepMilliseconds(ev->ms);
+                break;
+            case EV_HARD_RESET:
+                pdbs_dpm_transition_default(&pdb_config);
+                break;
+            case EV_DETACH:
+                pdb_config.pe._source_detached = true;
+                pdbs_dpm_transition_default(&pdb_config);
+                pdb_config.pe._source_detached = false;
+                break;
+            default:
+                break;
+            }
+        }
+
+        /* Give the database time to be written */
+        chThdSleep(PDBS_CHARGER_WRITE_DELAY + TIME_S2I(1));
+    }
+
+    uint32_t fingerprint = pdbs_charger_fingerprint(
+            (run_seq != NULL) ? run_seq->caps : &caps_65w);
+    run_found = false;
+    for (int i = 0; pdbs_charger_get(i, &run_charger); i++) {
+        if (run_charger.fingerprint == fingerprint) {
+            run_found = true;
+            break;
+        }
+    }
+    pdbs_charger_stats_get(&run_stats);
+    run_stats.lookups -= start.lookups;
+    run_stats.hits -= start.hits;
+    run_stats.avoided -= start.avoided;
+}
+
+/*
+ * Set the DPM up as it is at startup
+ */
+static void dpm_reset(void)
+{
+    if (dpm_data.capabilities != NULL) {
+        chPoolFree(&pdb_msg_pool, (union pd_msg *) dpm_data.capabilities);
+    }
+    memset(&dpm_data, 0, sizeof(dpm_data));
+    dpm_data.output_enabled = true;
+}
+
+
+/*
+ * Every recorded sequence leaves the database as it should
+ */
+static void test_sequences(void)
+{
+    for (size_t i = 0; i < SEQUENCES; i++) {
+        const struct sequence *seq = &sequences[i];
+
+        host_flash_reset();
+        dpm_reset();
+        run_seq = seq;
+        CHECK(host_run(device_main));
+
+        CHECK(run_found);
+        if (run_charger.avoid != seq->avoid || dpm_data._requested_pdo
+                != seq->pdo) {
+            fprintf(stderr, "%s: avoid %04X, PDO %d\n", seq->name,
+                    run_charger.avoid, dpm_data._requested_pdo);
+        }
+        CHECK_EQ(run_charger.avoid, seq->avoid);
+        CHECK_EQ(run_charger.resets, seq->resets);
+        CHECK_EQ(run_charger.pdo, seq->pdo);
+        CHECK_EQ(dpm_data._requested_pdo, seq->pdo);
+        CHECK_EQ(run_stats.avoided, seq->avoided);
+    }
+}
+
+/*
+ * What the database learned is still there after a restart, and steers the
+ * first Request
+ */
+static void test_restart(void)
+{
+    static const struct sequence first_request = {
+        "first Request after a restart", &caps_65w, &config_range_hv, 0,
+        {{EV_CAPS, 0}, {EV_END, 0}},
+        1 << 3, 1, 0, 1
+    };
+
+    host_flash_reset();
+    dpm_reset();
+    run_seq = &sequences[0];
+    CHECK(host_run(device_main));
+
+    /* Restart, and just look */
+    dpm_reset();
+    run_seq = NULL;
+    CHECK(host_run(device_main));
+    CHECK(run_found);
+    CHECK_EQ(run_charger.avoid, 1 << 3);
+    CHECK_EQ(run_charger.resets, 1);
+    CHECK_EQ(run_charger.pdo, 3);
+    CHECK_EQ(run_stats.lookups, 0);
+
+    /* Restart, and see the charger again */
+    dpm_reset();
+    run_seq = &first_request;
+    CHECK(host_run(device_main));
+    CHECK(run_found);
+    CHECK_EQ(run_charger.avoid, first_request.avoid);
+    CHECK_EQ(dpm_data._requested_pdo, 3);
+    CHECK_EQ(run_stats.hits, 1);
+    CHECK_EQ(run_stats.avoided, first_request.avoided);
+
+    struct host_flash_stats stats;
+    host_flash_stats_get(&stats);
+    CHECK_EQ(stats.errors, 0);
+}
+
+
+int main(void)
+{
+    test_sequences();
+    test_restart();
+
+    return check_done("test_charger");
+}
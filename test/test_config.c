@@ -0,0 +1,500 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Tests of the configuration journal, running src/config.c on simulated
+ * flash.  A model of what should be stored is kept alongside, and checked
+ * against what the firmware finds in flash after every restart.  The tests
+ * check that the pages wear evenly, and that losing power at any flash write
+ * leaves either the old configuration or the new one.
+ */
+
+#include <string.h>
+
+#include <ch.h>
+#include <hal.h>
+
+#include "check.h"
+#include "config.h"
+#include "device_policy_manager.h"
+#include "flash.h"
+
+
+/* Size of the configuration journal */
+#define JOURNAL_SIZE (PDBS_CONFIG_PAGES * PDBS_FLASH_PAGE_SIZE)
+
+/* Updates made by the wear levelling test */
+#define WEAR_UPDATES 1200
+
+
+/* The Policy Engine is always idle, so erasures never wait */
+bool pdb_pe_idle(struct pdb_config *cfg, sysinterval_t quiet)
+{
+    (void) cfg;
+    (void) quiet;
+    return true;
+}
+
+void pdbs_dpm_config_changed(struct pdb_config *cfg, uint8_t profile,
+        systime_t since)
+{
+    (void) cfg;
+    (void) profile;
+    (void) since;
+}
+
+
+static struct pdb_config pdb_config;
+
+/*
+ * What should be stored
+ */
+struct model {
+    bool has_cfg[PDBS_CONFIG_PROFILES];
+    struct pdbs_config cfg[PDBS_CONFIG_PROFILES];
+    char name[PDBS_CONFIG_PROFILES][PDBS_CONFIG_NAME_LEN + 1];
+    uint8_t active;
+};
+
+/*
+ * Changes to the configuration
+ */
+enum op_type {
+    OP_UPDATE,
+    OP_REMOVE,
+    OP_NAME,
+    OP_ACTIVE,
+    OP_ERASE
+};
+
+struct op {
+    enum op_type type;
+    uint8_t profile;
+    /* For OP_UPDATE, the voltage to configure, in millivolts */
+    uint16_t mv;
+    /* For OP_NAME, the name */
+    const char *name;
+};
+
+
+/*
+ * Return the configuration an OP_UPDATE stores
+ */
+static struct pdbs_config op_config(const struct op *op)
+{
+    struct pdbs_config cfg;
+
+    memset(&cfg, 0xFF, sizeof(cfg));
+    cfg.status = PDBS_CONFIG_STATUS_VALID;
+    cfg.flags = PDBS_CONFIG_FLAGS_CURRENT_DEFN_I;
+    cfg.v = op->mv;
+    cfg.i = 100 + op->profile;
+    cfg.vmin = 0;
+    cfg.vmax = 0;
+    cfg.profile = op->profile;
+    return cfg;
+}
+
+/*
+ * Make the change to the model
+ */
+static void model_apply(struct model *m, const struct op *op)
+{
+    switch (op->type) {
+    case OP_UPDATE:
+        m->has_cfg[op->profile] = true;
+        m->cfg[op->profile] = op_config(op);
+        break;
+    case OP_REMOVE:
+        if (m->has_cfg[op->profile]) {
+            m->has_cfg[op->profile] = false;
+            m->name[op->profile][0] = '\0';
+        }
+        break;
+    case OP_NAME:
+        strncpy(m->name[op->profile], op->name, PDBS_CONFIG_NAME_LEN);
+        m->name[op->profile][PDBS_CONFIG_NAME_LEN] = '\0';
+        break;
+    case OP_ACTIVE:
+        m->active = op->profile;
+        break;
+    case OP_ERASE:
+        memset(m, 0, sizeof(*m));
+        break;
+    }
+}
+
+/*
+ * Make the change to the stored configuration
+ */
+static void op_run(const struct op *op)
+{
+    struct pdbs_config cfg;
+
+    switch (op->type) {
+    case OP_UPDATE:
+        cfg = op_config(op);
+        pdbs_config_flash_update(&cfg);
+        break;
+    case OP_REMOVE:
+        pdbs_config_flash_remove(op->profile);
+        break;
+    case OP_NAME:
+        pdbs_config_flash_set_name(op->profile, op->name);
+        break;
+    case OP_ACTIVE:
+        pdbs_config_flash_set_active(op->profile);
+        break;
+    case OP_ERASE:
+        pdbs_config_flash_erase();
+        break;
+    }
+}
+
+/*
+ * Return whether the firmware has the model's configuration
+ */
+static bool model_stored(const struct model *m)
+{
+    char name[PDBS_CONFIG_NAME_LEN + 1];
+
+    for (uint8_t p = 0; p < PDBS_CONFIG_PROFILES; p++) {
+        const struct pdbs_config *cfg = pdbs_config_flash_read(p);
+        if ((cfg != NULL) != m->has_cfg[p]) {
+            return false;
+        }
+        if (cfg != NULL && memcmp(cfg, &m->cfg[p], sizeof(*cfg)) != 0) {
+            return false;
+        }
+        if (!pdbs_config_flash_get_name(p, name)) {
+            name[0] = '\0';
+        }
+        if (strcmp(name, m->name[p]) != 0) {
+            return false;
+        }
+    }
+    return pdbs_config_flash_get_active() == m->active;
+}
+
+
+/* What the device does when it's next started: the changes to make, and
+ * the models to check for afterwards */
+static const struct op *run_ops;
+static size_t run_nops;
+static const struct model *run_models[2];
+/* Which of run_models the firmware had, or -1 for neither */
+static int run_stored;
+
+/*
+ * Start the configuration journal, make the changes in run_ops, and see which
+ * of run_models the firmware has
+ */
+static void device_main(void)
+{
+    pdbs_flash_init(&pdb_config);
+    pdbs_config_flash_init();
+    pdbs_config_flash_run(&pdb_config);
+
+    for (size_t i = 0; i < run_nops; i++) {
+        op_run(&run_ops[i]);
+    }
+
+    run_stored = -1;
+    for (int i = 1; i >= 0; i--) {
+        if (run_models[i] != NULL && model_stored(run_models[i])) {
+            run_stored = i;
+        }
+    }
+}
+
+/*
+ * Start the device, making the given changes.  Returns false if the power
+ * failed.
+ */
+static bool device_run(const struct op *ops, size_t nops)
+{
+    run_ops = ops;
+    run_nops = nops;
+    run_models[0] = NULL;
+    run_models[1] = NULL;
+    return host_run(device_main);
+}
+
+/*
+ * Start the device, returning which of the given models it has stored: 0 for
+ * the first, 1 for the second, or -1 for neither
+ */
+static int device_stored(const struct model *m0, const struct model *m1)
+{
+    run_ops = NULL;
+    run_nops = 0;
+    run_models[0] = m0;
+    run_models[1] = m1;
+    host_run(device_main);
+    return run_stored;
+}
+
+/*
+ * Check that flash was only ever written the way real flash allows
+ */
+static void check_no_errors(void)
+{
+    struct host_flash_stats stats;
+
+    host_flash_stats_get(&stats);
+    CHECK_EQ(stats.errors, 0);
+}
+
+/*
+ * Return how many records fit in a configuration page
+ */
+static int page_records(void)
+{
+    int n = 0;
+
+    while (pdbs_config_flash_get(n) != NULL) {
+        n++;
+    }
+    return n;
+}
+
+
+/*
+ * Nothing is stored in erased flash, and what's written survives restarts
+ */
+static void test_fresh(void)
+{
+    static const struct op ops[] = {
+        {OP_UPDATE, 0, 9000, NULL},
+        {OP_UPDATE, 3, 15000, NULL},
+        {OP_NAME, 3, 0, "Fifteen volt"},
+        {OP_ACTIVE, 3, 0, NULL},
+        {OP_UPDATE, 0, 12000, NULL},
+        {OP_NAME, 0, 0, "A name longer than allowed"}
+    };
+    struct model empty, m;
+
+    host_flash_reset();
+    memset(&empty, 0, sizeof(empty));
+    CHECK_EQ(device_stored(&empty, NULL), 0);
+
+    memset(&m, 0, sizeof(m));
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        model_apply(&m, &ops[i]);
+    }
+    CHECK(device_run(ops, sizeof(ops) / sizeof(ops[0])));
+    CHECK_EQ(device_stored(&m, NULL), 0);
+    CHECK_EQ(strlen(m.name[0]), PDBS_CONFIG_NAME_LEN);
+
+    /* Removing a profile takes its name too, and erasing takes everything */
+    static const struct op remove = {OP_REMOVE, 3, 0, NULL};
+    model_apply(&m, &remove);
+    CHECK(device_run(&remove, 1));
+    CHECK_EQ(device_stored(&m, NULL), 0);
+
+    static const struct op erase = {OP_ERASE, 0, 0, NULL};
+    CHECK(device_run(&erase, 1));
+    CHECK_EQ(device_stored(&empty, NULL), 0);
+
+    check_no_errors();
+}
+
+/*
+ * Configuration from before the journal is found, and moved into it
+ */
+static void test_legacy(void)
+{
+    struct pdbs_config legacy[3];
+    struct model m;
+
+    host_flash_reset();
+    memset(&m, 0, sizeof(m));
+    memset(legacy, 0xFF, sizeof(legacy));
+
+    /* An object from before profiles, an old one for profile 2 replaced by a
+     * newer one, and the end of the array */
+    legacy[0] = op_config(&(struct op) {OP_UPDATE, 0, 5000, NULL});
+    legacy[0].profile = 0xFFFF;
+    legacy[1] = op_config(&(struct op) {OP_UPDATE, 2, 9000, NULL});
+    legacy[1].status = PDBS_CONFIG_STATUS_INVALID;
+    legacy[2] = op_config(&(struct op) {OP_UPDATE, 2, 20000, NULL});
+    host_flash_poke(PDBS_CONFIG_BASE, legacy, sizeof(legacy));
+
+    m.has_cfg[0] = true;
+    m.cfg[0] = legacy[0];
+    m.has_cfg[2] = true;
+    m.cfg[2] = legacy[2];
+    CHECK_EQ(device_stored(&m, NULL), 0);
+
+    /* The first change moves everything to the second page, leaving the old
+     * array alone until that's done */
+    static const struct op update = {OP_UPDATE, 1, 12000, NULL};
+    model_apply(&m, &update);
+    m.cfg[0].profile = 0;
+    CHECK(device_run(&update, 1));
+    CHECK_EQ(device_stored(&m, NULL), 0);
+    CHECK_EQ(host_flash_page_erases(PDBS_CONFIG_BASE), 0);
+
+    check_no_errors();
+}
+
+/*
+ * Rewriting the configuration over and over wears every page the same, and
+ * only erases a page once it's full
+ */
+static void test_wear(void)
+{
+    static struct op ops[WEAR_UPDATES];
+    static char names[PDBS_CONFIG_PROFILES][PDBS_CONFIG_NAME_LEN + 1];
+    struct model m;
+
+    host_flash_reset();
+    memset(&m, 0, sizeof(m));
+
+    /* Fill every profile, name it, and keep changing them */
+    for (int i = 0; i < WEAR_UPDATES; i++) {
+        uint8_t p = i % PDBS_CONFIG_PROFILES;
+        if (i % 10 == 9) {
+            snprintf(names[p], sizeof(names[p]), "Profile %d", i % 97);
+            ops[i] = (struct op) {OP_NAME, p, 0, names[p]};
+        } else if (i % 10 == 4) {
+            ops[i] = (struct op) {OP_ACTIVE, (i / 10) % PDBS_CONFIG_PROFILES,
+                0, NULL};
+        } else {
+            ops[i] = (struct op) {OP_UPDATE, p, 5000 + i, NULL};
+        }
+        model_apply(&m, &ops[i]);
+    }
+    CHECK(device_run(ops, WEAR_UPDATES));
+    CHECK_EQ(device_stored(&m, NULL), 0);
+
+    /* Every page was erased as often as the others, give or take one */
+    uint32_t min = UINT32_MAX, max = 0, total = 0;
+    for (int page = 0; page < PDBS_CONFIG_PAGES; page++) {
+        uint32_t erases = host_flash_page_erases(PDBS_CONFIG_BASE
+                + page * PDBS_FLASH_PAGE_SIZE);
+        min = (erases < min) ? erases : min;
+        max = (erases > max) ? erases : max;
+        total += erases;
+    }
+    CHECK(max - min <= 1);
+    CHECK(min > 0);
+
+    /* Each page holds every profile's configuration and name and the active
+     * profile when it's started, and the rest of it fills up before the
+     * next is erased */
+    int live = 2 * PDBS_CONFIG_PROFILES + 1;
+    int records = page_records();
+    CHECK(records > live);
+    CHECK(total <= (uint32_t) (WEAR_UPDATES / (records - live) + 1));
+    printf("test_config: %d records per page, %u erasures for %d changes\n",
+            records, (unsigned) total, WEAR_UPDATES);
+
+    check_no_errors();
+}
+
+/*
+ * Losing power at any flash write of a change leaves the old configuration
+ * or the new one, and the journal carries on working afterwards
+ */
+static void test_power_loss(void)
+{
+    /* Setup, before each change is made with power failures */
+    static const struct op setup[] = {
+        {OP_UPDATE, 0, 5000, NULL},
+        {OP_UPDATE, 1, 9000, NULL},
+        {OP_NAME, 1, 0, "Nine"},
+        {OP_ACTIVE, 1, 0, NULL}
+    };
+    /* Changes, the second filling the page and the third moving to the
+     * next */
+    static const struct op changes[] = {
+        {OP_UPDATE, 2, 12000, NULL},
+        {OP_NAME, 0, 0, "Five"},
+        {OP_UPDATE, 3, 15000, NULL},
+        {OP_REMOVE, 1, 0, NULL},
+        {OP_ACTIVE, 3, 0, NULL},
+        {OP_ERASE, 0, 0, NULL},
+        {OP_UPDATE, 4, 20000, NULL}
+    };
+    static uint8_t before[JOURNAL_SIZE];
+    struct model old, new;
+    int failures = 0;
+
+    host_flash_reset();
+    memset(&new, 0, sizeof(new));
+    for (size_t i = 0; i < sizeof(setup) / sizeof(setup[0]); i++) {
+        model_apply(&new, &setup[i]);
+    }
+    CHECK(device_run(setup, sizeof(setup) / sizeof(setup[0])));
+
+    /* Fill the page until only two records are left */
+    int records = page_records();
+    struct pdbs_config *last = pdbs_config_flash_get(records - 3);
+    for (uint16_t mv = 6000; last->status == PDBS_CONFIG_STATUS_EMPTY; mv++) {
+        struct op fill = {OP_UPDATE, 0, mv, NULL};
+        model_apply(&new, &fill);
+        CHECK(device_run(&fill, 1));
+    }
+    CHECK(pdbs_config_flash_get(records - 2)->status
+            == PDBS_CONFIG_STATUS_EMPTY);
+
+    for (size_t c = 0; c < sizeof(changes) / sizeof(changes[0]); c++) {
+        old = new;
+        model_apply(&new, &changes[c]);
+        memcpy(before, (const void *) PDBS_CONFIG_BASE, JOURNAL_SIZE);
+
+        for (int32_t op = 0; ; op++) {
+            host_flash_poke(PDBS_CONFIG_BASE, before, JOURNAL_SIZE);
+            host_flash_fail_at(op);
+            if (device_run(&changes[c], 1)) {
+                host_flash_fail_at(-1);
+                CHECK_EQ(device_stored(&new, NULL), 0);
+                break;
+            }
+            CHECK(host_flash_failed());
+            failures++;
+
+            /* The change happened or it didn't */
+            int stored = device_stored(&old, &new);
+            if (stored < 0) {
+                fprintf(stderr, "change %zu, power failed at %d: "
+                        "configuration lost\n", c, op);
+            }
+            CHECK(stored >= 0);
+
+            /* Making it again works */
+            CHECK(device_run(&changes[c], 1));
+            CHECK_EQ(device_stored(&new, NULL), 0);
+        }
+    }
+    printf("test_config: recovered from %d power failures\n", failures);
+
+    check_no_errors();
+}
+
+
+int main(void)
+{
+    test_fresh();
+    test_legacy();
+    test_wear();
+    test_power_loss();
+
+    return check_done("test_config");
+}
@@ -0,0 +1,220 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Tests of the crash log, running src/crash.c on simulated flash.  A crash
+ * leaves its report in RAM across the reset, and the next startup must take
+ * it only if it's whole: marked as captured, and with the right CRC.  Reports
+ * damaged in RAM or torn in flash are checked to be left out of the log.
+ *
+ * crash.c is included rather than linked, so the tests can reach the report
+ * in RAM and damage it the way a power cycle or a stray write would.
+ */
+
+#include <string.h>
+
+#include <ch.h>
+#include <hal.h>
+
+#include "check.h"
+#include "crash.c"
+
+
+/* The reason the test crashes with */
+#define TEST_REASON "test halt"
+
+
+/* The Policy Engine is always idle, so erasures never wait */
+bool pdb_pe_idle(struct pdb_config *cfg, sysinterval_t quiet)
+{
+    (void) cfg;
+    (void) quiet;
+    return true;
+}
+
+static struct pdb_config pdb_config;
+
+
+/*
+ * Clear crash.c's variables, as the C runtime does at startup.  The report in
+ * RAM is in a section it leaves alone.
+ */
+static void clear_bss(void)
+{
+    memset(&crash_pending, 0, sizeof(crash_pending));
+    crash_pending_valid = false;
+    crash_pdb = NULL;
+    crash_seq = 0;
+    crash_slot = 0;
+}
+
+static void crash_main(void)
+{
+    pdbs_flash_init(&pdb_config);
+    pdbs_crash_init(&pdb_config);
+    pdbs_crash_halt(TEST_REASON);
+}
+
+/*
+ * Crash, leaving a report in RAM
+ */
+static void crash(void)
+{
+    clear_bss();
+    CHECK(!host_run(crash_main));
+}
+
+static void startup_main(void)
+{
+    pdbs_flash_init(&pdb_config);
+    pdbs_crash_init(&pdb_config);
+    pdbs_crash_run();
+    /* Let the crash thread log the report */
+    chThdSleepMilliseconds(10);
+}
+
+/*
+ * Start up after a reset with the given reset flags, logging whatever report
+ * is taken.  Returns the number of reports in the log.
+ */
+static int startup(uint32_t csr)
+{
+    clear_bss();
+    RCC->CSR = csr;
+    CHECK(host_run(startup_main));
+
+    int n = 0;
+    for (const struct pdbs_crash *c = pdbs_crash_next(NULL); c != NULL;
+            c = pdbs_crash_next(c)) {
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Return the newest report in the log, or NULL if it's empty
+ */
+static const struct pdbs_crash *newest(void)
+{
+    const struct pdbs_crash *last = NULL;
+    for (const struct pdbs_crash *c = pdbs_crash_next(NULL); c != NULL;
+            c = pdbs_crash_next(c)) {
+        last = c;
+    }
+    return last;
+}
+
+/*
+ * A captured report is taken once, with why the device reset
+ */
+static void test_captured(void)
+{
+    host_flash_reset();
+    CHECK_EQ(startup(RCC_CSR_PORRSTF), 0);
+
+    crash();
+    CHECK_EQ(startup(RCC_CSR_SFTRSTF), 1);
+    const struct pdbs_crash *c = newest();
+    if (c != NULL) {
+        CHECK_EQ(c->seq, 1);
+        CHECK_EQ(c->cause, PDBS_CRASH_HALT);
+        CHECK_EQ(c->reset, RCC_CSR_SFTRSTF >> 24);
+        CHECK(strcmp(c->reason, TEST_REASON) == 0);
+        CHECK_EQ(c->pe_state, UINT8_MAX);
+    }
+
+    /* The report is only logged once */
+    CHECK_EQ(startup(RCC_CSR_PINRSTF), 1);
+}
+
+/*
+ * A report in RAM with a bad CRC or without the mark isn't taken
+ */
+static void test_damaged(void)
+{
+    host_flash_reset();
+
+    /* A bit flipped after capture */
+    crash();
+    crash_ram.uptime ^= 1;
+    CHECK_EQ(startup(RCC_CSR_SFTRSTF), 0);
+
+    /* A report that was already taken, even with a good CRC */
+    crash();
+    crash_ram.seq = 1;
+    crash_ram.crc = crash_crc(&crash_ram);
+    CHECK_EQ(startup(RCC_CSR_SFTRSTF), 0);
+
+    /* Whatever RAM holds after the power comes up */
+    memset(&crash_ram, 0, sizeof(crash_ram));
+    CHECK_EQ(startup(RCC_CSR_PORRSTF), 0);
+    memset(&crash_ram, 0xA5, sizeof(crash_ram));
+    CHECK_EQ(startup(RCC_CSR_PORRSTF), 0);
+
+    /* A damaged report behind a watchdog reset is logged as the watchdog's,
+     * with nothing from RAM */
+    crash();
+    crash_ram.crc ^= 1;
+    CHECK_EQ(startup(RCC_CSR_IWDGRSTF), 1);
+    const struct pdbs_crash *c = newest();
+    if (c != NULL) {
+        CHECK_EQ(c->cause, PDBS_CRASH_WATCHDOG);
+        CHECK_EQ(c->reason[0], '\0');
+    }
+}
+
+/*
+ * A report torn by a power failure while it was written is left out of the
+ * log, and numbering carries on from the newest whole one
+ */
+static void test_torn(void)
+{
+    host_flash_reset();
+    crash();
+    CHECK_EQ(startup(RCC_CSR_SFTRSTF), 1);
+
+    /* Fail partway through writing the second report, before its CRC */
+    crash();
+    clear_bss();
+    RCC->CSR = RCC_CSR_SFTRSTF;
+    host_flash_fail_at(10);
+    CHECK(!host_run(startup_main));
+    CHECK(host_flash_failed());
+    host_flash_fail_at(-1);
+    CHECK_EQ(startup(RCC_CSR_PORRSTF), 1);
+
+    /* The next report skips the torn slot */
+    crash();
+    CHECK_EQ(startup(RCC_CSR_SFTRSTF), 2);
+    const struct pdbs_crash *c = newest();
+    CHECK(c != NULL && c->seq == 2);
+    CHECK(c != NULL && c != crash_slot_get(1));
+
+    printf("test_crash: %d-byte reports, %d per page\n",
+            (int) sizeof(struct pdbs_crash), (int) CRASH_SLOTS_PER_PAGE);
+}
+
+
+int main(void)
+{
+    test_captured();
+    test_damaged();
+    test_torn();
+
+    return check_done("test_crash");
+}
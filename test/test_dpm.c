@@ -0,0 +1,632 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Tests of how the Device Policy Manager chooses a PDO, running the PDO
+ * scoring in src/device_policy_manager.c against real chargers' capabilities,
+ * in and out of EPR Mode, with a range of configurations, and timing it.  The
+ * governor, voltage transitions, and configuration changes that feed into the
+ * choice are tested too.  The rest of the firmware the DPM calls is stubbed
+ * out.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include <ch.h>
+#include <hal.h>
+
+#include "check.h"
+#include "config.h"
+#include "device_policy_manager.h"
+#include "history.h"
+#include "led.h"
+#include "telemetry.h"
+
+
+/* How many times the benchmark goes through the table */
+#define BENCH_ROUNDS 20000
+
+/* How often the governor checks the load, DPM_THERMAL_PERIOD in
+ * src/device_policy_manager.c */
+#define DPM_GOVERNOR_PERIOD TIME_S2I(1)
+
+
+thread_t *pdbs_led_thread;
+MEMORY_POOL_DECL(pdb_msg_pool, sizeof(union pd_msg), PORT_NATURAL_ALIGN, NULL);
+
+/* The configuration of profile 0, the only one stored */
+static struct pdbs_config test_scfg;
+
+struct pdbs_config *pdbs_config_flash_read(uint8_t profile)
+{
+    return (profile == 0) ? &test_scfg : NULL;
+}
+
+uint8_t pdbs_config_flash_get_active(void)
+{
+    return 0;
+}
+
+/* Every charger is new to the charger database */
+uint32_t pdbs_charger_fingerprint(const union pd_msg *caps)
+{
+    (void) caps;
+    return 1;
+}
+
+struct pdbs_charger *pdbs_charger_find(uint32_t fingerprint)
+{
+    (void) fingerprint;
+    return NULL;
+}
+
+void pdbs_charger_changed(void)
+{
+}
+
+void pdbs_charger_avoided(void)
+{
+}
+
+void pdbs_history_log(enum pdbs_history_type type, uint8_t pdo, int v,
+        uint16_t i)
+{
+    (void) type;
+    (void) pdo;
+    (void) v;
+    (void) i;
+}
+
+/* The output current telemetry measures, in centiamperes, or -1 if nothing
+ * has been measured */
+static int test_load = -1;
+
+bool pdbs_telemetry_get(struct pdbs_telemetry *t, uint8_t age)
+{
+    if (test_load < 0 || age != 0) {
+        return false;
+    }
+    memset(t, 0, sizeof(*t));
+    t->current = test_load;
+    t->temperature = 25;
+    t->ntc_temperature = PDBS_TELEMETRY_NO_TEMP;
+    t->time = chVTGetSystemTime();
+    return true;
+}
+
+/* The output switch: whether it's on, and its duty cycle limit */
+static bool test_output_on;
+static uint16_t test_duty_limit = PDBS_SOFTSTART_DUTY_MAX;
+
+void pdbs_softstart_on(const struct pdbs_softstart *ss)
+{
+    (void) ss;
+    test_output_on = true;
+}
+
+void pdbs_softstart_off(void)
+{
+    test_output_on = false;
+}
+
+void pdbs_softstart_limit(uint16_t duty)
+{
+    test_duty_limit = duty;
+}
+
+uint16_t pdbs_softstart_get_limit(void)
+{
+    return test_duty_limit;
+}
+
+bool pdbs_softstart_is_on(void)
+{
+    return test_output_on;
+}
+
+
+/* A fixed PDO, from millivolts and milliamperes */
+#define FIXED(mv, ma) \
+    (PD_PDO_TYPE_FIXED | (PD_MV2PDV(mv) << PD_PDO_SRC_FIXED_VOLTAGE_SHIFT) \
+     | PD_MA2PDI(ma))
+/* A PPS APDO, from millivolts and milliamperes */
+#define PPS(vmin, vmax, ma) \
+    (PD_PDO_TYPE_AUGMENTED | PD_APDO_TYPE_PPS \
+     | PD_APDO_PPS_MAX_VOLTAGE_SET(PD_MV2PAV(vmax)) \
+     | PD_APDO_PPS_MIN_VOLTAGE_SET(PD_MV2PAV(vmin)) \
+     | PD_APDO_PPS_CURRENT_SET(PD_CA2PAI(PD_MA2PDI(ma))))
+/* An EPR AVS APDO, from millivolts and watts */
+#define EPR_AVS(vmin, vmax, w) \
+    (PD_PDO_TYPE_AUGMENTED | PD_APDO_TYPE_EPR_AVS \
+     | (PD_MV2PAV(vmax) << PD_APDO_EPR_AVS_MAX_VOLTAGE_SHIFT) \
+     | (PD_MV2PAV(vmin) << PD_APDO_EPR_AVS_MIN_VOLTAGE_SHIFT) \
+     | ((w) << PD_APDO_EPR_AVS_PDP_SHIFT))
+#define SOURCE_CAPS(n, ...) { \
+    .hdr = PD_MSGTYPE_SOURCE_CAPABILITIES | PD_NUMOBJ(n), \
+    .obj = {__VA_ARGS__} \
+}
+
+/*
+ * Real chargers, with the PDOs they advertise.  Of the flags, only EPR
+ * Capable is set, since it's the only one that changes what we ask for.
+ */
+struct dpm_charger {
+    const char *name;
+    const union pd_msg *caps;
+    /* The objects of its EPR_Source_Capabilities, to evaluate in EPR Mode,
+     * or NULL */
+    const uint32_t *epr_pdos;
+    uint8_t epr_numobj;
+};
+
+/* Google 18 W */
+static const union pd_msg caps_google_18w = SOURCE_CAPS(2,
+        FIXED(5000, 3000), FIXED(9000, 2000));
+static const struct dpm_charger google_18w = {
+    "Google 18 W", &caps_google_18w, NULL, 0
+};
+/* Apple 30 W */
+static const union pd_msg caps_apple_30w = SOURCE_CAPS(4,
+        FIXED(5000, 3000), FIXED(9000, 3000), FIXED(15000, 2000),
+        FIXED(20000, 1500));
+static const struct dpm_charger apple_30w = {
+    "Apple 30 W", &caps_apple_30w, NULL, 0
+};
+/* Samsung 25 W, with PPS */
+static const union pd_msg caps_samsung_25w = SOURCE_CAPS(4,
+        FIXED(5000, 3000), FIXED(9000, 2770), PPS(3300, 5900, 3000),
+        PPS(3300, 11000, 2250));
+static const struct dpm_charger samsung_25w = {
+    "Samsung 25 W", &caps_samsung_25w, NULL, 0
+};
+/* Lenovo 65 W */
+static const union pd_msg caps_lenovo_65w = SOURCE_CAPS(4,
+        FIXED(5000, 3000), FIXED(9000, 3000), FIXED(15000, 3000),
+        FIXED(20000, 3250));
+static const struct dpm_charger lenovo_65w = {
+    "Lenovo 65 W", &caps_lenovo_65w, NULL, 0
+};
+/* Samsung 45 W, with PPS */
+static const union pd_msg caps_samsung_45w = SOURCE_CAPS(6,
+        FIXED(5000, 3000), FIXED(9000, 3000), FIXED(15000, 3000),
+        FIXED(20000, 2250), PPS(3300, 11000, 4050), PPS(3300, 21000, 2100));
+static const struct dpm_charger samsung_45w = {
+    "Samsung 45 W", &caps_samsung_45w, NULL, 0
+};
+/* Apple 96 W, whose top PDO is 20.5 V */
+static const union pd_msg caps_apple_96w = SOURCE_CAPS(4,
+        FIXED(5000, 3000), FIXED(9000, 3000), FIXED(15000, 3000),
+        FIXED(20500, 4700));
+static const struct dpm_charger apple_96w = {
+    "Apple 96 W", &caps_apple_96w, NULL, 0
+};
+/* Apple 140 W, with EPR */
+#define CAPS_APPLE_140W_SPR \
+    FIXED(5000, 3000) | PD_PDO_SRC_FIXED_EPR_CAPABLE, FIXED(9000, 3000), \
+    FIXED(15000, 5000), FIXED(20000, 4700)
+static const union pd_msg caps_apple_140w = SOURCE_CAPS(4,
+        CAPS_APPLE_140W_SPR);
+static const struct dpm_charger apple_140w = {
+    "Apple 140 W", &caps_apple_140w, NULL, 0
+};
+/* Its EPR_Source_Capabilities, with object positions 5 to 7 padded out */
+static const uint32_t epr_caps_apple_140w[] = {
+    CAPS_APPLE_140W_SPR, 0, 0, 0, FIXED(28000, 5000),
+    EPR_AVS(15000, 28000, 140)
+};
+static const struct dpm_charger apple_140w_epr = {
+    "Apple 140 W in EPR Mode", &caps_apple_140w, epr_caps_apple_140w,
+    sizeof(epr_caps_apple_140w) / sizeof(epr_caps_apple_140w[0])
+};
+
+#define CONFIG(flags_, mv, x) { \
+    .status = PDBS_CONFIG_STATUS_VALID, \
+    .flags = (flags_), \
+    .v = (mv), \
+    .i = (x), \
+    .profile = 0 \
+}
+#define CONFIG_RANGE(flags_, mv, x, min, max) { \
+    .status = PDBS_CONFIG_STATUS_VALID, \
+    .flags = (flags_), \
+    .v = (mv), \
+    .i = (x), \
+    .vmin = (min), \
+    .vmax = (max), \
+    .profile = 0 \
+}
+
+/* 9 V at 2 A */
+static const struct pdbs_config config_9v_2a =
+    CONFIG(PDBS_CONFIG_FLAGS_CURRENT_DEFN_I, 9000, 200);
+/* 9 V at 3 A */
+static const struct pdbs_config config_9v_3a =
+    CONFIG(PDBS_CONFIG_FLAGS_CURRENT_DEFN_I, 9000, 300);
+/* 9 V at 4 A */
+static const struct pdbs_config config_9v_4a =
+    CONFIG(PDBS_CONFIG_FLAGS_CURRENT_DEFN_I, 9000, 400);
+/* 9 V at 2 A, preferring PPS */
+static const struct pdbs_config config_9v_2a_pps =
+    CONFIG(PDBS_CONFIG_FLAGS_CURRENT_DEFN_I | PDBS_CONFIG_FLAGS_PPS_PREFERRED,
+            9000, 200);
+/* 20 V at 45 W */
+static const struct pdbs_config config_20v_45w =
+    CONFIG(PDBS_CONFIG_FLAGS_CURRENT_DEFN_P, 20000, 4500);
+/* 24 V at 3 A */
+static const struct pdbs_config config_24v_3a =
+    CONFIG(PDBS_CONFIG_FLAGS_CURRENT_DEFN_I, 24000, 300);
+/* 28 V at 100 W */
+static const struct pdbs_config config_28v_100w =
+    CONFIG(PDBS_CONFIG_FLAGS_CURRENT_DEFN_P, 28000, 10000);
+/* 12 V into 8 Ω */
+static const struct pdbs_config config_12v_8r =
+    CONFIG(PDBS_CONFIG_FLAGS_CURRENT_DEFN_R, 12000, 800);
+/* 12 V at 2 A, or anything from 5 V to 20 V */
+static const struct pdbs_config config_range =
+    CONFIG_RANGE(PDBS_CONFIG_FLAGS_CURRENT_DEFN_I, 12000, 200, 5000, 20000);
+/* The same, preferring high voltages */
+static const struct pdbs_config config_range_hv =
+    CONFIG_RANGE(PDBS_CONFIG_FLAGS_CURRENT_DEFN_I
+            | PDBS_CONFIG_FLAGS_HV_PREFERRED, 12000, 200, 5000, 20000);
+/* 12 V into 10 Ω, or anything from 5 V to 20 V, preferring high voltages */
+static const struct pdbs_config config_range_hv_10r =
+    CONFIG_RANGE(PDBS_CONFIG_FLAGS_CURRENT_DEFN_R
+            | PDBS_CONFIG_FLAGS_HV_PREFERRED, 12000, 1000, 5000, 20000);
+
+/*
+ * A charger, a configuration, and the Request the DPM should make
+ */
+struct dpm_case {
+    const struct dpm_charger *charger;
+    const struct pdbs_config *scfg;
+    const char *scfg_name;
+    /* The power governor's measured current, in centiamperes, or 0 to turn
+     * the governor off */
+    uint16_t governed;
+    /* Whether the DPM should find enough power */
+    bool match;
+    /* Object position, voltage in millivolts, and current in centiamperes
+     * of the Request */
+    uint8_t pdo;
+    int mv;
+    uint16_t current;
+};
+#define DPM_CASE(charger, scfg, governed, match, pdo, mv, current) \
+    {&(charger), &(scfg), #scfg, (governed), (match), (pdo), (mv), (current)}
+
+static const struct dpm_case dpm_cases[] = {
+    /* An exact fixed match asks for no current with the governor off, and
+     * the governed current with it on */
+    DPM_CASE(lenovo_65w, config_9v_2a, 0, true, 2, 9000, 0),
+    DPM_CASE(lenovo_65w, config_9v_2a, 150, true, 2, 9000, 150),
+    DPM_CASE(google_18w, config_9v_2a, 0, true, 2, 9000, 0),
+    /* Fixed PDOs are chosen over PPS unless PPS is preferred, and then the
+     * APDO with the most current to spare wins */
+    DPM_CASE(samsung_25w, config_9v_2a, 0, true, 2, 9000, 0),
+    DPM_CASE(samsung_25w, config_9v_2a_pps, 0, true, 4, 9000, 0),
+    DPM_CASE(samsung_45w, config_9v_2a, 0, true, 2, 9000, 0),
+    DPM_CASE(samsung_45w, config_9v_2a_pps, 0, true, 5, 9000, 0),
+    /* PDOs are scored by what the load draws, not by what's requested: a
+     * 4 A load would overload the 3 A fixed PDO, so the PPS APDO wins.  An
+     * overloaded PDO is only taken if nothing else matches. */
+    DPM_CASE(samsung_45w, config_9v_4a, 0, true, 5, 9000, 0),
+    DPM_CASE(apple_30w, config_20v_45w, 0, true, 4, 20000, 0),
+    /* Power and resistance are turned into current at the PDO's voltage */
+    DPM_CASE(lenovo_65w, config_20v_45w, 0, true, 4, 20000, 0),
+    DPM_CASE(google_18w, config_20v_45w, 0, false, 1, 5000, PD_MA2PDI(30)),
+    DPM_CASE(lenovo_65w, config_12v_8r, 0, false, 1, 5000, PD_MA2PDI(30)),
+    DPM_CASE(samsung_45w, config_12v_8r, 0, true, 6, 12000, 0),
+    /* A fixed PDO that isn't at the configured voltage doesn't match */
+    DPM_CASE(apple_96w, config_20v_45w, 0, false, 1, 5000, PD_MA2PDI(30)),
+    /* Ranges take the end of the range that's preferred, and request the
+     * current the load draws there, from a PDO with enough of it */
+    DPM_CASE(lenovo_65w, config_range, 0, true, 1, 5000, 200),
+    DPM_CASE(lenovo_65w, config_range_hv, 0, true, 4, 20000, 200),
+    DPM_CASE(lenovo_65w, config_range_hv_10r, 0, true, 4, 20000, 200),
+    DPM_CASE(apple_30w, config_range_hv, 0, true, 3, 15000, 200),
+    DPM_CASE(apple_96w, config_range_hv, 0, true, 3, 15000, 200),
+    /* A fixed PDO or APDO at the preferred voltage beats the range */
+    DPM_CASE(samsung_45w, config_range_hv, 0, true, 6, 12000, 0),
+    /* EPR voltages need EPR Mode, where the SPR PDOs are still there */
+    DPM_CASE(apple_140w, config_20v_45w, 0, true, 4, 20000, 0),
+    DPM_CASE(apple_140w, config_28v_100w, 0, false, 1, 5000, PD_MA2PDI(30)),
+    DPM_CASE(apple_140w_epr, config_20v_45w, 0, true, 4, 20000, 0),
+    DPM_CASE(apple_140w_epr, config_28v_100w, 0, true, 8, 28000, 0),
+    DPM_CASE(apple_140w_epr, config_24v_3a, 0, true, 9, 24000, 0)
+};
+#define DPM_CASES (sizeof(dpm_cases) / sizeof(dpm_cases[0]))
+
+
+static struct pdbs_dpm_data dpm_data;
+static struct pdb_config pdb_config = {
+    .dpm_data = &dpm_data
+};
+
+/*
+ * Set the DPM up for the given case and have it evaluate the charger's
+ * capabilities.  Returns whether it found enough power.
+ */
+static bool dpm_case_evaluate(const struct dpm_case *dc, union pd_msg *request)
+{
+    test_scfg = *dc->scfg;
+
+    memset(&dpm_data, 0, sizeof(dpm_data));
+    dpm_data.output_enabled = true;
+    dpm_data.capabilities = dc->charger->caps;
+    dpm_data.governor.enabled = dc->governed != 0;
+    dpm_data.governor._current = dc->governed;
+
+    if (dc->charger->epr_pdos != NULL) {
+        return pdbs_dpm_evaluate_epr_capability(&pdb_config,
+                dc->charger->epr_pdos, dc->charger->epr_numobj, request);
+    }
+    return pdbs_dpm_evaluate_capability(&pdb_config, NULL, request);
+}
+
+
+/*
+ * Every case of the table gets the Request it should.  Prints the object
+ * position, what current it asks for, and the most the PDO offers.
+ */
+static void test_table(void)
+{
+    for (size_t i = 0; i < DPM_CASES; i++) {
+        const struct dpm_case *dc = &dpm_cases[i];
+        union pd_msg request;
+
+        bool match = dpm_case_evaluate(dc, &request);
+        if (match != dc->match
+                || PD_RDO_OBJPOS_GET(&request) != dc->pdo
+                || dpm_data._requested_voltage != dc->mv
+                || dpm_data._requested_current != dc->current) {
+            fprintf(stderr, "case %zu: got %d, PDO %d, %d mV, %d cA\n", i,
+                    match, (int) PD_RDO_OBJPOS_GET(&request),
+                    dpm_data._requested_voltage,
+                    dpm_data._requested_current);
+        }
+        CHECK_EQ(match, dc->match);
+        CHECK_EQ(PD_RDO_OBJPOS_GET(&request), dc->pdo);
+        CHECK_EQ(dpm_data._requested_voltage, dc->mv);
+        CHECK_EQ(dpm_data._requested_current, dc->current);
+
+        printf("test_dpm: %s, %s: PDO %d, %d.%02d A of %d.%02d A\n",
+                dc->charger->name, dc->scfg_name,
+                (int) PD_RDO_OBJPOS_GET(&request),
+                dpm_data._requested_current / 100,
+                dpm_data._requested_current % 100,
+                dpm_data._requested_imax / 100,
+                dpm_data._requested_imax % 100);
+    }
+}
+
+/*
+ * With the output disabled, the DPM asks for vSafe5V and is happy with it
+ */
+static void test_output_disabled(void)
+{
+    union pd_msg request;
+
+    dpm_case_evaluate(&dpm_cases[0], &request);
+    dpm_data.output_enabled = false;
+    CHECK(pdbs_dpm_evaluate_capability(&pdb_config, NULL, &request));
+    CHECK_EQ(PD_RDO_OBJPOS_GET(&request), 1);
+    CHECK(!(request.obj[0] & PD_RDO_CAP_MISMATCH));
+    CHECK_EQ(dpm_data._requested_voltage, 5000);
+}
+
+/*
+ * A tolerated voltage transition keeps the output on, but within Sink Standby
+ * power until the new contract is in place
+ */
+static void test_transition_standby(void)
+{
+    union pd_msg request;
+
+    test_scfg = config_range;
+    memset(&dpm_data, 0, sizeof(dpm_data));
+    dpm_data.output_enabled = true;
+    dpm_data.capabilities = &caps_lenovo_65w;
+    dpm_data.transition = PDBS_DPM_TRANSITION_TOLERANT;
+    dpm_data._present_voltage = 9000;
+    test_output_on = true;
+    test_duty_limit = PDBS_SOFTSTART_DUTY_MAX;
+
+    /* Going from 9 V to 5 V at 2 A, the load draws up to 18 W, so it gets
+     * 2.5 / 18 of the duty cycle */
+    pdbs_dpm_evaluate_capability(&pdb_config, NULL, &request);
+    CHECK_EQ(dpm_data._requested_voltage, 5000);
+    pdbs_dpm_transition_standby(&pdb_config);
+    CHECK(test_output_on);
+    CHECK_EQ(test_duty_limit, 138);
+
+    /* The new contract gets the whole duty cycle back */
+    pdbs_dpm_transition_requested(&pdb_config);
+    CHECK(test_output_on);
+    CHECK_EQ(test_duty_limit, PDBS_SOFTSTART_DUTY_MAX);
+
+    /* Without a range, the output is turned off instead */
+    test_scfg = config_9v_2a;
+    dpm_data._present_voltage = 20000;
+    pdbs_dpm_evaluate_capability(&pdb_config, NULL, &request);
+    pdbs_dpm_transition_standby(&pdb_config);
+    CHECK(!test_output_on);
+}
+
+/*
+ * Run the governor with the load drawing current (in centiamperes) until it
+ * wants a new request, or for at most timeout.  Returns how many governor
+ * periods that took, or 0 if it never did.
+ */
+static int governor_periods(int current, sysinterval_t timeout)
+{
+    systime_t start = chVTGetSystemTime();
+
+    test_load = current;
+    if (chEvtWaitAnyTimeout(PDB_EVT_PE_NEW_POWER, timeout) == 0) {
+        return 0;
+    }
+    return (chVTTimeElapsedSinceX(start) + DPM_GOVERNOR_PERIOD - 1)
+        / DPM_GOVERNOR_PERIOD;
+}
+
+static void test_governor_main(void)
+{
+    union pd_msg request;
+
+    test_scfg = config_9v_3a;
+    memset(&dpm_data, 0, sizeof(dpm_data));
+    dpm_data.output_enabled = true;
+    dpm_data.capabilities = &caps_lenovo_65w;
+    dpm_data.governor = (struct pdbs_dpm_governor) {
+        .enabled = true,
+        .step = PD_MA2CA(250),
+        .margin = 25,
+        .up_threshold = 80,
+        .down_threshold = 50,
+        .hold = TIME_S2I(5)
+    };
+    pdb_config.pe.thread = chThdGetSelfX();
+    pdbs_dpm_pd_start(&pdb_config);
+
+    /* Before the first measurement, the DPM asks for the full 3 A, so a
+     * 1.6 A draw is more than half of the request and needs no change */
+    CHECK_EQ(governor_periods(160, 10 * DPM_GOVERNOR_PERIOD), 0);
+    CHECK_EQ(dpm_data.governor._current, 0);
+
+    /* A 1 A draw is low enough to step down, after the hold time */
+    int down = governor_periods(100, 10 * DPM_GOVERNOR_PERIOD);
+    CHECK(down > 0);
+    CHECK_EQ(dpm_data.governor._current, 150);
+    pdbs_dpm_evaluate_capability(&pdb_config, NULL, &request);
+    CHECK_EQ(dpm_data._requested_current, 150);
+
+    /* Stepping the draw up to 2.5 A raises the request at the next check,
+     * but never past the 3 A the configuration needs */
+    int up = governor_periods(250, 10 * DPM_GOVERNOR_PERIOD);
+    CHECK_EQ(up, 1);
+    CHECK_EQ(dpm_data.governor._current, 300);
+    pdbs_dpm_evaluate_capability(&pdb_config, NULL, &request);
+    CHECK_EQ(dpm_data._requested_current, 300);
+
+    printf("test_dpm: governor steps down after %d periods, up after %d\n",
+            down, up);
+    test_load = -1;
+}
+
+/*
+ * The governor compares the draw against what's really being requested, and
+ * follows a step up in the load within a period
+ */
+static void test_governor(void)
+{
+    CHECK(host_run(test_governor_main));
+}
+
+static void test_config_apply_main(void)
+{
+    union pd_msg request;
+
+    test_scfg = config_9v_2a;
+    memset(&dpm_data, 0, sizeof(dpm_data));
+    dpm_data.output_enabled = true;
+    dpm_data.capabilities = &caps_lenovo_65w;
+    pdb_config.pe.thread = chThdGetSelfX();
+    pdb_config.pe._explicit_contract = true;
+    pdbs_dpm_evaluate_capability(&pdb_config, NULL, &request);
+    pdbs_dpm_transition_requested(&pdb_config);
+
+    /* The time counts from the command, including the flash write */
+    systime_t since = chVTGetSystemTime();
+    chThdSleepMilliseconds(30);
+    test_scfg = config_20v_45w;
+    pdbs_dpm_config_changed(&pdb_config, 0, since);
+    chThdSleepMilliseconds(5);
+    pdbs_dpm_evaluate_capability(&pdb_config, NULL, &request);
+    pdbs_dpm_transition_requested(&pdb_config);
+    CHECK(dpm_data.config_apply_time_valid);
+    CHECK_EQ(TIME_I2MS(dpm_data.config_apply_time), 35);
+    printf("test_dpm: configuration applied in %d ms\n",
+            (int) TIME_I2MS(dpm_data.config_apply_time));
+
+    /* A change that leaves the Request as it was isn't timed, even if the
+     * source sends PS_RDY for it later */
+    dpm_data.config_apply_time_valid = false;
+    pdbs_dpm_config_changed(&pdb_config, 0, chVTGetSystemTime());
+    CHECK(dpm_data._config_changed);
+    pdbs_dpm_evaluate_capability(&pdb_config, NULL, &request);
+    CHECK(!dpm_data._config_changed);
+    pdbs_dpm_transition_requested(&pdb_config);
+    CHECK(!dpm_data.config_apply_time_valid);
+
+    /* Nor is one the source rejects */
+    test_scfg = config_9v_2a;
+    pdbs_dpm_config_changed(&pdb_config, 0, chVTGetSystemTime());
+    pdbs_dpm_evaluate_capability(&pdb_config, NULL, &request);
+    pdbs_dpm_request_rejected(&pdb_config);
+    CHECK(!dpm_data._config_changed);
+
+    /* Nor one made with no contract to renegotiate */
+    pdb_config.pe._explicit_contract = false;
+    pdbs_dpm_config_changed(&pdb_config, 0, chVTGetSystemTime());
+    CHECK(!dpm_data._config_changed);
+}
+
+/*
+ * A configuration change is timed from the command that made it to the
+ * source's PS_RDY, and only if one comes
+ */
+static void test_config_apply(void)
+{
+    CHECK(host_run(test_config_apply_main));
+}
+
+/*
+ * Time how long choosing a PDO takes, on the host
+ */
+static void test_benchmark(void)
+{
+    struct timespec start, end;
+    union pd_msg request;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        for (size_t i = 0; i < DPM_CASES; i++) {
+            dpm_case_evaluate(&dpm_cases[i], &request);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ns = (end.tv_sec - start.tv_sec) * 1e9
+        + (end.tv_nsec - start.tv_nsec);
+    printf("test_dpm: %.0f ns per evaluation\n",
+            ns / ((double) BENCH_ROUNDS * DPM_CASES));
+}
+
+
+int main(void)
+{
+    test_table();
+    test_output_disabled();
+    test_transition_standby();
+    test_governor();
+    test_config_apply();
+    test_benchmark();
+
+    return check_done("test_dpm");
+}
@@ -0,0 +1,405 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Tests of Extended Power Range: the Device Policy Manager choosing from
+ * EPR_Source_Capabilities, whose SPR part is padded out to seven PDOs with
+ * zeros, and the Policy Engine keeping EPR Mode alive once it's in it.  The
+ * Policy Engine runs against the source in host/pd_source.c, and the rest of
+ * the firmware the DPM calls is stubbed out.
+ */
+
+#include <string.h>
+
+#include <ch.h>
+#include <hal.h>
+
+#include "check.h"
+#include "pd_source.h"
+#include "config.h"
+#include "device_policy_manager.h"
+#include "history.h"
+#include "led.h"
+#include "telemetry.h"
+
+
+/* How many EPR_KeepAlive messages to wait for */
+#define KEEPALIVE_ROUNDS 4
+
+
+thread_t *pdbs_led_thread;
+MEMORY_POOL_DECL(pdb_msg_pool, sizeof(union pd_msg), PORT_NATURAL_ALIGN, NULL);
+
+/* The configuration of profile 0, the only one stored */
+static struct pdbs_config test_scfg;
+
+struct pdbs_config *pdbs_config_flash_read(uint8_t profile)
+{
+    return (profile == 0) ? &test_scfg : NULL;
+}
+
+uint8_t pdbs_config_flash_get_active(void)
+{
+    return 0;
+}
+
+/* Every charger is new to the charger database */
+uint32_t pdbs_charger_fingerprint(const union pd_msg *caps)
+{
+    (void) caps;
+    return 1;
+}
+
+struct pdbs_charger *pdbs_charger_find(uint32_t fingerprint)
+{
+    (void) fingerprint;
+    return NULL;
+}
+
+void pdbs_charger_changed(void)
+{
+}
+
+void pdbs_charger_avoided(void)
+{
+}
+
+void pdbs_history_log(enum pdbs_history_type type, uint8_t pdo, int v,
+        uint16_t i)
+{
+    (void) type;
+    (void) pdo;
+    (void) v;
+    (void) i;
+}
+
+bool pdbs_telemetry_get(struct pdbs_telemetry *t, uint8_t age)
+{
+    (void) t;
+    (void) age;
+    return false;
+}
+
+void pdbs_softstart_on(const struct pdbs_softstart *ss)
+{
+    (void) ss;
+}
+
+void pdbs_softstart_off(void)
+{
+}
+
+void pdbs_softstart_limit(uint16_t duty)
+{
+    (void) duty;
+}
+
+uint16_t pdbs_softstart_get_limit(void)
+{
+    return 1000;
+}
+
+bool pdbs_softstart_is_on(void)
+{
+    return false;
+}
+
+
+/* A fixed PDO, from millivolts and milliamperes */
+#define FIXED(mv, ma) \
+    (PD_PDO_TYPE_FIXED | (PD_MV2PDV(mv) << PD_PDO_SRC_FIXED_VOLTAGE_SHIFT) \
+     | PD_MA2PDI(ma))
+/* An EPR AVS APDO, from millivolts and watts */
+#define EPR_AVS(vmin, vmax, w) \
+    (PD_PDO_TYPE_AUGMENTED | PD_APDO_TYPE_EPR_AVS \
+     | (PD_MV2PAV(vmax) << PD_APDO_EPR_AVS_MAX_VOLTAGE_SHIFT) \
+     | (PD_MV2PAV(vmin) << PD_APDO_EPR_AVS_MIN_VOLTAGE_SHIFT) \
+     | ((w) << PD_APDO_EPR_AVS_PDP_SHIFT))
+
+/* The SPR PDOs of a 140 W charger */
+#define CAPS_140W_SPR \
+    FIXED(5000, 3000) | PD_PDO_SRC_FIXED_EPR_CAPABLE, FIXED(9000, 3000), \
+    FIXED(15000, 3000), FIXED(20000, 5000)
+/* Its Source_Capabilities */
+static const union pd_msg caps_140w = {
+    .hdr = PD_SPECREV_3_0 | PD_POWERROLE_SOURCE | PD_DATAROLE_DFP
+        | PD_MSGTYPE_SOURCE_CAPABILITIES | PD_NUMOBJ(4),
+    .obj = {CAPS_140W_SPR}
+};
+/* Its EPR_Source_Capabilities, with object positions 5 to 7 padded out */
+static const uint32_t epr_caps_140w[] = {
+    CAPS_140W_SPR, 0, 0, 0, FIXED(28000, 5000), EPR_AVS(15000, 28000, 140)
+};
+#define EPR_CAPS_140W_NUMOBJ (sizeof(epr_caps_140w) / sizeof(epr_caps_140w[0]))
+
+#define CONFIG(flags_, mv, x) { \
+    .status = PDBS_CONFIG_STATUS_VALID, \
+    .flags = (flags_), \
+    .v = (mv), \
+    .i = (x), \
+    .profile = 0 \
+}
+
+/*
+ * A configuration, and the object position the DPM should ask for
+ */
+struct epr_case {
+    struct pdbs_config scfg;
+    /* Thermal governor level, to throttle the output */
+    uint8_t thermal;
+    uint8_t pdo;
+};
+
+static const struct epr_case epr_cases[] = {
+    /* 28 V at 3 A, 84 W, and into 10 Ω all take the 28 V fixed PDO, never
+     * the zero padding */
+    {CONFIG(PDBS_CONFIG_FLAGS_CURRENT_DEFN_I, 28000, 300), 0, 8},
+    {CONFIG(PDBS_CONFIG_FLAGS_CURRENT_DEFN_P, 28000, 8400), 0, 8},
+    {CONFIG(PDBS_CONFIG_FLAGS_CURRENT_DEFN_R, 28000, 1000), 0, 8},
+    /* Throttling doesn't change that */
+    {CONFIG(PDBS_CONFIG_FLAGS_CURRENT_DEFN_P, 28000, 8400), 1, 8},
+    /* 24 V comes from the EPR AVS APDO */
+    {CONFIG(PDBS_CONFIG_FLAGS_CURRENT_DEFN_P, 24000, 6000), 0, 9},
+    /* Voltages below it still come from the SPR PDOs */
+    {CONFIG(PDBS_CONFIG_FLAGS_CURRENT_DEFN_R, 9000, 1000), 0, 2}
+};
+#define EPR_CASES (sizeof(epr_cases) / sizeof(epr_cases[0]))
+
+
+static struct pdbs_dpm_data dpm_data;
+
+static void test_transition(struct pdb_config *cfg)
+{
+    (void) cfg;
+}
+
+static struct pdb_config pdb_config = {
+    .dpm = {
+        .evaluate_capability = pdbs_dpm_evaluate_capability,
+        .transition_default = test_transition,
+        .transition_standby = test_transition,
+        .transition_requested = test_transition,
+        .epr_mode_pdp = pdbs_dpm_epr_mode_pdp,
+        .evaluate_epr_capability = pdbs_dpm_evaluate_epr_capability
+    },
+    .dpm_data = &dpm_data
+};
+
+
+/*
+ * Every case gets the EPR_Request it should, for a real PDO
+ */
+static void test_zero_padding(void)
+{
+    for (size_t i = 0; i < EPR_CASES; i++) {
+        const struct epr_case *ec = &epr_cases[i];
+        union pd_msg request;
+
+        test_scfg = ec->scfg;
+        memset(&dpm_data, 0, sizeof(dpm_data));
+        dpm_data.output_enabled = true;
+        dpm_data.capabilities = &caps_140w;
+        dpm_data.thermal._level = ec->thermal;
+        pdb_config.pe.hdr_template = PD_SPECREV_3_0;
+
+        bool match = pdbs_dpm_evaluate_epr_capability(&pdb_config,
+                epr_caps_140w, EPR_CAPS_140W_NUMOBJ, &request);
+        uint8_t pdo = PD_RDO_OBJPOS_GET(&request);
+        if (!match || pdo != ec->pdo) {
+            fprintf(stderr, "case %zu: got %d, PDO %d, %d mV\n", i, match,
+                    pdo, dpm_data._requested_voltage);
+        }
+        CHECK(match);
+        CHECK_EQ(pdo, ec->pdo);
+        CHECK_EQ(PD_MSGTYPE_GET(&request), PD_MSGTYPE_EPR_REQUEST);
+        CHECK_EQ(request.obj[1], epr_caps_140w[pdo - 1]);
+        CHECK(dpm_data._requested_voltage > 0);
+    }
+}
+
+
+/* The header of every message from the source */
+#define SOURCE_HDR (PD_SPECREV_3_0 | PD_POWERROLE_SOURCE | PD_DATAROLE_DFP)
+
+/*
+ * Wait for the sink to send a message of the given type, returning it, or
+ * NULL if it sent something else or nothing at all
+ */
+static const struct host_pd_sent *sink_sent(uint8_t type, bool ext)
+{
+    const struct host_pd_sent *s = host_pd_receive(TIME_S2I(1));
+    if (s == NULL) {
+        fprintf(stderr, "no message from the sink, expected type %d\n",
+                type);
+        check_failures++;
+        return NULL;
+    }
+    if (PD_MSGTYPE_GET(&s->msg) != type
+            || ((s->msg.hdr & PD_HDR_EXT) != 0) != ext) {
+        fprintf(stderr, "got message 0x%04x, expected type %d\n",
+                s->msg.hdr, type);
+        check_failures++;
+        return NULL;
+    }
+    return s;
+}
+
+/*
+ * Send the sink a message with no data objects
+ */
+static void source_send_control(uint8_t type)
+{
+    union pd_msg msg = {.hdr = SOURCE_HDR | type | PD_NUMOBJ(0)};
+    host_pd_send(&pdb_config, &msg);
+}
+
+/*
+ * Send the sink an EPR_Mode message
+ */
+static void source_send_epr_mode(uint8_t action)
+{
+    union pd_msg msg = {
+        .hdr = SOURCE_HDR | PD_MSGTYPE_EPR_MODE | PD_NUMOBJ(1),
+        .obj = {PD_EPRMDO_ACTION_SET(action)}
+    };
+    host_pd_send(&pdb_config, &msg);
+}
+
+/*
+ * Send the sink the given chunk of the 140 W charger's
+ * EPR_Source_Capabilities
+ */
+static void source_send_epr_caps(int chunk)
+{
+    const uint8_t *caps = (const uint8_t *) epr_caps_140w;
+    int size = sizeof(epr_caps_140w);
+    int offset = chunk * PD_MAX_EXT_MSG_CHUNK_LEN;
+    int len = size - offset;
+    if (len > PD_MAX_EXT_MSG_CHUNK_LEN) {
+        len = PD_MAX_EXT_MSG_CHUNK_LEN;
+    }
+
+    union pd_msg msg = {
+        .hdr = SOURCE_HDR | PD_HDR_EXT | PD_MSGTYPE_EPR_SOURCE_CAPABILITIES
+            | PD_NUMOBJ((len + 2 + 3) / 4)
+    };
+    msg.exthdr = PD_EXTHDR_CHUNKED | PD_CHUNK_NUMBER(chunk)
+        | PD_DATA_SIZE(size);
+    memcpy(msg.data, caps + offset, len);
+    host_pd_send(&pdb_config, &msg);
+}
+
+/*
+ * Get an explicit contract, and return when the PS_RDY was sent
+ */
+static systime_t source_contract(void)
+{
+    source_send_control(PD_MSGTYPE_ACCEPT);
+    source_send_control(PD_MSGTYPE_PS_RDY);
+    return chVTGetSystemTime();
+}
+
+/*
+ * The sink enters EPR Mode, asks for the 28 V PDO past the padding, and sends
+ * EPR_KeepAlive every PD_T_SINK_EPR_KEEP_ALIVE
+ */
+static void test_keepalive_main(void)
+{
+    const struct host_pd_sent *s;
+
+    test_scfg = (struct pdbs_config)
+        CONFIG(PDBS_CONFIG_FLAGS_CURRENT_DEFN_I, 28000, 300);
+    memset(&dpm_data, 0, sizeof(dpm_data));
+    dpm_data.output_enabled = true;
+    host_pd_start(&pdb_config);
+
+    /* SPR has nothing at 28 V, so the sink takes vSafe5V for now */
+    host_pd_send(&pdb_config, &caps_140w);
+    if ((s = sink_sent(PD_MSGTYPE_REQUEST, false)) == NULL) {
+        return;
+    }
+    CHECK_EQ(PD_RDO_OBJPOS_GET(&s->msg), 1);
+    CHECK(s->msg.obj[0] & PD_RDO_EPR_CAPABLE);
+    source_contract();
+
+    /* Then enters EPR Mode, for 84 W */
+    if ((s = sink_sent(PD_MSGTYPE_EPR_MODE, false)) == NULL) {
+        return;
+    }
+    CHECK_EQ(PD_EPRMDO_ACTION_GET(&s->msg), PD_EPRMDO_ACTION_ENTER);
+    CHECK_EQ(PD_EPRMDO_DATA_GET(&s->msg), 84);
+    source_send_epr_mode(PD_EPRMDO_ACTION_ENTER_ACK);
+    source_send_epr_mode(PD_EPRMDO_ACTION_ENTER_SUCCEEDED);
+
+    /* EPR_Source_Capabilities take two chunks */
+    source_send_epr_caps(0);
+    if ((s = sink_sent(PD_MSGTYPE_EPR_SOURCE_CAPABILITIES, true)) == NULL) {
+        return;
+    }
+    CHECK(s->msg.exthdr & PD_EXTHDR_REQUEST_CHUNK);
+    CHECK_EQ(PD_CHUNK_NUMBER_GET(&s->msg), 1);
+    source_send_epr_caps(1);
+
+    /* The sink asks for 28 V */
+    if ((s = sink_sent(PD_MSGTYPE_EPR_REQUEST, false)) == NULL) {
+        return;
+    }
+    CHECK_EQ(PD_RDO_OBJPOS_GET(&s->msg), 8);
+    CHECK_EQ(s->msg.obj[1], epr_caps_140w[7]);
+    systime_t last = source_contract();
+
+    /* And keeps EPR Mode alive */
+    for (int i = 0; i < KEEPALIVE_ROUNDS; i++) {
+        if ((s = sink_sent(PD_MSGTYPE_EXTENDED_CONTROL, true)) == NULL) {
+            return;
+        }
+        CHECK_EQ(s->msg.data[0], PD_EXTCTRL_TYPE_EPR_KEEPALIVE);
+        CHECK_EQ(chTimeDiffX(last, s->time),
+                PD_T_SINK_EPR_KEEP_ALIVE + HOST_PD_BUS_TIME);
+        if (i == 0) {
+            printf("test_epr: EPR_KeepAlive %d ms after PS_RDY\n",
+                    (int) TIME_I2MS(chTimeDiffX(last, s->time)));
+        }
+
+        union pd_msg ack = {
+            .hdr = SOURCE_HDR | PD_HDR_EXT | PD_MSGTYPE_EXTENDED_CONTROL
+                | PD_NUMOBJ(1)
+        };
+        ack.exthdr = PD_EXTHDR_CHUNKED | PD_DATA_SIZE(PD_EXTCTRL_DATA_SIZE);
+        ack.data[0] = PD_EXTCTRL_TYPE_EPR_KEEPALIVE_ACK;
+        host_pd_send(&pdb_config, &ack);
+        last = chVTGetSystemTime();
+    }
+
+    CHECK(pdb_config.pe._epr_mode);
+    CHECK_EQ(host_pd_hard_resets(), 0);
+}
+
+static void test_keepalive(void)
+{
+    CHECK(host_run(test_keepalive_main));
+}
+
+
+int main(void)
+{
+    test_zero_padding();
+    test_keepalive();
+
+    return check_done("test_epr");
+}
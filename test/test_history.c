@@ -0,0 +1,364 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Tests of the history log, running src/history.c on simulated flash.  The
+ * encoder is checked against the size each kind of record should take, and
+ * the log is filled until it has wrapped around its pages, checking that the
+ * page after the one being written is always erased ahead of time and that
+ * what's read back is the newest part of what was logged.
+ */
+
+#include <string.h>
+
+#include <ch.h>
+#include <hal.h>
+
+#include "check.h"
+#include "flash.h"
+#include "history.h"
+#include "telemetry.h"
+
+
+/* The most events the wrapping test logs before giving up */
+#define WRAP_EVENTS_MAX 8000
+
+/* Page header magic number, as history.c writes it */
+#define HISTORY_MAGIC 0x48495354
+
+
+/* The Policy Engine is always idle, so erasures never wait */
+bool pdb_pe_idle(struct pdb_config *cfg, sysinterval_t quiet)
+{
+    (void) cfg;
+    (void) quiet;
+    return true;
+}
+
+/* The output isn't sampled, so only logged events are written */
+bool pdbs_telemetry_get(struct pdbs_telemetry *t, uint8_t age)
+{
+    (void) t;
+    (void) age;
+    return false;
+}
+
+
+/*
+ * An event, and the length of the record it should be encoded as
+ */
+struct encode_case {
+    struct pdbs_history_event ev;
+    size_t len;
+};
+
+static const struct encode_case encode_cases[] = {
+    /* Boot 3 at 5 V 3 A from PDO 1: tag, boot, time, PDO, and two-byte V
+     * and I */
+    {{.time = 0, .boot = 3, .v = 500, .i = 300, .type = PDBS_HISTORY_SYNC,
+        .pdo = 1}, 8},
+    /* A contract for 20 V 3.25 A from PDO 4: tag with time, PDO, and V and
+     * I changes of two bytes and one */
+    {{.time = 2, .boot = 3, .v = 2000, .i = 325,
+        .type = PDBS_HISTORY_CONTRACT, .pdo = 4}, 5},
+    /* The first sample, from 5 V and no current */
+    {{.time = 12, .boot = 3, .v = 1998, .i = 210,
+        .type = PDBS_HISTORY_POWER}, 5},
+    /* The same sample again is just a tag */
+    {{.time = 22, .boot = 3, .v = 1998, .i = 210,
+        .type = PDBS_HISTORY_POWER}, 1},
+    /* A small change takes a byte for each of V and I */
+    {{.time = 32, .boot = 3, .v = 1997, .i = 215,
+        .type = PDBS_HISTORY_POWER}, 3},
+    /* Events without data are just a tag */
+    {{.time = 40, .boot = 3, .v = 2000, .i = 325,
+        .type = PDBS_HISTORY_HARD_RESET, .pdo = 4}, 1},
+    /* ...unless the time since the last record doesn't fit in it */
+    {{.time = 100, .boot = 3, .v = 2000, .i = 325,
+        .type = PDBS_HISTORY_DETACH, .pdo = 4}, 2},
+    /* A contract over an hour later, back to 5 V */
+    {{.time = 5000, .boot = 3, .v = 500, .i = 300,
+        .type = PDBS_HISTORY_CONTRACT, .pdo = 1}, 7},
+    {{.time = 5000, .boot = 3, .v = 500, .i = 300,
+        .type = PDBS_HISTORY_SOFT_RESET, .pdo = 1}, 1}
+};
+#define ENCODE_CASES (sizeof(encode_cases) / sizeof(encode_cases[0]))
+
+
+/*
+ * Each kind of record takes the bytes it should, and decodes to the event it
+ * was encoded from
+ */
+static void test_encode(void)
+{
+    struct pdbs_history_coder enc, dec;
+    uint8_t buf[ENCODE_CASES * PDBS_HISTORY_RECORD_MAX];
+    size_t len = 0;
+
+    memset(&enc, 0, sizeof(enc));
+    for (size_t i = 0; i < ENCODE_CASES; i++) {
+        size_t n = pdbs_history_encode(&enc, &encode_cases[i].ev, buf + len);
+        if (n != encode_cases[i].len) {
+            fprintf(stderr, "record %zu: %zu bytes\n", i, n);
+        }
+        CHECK_EQ(n, encode_cases[i].len);
+        len += n;
+    }
+
+    memset(&dec, 0, sizeof(dec));
+    size_t pos = 0;
+    for (size_t i = 0; i < ENCODE_CASES; i++) {
+        const struct pdbs_history_event *want = &encode_cases[i].ev;
+        struct pdbs_history_event ev;
+
+        size_t n = pdbs_history_decode(&dec, buf + pos, len - pos, &ev);
+        CHECK_EQ(n, encode_cases[i].len);
+        pos += n;
+        CHECK_EQ(ev.type, want->type);
+        CHECK_EQ(ev.time, want->time);
+        CHECK_EQ(ev.boot, want->boot);
+        CHECK_EQ(ev.v, want->v);
+        CHECK_EQ(ev.i, want->i);
+        CHECK_EQ(ev.pdo, (want->type == PDBS_HISTORY_POWER) ? 0 : want->pdo);
+    }
+    CHECK_EQ(pos, len);
+    CHECK_EQ(pdbs_history_decode(&dec, buf + pos, 0, NULL), 0);
+
+    printf("test_history: %.1f bytes per record\n",
+            (double) len / ENCODE_CASES);
+}
+
+/*
+ * The biggest records still fit in PDBS_HISTORY_RECORD_MAX
+ */
+static void test_encode_max(void)
+{
+    static const struct pdbs_history_event big[] = {
+        {.time = UINT32_MAX, .boot = UINT16_MAX, .v = UINT16_MAX,
+            .i = UINT16_MAX, .type = PDBS_HISTORY_SYNC, .pdo = UINT8_MAX},
+        {.time = 0, .boot = 0, .v = 0, .i = 0, .type = PDBS_HISTORY_SYNC},
+        {.time = UINT32_MAX, .v = UINT16_MAX, .i = UINT16_MAX,
+            .type = PDBS_HISTORY_CONTRACT, .pdo = UINT8_MAX},
+        {.time = UINT32_MAX, .v = UINT16_MAX, .i = UINT16_MAX,
+            .type = PDBS_HISTORY_POWER}
+    };
+    struct pdbs_history_coder st;
+    uint8_t buf[PDBS_HISTORY_RECORD_MAX];
+
+    memset(&st, 0, sizeof(st));
+    for (size_t i = 0; i < sizeof(big) / sizeof(big[0]); i++) {
+        CHECK(pdbs_history_encode(&st, &big[i], buf)
+                <= PDBS_HISTORY_RECORD_MAX);
+    }
+}
+
+
+/* Contracts logged by the device, in order, and how many */
+static struct pdbs_history_event logged[WRAP_EVENTS_MAX];
+static int nlogged;
+/* How many events the device should log this time it's started */
+static int run_events;
+/* Whether the device checks the page after the newest is erased */
+static bool run_check_erased;
+/* How many times it wasn't */
+static int not_erased;
+
+/*
+ * Return the newest page of the log with a header, or -1 if there isn't one
+ */
+static int newest_page(void)
+{
+    int newest = -1;
+    uint32_t newest_seq = 0;
+
+    for (int page = 0; page < PDBS_HISTORY_PAGES; page++) {
+        const uint32_t *hdr = (const uint32_t *) (PDBS_HISTORY_BASE
+                + page * PDBS_FLASH_PAGE_SIZE);
+        if (hdr[0] == HISTORY_MAGIC
+                && (newest < 0 || (int32_t) (hdr[1] - newest_seq) > 0)) {
+            newest = page;
+            newest_seq = hdr[1];
+        }
+    }
+    return newest;
+}
+
+/*
+ * Start the log and log run_events contracts, a second apart
+ */
+static void device_main(void)
+{
+    pdbs_flash_init(NULL);
+    pdbs_history_init();
+    pdbs_history_run();
+
+    for (int k = 0; k < run_events && nlogged < WRAP_EVENTS_MAX; k++) {
+        struct pdbs_history_event *ev = &logged[nlogged];
+        ev->pdo = 1 + nlogged % 4;
+        ev->v = 500 + (nlogged % 300) * 5;
+        ev->i = 100 + nlogged % 7;
+        nlogged++;
+        pdbs_history_log(PDBS_HISTORY_CONTRACT, ev->pdo, ev->v * 10, ev->i);
+
+        /* Let the history thread write it and get the next page ready */
+        chThdSleep(TIME_S2I(1));
+
+        int newest = newest_page();
+        if (run_check_erased && newest >= 0) {
+            uint32_t next = PDBS_HISTORY_BASE
+                + ((newest + 1) % PDBS_HISTORY_PAGES) * PDBS_FLASH_PAGE_SIZE;
+            if (!pdbs_flash_blank((const void *) next, PDBS_FLASH_PAGE_SIZE)) {
+                not_erased++;
+            }
+        }
+    }
+}
+
+/*
+ * Read the log, checking that its contracts are the newest ones logged, in
+ * order.  Returns how many were read, and sets the boots seen in the log's
+ * SYNC records.
+ */
+static int log_check(uint32_t *boots)
+{
+    static struct pdbs_history_event read[WRAP_EVENTS_MAX];
+    struct pdbs_history_reader r;
+    struct pdbs_history_event ev;
+    int contracts = 0;
+    uint32_t last_time = 0;
+
+    *boots = 0;
+    pdbs_history_read_start(&r);
+    while (pdbs_history_read(&r, &ev)) {
+        /* Time counts from each startup */
+        if (ev.type == PDBS_HISTORY_SYNC) {
+            *boots |= 1 << ev.boot;
+            last_time = ev.time;
+            continue;
+        }
+        CHECK(ev.time >= last_time);
+        last_time = ev.time;
+        CHECK_EQ(ev.type, PDBS_HISTORY_CONTRACT);
+        if (contracts < WRAP_EVENTS_MAX) {
+            read[contracts++] = ev;
+        }
+    }
+
+    /* They're the last ones logged */
+    CHECK(contracts <= nlogged);
+    for (int k = 1; k <= contracts && k <= nlogged; k++) {
+        const struct pdbs_history_event *got = &read[contracts - k];
+        const struct pdbs_history_event *want = &logged[nlogged - k];
+        if (got->pdo != want->pdo || got->v != want->v || got->i != want->i) {
+            fprintf(stderr, "contract %d of the log isn't what was logged\n",
+                    contracts - k);
+            check_failures++;
+            break;
+        }
+    }
+    return contracts;
+}
+
+/*
+ * The log carries on across restarts, marking each one
+ */
+static void test_restart(void)
+{
+    uint32_t boots;
+    struct pdbs_history_stats stats;
+
+    host_flash_reset();
+    nlogged = 0;
+    run_check_erased = false;
+
+    run_events = 10;
+    CHECK(host_run(device_main));
+    CHECK_EQ(log_check(&boots), 10);
+    CHECK_EQ(boots, 1 << 0);
+
+    run_events = 10;
+    CHECK(host_run(device_main));
+    pdbs_history_stats_get(&stats);
+    CHECK_EQ(stats.boot, 1);
+    CHECK_EQ(log_check(&boots), 20);
+    CHECK_EQ(boots, (1 << 0) | (1 << 1));
+}
+
+/*
+ * Filled past its end, the log wraps around its pages, always erasing the
+ * next page before it's needed, and keeps the newest pages
+ */
+static void test_wrap(void)
+{
+    uint32_t boots;
+
+    host_flash_reset();
+    nlogged = 0;
+    not_erased = 0;
+    run_check_erased = true;
+
+    /* Log until every page has been erased ahead of use at least twice */
+    run_events = 100;
+    while (nlogged < WRAP_EVENTS_MAX) {
+        CHECK(host_run(device_main));
+        uint32_t min = UINT32_MAX;
+        for (int page = 0; page < PDBS_HISTORY_PAGES; page++) {
+            uint32_t erases = host_flash_page_erases(PDBS_HISTORY_BASE
+                    + page * PDBS_FLASH_PAGE_SIZE);
+            min = (erases < min) ? erases : min;
+        }
+        if (min >= 3) {
+            break;
+        }
+    }
+    CHECK(nlogged < WRAP_EVENTS_MAX);
+    CHECK_EQ(not_erased, 0);
+
+    /* What's left is every page but the one erased ahead */
+    struct pdbs_history_reader r;
+    size_t len, bytes = 0;
+    int pages = 0;
+    pdbs_history_read_start(&r);
+    while (pdbs_history_read_page(&r, &len) != NULL) {
+        CHECK(len <= PDBS_FLASH_PAGE_SIZE);
+        bytes += len;
+        pages++;
+    }
+    CHECK_EQ(pages, PDBS_HISTORY_PAGES - 1);
+
+    int contracts = log_check(&boots);
+    CHECK(bytes > (PDBS_HISTORY_PAGES - 2) * PDBS_FLASH_PAGE_SIZE);
+    printf("test_history: %d of %d contracts kept in %d pages, "
+            "%.1f bytes each\n", contracts, nlogged, pages,
+            (double) bytes / contracts);
+
+    struct host_flash_stats flash;
+    host_flash_stats_get(&flash);
+    CHECK_EQ(flash.errors, 0);
+}
+
+
+int main(void)
+{
+    test_encode();
+    test_encode_max();
+    test_restart();
+    test_wrap();
+
+    return check_done("test_history");
+}
@@ -0,0 +1,151 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Tests of the output switch's soft-start, running src/softstart.c against a
+ * simulated TIM16.  A ramp is stepped through on the simulated clock while
+ * the duty cycle limit changes under it, and the duty cycle the timer is set
+ * to is checked against the limit at every step.
+ */
+
+#include <ch.h>
+#include <hal.h>
+
+#include "check.h"
+#include "softstart.h"
+
+
+/* How long the test ramp takes, and the duty cycle it starts from */
+#define RAMP_TIME TIME_MS2I(100)
+#define RAMP_START 10
+
+/* How long to watch the output for */
+#define WATCH_TIME TIME_MS2I(150)
+
+
+/*
+ * Return the duty cycle the switch is being driven with, in tenths of a
+ * percent
+ */
+static uint16_t switch_duty(void)
+{
+    switch (TIM16->CCMR1 & TIM_CCMR1_OC1M) {
+    case TIM_CCMR1_OC1M_2 | TIM_CCMR1_OC1M_1:
+        /* PWM */
+        return TIM16->CCR1 * PDBS_SOFTSTART_DUTY_MAX / (TIM16->ARR + 1);
+    case TIM_CCMR1_OC1M_2 | TIM_CCMR1_OC1M_0:
+        /* Forced on */
+        return PDBS_SOFTSTART_DUTY_MAX;
+    default:
+        /* Forced off */
+        return 0;
+    }
+}
+
+/*
+ * Without a limit, the ramp rises linearly from the start duty cycle to full
+ */
+static void test_profile(void)
+{
+    const struct pdbs_softstart ss = {RAMP_TIME, RAMP_START};
+
+    pdbs_softstart_limit(PDBS_SOFTSTART_DUTY_MAX);
+    CHECK_EQ(pdbs_softstart_duty(&ss, 0), 100);
+    CHECK_EQ(pdbs_softstart_duty(&ss, RAMP_TIME / 2), 550);
+    CHECK_EQ(pdbs_softstart_duty(&ss, RAMP_TIME), PDBS_SOFTSTART_DUTY_MAX);
+
+    /* With one, it stops rising at the limit */
+    pdbs_softstart_limit(300);
+    CHECK_EQ(pdbs_softstart_duty(&ss, 0), 100);
+    CHECK_EQ(pdbs_softstart_duty(&ss, RAMP_TIME / 2), 300);
+    CHECK_EQ(pdbs_softstart_duty(&ss, RAMP_TIME), 300);
+}
+
+static void test_ramp_main(void)
+{
+    const struct pdbs_softstart ss = {RAMP_TIME, RAMP_START};
+    uint16_t limit = 400;
+    uint16_t last = 0;
+    int over = 0;
+    sysinterval_t held = 0;
+    sysinterval_t full = 0;
+
+    pdbs_softstart_init();
+    pdbs_softstart_limit(limit);
+    pdbs_softstart_on(&ss);
+
+    for (sysinterval_t t = 0; t <= WATCH_TIME; t += PDBS_SOFTSTART_STEP) {
+        /* The ramp reaches the first limit at 34 ms.  Lower the limit
+         * partway up the ramp, as a voltage transition would, then lift it
+         * after the ramp is over. */
+        if (t == TIME_MS2I(50)) {
+            limit = 250;
+            pdbs_softstart_limit(limit);
+        } else if (t == TIME_MS2I(120)) {
+            limit = PDBS_SOFTSTART_DUTY_MAX;
+            pdbs_softstart_limit(limit);
+        }
+
+        uint16_t duty = switch_duty();
+        if (duty > limit) {
+            fprintf(stderr, "%d ms: duty %d over limit %d\n", (int) t, duty,
+                    limit);
+            over++;
+        }
+        if (held == 0 && duty == 250) {
+            held = t;
+        }
+        if (full == 0 && duty == PDBS_SOFTSTART_DUTY_MAX) {
+            full = t;
+        }
+        /* Only a lower limit ever lowers the duty cycle */
+        CHECK(duty >= last || t == TIME_MS2I(50));
+        last = duty;
+
+        chThdSleep(PDBS_SOFTSTART_STEP);
+    }
+
+    CHECK_EQ(over, 0);
+    CHECK_EQ(held, TIME_MS2I(50));
+    CHECK_EQ(full, TIME_MS2I(120));
+    CHECK(pdbs_softstart_is_on());
+    printf("test_softstart: held at 25%% from %d ms, full on at %d ms\n",
+            (int) TIME_I2MS(held), (int) TIME_I2MS(full));
+
+    pdbs_softstart_off();
+    CHECK_EQ(switch_duty(), 0);
+    CHECK(!pdbs_softstart_is_on());
+}
+
+/*
+ * The duty cycle never goes over the limit at any step of a ramp, even when
+ * the limit is lowered partway up
+ */
+static void test_ramp(void)
+{
+    CHECK(host_run(test_ramp_main));
+}
+
+
+int main(void)
+{
+    test_profile();
+    test_ramp();
+
+    return check_done("test_softstart");
+}
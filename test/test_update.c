@@ -0,0 +1,436 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Tests of firmware updates and the boot selector, running src/update.c and
+ * boot/boot_select.c on simulated flash.  Every test boots the device through
+ * the boot selector, so the firmware finds out which slot it's running from
+ * the way it does on the real thing.
+ */
+
+#include <string.h>
+
+#include <ch.h>
+#include <hal.h>
+
+#include "check.h"
+#include "flash.h"
+#include "update.h"
+
+
+/* What the boot selector started: the DfuSe bootloader, or an image in a
+ * slot */
+#define BOOTED_DFU -1
+#define BOOTED(slot, id) (((slot) << 8) | (id))
+
+/* Length of the images written by most tests, odd to check padding */
+#define IMAGE_LENGTH 4999
+/* Length of the images written when the power is made to fail */
+#define IMAGE_LENGTH_SHORT 601
+
+
+void boot_reset(void) __attribute__((noreturn));
+
+/* The boot selector's stack, which it only takes the address of */
+uint32_t __boot_stack_end__;
+
+/* The Policy Engine is always idle, so erasures never wait */
+bool pdb_pe_idle(struct pdb_config *cfg, sysinterval_t quiet)
+{
+    (void) cfg;
+    (void) quiet;
+    return true;
+}
+
+
+/*
+ * The CRC-32 used by zlib, a bit at a time, to check pdbs_boot_crc32 against
+ */
+static uint32_t test_crc32(const uint8_t *data, uint32_t len)
+{
+    uint32_t crc = 0xFFFFFFFF;
+
+    for (uint32_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (int b = 0; b < 8; b++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+        }
+    }
+    return ~crc;
+}
+
+/*
+ * Make a firmware image linked for the given slot, with the given ID in its
+ * reset vector so it can be told apart once it's started.  Returns its CRC.
+ */
+static uint32_t image_make(uint8_t *buf, uint32_t len, uint8_t slot,
+        uint8_t id)
+{
+    uint32_t seed = id * 2654435761u + slot;
+
+    for (uint32_t i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = seed >> 16;
+    }
+
+    uint32_t vectors[2] = {
+        SRAM_BASE + SRAM_SIZE,
+        pdbs_slot_base(slot) + 0x101 + id * 0x10
+    };
+    memcpy(buf, vectors, sizeof(vectors));
+
+    return test_crc32(buf, len);
+}
+
+/*
+ * Flash an image to the given slot, as a programmer would
+ */
+static void image_flash(uint32_t len, uint8_t slot, uint8_t id)
+{
+    static uint8_t buf[PDBS_SLOT_SIZE];
+
+    image_make(buf, len, slot, id);
+    host_flash_poke(pdbs_slot_base(slot), buf, len);
+}
+
+/*
+ * Reset the device and run the boot selector, returning what it started.  If
+ * the power fails while it's writing to flash, it starts over.
+ */
+static int boot(void)
+{
+    do {
+        host_syscfg.CFGR1 = 0;
+        memset((void *) SRAM_BASE, 0, PDBS_BOOT_VECTORS * sizeof(uint32_t));
+        host_run(boot_reset);
+    } while (host_flash_failed());
+
+    const uint32_t *ram = (const uint32_t *) SRAM_BASE;
+    if ((host_syscfg.CFGR1 & SYSCFG_CFGR1_MEM_MODE)
+            == SYSCFG_CFGR1_MEM_MODE_0) {
+        CHECK_EQ(host_msp(), ((const uint32_t *) HOST_SYSMEM_VECTORS)[0]);
+        return BOOTED_DFU;
+    }
+
+    /* The image's vector table is in RAM, mapped at address 0 */
+    CHECK_EQ(host_syscfg.CFGR1 & SYSCFG_CFGR1_MEM_MODE,
+            SYSCFG_CFGR1_MEM_MODE);
+    CHECK_EQ(host_msp(), ram[0]);
+    uint8_t slot = (ram[1] >= PDBS_SLOT_B_BASE) ? PDBS_SLOT_B : PDBS_SLOT_A;
+    CHECK(memcmp(ram, (const void *) pdbs_slot_base(slot),
+                PDBS_BOOT_VECTORS * sizeof(uint32_t)) == 0);
+    return BOOTED(slot, (ram[1] - pdbs_slot_base(slot) - 0x101) / 0x10);
+}
+
+
+/* The update the firmware is told to do, and how it went */
+static uint8_t update_image[PDBS_SLOT_SIZE + 2];
+static uint32_t update_len;
+static uint32_t update_crc;
+static enum pdbs_update_status update_result;
+
+/*
+ * Firmware that writes update_image the way the shell does, in blocks
+ */
+static void fw_update(void)
+{
+    pdbs_flash_init(NULL);
+
+    update_result = pdbs_update_begin(update_len, update_crc);
+    for (uint32_t off = 0; off < update_len && update_result == PDBS_UPDATE_OK;
+            off += PDBS_UPDATE_BLOCK_SIZE) {
+        uint32_t len = update_len - off;
+        if (len > PDBS_UPDATE_BLOCK_SIZE) {
+            len = PDBS_UPDATE_BLOCK_SIZE;
+        }
+        update_result = pdbs_update_write(off, update_image + off, len);
+    }
+    if (update_result == PDBS_UPDATE_OK) {
+        update_result = pdbs_update_finish();
+    }
+}
+
+/*
+ * Firmware that runs long enough to confirm itself
+ */
+static void fw_confirm(void)
+{
+    pdbs_flash_init(NULL);
+    pdbs_update_run();
+    chThdSleep(PDBS_UPDATE_CONFIRM_DELAY + TIME_S2I(1));
+}
+
+/* What fw_state found */
+static uint8_t state_slot;
+static bool state_confirmed;
+
+/*
+ * Firmware that checks what slot it's running from
+ */
+static void fw_state(void)
+{
+    state_slot = pdbs_update_slot();
+    state_confirmed = pdbs_update_confirmed();
+}
+
+/*
+ * Update the running firmware to an image with the given ID and length,
+ * returning the result
+ */
+static enum pdbs_update_status update(uint32_t len, uint8_t slot, uint8_t id)
+{
+    update_len = len;
+    update_crc = image_make(update_image, len, slot, id);
+    host_run(fw_update);
+    return update_result;
+}
+
+/*
+ * Check that the running firmware thinks it's in the given slot
+ */
+static void check_state(uint8_t slot, bool confirmed)
+{
+    CHECK(host_run(fw_state));
+    CHECK_EQ(state_slot, slot);
+    CHECK_EQ(state_confirmed, confirmed);
+}
+
+static void check_no_errors(void)
+{
+    struct host_flash_stats stats;
+
+    host_flash_stats_get(&stats);
+    CHECK_EQ(stats.errors, 0);
+}
+
+
+static void test_crc(void)
+{
+    CHECK_EQ(pdbs_boot_crc32((const uint8_t *) "123456789", 9), 0xCBF43926);
+    CHECK_EQ(pdbs_boot_crc32(NULL, 0), 0);
+
+    uint32_t crc = image_make(update_image, IMAGE_LENGTH, PDBS_SLOT_A, 1);
+    CHECK_EQ(pdbs_boot_crc32(update_image, IMAGE_LENGTH), crc);
+}
+
+static void test_fresh(void)
+{
+    /* With nothing flashed, the DfuSe bootloader starts */
+    host_flash_reset();
+    CHECK_EQ(boot(), BOOTED_DFU);
+
+    /* Flashing slot A starts it, confirmed */
+    image_flash(IMAGE_LENGTH, PDBS_SLOT_A, 1);
+    CHECK_EQ(boot(), BOOTED(PDBS_SLOT_A, 1));
+    check_state(PDBS_SLOT_A, true);
+
+    /* Firmware linked for slot B only starts from slot B */
+    host_flash_reset();
+    image_flash(IMAGE_LENGTH, PDBS_SLOT_A, 1);
+    image_make(update_image, IMAGE_LENGTH, PDBS_SLOT_B, 2);
+    host_flash_poke(PDBS_SLOT_A_BASE, update_image, IMAGE_LENGTH);
+    CHECK_EQ(boot(), BOOTED_DFU);
+    check_no_errors();
+}
+
+static void test_update_rollback(void)
+{
+    host_flash_reset();
+    image_flash(IMAGE_LENGTH, PDBS_SLOT_A, 1);
+    CHECK_EQ(boot(), BOOTED(PDBS_SLOT_A, 1));
+
+    /* The new image gets one try */
+    CHECK_EQ(update(IMAGE_LENGTH, PDBS_SLOT_B, 2), PDBS_UPDATE_OK);
+    CHECK(memcmp((const void *) PDBS_SLOT_B_BASE, update_image,
+                IMAGE_LENGTH) == 0);
+    CHECK_EQ(*(const uint8_t *) (PDBS_SLOT_B_BASE + IMAGE_LENGTH), 0xFF);
+    CHECK_EQ(boot(), BOOTED(PDBS_SLOT_B, 2));
+    check_state(PDBS_SLOT_B, false);
+
+    /* While it's unconfirmed, the old image can't be overwritten */
+    CHECK_EQ(update(IMAGE_LENGTH, PDBS_SLOT_A, 3), PDBS_UPDATE_UNCONFIRMED);
+
+    /* It never confirmed itself, so the old image starts from then on */
+    CHECK_EQ(boot(), BOOTED(PDBS_SLOT_A, 1));
+    check_state(PDBS_SLOT_A, true);
+    CHECK_EQ(boot(), BOOTED(PDBS_SLOT_A, 1));
+    check_no_errors();
+}
+
+static void test_update_confirm(void)
+{
+    host_flash_reset();
+    image_flash(IMAGE_LENGTH, PDBS_SLOT_A, 1);
+    CHECK_EQ(boot(), BOOTED(PDBS_SLOT_A, 1));
+
+    /* Once it's confirmed, the new image keeps starting */
+    CHECK_EQ(update(IMAGE_LENGTH, PDBS_SLOT_B, 2), PDBS_UPDATE_OK);
+    CHECK_EQ(boot(), BOOTED(PDBS_SLOT_B, 2));
+    CHECK(host_run(fw_confirm));
+    check_state(PDBS_SLOT_B, true);
+    CHECK_EQ(boot(), BOOTED(PDBS_SLOT_B, 2));
+    CHECK_EQ(boot(), BOOTED(PDBS_SLOT_B, 2));
+
+    /* And it can be updated in turn, back into slot A */
+    CHECK_EQ(update(PDBS_SLOT_SIZE, PDBS_SLOT_A, 3), PDBS_UPDATE_OK);
+    CHECK_EQ(boot(), BOOTED(PDBS_SLOT_A, 3));
+    CHECK(host_run(fw_confirm));
+    CHECK_EQ(boot(), BOOTED(PDBS_SLOT_A, 3));
+    check_state(PDBS_SLOT_A, true);
+    check_no_errors();
+}
+
+static void test_update_errors(void)
+{
+    host_flash_reset();
+    image_flash(IMAGE_LENGTH, PDBS_SLOT_A, 1);
+    CHECK_EQ(boot(), BOOTED(PDBS_SLOT_A, 1));
+
+    CHECK_EQ(update(0, PDBS_SLOT_B, 2), PDBS_UPDATE_TOO_BIG);
+    CHECK_EQ(update(PDBS_SLOT_SIZE + 2, PDBS_SLOT_B, 2), PDBS_UPDATE_TOO_BIG);
+    CHECK_EQ(update(IMAGE_LENGTH, PDBS_SLOT_A, 2), PDBS_UPDATE_WRONG_SLOT);
+    CHECK_EQ(boot(), BOOTED(PDBS_SLOT_A, 1));
+
+    /* An image that doesn't match its CRC isn't tried */
+    update_len = IMAGE_LENGTH;
+    update_crc = image_make(update_image, IMAGE_LENGTH, PDBS_SLOT_B, 2) ^ 1;
+    CHECK(host_run(fw_update));
+    CHECK_EQ(update_result, PDBS_UPDATE_BAD_CRC);
+    CHECK_EQ(boot(), BOOTED(PDBS_SLOT_A, 1));
+
+    /* Blocks must come in order */
+    CHECK_EQ(pdbs_update_write(0, update_image, 2), PDBS_UPDATE_OUT_OF_ORDER);
+    CHECK_EQ(pdbs_update_finish(), PDBS_UPDATE_OUT_OF_ORDER);
+
+    /* An image corrupted after it's written isn't started */
+    CHECK_EQ(update(IMAGE_LENGTH, PDBS_SLOT_B, 3), PDBS_UPDATE_OK);
+    const uint8_t zero = 0;
+    host_flash_poke(PDBS_SLOT_B_BASE + IMAGE_LENGTH / 2, &zero, 1);
+    CHECK_EQ(boot(), BOOTED(PDBS_SLOT_A, 1));
+    check_state(PDBS_SLOT_A, true);
+    CHECK_EQ(boot(), BOOTED(PDBS_SLOT_A, 1));
+    check_no_errors();
+}
+
+static void test_update_many(void)
+{
+    host_flash_reset();
+    image_flash(IMAGE_LENGTH_SHORT, PDBS_SLOT_A, 1);
+    CHECK_EQ(boot(), BOOTED(PDBS_SLOT_A, 1));
+
+    /* Enough updates to fill the boot state page several times over, some
+     * confirmed and some not */
+    int booted = BOOTED(PDBS_SLOT_A, 1);
+    for (int i = 0; i < 3 * (int) PDBS_BOOT_RECORDS; i++) {
+        uint8_t slot = !(booted >> 8);
+        uint8_t id = 2 + i % 200;
+        CHECK_EQ(update(IMAGE_LENGTH_SHORT, slot, id), PDBS_UPDATE_OK);
+        CHECK_EQ(boot(), BOOTED(slot, id));
+        if (i % 3 != 0) {
+            CHECK(host_run(fw_confirm));
+            booted = BOOTED(slot, id);
+        }
+        CHECK_EQ(boot(), booted);
+    }
+    check_no_errors();
+}
+
+/*
+ * Set up a device running the given image, with an older image in the other
+ * slot and the given number of records for the running slot in the boot
+ * state, then make the power fail at every flash operation of an update and
+ * the resets after it.  Only the running image or the new one may ever start,
+ * the new one only once, and another update must work afterwards.
+ */
+static void test_power_loss(uint8_t slot, uint32_t records)
+{
+    static uint8_t snapshot[FLASH_SIZE];
+    const int old = BOOTED(slot, 1);
+    const int new = BOOTED(!slot, 2);
+
+    host_flash_reset();
+    image_flash(IMAGE_LENGTH_SHORT, slot, 1);
+    image_flash(IMAGE_LENGTH_SHORT, !slot, 9);
+    for (uint32_t i = 0; i < records; i++) {
+        struct pdbs_boot_record rec = {
+            .magic = PDBS_BOOT_MAGIC,
+            .slot = slot
+        };
+        host_flash_poke((uint32_t) pdbs_boot_record(i), &rec, sizeof(rec));
+    }
+    memcpy(snapshot, (const void *) FLASH_BASE, FLASH_SIZE);
+
+    /* Count the flash operations with the power on */
+    struct host_flash_stats stats;
+    host_flash_stats_get(&stats);
+    uint32_t start = stats.programs + stats.erases;
+    CHECK_EQ(boot(), old);
+    CHECK_EQ(update(IMAGE_LENGTH_SHORT, !slot, 2), PDBS_UPDATE_OK);
+    CHECK_EQ(boot(), new);
+    CHECK_EQ(boot(), old);
+    CHECK_EQ(boot(), old);
+    host_flash_stats_get(&stats);
+    uint32_t ops = stats.programs + stats.erases - start;
+
+    for (uint32_t fail = 0; fail <= ops; fail++) {
+        host_flash_poke(FLASH_BASE, snapshot, FLASH_SIZE);
+        CHECK_EQ(boot(), old);
+
+        host_flash_fail_at(fail);
+        if (update(IMAGE_LENGTH_SHORT, !slot, 2) != PDBS_UPDATE_OK) {
+            CHECK(host_flash_failed());
+        }
+        int prev = old;
+        for (int i = 0; i < 3; i++) {
+            int booted = boot();
+            if (booted != old && booted != new) {
+                fprintf(stderr, "power lost at %u of %u: booted %d\n",
+                        (unsigned) fail, (unsigned) ops, booted);
+            }
+            CHECK(booted == old || (booted == new && prev == old));
+            prev = booted;
+        }
+        CHECK_EQ(prev, old);
+        host_flash_fail_at(-1);
+        host_flash_failed();
+
+        /* Things still work afterwards */
+        CHECK_EQ(update(IMAGE_LENGTH_SHORT, !slot, 3), PDBS_UPDATE_OK);
+        CHECK_EQ(boot(), BOOTED(!slot, 3));
+        CHECK(host_run(fw_confirm));
+        CHECK_EQ(boot(), BOOTED(!slot, 3));
+    }
+    check_no_errors();
+}
+
+int main(void)
+{
+    test_crc();
+    test_fresh();
+    test_update_rollback();
+    test_update_confirm();
+    test_update_errors();
+    test_update_many();
+    test_power_loss(PDBS_SLOT_A, 0);
+    test_power_loss(PDBS_SLOT_A, PDBS_BOOT_RECORDS - 1);
+    test_power_loss(PDBS_SLOT_A, PDBS_BOOT_RECORDS);
+    test_power_loss(PDBS_SLOT_B, PDBS_BOOT_RECORDS - 1);
+    test_power_loss(PDBS_SLOT_B, PDBS_BOOT_RECORDS);
+
+    return check_done("test_update");
+}
@@ -0,0 +1,206 @@
+/*
+ * PD Buddy Sink Firmware - Smart power jack for USB Power Delivery
+ * Copyright (C) 2017-2018 Clayton G. Hobbs <clay@lakeserv.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Tests of how the Policy Engine answers Discover Identity, running it
+ * against the source in host/pd_source.c.  The response has to be on the bus
+ * before the source gives up waiting for it, and has to use the ID Header
+ * encoding of the Structured VDM version negotiated.  The Device Policy
+ * Manager is a stand-in that always asks for vSafe5V.
+ */
+
+#include <string.h>
+
+#include <ch.h>
+#include <hal.h>
+
+#include "check.h"
+#include "pd_source.h"
+
+
+MEMORY_POOL_DECL(pdb_msg_pool, sizeof(union pd_msg), PORT_NATURAL_ALIGN, NULL);
+
+/* A Power Sink Device with a receptacle, reported like the firmware does */
+static const struct pdb_dpm_identity identity = {
+    .id_header = PD_VDO_IDH_UFP_TYPE_PSD | PD_VDO_IDH_CONNECTOR_RECEPTACLE
+        | PD_VDO_IDH_VID_SET(0x1209),
+    .cert_stat = 0,
+    .product = PD_VDO_PRODUCT_PID_SET(0x9DB5)
+        | PD_VDO_PRODUCT_BCDDEVICE_SET(0x0200),
+    .product_type_numobj = 0
+};
+
+/*
+ * Ask for vSafe5V from whatever the source offers
+ */
+static bool test_evaluate_capability(struct pdb_config *cfg,
+        const union pd_msg *caps, union pd_msg *request)
+{
+    (void) caps;
+
+    request->hdr = cfg->pe.hdr_template | PD_MSGTYPE_REQUEST | PD_NUMOBJ(1);
+    request->obj[0] = PD_RDO_FV_MAX_CURRENT_SET(100)
+        | PD_RDO_FV_CURRENT_SET(100) | PD_RDO_NO_USB_SUSPEND
+        | PD_RDO_OBJPOS_SET(1);
+    return true;
+}
+
+static void test_transition(struct pdb_config *cfg)
+{
+    (void) cfg;
+}
+
+static const struct pdb_dpm_identity *test_get_identity(struct pdb_config *cfg)
+{
+    (void) cfg;
+    return &identity;
+}
+
+static struct pdb_config pdb_config = {
+    .dpm = {
+        .evaluate_capability = test_evaluate_capability,
+        .transition_default = test_transition,
+        .transition_standby = test_transition,
+        .transition_requested = test_transition,
+        .get_identity = test_get_identity
+    }
+};
+
+
+/*
+ * A source, the PD revision it speaks, and the Structured VDM version of its
+ * Discover Identity
+ */
+struct vdm_case {
+    const char *name;
+    uint16_t specrev;
+    uint8_t version;
+};
+
+static const struct vdm_case vdm_cases[] = {
+    {"PD 3.0", PD_SPECREV_3_0, PD_VDM_VERSION_2_0},
+    {"PD 3.0, SVDM 1.0", PD_SPECREV_3_0, PD_VDM_VERSION_1_0},
+    {"PD 2.0", PD_SPECREV_2_0, PD_VDM_VERSION_1_0}
+};
+#define VDM_CASES (sizeof(vdm_cases) / sizeof(vdm_cases[0]))
+
+/* The case being run */
+static const struct vdm_case *vdm_case;
+
+
+/*
+ * Send the sink a message with no data objects
+ */
+static void source_send_control(uint16_t hdr, uint8_t type)
+{
+    union pd_msg msg = {.hdr = hdr | type | PD_NUMOBJ(0)};
+    host_pd_send(&pdb_config, &msg);
+}
+
+static void test_identity_main(void)
+{
+    const struct vdm_case *vc = vdm_case;
+    uint16_t hdr = vc->specrev | PD_POWERROLE_SOURCE | PD_DATAROLE_DFP;
+    const struct host_pd_sent *s;
+
+    host_pd_start(&pdb_config);
+
+    /* Get a contract for vSafe5V */
+    union pd_msg caps = {
+        .hdr = hdr | PD_MSGTYPE_SOURCE_CAPABILITIES | PD_NUMOBJ(1),
+        .obj = {PD_PDO_TYPE_FIXED
+            | (PD_MV2PDV(5000) << PD_PDO_SRC_FIXED_VOLTAGE_SHIFT)
+            | PD_MA2PDI(3000)}
+    };
+    host_pd_send(&pdb_config, &caps);
+    s = host_pd_receive(TIME_S2I(1));
+    CHECK(s != NULL && PD_MSGTYPE_GET(&s->msg) == PD_MSGTYPE_REQUEST);
+    source_send_control(hdr, PD_MSGTYPE_ACCEPT);
+    source_send_control(hdr, PD_MSGTYPE_PS_RDY);
+
+    /* Discover Identity */
+    union pd_msg req = {
+        .hdr = hdr | PD_MSGTYPE_VENDOR_DEFINED | PD_NUMOBJ(1),
+        .obj = {PD_VDM_SVID_SET(PD_SVID_PD_SID) | PD_VDM_STRUCTURED
+            | PD_VDM_VERSION_SET(vc->version)
+            | PD_VDM_CMDTYPE_SET(PD_VDM_CMDTYPE_REQ)
+            | PD_VDM_CMD_DISCOVER_IDENTITY}
+    };
+    host_pd_send(&pdb_config, &req);
+    systime_t sent = chVTGetSystemTime();
+    s = host_pd_receive(PD_T_VDM_SENDER_RESPONSE);
+    if (s == NULL || PD_MSGTYPE_GET(&s->msg) != PD_MSGTYPE_VENDOR_DEFINED) {
+        fprintf(stderr, "%s: no response to Discover Identity\n", vc->name);
+        check_failures++;
+        return;
+    }
+
+    /* The response comes in time, even for a source that only waits the
+     * shortest tVDMSenderResponse, and from the same revision */
+    sysinterval_t response = chTimeDiffX(sent, s->time);
+    CHECK(response <= PD_T_VDM_RECEIVER_RESPONSE);
+    CHECK(response < PD_T_VDM_SENDER_RESPONSE);
+    CHECK_EQ(s->msg.hdr & PD_HDR_SPECREV, vc->specrev);
+
+    /* It's an ACK at the source's Structured VDM version */
+    uint32_t vdm_header = s->msg.obj[0];
+    CHECK_EQ(PD_VDM_CMDTYPE_GET(vdm_header), PD_VDM_CMDTYPE_ACK);
+    CHECK_EQ(PD_VDM_VERSION_GET(vdm_header), vc->version);
+    CHECK_EQ(PD_VDM_SVID_GET(vdm_header), PD_SVID_PD_SID);
+
+    /* SVDM 1.0 has no PSD product type, nor connector type */
+    uint32_t id_header = s->msg.obj[1];
+    if (vc->version == PD_VDM_VERSION_2_0) {
+        CHECK_EQ(id_header, identity.id_header);
+    } else {
+        CHECK_EQ(id_header & PD_VDO_IDH_UFP_TYPE,
+                PD_VDO_IDH_UFP_TYPE_UNDEFINED);
+        CHECK_EQ(id_header & PD_VDO_IDH_CONNECTOR, 0);
+        CHECK_EQ(id_header & PD_VDO_IDH_VID, 0x1209);
+    }
+    CHECK_EQ(PD_NUMOBJ_GET(&s->msg), 4);
+    CHECK_EQ(s->msg.obj[3], identity.product);
+
+    printf("test_vdm: %s: Discover Identity ACKed in %d ms, "
+            "UFP type %d\n", vc->name, (int) TIME_I2MS(response),
+            (int) ((id_header & PD_VDO_IDH_UFP_TYPE)
+                >> PD_VDO_IDH_UFP_TYPE_SHIFT));
+    CHECK_EQ(host_pd_hard_resets(), 0);
+}
+
+/*
+ * Each source gets its Discover Identity answered in time, in its own
+ * encoding
+ */
+static void test_identity(void)
+{
+    for (size_t i = 0; i < VDM_CASES; i++) {
+        vdm_case = &vdm_cases[i];
+        memset(&pdb_config.pe, 0, sizeof(pdb_config.pe));
+        memset(&pdb_config.prl, 0, sizeof(pdb_config.prl));
+        CHECK(host_run(test_identity_main));
+    }
+}
+
+
+int main(void)
+{
+    test_identity();
+
+    return check_done("test_vdm");
+}